@@ -0,0 +1,663 @@
+// Benchmark runner
+//  Generates occluders for a set of models and reports, for each phase, the wall
+//  time and the hardware counters collected while it ran: cycles, instructions,
+//  last level cache misses and branch misses. Counters are read through
+//  perf_event_open on Linux when the kernel permits it, only timings are reported
+//  otherwise.
+//
+//  Phases are the melt functions instrumented with MELT_PROFILE_BEGIN/END. A phase
+//  nested in another one gets its own row, its time is part of the inclusive time
+//  of the enclosing phase and not of its self time. Counters follow the threads
+//  spawned by the parallel passes. They are only read around the outermost
+//  phases, a nested phase such as _get_max_aabb_extent runs once per voxel and
+//  reading them that often would swamp the enclosing phase.
+//
+//  Usage: benchmark [options]
+//    --case <model>:<voxel_size>  adds a case, the bundled models by default
+//    --samples <count>            generations per case, 10 by default
+//    --threads <count>            melt_params_t.thread_count
+//    --isa <name>                 auto, scalar, sse41, avx2 or avx512
+//    --output <path>              writes every sample as JSON
+//    --no-counters                only collects timings
+//    --scaling <threads>          runs each case from 1 to the given thread count
+//
+//  The scaling mode reports, for each phase, the speedup and efficiency over a
+//  single thread. Strong scaling keeps the case as is, weak scaling shrinks the
+//  voxel size so that the voxel count grows with the thread count. The serial
+//  fraction is estimated with the Karp-Flatt metric, its inverse bounds the
+//  speedup any thread count can reach.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+static void BenchmarkPhaseBegin(const char* name);
+static void BenchmarkPhaseEnd();
+
+#define MELT_PROFILE_BEGIN() BenchmarkPhaseBegin(__func__)
+#define MELT_PROFILE_END() BenchmarkPhaseEnd()
+#define MELT_IMPLEMENTATION
+#include "melt.h"
+#define TINYOBJLOADER_IMPLEMENTATION
+#include "tiny_obj_loader.h"
+
+enum Counter
+{
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_LLC_MISSES,
+    COUNTER_BRANCH_MISSES,
+    COUNTER_COUNT
+};
+
+static const char* const counter_names[COUNTER_COUNT] = { "cycles", "instructions", "llc_misses", "branch_misses" };
+static const uint64_t counter_unavailable = UINT64_MAX;
+
+// Counts for the calling process, including the threads it spawns once opened.
+// Each counter degrades on its own, a kernel may expose cycles but not cache
+// misses, e.g. in a virtual machine.
+struct PerfCounters
+{
+    int fds[COUNTER_COUNT] = { -1, -1, -1, -1 };
+    std::string error;
+
+    bool Open()
+    {
+#if defined(__linux__)
+        static const uint64_t configs[COUNTER_COUNT] =
+        {
+            PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_BRANCH_MISSES,
+        };
+
+        bool any = false;
+        for (int i = 0; i < COUNTER_COUNT; ++i)
+        {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.size = sizeof(attr);
+            attr.config = configs[i];
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.inherit = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+            fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+            if (fds[i] < 0)
+            {
+                if (error.empty())
+                    error = std::string(counter_names[i]) + ": " + strerror(errno);
+                continue;
+            }
+            any = true;
+        }
+        return any;
+#else
+        error = "perf_event_open is only available on Linux";
+        return false;
+#endif
+    }
+
+    void Close()
+    {
+#if defined(__linux__)
+        for (int& fd : fds)
+        {
+            if (fd >= 0)
+                close(fd);
+            fd = -1;
+        }
+#endif
+    }
+
+    // Counters multiplexed with other events are scaled to the time they were
+    // enabled.
+    void Read(uint64_t out_values[COUNTER_COUNT]) const
+    {
+        for (int i = 0; i < COUNTER_COUNT; ++i)
+        {
+            out_values[i] = counter_unavailable;
+#if defined(__linux__)
+            uint64_t values[3];
+            if (fds[i] < 0 || read(fds[i], values, sizeof(values)) != sizeof(values))
+                continue;
+            out_values[i] = values[2] > 0 && values[2] < values[1] ? (uint64_t)((double)values[0] * values[1] / values[2]) : values[0];
+#endif
+        }
+    }
+};
+
+struct PhaseSample
+{
+    std::string name;
+    uint32_t calls = 0;
+    // Inclusive, and without the phases nested in it
+    uint64_t nanoseconds = 0;
+    uint64_t self_nanoseconds = 0;
+    uint64_t counters[COUNTER_COUNT] = { 0, 0, 0, 0 };
+};
+
+struct OpenPhase
+{
+    const char* name;
+    std::chrono::steady_clock::time_point begin_time;
+    uint64_t begin_counters[COUNTER_COUNT];
+    uint64_t nested_nanoseconds;
+};
+
+struct Sample
+{
+    int status = 0;
+    uint64_t nanoseconds = 0;
+    uint64_t peak_memory_bytes = 0;
+    uint32_t box_count = 0;
+    std::vector<PhaseSample> phases;
+};
+
+struct Case
+{
+    std::string model;
+    float voxel_size;
+    std::vector<Sample> samples;
+    uint32_t thread_count = 0;
+};
+
+static struct
+{
+    PerfCounters counters;
+    bool counters_enabled = false;
+    Sample* sample = nullptr;
+    std::vector<OpenPhase> open_phases;
+} benchmark;
+
+static void ReadCounters(uint64_t out_values[COUNTER_COUNT])
+{
+    if (benchmark.counters_enabled)
+        benchmark.counters.Read(out_values);
+    else
+        std::fill(out_values, out_values + COUNTER_COUNT, counter_unavailable);
+}
+
+static void BenchmarkPhaseBegin(const char* name)
+{
+    if (!benchmark.sample)
+        return;
+
+    benchmark.open_phases.emplace_back();
+    OpenPhase& open_phase = benchmark.open_phases.back();
+    open_phase.name = name;
+    open_phase.nested_nanoseconds = 0;
+    if (benchmark.open_phases.size() == 1)
+        ReadCounters(open_phase.begin_counters);
+    else
+        std::fill(open_phase.begin_counters, open_phase.begin_counters + COUNTER_COUNT, counter_unavailable);
+    open_phase.begin_time = std::chrono::steady_clock::now();
+}
+
+static void BenchmarkPhaseEnd()
+{
+    if (!benchmark.sample)
+        return;
+
+    const auto end_time = std::chrono::steady_clock::now();
+    const OpenPhase open_phase = benchmark.open_phases.back();
+    benchmark.open_phases.pop_back();
+    uint64_t end_counters[COUNTER_COUNT];
+    if (benchmark.open_phases.empty())
+        ReadCounters(end_counters);
+    else
+        std::fill(end_counters, end_counters + COUNTER_COUNT, counter_unavailable);
+
+    std::vector<PhaseSample>& phases = benchmark.sample->phases;
+    auto phase = std::find_if(phases.begin(), phases.end(), [&](const PhaseSample& p) { return p.name == open_phase.name; });
+    if (phase == phases.end())
+    {
+        phases.emplace_back();
+        phase = phases.end() - 1;
+        phase->name = open_phase.name;
+    }
+
+    const uint64_t nanoseconds = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - open_phase.begin_time).count();
+    phase->calls++;
+    phase->nanoseconds += nanoseconds;
+    phase->self_nanoseconds += nanoseconds - std::min(nanoseconds, open_phase.nested_nanoseconds);
+    if (!benchmark.open_phases.empty())
+        benchmark.open_phases.back().nested_nanoseconds += nanoseconds;
+    for (int i = 0; i < COUNTER_COUNT; ++i)
+    {
+        if (end_counters[i] == counter_unavailable || open_phase.begin_counters[i] == counter_unavailable)
+            phase->counters[i] = counter_unavailable;
+        else if (phase->counters[i] != counter_unavailable)
+            phase->counters[i] += end_counters[i] - open_phase.begin_counters[i];
+    }
+}
+
+static bool LoadModelMesh(const char* model_path, melt_mesh_t& mesh)
+{
+    std::vector<tinyobj::shape_t> shapes;
+    std::vector<tinyobj::material_t> materials;
+    std::string error;
+    if (!tinyobj::LoadObj(shapes, materials, error, model_path, NULL) || shapes.empty())
+        return false;
+
+    const tinyobj::mesh_t& shape = shapes[0].mesh;
+    mesh.vertex_count = (uint32_t)(shape.positions.size() / 3);
+    mesh.index_count = (uint32_t)shape.indices.size();
+    mesh.vertices = MELT_MALLOC(melt_vec3_t, mesh.vertex_count);
+    mesh.indices = MELT_MALLOC(uint16_t, mesh.index_count);
+
+    for (uint32_t i = 0; i < mesh.index_count; ++i)
+        mesh.indices[i] = (uint16_t)shape.indices[i];
+    for (uint32_t v = 0; v < mesh.vertex_count; ++v)
+        mesh.vertices[v] = { shape.positions[3 * v + 0], shape.positions[3 * v + 1], shape.positions[3 * v + 2] };
+
+    return true;
+}
+
+static bool RunCase(Case& benchmark_case, const melt_params_t& base_params, uint32_t sample_count)
+{
+    const std::string model_path = "models/" + benchmark_case.model + ".obj";
+
+    melt_params_t params = base_params;
+    if (!LoadModelMesh(model_path.c_str(), params.mesh))
+    {
+        fprintf(stderr, "failed to load %s\n", model_path.c_str());
+        return false;
+    }
+    params.voxel_size = benchmark_case.voxel_size;
+    params.thread_count = benchmark_case.thread_count;
+
+    // The first generation warms up caches and the allocator, it is not reported.
+    for (uint32_t i = 0; i <= sample_count; ++i)
+    {
+        Sample sample;
+        melt_result_t result;
+
+        benchmark.sample = &sample;
+        const auto begin_time = std::chrono::steady_clock::now();
+        sample.status = melt_generate_occluder(params, &result);
+        const auto end_time = std::chrono::steady_clock::now();
+        benchmark.sample = nullptr;
+
+        sample.nanoseconds = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - begin_time).count();
+        if (sample.status)
+        {
+            sample.peak_memory_bytes = result.stats.peak_memory_bytes;
+            sample.box_count = result.mesh.vertex_count / 8;
+            melt_free_result(result);
+        }
+
+        if (i > 0)
+            benchmark_case.samples.push_back(sample);
+    }
+
+    MELT_FREE(params.mesh.vertices);
+    MELT_FREE(params.mesh.indices);
+    return true;
+}
+
+static double Median(std::vector<double> values)
+{
+    if (values.empty())
+        return 0.0;
+    std::sort(values.begin(), values.end());
+    const size_t middle = values.size() / 2;
+    return values.size() % 2 ? values[middle] : 0.5 * (values[middle - 1] + values[middle]);
+}
+
+// Median of a phase value over the samples, negative if unavailable.
+template <typename Getter>
+static double PhaseMedian(const Case& benchmark_case, const std::string& phase_name, Getter getter)
+{
+    std::vector<double> values;
+    for (const Sample& sample : benchmark_case.samples)
+    {
+        for (const PhaseSample& phase : sample.phases)
+        {
+            if (phase.name != phase_name)
+                continue;
+            const uint64_t value = getter(phase);
+            if (value == counter_unavailable)
+                return -1.0;
+            values.push_back((double)value);
+        }
+    }
+    return Median(values);
+}
+
+static void PrintCounter(double value)
+{
+    if (value < 0.0)
+        printf(" %12s", "-");
+    else
+        printf(" %12.4g", value);
+}
+
+static void PrintCase(const Case& benchmark_case)
+{
+    std::vector<double> totals;
+    for (const Sample& sample : benchmark_case.samples)
+        totals.push_back(sample.nanoseconds * 1e-6);
+
+    const Sample& first = benchmark_case.samples.front();
+    printf("\n%s, voxel size %g: %s, %u boxes, %.3f ms median, peak memory %.1f KiB\n",
+        benchmark_case.model.c_str(), benchmark_case.voxel_size, first.status ? "watertight" : "not watertight",
+        first.box_count, Median(totals), first.peak_memory_bytes / 1024.0);
+    printf("  %-32s %8s %12s %12s %12s %12s %6s %12s %12s\n", "phase", "calls", "ms", "self ms", "cycles", "instructions", "ipc", "llc misses", "br misses");
+
+    for (const PhaseSample& phase : first.phases)
+    {
+        const double calls = PhaseMedian(benchmark_case, phase.name, [](const PhaseSample& p) { return (uint64_t)p.calls; });
+        const double ms = PhaseMedian(benchmark_case, phase.name, [](const PhaseSample& p) { return p.nanoseconds; }) * 1e-6;
+        const double self_ms = PhaseMedian(benchmark_case, phase.name, [](const PhaseSample& p) { return p.self_nanoseconds; }) * 1e-6;
+
+        double counters[COUNTER_COUNT];
+        for (int i = 0; i < COUNTER_COUNT; ++i)
+            counters[i] = PhaseMedian(benchmark_case, phase.name, [i](const PhaseSample& p) { return p.counters[i]; });
+
+        printf("  %-32s %8.0f %12.3f %12.3f", phase.name.c_str(), calls, ms, self_ms);
+        PrintCounter(counters[COUNTER_CYCLES]);
+        PrintCounter(counters[COUNTER_INSTRUCTIONS]);
+        if (counters[COUNTER_CYCLES] > 0.0 && counters[COUNTER_INSTRUCTIONS] >= 0.0)
+            printf(" %6.2f", counters[COUNTER_INSTRUCTIONS] / counters[COUNTER_CYCLES]);
+        else
+            printf(" %6s", "-");
+        PrintCounter(counters[COUNTER_LLC_MISSES]);
+        PrintCounter(counters[COUNTER_BRANCH_MISSES]);
+        printf("\n");
+    }
+}
+
+static void WriteCounterJson(FILE* file, uint64_t value)
+{
+    if (value == counter_unavailable)
+        fprintf(file, "null");
+    else
+        fprintf(file, "%llu", (unsigned long long)value);
+}
+
+static double MedianTotal(const Case& benchmark_case)
+{
+    std::vector<double> totals;
+    for (const Sample& sample : benchmark_case.samples)
+        totals.push_back((double)sample.nanoseconds);
+    return Median(totals);
+}
+
+// Speedup and efficiency of each phase over the first run, which is the single
+// threaded one. With weak scaling the work grows with the thread count, the
+// speedup is scaled accordingly. Time spent outside of the phases, such as
+// allocations and the copy of the output, is reported as "other", it is what
+// the self times of the phases leave of the total.
+static void PrintScaling(bool weak, const std::vector<Case>& runs)
+{
+    const Case& serial = runs.front();
+
+    std::vector<std::string> phase_names;
+    for (const Case& run : runs)
+        for (const Sample& sample : run.samples)
+            for (const PhaseSample& phase : sample.phases)
+                if (std::find(phase_names.begin(), phase_names.end(), phase.name) == phase_names.end())
+                    phase_names.push_back(phase.name);
+    phase_names.push_back("other");
+    phase_names.push_back("total");
+
+    auto phase_time = [&](const Case& run, const std::string& name)
+    {
+        if (name == "total")
+            return MedianTotal(run);
+        if (name != "other")
+            return std::max(0.0, PhaseMedian(run, name, [](const PhaseSample& p) { return p.nanoseconds; }));
+
+        double phases = 0.0;
+        for (const std::string& phase_name : phase_names)
+            if (phase_name != "other" && phase_name != "total")
+                phases += std::max(0.0, PhaseMedian(run, phase_name, [](const PhaseSample& p) { return p.self_nanoseconds; }));
+        return std::max(0.0, MedianTotal(run) - phases);
+    };
+
+    printf("\n%s scaling, %s, voxel size %g at 1 thread\n", weak ? "weak" : "strong", serial.model.c_str(), serial.voxel_size);
+    printf("  %-32s %12s", "phase", "1 thread ms");
+    for (size_t i = 1; i < runs.size(); ++i)
+        printf("   %3u: speedup eff", runs[i].thread_count);
+    if (!weak)
+        printf(" %10s %11s", "serial", "max speedup");
+    printf("\n");
+
+    for (const std::string& name : phase_names)
+    {
+        const double serial_time = phase_time(serial, name);
+        printf("  %-32s %12.3f", name.c_str(), serial_time * 1e-6);
+
+        double speedup = 1.0;
+        for (size_t i = 1; i < runs.size(); ++i)
+        {
+            const double time = phase_time(runs[i], name);
+            speedup = time > 0.0 ? serial_time / time : 0.0;
+            if (weak)
+                speedup *= runs[i].thread_count;
+            printf("   %12.2f %3.0f%%", speedup, 100.0 * speedup / runs[i].thread_count);
+        }
+
+        // Karp-Flatt serial fraction at the highest thread count, only meaningful
+        // for strong scaling where the work is the same for every run.
+        const double thread_count = runs.back().thread_count;
+        if (!weak && runs.size() > 1 && speedup > 0.0)
+        {
+            const double serial_fraction = std::min(1.0, std::max(0.0, (1.0 / speedup - 1.0 / thread_count) / (1.0 - 1.0 / thread_count)));
+            printf(" %9.0f%%", 100.0 * serial_fraction);
+            if (serial_fraction > 0.0)
+                printf(" %11.1f", 1.0 / serial_fraction);
+            else
+                printf(" %11s", "-");
+        }
+        printf("\n");
+    }
+}
+
+static bool RunScaling(const std::vector<Case>& cases, const melt_params_t& params, uint32_t sample_count, uint32_t max_thread_count,
+    std::vector<Case>& out_runs)
+{
+    std::vector<uint32_t> thread_counts;
+    for (uint32_t thread_count = 1; thread_count < max_thread_count; thread_count *= 2)
+        thread_counts.push_back(thread_count);
+    thread_counts.push_back(max_thread_count);
+
+    for (const Case& benchmark_case : cases)
+    {
+        for (int weak = 0; weak < 2; ++weak)
+        {
+            std::vector<Case> runs;
+            for (uint32_t thread_count : thread_counts)
+            {
+                Case run = benchmark_case;
+                run.thread_count = thread_count;
+                // The voxel count grows as the cube of the inverse voxel size
+                if (weak)
+                    run.voxel_size = benchmark_case.voxel_size / cbrtf((float)thread_count);
+                if (!RunCase(run, params, sample_count))
+                    return false;
+                runs.push_back(run);
+            }
+
+            PrintScaling(weak != 0, runs);
+            out_runs.insert(out_runs.end(), runs.begin(), runs.end());
+        }
+    }
+
+    return true;
+}
+
+static bool WriteJson(const char* path, const std::vector<Case>& cases, const melt_params_t& params)
+{
+    FILE* file = fopen(path, "w");
+    if (!file)
+        return false;
+
+    fprintf(file, "{\n  \"isa\": %d,\n", (int)params.isa);
+    fprintf(file, "  \"counters\": %s,\n", benchmark.counters_enabled ? "true" : "false");
+    fprintf(file, "  \"cases\": [\n");
+    for (size_t c = 0; c < cases.size(); ++c)
+    {
+        const Case& benchmark_case = cases[c];
+        fprintf(file, "    {\n      \"model\": \"%s\",\n      \"voxel_size\": %g,\n      \"threads\": %u,\n      \"samples\": [\n",
+            benchmark_case.model.c_str(), benchmark_case.voxel_size, benchmark_case.thread_count);
+        for (size_t s = 0; s < benchmark_case.samples.size(); ++s)
+        {
+            const Sample& sample = benchmark_case.samples[s];
+            fprintf(file, "        {\n          \"status\": %d,\n          \"ns\": %llu,\n          \"peak_memory_bytes\": %llu,\n          \"boxes\": %u,\n          \"phases\": [\n",
+                sample.status, (unsigned long long)sample.nanoseconds, (unsigned long long)sample.peak_memory_bytes, sample.box_count);
+            for (size_t p = 0; p < sample.phases.size(); ++p)
+            {
+                const PhaseSample& phase = sample.phases[p];
+                fprintf(file, "            { \"name\": \"%s\", \"calls\": %u, \"ns\": %llu, \"self_ns\": %llu", phase.name.c_str(), phase.calls,
+                    (unsigned long long)phase.nanoseconds, (unsigned long long)phase.self_nanoseconds);
+                for (int i = 0; i < COUNTER_COUNT; ++i)
+                {
+                    fprintf(file, ", \"%s\": ", counter_names[i]);
+                    WriteCounterJson(file, phase.counters[i]);
+                }
+                fprintf(file, " }%s\n", p + 1 < sample.phases.size() ? "," : "");
+            }
+            fprintf(file, "          ]\n        }%s\n", s + 1 < benchmark_case.samples.size() ? "," : "");
+        }
+        fprintf(file, "      ]\n    }%s\n", c + 1 < cases.size() ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+
+    fclose(file);
+    return true;
+}
+
+static bool ParseIsa(const char* name, melt_isa_t* out_isa)
+{
+    static const char* const names[] = { "auto", "scalar", "sse41", "avx2", "avx512" };
+    for (int i = 0; i < (int)(sizeof(names) / sizeof(*names)); ++i)
+    {
+        if (strcmp(name, names[i]) == 0)
+        {
+            *out_isa = (melt_isa_t)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+int main(int argc, char** argv)
+{
+    std::vector<Case> cases;
+    uint32_t sample_count = 10;
+    const char* output_path = nullptr;
+    bool counters = true;
+    uint32_t scaling_thread_count = 0;
+
+    melt_params_t params;
+    memset(&params, 0, sizeof(melt_params_t));
+    params.fill_pct = 1.0f;
+    params.box_type_flags = MELT_OCCLUDER_BOX_TYPE_REGULAR;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--case") == 0 && has_value)
+        {
+            const char* value = argv[++i];
+            const char* separator = strchr(value, ':');
+            if (!separator)
+            {
+                fprintf(stderr, "invalid case %s, expected <model>:<voxel_size>\n", value);
+                return 1;
+            }
+            cases.push_back({ std::string(value, separator), (float)atof(separator + 1), {} });
+        }
+        else if (strcmp(argv[i], "--samples") == 0 && has_value)
+            sample_count = (uint32_t)std::max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--threads") == 0 && has_value)
+            params.thread_count = (uint32_t)std::max(0, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--isa") == 0 && has_value)
+        {
+            if (!ParseIsa(argv[++i], &params.isa))
+            {
+                fprintf(stderr, "unknown isa %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--output") == 0 && has_value)
+            output_path = argv[++i];
+        else if (strcmp(argv[i], "--no-counters") == 0)
+            counters = false;
+        else if (strcmp(argv[i], "--scaling") == 0 && has_value)
+            scaling_thread_count = (uint32_t)std::max(1, atoi(argv[++i]));
+        else
+        {
+            fprintf(stderr, "usage: %s [--case <model>:<voxel_size>]... [--samples <count>] [--threads <count>]\n"
+                            "       [--isa auto|scalar|sse41|avx2|avx512] [--output <path>] [--no-counters] [--scaling <threads>]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (cases.empty())
+    {
+        cases = {
+            { "bunny",   0.1f,  {} },
+            { "suzanne", 0.1f,  {} },
+            { "cube",    0.1f,  {} },
+            { "sphere",  0.1f,  {} },
+            { "teapot",  0.5f,  {} },
+            { "column",  0.1f,  {} },
+        };
+    }
+
+    if (counters)
+    {
+        benchmark.counters_enabled = benchmark.counters.Open();
+        if (!benchmark.counters_enabled || !benchmark.counters.error.empty())
+            fprintf(stderr, "hardware counters %s (%s)\n", benchmark.counters_enabled ? "partially unavailable" : "unavailable",
+                benchmark.counters.error.c_str());
+    }
+
+    for (Case& benchmark_case : cases)
+        benchmark_case.thread_count = params.thread_count;
+
+    if (scaling_thread_count > 0)
+    {
+        std::vector<Case> runs;
+        if (!RunScaling(cases, params, sample_count, scaling_thread_count, runs))
+            return 1;
+        cases = runs;
+    }
+    else
+    {
+        for (Case& benchmark_case : cases)
+        {
+            if (!RunCase(benchmark_case, params, sample_count))
+                return 1;
+            PrintCase(benchmark_case);
+        }
+    }
+
+    benchmark.counters.Close();
+
+    if (output_path && !WriteJson(output_path, cases, params))
+    {
+        fprintf(stderr, "failed to write %s\n", output_path);
+        return 1;
+    }
+
+    return 0;
+}
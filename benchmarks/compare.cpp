@@ -0,0 +1,379 @@
+// Benchmark comparison
+//  Compares a run of the benchmark runner against a baseline run, both written
+//  with --output. For each case and phase the samples of both runs are compared
+//  with Welch's t-test: the relative change of the mean is reported with its
+//  confidence interval. A change is a regression when it is significant, the
+//  interval lying above zero, and the change itself is above the threshold.
+//
+//  Usage: benchmark-compare <baseline.json> <run.json> [options]
+//    --threshold <percent>   smallest slowdown reported as a regression, 5 by default
+//    --confidence <level>    confidence level of the intervals, 0.95 by default
+//    --metric <name>         ns, cycles, instructions, llc_misses or branch_misses
+//
+//  Exits with 1 when any case or phase regressed, 2 when the runs can't be read.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+// Just enough JSON to read back what the runner writes
+struct JsonValue
+{
+    enum Type { NUL, BOOLEAN, NUMBER, STRING, ARRAY, OBJECT } type = NUL;
+    double number = 0.0;
+    std::string string;
+    std::vector<JsonValue> array;
+    std::map<std::string, JsonValue> object;
+
+    const JsonValue* Find(const char* key) const
+    {
+        auto it = object.find(key);
+        return it != object.end() ? &it->second : nullptr;
+    }
+};
+
+struct JsonParser
+{
+    const char* cursor;
+
+    void SkipSpaces()
+    {
+        while (*cursor == ' ' || *cursor == '\n' || *cursor == '\r' || *cursor == '\t')
+            ++cursor;
+    }
+
+    bool Expect(char c)
+    {
+        SkipSpaces();
+        if (*cursor != c)
+            return false;
+        ++cursor;
+        return true;
+    }
+
+    bool ParseString(std::string& out)
+    {
+        if (!Expect('"'))
+            return false;
+        while (*cursor && *cursor != '"')
+        {
+            if (*cursor == '\\' && cursor[1])
+                ++cursor;
+            out += *cursor++;
+        }
+        return Expect('"');
+    }
+
+    bool Parse(JsonValue& out)
+    {
+        SkipSpaces();
+        if (*cursor == '{')
+        {
+            ++cursor;
+            out.type = JsonValue::OBJECT;
+            if (Expect('}'))
+                return true;
+            do
+            {
+                std::string key;
+                if (!ParseString(key) || !Expect(':') || !Parse(out.object[key]))
+                    return false;
+            } while (Expect(','));
+            return Expect('}');
+        }
+        if (*cursor == '[')
+        {
+            ++cursor;
+            out.type = JsonValue::ARRAY;
+            if (Expect(']'))
+                return true;
+            do
+            {
+                out.array.emplace_back();
+                if (!Parse(out.array.back()))
+                    return false;
+            } while (Expect(','));
+            return Expect(']');
+        }
+        if (*cursor == '"')
+        {
+            out.type = JsonValue::STRING;
+            return ParseString(out.string);
+        }
+        if (strncmp(cursor, "null", 4) == 0)
+        {
+            cursor += 4;
+            out.type = JsonValue::NUL;
+            return true;
+        }
+        if (strncmp(cursor, "true", 4) == 0 || strncmp(cursor, "false", 5) == 0)
+        {
+            out.type = JsonValue::BOOLEAN;
+            out.number = *cursor == 't' ? 1.0 : 0.0;
+            cursor += *cursor == 't' ? 4 : 5;
+            return true;
+        }
+        char* end = nullptr;
+        out.number = strtod(cursor, &end);
+        if (end == cursor)
+            return false;
+        out.type = JsonValue::NUMBER;
+        cursor = end;
+        return true;
+    }
+};
+
+static bool LoadJson(const char* path, JsonValue& out)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        return false;
+
+    std::string text;
+    char buffer[4096];
+    size_t size;
+    while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        text.append(buffer, size);
+    fclose(file);
+
+    JsonParser parser = { text.c_str() };
+    return parser.Parse(out) && out.type == JsonValue::OBJECT;
+}
+
+// Samples of a metric for each case and phase of a run, the whole generation
+// being the "total" phase.
+typedef std::map<std::string, std::map<std::string, std::vector<double>>> RunSamples;
+
+static const char* const total_phase = "total";
+
+static bool CollectSamples(const JsonValue& run, const std::string& metric, RunSamples& out_samples)
+{
+    const JsonValue* cases = run.Find("cases");
+    if (!cases || cases->type != JsonValue::ARRAY)
+        return false;
+
+    for (const JsonValue& benchmark_case : cases->array)
+    {
+        const JsonValue* model = benchmark_case.Find("model");
+        const JsonValue* voxel_size = benchmark_case.Find("voxel_size");
+        const JsonValue* samples = benchmark_case.Find("samples");
+        if (!model || !voxel_size || !samples)
+            return false;
+
+        const JsonValue* threads = benchmark_case.Find("threads");
+        char name[256];
+        snprintf(name, sizeof(name), "%s:%g@%g", model->string.c_str(), voxel_size->number, threads ? threads->number : 0.0);
+        auto& phases = out_samples[name];
+
+        for (const JsonValue& sample : samples->array)
+        {
+            const JsonValue* ns = sample.Find("ns");
+            if (metric == "ns" && ns)
+                phases[total_phase].push_back(ns->number);
+
+            const JsonValue* sample_phases = sample.Find("phases");
+            if (!sample_phases)
+                continue;
+
+            for (const JsonValue& phase : sample_phases->array)
+            {
+                const JsonValue* phase_name = phase.Find("name");
+                const JsonValue* value = phase.Find(metric.c_str());
+                // Counters that were not available are left out of the comparison
+                if (phase_name && value && value->type == JsonValue::NUMBER)
+                    phases[phase_name->string].push_back(value->number);
+            }
+        }
+    }
+
+    return true;
+}
+
+// Quantile of the standard normal distribution, Acklam's rational approximation.
+static double NormalQuantile(double p)
+{
+    static const double a[] = { -3.969683028665376e+01, 2.209460984245205e+02, -2.759285104469687e+02, 1.383577518672690e+02, -3.066479806614716e+01, 2.506628277459239e+00 };
+    static const double b[] = { -5.447609879822406e+01, 1.615858368580409e+02, -1.556989798598866e+02, 6.680131188771972e+01, -1.328068155288572e+01 };
+    static const double c[] = { -7.784894002430293e-03, -3.223964580411365e-01, -2.400758277161838e+00, -2.549732539343734e+00, 4.374664141464968e+00, 2.938163982698783e+00 };
+    static const double d[] = { 7.784695709041462e-03, 3.224671290700398e-01, 2.445134137142996e+00, 3.754408661907416e+00 };
+
+    if (p < 0.02425)
+    {
+        const double q = sqrt(-2.0 * log(p));
+        return (((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) * q + c[5]) / ((((d[0] * q + d[1]) * q + d[2]) * q + d[3]) * q + 1.0);
+    }
+    if (p > 1.0 - 0.02425)
+        return -NormalQuantile(1.0 - p);
+
+    const double q = p - 0.5;
+    const double r = q * q;
+    return (((((a[0] * r + a[1]) * r + a[2]) * r + a[3]) * r + a[4]) * r + a[5]) * q / (((((b[0] * r + b[1]) * r + b[2]) * r + b[3]) * r + b[4]) * r + 1.0);
+}
+
+// Quantile of Student's t distribution, Cornish-Fisher expansion around the
+// normal quantile. Accurate to a few percent from 3 degrees of freedom.
+static double StudentQuantile(double p, double degrees_of_freedom)
+{
+    const double z = NormalQuantile(p);
+    const double z3 = z * z * z;
+    const double z5 = z3 * z * z;
+    const double z7 = z5 * z * z;
+    const double n = degrees_of_freedom;
+    return z + (z3 + z) / (4.0 * n) + (5.0 * z5 + 16.0 * z3 + 3.0 * z) / (96.0 * n * n) +
+        (3.0 * z7 + 19.0 * z5 + 17.0 * z3 - 15.0 * z) / (384.0 * n * n * n);
+}
+
+struct Summary
+{
+    double mean = 0.0;
+    double variance = 0.0;
+    size_t count = 0;
+};
+
+static Summary Summarize(const std::vector<double>& values)
+{
+    Summary summary;
+    summary.count = values.size();
+    for (double value : values)
+        summary.mean += value;
+    summary.mean /= (double)values.size();
+    for (double value : values)
+        summary.variance += (value - summary.mean) * (value - summary.mean);
+    summary.variance = values.size() > 1 ? summary.variance / (double)(values.size() - 1) : 0.0;
+    return summary;
+}
+
+struct Comparison
+{
+    double delta;
+    double delta_low;
+    double delta_high;
+};
+
+// Relative change of the mean with its Welch confidence interval
+static Comparison Compare(const std::vector<double>& baseline, const std::vector<double>& run, double confidence)
+{
+    const Summary a = Summarize(baseline);
+    const Summary b = Summarize(run);
+
+    const double va = a.variance / (double)a.count;
+    const double vb = b.variance / (double)b.count;
+    const double standard_error = sqrt(va + vb);
+
+    double degrees_of_freedom = 1.0;
+    if (va + vb > 0.0)
+    {
+        const double denominator = (a.count > 1 ? va * va / (double)(a.count - 1) : 0.0) + (b.count > 1 ? vb * vb / (double)(b.count - 1) : 0.0);
+        degrees_of_freedom = denominator > 0.0 ? std::max(1.0, (va + vb) * (va + vb) / denominator) : 1.0;
+    }
+
+    const double t = StudentQuantile(0.5 + 0.5 * confidence, degrees_of_freedom);
+    const double difference = b.mean - a.mean;
+
+    Comparison comparison;
+    comparison.delta = a.mean > 0.0 ? difference / a.mean : 0.0;
+    comparison.delta_low = a.mean > 0.0 ? (difference - t * standard_error) / a.mean : 0.0;
+    comparison.delta_high = a.mean > 0.0 ? (difference + t * standard_error) / a.mean : 0.0;
+    return comparison;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "usage: %s <baseline.json> <run.json> [--threshold <percent>] [--confidence <level>]\n"
+                        "       [--metric ns|cycles|instructions|llc_misses|branch_misses]\n", argv[0]);
+        return 2;
+    }
+
+    double threshold = 0.05;
+    double confidence = 0.95;
+    std::string metric = "ns";
+
+    for (int i = 3; i < argc; ++i)
+    {
+        const bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--threshold") == 0 && has_value)
+            threshold = atof(argv[++i]) / 100.0;
+        else if (strcmp(argv[i], "--confidence") == 0 && has_value)
+            confidence = std::min(0.999, std::max(0.5, atof(argv[++i])));
+        else if (strcmp(argv[i], "--metric") == 0 && has_value)
+            metric = argv[++i];
+        else
+        {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 2;
+        }
+    }
+
+    JsonValue baseline_run;
+    JsonValue run;
+    RunSamples baseline_samples;
+    RunSamples run_samples;
+
+    if (!LoadJson(argv[1], baseline_run) || !CollectSamples(baseline_run, metric, baseline_samples))
+    {
+        fprintf(stderr, "failed to read %s\n", argv[1]);
+        return 2;
+    }
+    if (!LoadJson(argv[2], run) || !CollectSamples(run, metric, run_samples))
+    {
+        fprintf(stderr, "failed to read %s\n", argv[2]);
+        return 2;
+    }
+
+    printf("%s, %g%% confidence intervals, regression threshold %+.1f%%\n", metric.c_str(), confidence * 100.0, threshold * 100.0);
+    printf("%-20s %-32s %14s %14s %9s %21s\n", "case", "phase", "baseline", "run", "delta", "interval");
+
+    uint32_t regression_count = 0;
+
+    for (const auto& benchmark_case : run_samples)
+    {
+        auto baseline_case = baseline_samples.find(benchmark_case.first);
+        if (baseline_case == baseline_samples.end())
+        {
+            printf("%-20s not in the baseline\n", benchmark_case.first.c_str());
+            continue;
+        }
+
+        for (const auto& phase : benchmark_case.second)
+        {
+            auto baseline_phase = baseline_case->second.find(phase.first);
+            if (baseline_phase == baseline_case->second.end() || baseline_phase->second.empty() || phase.second.empty())
+            {
+                printf("%-20s %-32s not in the baseline\n", benchmark_case.first.c_str(), phase.first.c_str());
+                continue;
+            }
+
+            const Comparison comparison = Compare(baseline_phase->second, phase.second, confidence);
+            const bool regression = comparison.delta_low > 0.0 && comparison.delta > threshold;
+            const bool improvement = comparison.delta_high < 0.0 && comparison.delta < -threshold;
+            regression_count += regression;
+
+            printf("%-20s %-32s %14.6g %14.6g %+8.1f%% [%+8.1f%%, %+8.1f%%] %s\n",
+                benchmark_case.first.c_str(), phase.first.c_str(),
+                Summarize(baseline_phase->second).mean, Summarize(phase.second).mean,
+                comparison.delta * 100.0, comparison.delta_low * 100.0, comparison.delta_high * 100.0,
+                regression ? "REGRESSION" : (improvement ? "improvement" : ""));
+        }
+    }
+
+    for (const auto& baseline_case : baseline_samples)
+    {
+        if (run_samples.find(baseline_case.first) == run_samples.end())
+            printf("%-20s missing from the run\n", baseline_case.first.c_str());
+    }
+
+    if (regression_count > 0)
+    {
+        printf("%u regression%s beyond %.1f%%\n", regression_count, regression_count > 1 ? "s" : "", threshold * 100.0);
+        return 1;
+    }
+
+    return 0;
+}
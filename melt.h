@@ -28,6 +28,14 @@
 //  #define MELT_IMPLEMENTATION
 //  #include melt.h
 //
+// Thread safety:
+//  melt_generate_occluder and melt_free_result are reentrant, all the state of a
+//  generation lives on the stack of the call and in the buffers it allocates, the
+//  implementation has no mutable globals. Calls can be made concurrently from any
+//  number of threads as long as they do not share a result, and as long as the
+//  MELT_MALLOC and MELT_FREE overrides, if any, are themselves thread safe. A
+//  time sliced generation can be stepped from any thread, one at a time.
+//
 // A full description of the algorithm is available at:
 //  http://karim.naaji.fr/blog/2019/15.11.19.html
 //
@@ -42,6 +50,7 @@
 #ifndef MELT_H
 #define MELT_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 typedef struct
@@ -57,6 +66,9 @@ typedef struct
     uint16_t* indices;
     uint32_t vertex_count;
     uint32_t index_count;
+    // Output only, holds the indices instead of indices when 32 bit indices are
+    // requested, see melt_params_t.
+    uint32_t* indices32;
 }  melt_mesh_t;
 
 typedef enum melt_occluder_box_type_t
@@ -71,49 +83,471 @@ typedef enum melt_occluder_box_type_t
 
 typedef int32_t melt_occluder_box_type_flags_t;
 
-typedef enum melt_debug_type_t
+// Data streamed by the export, see melt_params_t::export_flags
+typedef enum melt_export_type_t
 {
-    MELT_DEBUG_TYPE_SHOW_INNER           = 1 << 0,
-    MELT_DEBUG_TYPE_SHOW_EXTENT          = 1 << 1,
-    MELT_DEBUG_TYPE_SHOW_RESULT          = 1 << 2,
-    MELT_DEBUG_TYPE_SHOW_OUTER           = 1 << 3,
-    MELT_DEBUG_TYPE_SHOW_MIN_DISTANCE    = 1 << 4,
-    MELT_DEBUG_TYPE_SHOW_SLICE_SELECTION = 1 << 5
-} melt_debug_type_t;
-
-typedef int32_t melt_debug_type_flags_t;
+    MELT_EXPORT_TYPE_SHELL      = 1 << 0,
+    MELT_EXPORT_TYPE_INNER      = 1 << 1,
+    MELT_EXPORT_TYPE_CLIPPED    = 1 << 2,
+    MELT_EXPORT_TYPE_DISTANCE   = 1 << 3,
+    MELT_EXPORT_TYPE_BOXES      = 1 << 4,
+    MELT_EXPORT_TYPE_ITERATIONS = 1 << 5
+} melt_export_type_t;
+
+typedef int32_t melt_export_type_flags_t;
+
+// Receives the exported bytes in order, returns 0 to stop the export.
+typedef int (*melt_write_callback_t)(const void* data, size_t byte_size, void* user_data);
+
+// Instruction sets the kernels are specialized for. The best set supported by the
+// running CPU is detected at runtime, the binary does not need to be compiled for
+// a specific target.
+typedef enum melt_isa_t
+{
+    MELT_ISA_AUTO   = 0,
+    MELT_ISA_SCALAR = 1,
+    MELT_ISA_SSE41  = 2,
+    MELT_ISA_AVX2   = 3,
+    MELT_ISA_AVX512 = 4
+} melt_isa_t;
+
+// Phases of a generation, in the order they run
+typedef enum melt_phase_t
+{
+    MELT_PHASE_VOXELIZATION   = 0,
+    MELT_PHASE_CLASSIFICATION = 1,
+    MELT_PHASE_EXTRACTION     = 2
+} melt_phase_t;
 
 typedef struct
 {
-    melt_debug_type_flags_t flags;
-    int32_t voxel_x;
-    int32_t voxel_y;
-    int32_t voxel_z;
-    int32_t extent_index;
-    float voxelScale;
-} melt_debug_params_t;
+    melt_phase_t phase;
+    // Progress of the phase from 0 to 1, extraction progresses towards fill_pct
+    float fraction;
+    // Boxes extracted so far and the fraction of the volume they fill
+    uint32_t box_count;
+    float fill_pct;
+} melt_progress_t;
+
+typedef void (*melt_progress_callback_t)(const melt_progress_t* progress, void* user_data);
+
+// Width of the indices of the output mesh. 16 bit indices address 8192 boxes at
+// most, larger meshes are written with 32 bit indices whatever the width asked.
+typedef enum melt_index_width_t
+{
+    MELT_INDEX_WIDTH_16 = 0,
+    MELT_INDEX_WIDTH_32 = 1
+} melt_index_width_t;
+
+// Output of the boxes as instances of a unit cube, see
+// melt_params_t::instance_format.
+typedef enum melt_instance_format_t
+{
+    MELT_INSTANCE_FORMAT_NONE      = 0,
+    MELT_INSTANCE_FORMAT_FLOAT     = 1,
+    MELT_INSTANCE_FORMAT_QUANTIZED = 2
+} melt_instance_format_t;
+
+// Direction the triangles of a box face, see melt_params_t::face_buckets.
+typedef enum melt_face_t
+{
+    MELT_FACE_POSITIVE_X = 0,
+    MELT_FACE_NEGATIVE_X = 1,
+    MELT_FACE_POSITIVE_Y = 2,
+    MELT_FACE_NEGATIVE_Y = 3,
+    MELT_FACE_POSITIVE_Z = 4,
+    MELT_FACE_NEGATIVE_Z = 5,
+    // Diagonal planes through the box, facing no axis
+    MELT_FACE_DIAGONAL   = 6,
+    MELT_FACE_COUNT      = 7
+} melt_face_t;
+
+typedef enum melt_status_t
+{
+    MELT_STATUS_SUCCESS        = 0,
+    MELT_STATUS_NOT_WATERTIGHT = 1,
+    MELT_STATUS_CANCELLED      = 2,
+    // melt_wait was given a job that is not in the queue, or already collected
+    MELT_STATUS_UNKNOWN_JOB    = 3
+} melt_status_t;
 
 typedef struct
 {
     uint32_t _start_canary;
     melt_mesh_t mesh;
     melt_occluder_box_type_flags_t box_type_flags;
-    melt_debug_params_t debug;
     float voxel_size;
     float fill_pct;
+    // Highest instruction set the kernels may use, MELT_ISA_AUTO selects the best
+    // one supported. Lower values force a variant, e.g. to benchmark it.
+    melt_isa_t isa;
+    // Number of threads the parallel passes run on, including the calling thread.
+    // 0 and 1 run everything on the calling thread, as do time sliced generations.
+    uint32_t thread_count;
+    // Non-zero runs the naive reference implementation of every phase instead of
+    // the optimized one. It is much slower and produces exactly the same result,
+    // it exists to validate the optimized phases.
+    int32_t reference;
+    // Called on the calling thread as the generation progresses, about a hundred
+    // times per phase at most and once per extracted box.
+    melt_progress_callback_t progress_callback;
+    void* progress_user_data;
+    // Polled during voxelization, classification and every extraction iteration,
+    // the generation stops with MELT_STATUS_CANCELLED once it is non-zero. It can
+    // be set from any thread, but only with an atomic store (std::atomic_ref,
+    // __atomic_store_n, InterlockedExchange), a plain store through the volatile
+    // pointer is a data race with the worker threads that poll it.
+    const volatile uint32_t* cancel_flag;
+    // MELT_INDEX_WIDTH_32 writes the output indices to mesh.indices32, so does
+    // MELT_INDEX_WIDTH_16 past 8192 boxes. The other pointer is then NULL.
+    melt_index_width_t index_width;
+    // Working memory the generation allocates from before falling back to
+    // MELT_MALLOC, it is never freed by melt and must not be shared by concurrent
+    // generations. A buffer of stats.scratch_bytes from a previous generation of
+    // the same mesh runs it without heap allocation besides the output.
+    void* scratch_buffer;
+    size_t scratch_buffer_size;
+    // Streams the grid and the boxes as a binary PLY through export_callback once
+    // the extraction is over, using a fixed amount of memory whatever the grid
+    // size. Voxels are "vertex" elements with their center, a state (1 shell,
+    // 2 inner, 4 clipped by a box) and with MELT_EXPORT_TYPE_DISTANCE their
+    // distance field. Boxes are "box" elements in extraction order. When the shell
+    // is not watertight the fields are incomplete and only the shell is written.
+    // MELT_EXPORT_TYPE_ITERATIONS also streams one document before each extraction
+    // iteration, with the fields and the boxes found so far and a "comment melt
+    // iteration" giving its box count. Every document starts with a new call to
+    // export_callback, the last one is the state the boxes are output from.
+    melt_export_type_flags_t export_flags;
+    melt_write_callback_t export_callback;
+    void* export_user_data;
+    // Non-zero returns the classified voxels in result.occupancy, for other bake
+    // steps to reuse, at a cost of 2 bits per voxel of the grid.
+    int32_t occupancy;
+    // Returns the boxes as instances of a shared cube in result.instances instead
+    // of result.mesh, for instanced draws.
+    melt_instance_format_t instance_format;
+    // Non-zero places the grid on whole multiples of the voxel size and derives
+    // every voxel center and output coordinate from integers with a single
+    // rounding, and stops the extraction on whole voxel counts. The output is
+    // then bit exact across thread counts, instruction sets, compilers and
+    // platforms with IEEE single precision, as long as the compiler does not
+    // contract floating point operations (e.g. -ffp-contract=off). The grid
+    // differs from the default one, mesh coordinates are limited to 2^23 voxels.
+    int32_t deterministic;
+    // Non-zero groups the output triangles of all the boxes by the direction
+    // they face, see melt_result_t::face_offsets. A renderer can then skip the
+    // faces pointing away from the camera with one test per direction, e.g. all
+    // of MELT_FACE_POSITIVE_X when looking along +x.
+    int32_t face_buckets;
+    // Closes holes and gaps in the shell of up to about twice closing_radius
+    // voxels before classification, by dilating then eroding the shell voxels
+    // with a cube of closing_radius voxels around each. Concave features
+    // narrower than that are filled as well, the grid gets closing_radius
+    // voxels of extra margin.
+    uint32_t closing_radius;
+    // Non-zero caps the shell along y under every column that holds shell
+    // voxels, for meshes with an open bottom such as buildings standing on
+    // terrain. Columns sharing a side in the xz plane form a footprint, each
+    // footprint is capped at its own lowest layer and covered whole, overhangs
+    // included.
+    int32_t ground_cap;
     uint32_t _end_canary;
 } melt_params_t;
 
 typedef struct
 {
+    // Highest amount of memory held at once during generation, in bytes. This
+    // includes the working buffers and the output mesh.
+    uint64_t peak_memory_bytes;
+    // Size of the scratch buffer the working memory fits in, see
+    // melt_params_t::scratch_buffer.
+    uint64_t scratch_bytes;
+} melt_stats_t;
+
+// Classified voxels of the grid. Voxel (x, y, z) spans min + (x, y, z) *
+// voxel_size to min + (x + 1, y + 1, z + 1) * voxel_size. Its index is
+// x + dimension_x * (y + dimension_y * z), it is bit (index & 31) of word
+// index / 32 of the masks. Voxels in neither mask are exterior.
+typedef struct
+{
+    melt_vec3_t min;
+    float voxel_size;
+    uint32_t dimension_x;
+    uint32_t dimension_y;
+    uint32_t dimension_z;
+    uint32_t* shell;
+    uint32_t* inner;
+} melt_occupancy_t;
+
+typedef struct
+{
+    // Cube with corners at -1 and 1 and the faces selected by box_type_flags.
+    // Box i is the cube scaled by its half extent and moved to its center.
+    melt_mesh_t cube;
+    uint32_t count;
+    // MELT_INSTANCE_FORMAT_FLOAT: center x, y, z then half extent x, y, z, 24
+    // bytes per box.
+    float* boxes;
+    // MELT_INSTANCE_FORMAT_QUANTIZED: the same in 12 bytes per box, without loss.
+    // center = offset + quantized center * scale, half extent = quantized half
+    // extent * scale. Grids above 32767 voxels on an axis don't fit, their boxes
+    // are written to boxes instead and quantized_boxes is NULL.
+    uint16_t* quantized_boxes;
+    melt_vec3_t offset;
+    float scale;
+} melt_instances_t;
+
+typedef struct
+{
+    melt_status_t status;
     melt_mesh_t mesh;
-    melt_mesh_t debug_mesh;
+    // Filled instead of mesh when melt_params_t::instance_format is set
+    melt_instances_t instances;
+    // Filled when melt_params_t::occupancy is set
+    melt_occupancy_t occupancy;
+    // Filled when melt_params_t::face_buckets is set, the triangles facing
+    // melt_face_t f are indices face_offsets[f] to face_offsets[f + 1] of the
+    // mesh, or of the instance cube.
+    uint32_t face_offsets[MELT_FACE_COUNT + 1];
+    melt_stats_t stats;
 } melt_result_t;
 
+// Returns 1 when the occluder was generated, 0 otherwise with the reason in
+// result->status. The result only needs to be freed on success.
 int melt_generate_occluder(melt_params_t params, melt_result_t* result);
 
 void melt_free_result(melt_result_t result);
 
+// melt_write_callback_t writing to the FILE* given as user data.
+int melt_write_file(const void* data, size_t byte_size, void* file);
+
+// Time sliced generation, to spread the generation of an occluder across frames.
+// melt_begin_generation copies the parameters, the mesh has to outlive the
+// generation. Each call to melt_step runs until the generation is complete or
+// budget_us microseconds have elapsed, a budget of 0 runs it to completion. A
+// step always runs at least one unit of work: 64 triangles, a chunk of 64K voxels
+// of the shell repair, the plane lists or the output, one slab of at most 64K
+// voxels, the z slices of about 64K voxels searched for the next box, or 1024
+// boxes written. Placing a box found updates the distances of the voxels it
+// shadows in the same step, and MELT_EXPORT_TYPE_ITERATIONS writes a whole
+// document in the first step of every iteration. Reference generations search
+// the whole grid in one step. Steps run on the calling thread
+// whatever the thread count. melt_step returns 1 once the generation is
+// complete. melt_end_generation releases the generation and returns the same as
+// melt_generate_occluder, a generation ended before completion is cancelled.
+typedef struct melt_generation_t melt_generation_t;
+
+melt_generation_t* melt_begin_generation(melt_params_t params);
+
+int melt_step(melt_generation_t* generation, uint32_t budget_us);
+
+int melt_end_generation(melt_generation_t* generation, melt_result_t* result);
+
+// Retained classification, to extract occluders with other settings without
+// voxelizing and classifying the mesh again. melt_classify runs the first two
+// phases of melt_generate_occluder and returns NULL with the reason in
+// out_status when they fail. The mesh is no longer needed afterwards.
+typedef struct melt_classification_t melt_classification_t;
+
+melt_classification_t* melt_classify(melt_params_t params, melt_status_t* out_status);
+
+// Extracts an occluder from a copy of the classified voxels, the classification
+// is left as is and can be extracted from again. The mesh, voxel_size and
+// deterministic of params are ignored.
+// Returns the same as melt_generate_occluder.
+int melt_extract_occluder(const melt_classification_t* classification, melt_params_t params, melt_result_t* result);
+
+void melt_destroy_classification(melt_classification_t* classification);
+
+// Serialized classifications are in the byte order of the machine that wrote
+// them.
+size_t melt_get_classification_serialized_size(const melt_classification_t* classification);
+
+void melt_serialize_classification(const melt_classification_t* classification, void* buffer);
+
+// Returns NULL when the data is not a serialized classification.
+melt_classification_t* melt_deserialize_classification(const void* data, size_t byte_size);
+
+// Sharded generation, for scenes whose grid does not fit in one process. The
+// deterministic grid of the whole mesh is split in tiles of tile_size voxels a
+// side that are generated independently, e.g. by worker processes. Tiles only
+// exchange one byte per line of voxels crossing them, in four steps:
+//  . melt_scan_tile finds the lines of a tile that hold shell voxels
+//  . melt_resolve_tile_lines tells each tile which of its lines hold shell voxels
+//    before or after it
+//  . melt_generate_tile classifies the voxels of a tile exactly as the whole grid
+//    would and fills them with boxes
+//  . melt_stitch_tile_lines checks that the shell is watertight across tiles
+// Boxes stop at the tile borders, melt_merge_boxes joins them back. Every tile
+// takes the whole mesh and the parameters of melt_generate_occluder, with
+// deterministic forced on. The fill percentage applies to each tile,
+// closing_radius, ground_cap and reference are not supported.
+typedef struct
+{
+    // Deterministic grid of the whole mesh, see melt_params_t::deterministic
+    int32_t origin_cell[3];
+    uint32_t dimension[3];
+    uint32_t tile_size;
+    uint32_t tile_count[3];
+} melt_tiling_t;
+
+void melt_plan_tiling(melt_params_t params, uint32_t tile_size, melt_tiling_t* out_tiling);
+
+// Tiles are numbered along x, then y, then z.
+uint32_t melt_get_tile_count(const melt_tiling_t* tiling);
+
+// Number of lines of voxels crossing a tile along x, y and z, the size of the
+// line buffers of the tile in bytes.
+uint32_t melt_get_tile_line_count(const melt_tiling_t* tiling, uint32_t tile);
+
+// Voxelizes the shell of a tile and writes its lines. Returns 0 when cancelled.
+int melt_scan_tile(melt_params_t params, const melt_tiling_t* tiling, uint32_t tile, uint8_t* out_lines);
+
+// Takes the scanned lines of every tile, by tile number, and updates them in
+// place for melt_generate_tile.
+void melt_resolve_tile_lines(const melt_tiling_t* tiling, uint8_t* const* tile_lines);
+
+// Generates the boxes of a tile from its resolved lines and writes the state
+// of the lines for melt_stitch_tile_lines. Returns the same as
+// melt_generate_occluder, a tile that leaks on its own is not watertight and
+// the states are only written on success.
+int melt_generate_tile(melt_params_t params, const melt_tiling_t* tiling, uint32_t tile, const uint8_t* lines,
+    uint8_t* out_states, melt_result_t* result);
+
+// Takes the line states of every tile, by tile number. Returns 1 when the shell
+// is watertight across the tiles, the tiles are then the occluder of the whole
+// mesh.
+int melt_stitch_tile_lines(const melt_tiling_t* tiling, const uint8_t* const* tile_states);
+
+// Job queue, to generate many occluders in the background and collect them as
+// they complete. Jobs run on worker threads owned by the queue, or on a caller
+// owned pool through the schedule callback. Pending jobs start by decreasing
+// priority, then by decreasing grid size, then in submission order.
+typedef struct melt_queue_t melt_queue_t;
+
+// Identifies a submitted job until its result is collected, 0 is never a job.
+typedef uint32_t melt_job_t;
+
+typedef void (*melt_task_t)(void* task_data);
+
+// Runs task(task_data) once on a thread of the caller owned pool. It is called
+// without any lock of the queue held and must not run the task inline.
+typedef void (*melt_schedule_callback_t)(melt_task_t task, void* task_data, void* user_data);
+
+typedef struct
+{
+    // Worker threads owned by the queue. With 0 and no schedule callback, the
+    // jobs run on the thread polling or waiting for them.
+    uint32_t thread_count;
+    melt_schedule_callback_t schedule_callback;
+    void* schedule_user_data;
+    // Jobs only start while the memory estimated for the running jobs fits in the
+    // budget, the others wait in the queue. A job larger than the budget runs
+    // alone. 0 is no budget.
+    uint64_t memory_budget_bytes;
+} melt_queue_params_t;
+
+melt_queue_t* melt_create_queue(melt_queue_params_t params);
+
+// Waits for the running jobs, drops the pending ones and frees the results that
+// were not collected.
+void melt_destroy_queue(melt_queue_t* queue);
+
+// The mesh has to outlive the job. Higher priorities start first.
+melt_job_t melt_submit(melt_queue_t* queue, melt_params_t params, int32_t priority);
+
+// Returns 1 once the job is complete and hands its result over, the job is then
+// released. Returns 0 while the job is pending or running.
+int melt_poll(melt_queue_t* queue, melt_job_t job, melt_result_t* result);
+
+// Blocks until the job is complete and hands its result over. Returns the same
+// as melt_generate_occluder. Returns 0 with a zeroed result and the status
+// MELT_STATUS_UNKNOWN_JOB when the job is not in the queue or already collected.
+int melt_wait(melt_queue_t* queue, melt_job_t job, melt_result_t* result);
+
+// Blocks until any job is complete and hands its result over. Returns the job,
+// or 0 when the queue has no job left. Jobs another thread waits for with
+// melt_wait are left to that thread.
+melt_job_t melt_wait_any(melt_queue_t* queue, melt_result_t* result);
+
+// Runtime occluder selection. A box set holds the boxes of any number of results
+// in structure of arrays form, melt_select_occluders picks each frame the boxes
+// in the view frustum with the largest projected size.
+typedef struct melt_box_set_t melt_box_set_t;
+
+typedef struct
+{
+    // A point p is inside when planes[i][0] * p.x + planes[i][1] * p.y +
+    // planes[i][2] * p.z + planes[i][3] >= 0 for every plane.
+    float planes[6][4];
+    melt_vec3_t eye;
+    // Converts the angular size of a box to the unit of the projected size, e.g.
+    // viewport height / (2 * tan(vertical fov / 2)) for a size in pixels.
+    float projection_scale;
+    // Boxes projected smaller are not selected
+    float min_projected_size;
+    // At most max_count boxes are selected, the largest ones
+    uint32_t max_count;
+    melt_isa_t isa;
+} melt_selection_params_t;
+
+melt_box_set_t* melt_create_box_set(void);
+
+void melt_destroy_box_set(melt_box_set_t* set);
+
+uint32_t melt_add_box(melt_box_set_t* set, melt_vec3_t center, melt_vec3_t half_extent);
+
+// Adds the boxes of a result, from its instances when it has some and from its
+// mesh otherwise. Boxes are numbered in the order they are added, returns the
+// number of the first box of the result.
+uint32_t melt_add_result_boxes(melt_box_set_t* set, const melt_result_t* result);
+
+uint32_t melt_get_box_count(const melt_box_set_t* set);
+
+void melt_get_box(const melt_box_set_t* set, uint32_t box, melt_vec3_t* out_center, melt_vec3_t* out_half_extent);
+
+// Merges the boxes sharing a whole face into one until none is left, e.g. the
+// boxes of tiles cut at the tile borders. Box corners have to lie on whole half
+// voxels of voxel_size, as those of deterministic generations do. Boxes are
+// numbered again in an order that depends on the boxes only, not on the order
+// they were added in. Returns the number of boxes.
+uint32_t melt_merge_boxes(melt_box_set_t* set, float voxel_size);
+
+// Writes the selected boxes to out_boxes and their projected size to out_sizes,
+// both of params->max_count elements, by decreasing size then increasing box
+// number. The projected size is the radius of the bounding sphere of a box
+// over its distance to the eye, times the projection scale. Boxes around the
+// eye have a size of FLT_MAX. Returns the number of selected boxes.
+uint32_t melt_select_occluders(const melt_box_set_t* set, const melt_selection_params_t* params,
+    uint32_t* out_boxes, float* out_sizes);
+
+// Bounding volume hierarchy over the boxes of a box set, to visit the boxes in
+// the view frustum nearest first in large scenes. Nodes have four children and
+// are split with a binned surface area heuristic. A hierarchy does not refer to
+// its box set once built.
+typedef struct melt_bvh_t melt_bvh_t;
+
+melt_bvh_t* melt_build_bvh(const melt_box_set_t* set);
+
+void melt_destroy_bvh(melt_bvh_t* bvh);
+
+// Serialized hierarchies are in the byte order of the machine that wrote them.
+size_t melt_get_bvh_serialized_size(const melt_bvh_t* bvh);
+
+void melt_serialize_bvh(const melt_bvh_t* bvh, void* buffer);
+
+// Returns NULL when the data is not a serialized hierarchy, or when its nodes
+// refer to nodes or boxes out of range.
+melt_bvh_t* melt_deserialize_bvh(const void* data, size_t byte_size);
+
+// Writes to out_boxes, in approximate front to back order, the boxes that
+// melt_select_occluders could select: in the frustum and at least as large as
+// the minimum projected size. Stops after view->max_count boxes, returns the
+// number of boxes written.
+uint32_t melt_traverse_bvh(const melt_bvh_t* bvh, const melt_selection_params_t* view, uint32_t* out_boxes);
+
+melt_isa_t melt_get_supported_isa(void);
+
 #ifndef MELT_ASSERT
 #define MELT_ASSERT(stmt) (void)(stmt)
 #endif
@@ -123,11 +557,21 @@ void melt_free_result(melt_result_t result);
 #ifndef MELT_PROFILE_END
 #define MELT_PROFILE_END()
 #endif
+// MELT_MALLOC and MELT_FREE can be overridden, they may be called concurrently
+// when generating occluders from several threads.
 #ifndef MELT_MALLOC
 #include <stdlib.h>
 #define MELT_MALLOC(T, N) (T*)malloc(N * sizeof(T))
 #define MELT_FREE(T) free(T)
 #endif
+// Above 0, generations without a scratch buffer use one of this size on the
+// stack, so that small grids are generated without heap allocation besides the
+// output, up to about 9x9x9 voxels with 64 KiB. Every thread generating
+// occluders needs that much stack, including the workers of a queue, so it is
+// disabled by default.
+#ifndef MELT_STACK_SCRATCH_SIZE
+#define MELT_STACK_SCRATCH_SIZE 0
+#endif
 
 #endif // MELT_H
 
@@ -152,9 +596,56 @@ void melt_free_result(melt_result_t result);
 #include <float.h>   // FLT_MAX
 #include <limits.h>  // INT_MAX
 #include <string.h>  // memset
+#include <stdio.h>   // vsnprintf, fwrite
+#include <stdarg.h>  // va_list
 #include <stdbool.h> // bool
 
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <time.h>     // clock_gettime
+#include <sys/time.h> // gettimeofday
+#if !defined(MELT_NO_THREADS)
+#include <pthread.h>
+#endif
+#endif
+
+#if !defined(MELT_NO_SIMD) && (defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86))
+#define MELT_SIMD_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define MELT_TARGET(isa)
+#else
+#include <cpuid.h>
+#define MELT_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
 #define MELT_ARRAY_LENGTH(array) ((int)(sizeof(array) / sizeof(*array)))
+#define MELT_VOXEL_ROW_CHUNK 64
+#define MELT_POLL_TRIANGLE_COUNT 64
+#define MELT_STEP_TRIANGLE_COUNT 64
+#define MELT_MAX_BOX_INDEX_COUNT 48
+#define MELT_STEP_VOXEL_COUNT (1 << 16)
+#define MELT_STEP_BOX_COUNT 1024
+#define MELT_MAX_THREADS 256
+#define MELT_SCRATCH_ALIGNMENT 16
+#define MELT_EXPORT_BUFFER_SIZE 4096
+#define MELT_CULL_BLOCK 8
+#define MELT_CULL_CHUNK 256
+#define MELT_BVH_LEAF_SIZE 4
+#define MELT_BVH_BIN_COUNT 16
+#define MELT_BVH_MAGIC 0x4856424du // "MBVH"
+#define MELT_BVH_VERSION 1
+#define MELT_CLASSIFICATION_MAGIC 0x4c43434du // "MCCL"
+#define MELT_CLASSIFICATION_VERSION 2
+#define MELT_TILE_LINE_SHELL  (1 << 0)
+#define MELT_TILE_LINE_BEFORE (1 << 1)
+#define MELT_TILE_LINE_AFTER  (1 << 2)
 #define MELT_UNUSED(value) (void)value
 
 typedef melt_vec3_t vec3_t;
@@ -178,8 +669,6 @@ typedef struct
     uint32_t x, y, z;
 } uvec3_t;
 
-typedef uvec3_t color_3u8_t;
-
 typedef struct
 {
     vec3_t min;
@@ -220,6 +709,15 @@ typedef struct
     };
 } _min_distance_t;
 
+// The minimum distance field is stored as one plane per axis, so that updating
+// the distances of a row of voxels works on contiguous memory.
+typedef struct
+{
+    uint32_t* x;
+    uint32_t* y;
+    uint32_t* z;
+} _min_distance_field_t;
+
 typedef struct
 {
     uint8_t visibility : 6;
@@ -268,44 +766,108 @@ typedef struct
     uint32_t x_count;
     uint32_t y_count;
     uint32_t z_count;
+
+    // Backing storage of the plane voxel lists, one block per axis
+    _voxel_t* x_voxels;
+    _voxel_t* y_voxels;
+    _voxel_t* z_voxels;
+    uint32_t voxel_count;
 } _voxel_set_planes_t;
 
+// Boxes of a box set, the arrays are padded with empty boxes to a multiple of
+// MELT_CULL_BLOCK.
+typedef struct
+{
+    float* center_x;
+    float* center_y;
+    float* center_z;
+    float* half_x;
+    float* half_y;
+    float* half_z;
+} _box_arrays_t;
+
+// Kernels that have a specialized implementation per instruction set. The best
+// implementation is picked when a context is initialized.
+typedef struct
+{
+    melt_isa_t isa;
+
+    // Intersects one triangle with a row of voxels along z, writes 1 for each
+    // voxel of the row intersecting the triangle and 0 otherwise.
+    void (*triangle_intersects_voxel_row)(const _triangle_t* triangle, float center_x, float center_y,
+        const float* center_z, uint32_t count, vec3_t half_voxel_extent, uint8_t* out_intersects);
+
+    // Lowers the distances of the inner voxels that are not clipped in a row to
+    // value - i * step for the i-th voxel of the row.
+    void (*update_min_distance_row)(uint32_t* distances, const _voxel_status_t* voxel_field, uint32_t count,
+        uint32_t value, uint32_t step);
+
+    // Counts the inner voxels that are not clipped.
+    uint32_t (*count_inner_voxels)(const _voxel_status_t* voxel_field, uint32_t count);
+
+    // Returns the index of the first inner voxel that is not clipped in [begin, end),
+    // or end if there is none.
+    uint32_t (*find_inner_voxel)(const _voxel_status_t* voxel_field, uint32_t begin, uint32_t end);
+
+    // Writes the projected size of count boxes, or -1 for the boxes outside of
+    // the frustum. count is a multiple of MELT_CULL_BLOCK.
+    void (*cull_boxes)(const _box_arrays_t* boxes, uint32_t begin, uint32_t count,
+        const melt_selection_params_t* view, float* out_sizes);
+
+} _kernels_t;
+
 typedef struct
 {
+    // Voxel (x, y, z) is centered on origin + (position + 1) * voxel_size
+    vec3_t origin;
+    float voxel_size;
+    // Deterministic grids start at origin_cell * voxel_size, see melt_params_t
+    bool deterministic;
+    svec3_t origin_cell;
     uvec3_t dimension;
     uint32_t size;
 
-    int32_t* voxel_indices;
+    _kernels_t kernels;
+    uint32_t thread_count;
+
+    uint32_t* shell_mask;
     _voxel_status_t* voxel_field;
-    _min_distance_t* min_distance_field;
+    _min_distance_field_t min_distance_field;
+
+    // Lines of the tile in the grid along x, y and z, see melt_generate_tile.
+    // NULL when the grid is not a tile.
+    const uint8_t* tile_lines[3];
 
     _voxel_t* voxel_set;
     uint32_t voxel_set_count;
+    uint32_t voxel_set_capacity;
 
     _voxel_set_planes_t voxel_set_planes;
 
     _max_extent_t* max_extents;
     uint32_t max_extents_count;
+    uint32_t max_extents_capacity;
+
+    // Progress reporting and cancellation, see melt_params_t
+    melt_progress_callback_t progress_callback;
+    void* progress_user_data;
+    const volatile uint32_t* cancel_flag;
+    volatile uint32_t cancelled;
+    melt_progress_t progress;
+    melt_progress_t reported_progress;
+
+    size_t memory_usage;
+    size_t memory_peak;
+
+    // Bump allocated scratch buffer, see melt_params_t
+    uint8_t* scratch;
+    size_t scratch_size;
+    size_t scratch_top;
+    size_t scratch_virtual_top;
+    size_t scratch_bytes;
+    void* scratch_last;
 } _context_t;
 
-static const color_3u8_t _color_null = { 0, 0, 0 };
-
-#ifdef MELT_DEBUG
-static const color_3u8_t _color_steel_blue = { 70, 130, 180 };
-static const color_3u8_t _colors[] =
-{
-    { 245, 245, 245 },
-    {  70, 130, 180 },
-    {   0, 255, 127 },
-    {   0, 128, 128 },
-    { 255, 182, 193 },
-    { 176, 224, 230 },
-    { 119, 136, 153 },
-    { 143, 188, 143 },
-    { 255, 250, 240 },
-};
-#endif
-
 static const uint16_t _voxel_cube_indices[36] =
 {
     0, 1, 2,
@@ -467,11 +1029,6 @@ static int _svec3_equals(svec3_t a, svec3_t b)
     return a.x == b.x && a.y == b.y && a.z == b.z;
 }
 
-static int _uvec3_equals(uvec3_t a, uvec3_t b)
-{
-    return a.x == b.x && a.y == b.y && a.z == b.z;
-}
-
 static float _float_min(float a, float b) {
     return a < b ? a : b;
 }
@@ -501,11 +1058,6 @@ static vec3_t _vec3_max(vec3_t a, vec3_t b)
     return _vec3_init(x, y, z);
 }
 
-static vec3_t _aabb_center(_aabb_t aabb)
-{
-    return _vec3_mulf(_vec3_add(aabb.min, aabb.max), 0.5f);
-}
-
 static bool _aabb_intersects_plane(const _plane_t plane, vec3_t half_aabb_dim)
 {
     vec3_t vmin;
@@ -692,6 +1244,267 @@ static bool _aabb_intersects_triangle(const _triangle_t* triangle, vec3_t aabb_c
     return true;
 }
 
+static void _triangle_intersects_voxel_row_scalar(const _triangle_t* triangle, float center_x, float center_y,
+    const float* center_z, uint32_t count, vec3_t half_voxel_extent, uint8_t* out_intersects)
+{
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        vec3_t center = _vec3_init(center_x, center_y, center_z[i]);
+        out_intersects[i] = _aabb_intersects_triangle(triangle, center, half_voxel_extent);
+    }
+}
+
+#if defined(MELT_SIMD_X86)
+
+// The vector variants of the triangle box test evaluate the same expressions as
+// _aabb_intersects_triangle, in the same order and without contraction, so that
+// every variant classifies voxels identically. Separating axis tests are combined
+// instead of exiting early.
+
+MELT_TARGET("sse4.1")
+static inline __m128 _sse41_axis_separated(__m128 first, __m128 second, __m128 rad)
+{
+    const __m128 lt = _mm_cmplt_ps(first, second);
+    const __m128 min = _mm_blendv_ps(second, first, lt);
+    const __m128 max = _mm_blendv_ps(first, second, lt);
+    const __m128 neg_rad = _mm_xor_ps(rad, _mm_set1_ps(-0.0f));
+    return _mm_or_ps(_mm_cmpgt_ps(min, rad), _mm_cmplt_ps(max, neg_rad));
+}
+
+MELT_TARGET("sse4.1")
+static inline __m128 _sse41_extent_separated(__m128 a, __m128 b, __m128 c, __m128 half)
+{
+    __m128 min = a;
+    __m128 max = a;
+    min = _mm_min_ps(b, min);
+    max = _mm_max_ps(b, max);
+    min = _mm_min_ps(c, min);
+    max = _mm_max_ps(c, max);
+    const __m128 neg_half = _mm_xor_ps(half, _mm_set1_ps(-0.0f));
+    return _mm_or_ps(_mm_cmpgt_ps(min, half), _mm_cmplt_ps(max, neg_half));
+}
+
+MELT_TARGET("sse4.1")
+static void _triangle_intersects_voxel_row_sse41(const _triangle_t* triangle, float center_x, float center_y,
+    const float* center_z, uint32_t count, vec3_t half_voxel_extent, uint8_t* out_intersects)
+{
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    const __m128 hx = _mm_set1_ps(half_voxel_extent.x);
+    const __m128 hy = _mm_set1_ps(half_voxel_extent.y);
+    const __m128 hz = _mm_set1_ps(half_voxel_extent.z);
+    const __m128 cx = _mm_set1_ps(center_x);
+    const __m128 cy = _mm_set1_ps(center_y);
+
+    uint32_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        const __m128 cz = _mm_loadu_ps(center_z + i);
+
+        const __m128 v0x = _mm_sub_ps(_mm_set1_ps(triangle->v0.x), cx);
+        const __m128 v0y = _mm_sub_ps(_mm_set1_ps(triangle->v0.y), cy);
+        const __m128 v0z = _mm_sub_ps(_mm_set1_ps(triangle->v0.z), cz);
+        const __m128 v1x = _mm_sub_ps(_mm_set1_ps(triangle->v1.x), cx);
+        const __m128 v1y = _mm_sub_ps(_mm_set1_ps(triangle->v1.y), cy);
+        const __m128 v1z = _mm_sub_ps(_mm_set1_ps(triangle->v1.z), cz);
+        const __m128 v2x = _mm_sub_ps(_mm_set1_ps(triangle->v2.x), cx);
+        const __m128 v2y = _mm_sub_ps(_mm_set1_ps(triangle->v2.y), cy);
+        const __m128 v2z = _mm_sub_ps(_mm_set1_ps(triangle->v2.z), cz);
+
+        const __m128 e0x = _mm_sub_ps(v1x, v0x), e0y = _mm_sub_ps(v1y, v0y), e0z = _mm_sub_ps(v1z, v0z);
+        const __m128 e1x = _mm_sub_ps(v2x, v1x), e1y = _mm_sub_ps(v2y, v1y), e1z = _mm_sub_ps(v2z, v1z);
+        const __m128 e2x = _mm_sub_ps(v0x, v2x), e2y = _mm_sub_ps(v0y, v2y), e2z = _mm_sub_ps(v0z, v2z);
+
+        __m128 separated = _mm_setzero_ps();
+        __m128 fx, fy, fz;
+
+#define MELT_SSE41_AXIS_X(first_v, second_v, a, b, fa, fb)                                                       \
+        separated = _mm_or_ps(separated, _sse41_axis_separated(                                               \
+            _mm_sub_ps(_mm_mul_ps(a, first_v##y), _mm_mul_ps(b, first_v##z)),                                 \
+            _mm_sub_ps(_mm_mul_ps(a, second_v##y), _mm_mul_ps(b, second_v##z)),                               \
+            _mm_add_ps(_mm_mul_ps(fa, hy), _mm_mul_ps(fb, hz))))
+#define MELT_SSE41_AXIS_Y(first_v, second_v, a, b, fa, fb)                                                       \
+        separated = _mm_or_ps(separated, _sse41_axis_separated(                                               \
+            _mm_sub_ps(_mm_mul_ps(b, first_v##z), _mm_mul_ps(a, first_v##x)),                                 \
+            _mm_sub_ps(_mm_mul_ps(b, second_v##z), _mm_mul_ps(a, second_v##x)),                               \
+            _mm_add_ps(_mm_mul_ps(fa, hx), _mm_mul_ps(fb, hz))))
+#define MELT_SSE41_AXIS_Z(first_v, second_v, a, b, fa, fb)                                                       \
+        separated = _mm_or_ps(separated, _sse41_axis_separated(                                               \
+            _mm_sub_ps(_mm_mul_ps(a, first_v##x), _mm_mul_ps(b, first_v##y)),                                 \
+            _mm_sub_ps(_mm_mul_ps(a, second_v##x), _mm_mul_ps(b, second_v##y)),                               \
+            _mm_add_ps(_mm_mul_ps(fa, hx), _mm_mul_ps(fb, hy))))
+
+        fx = _mm_andnot_ps(sign, e0x); fy = _mm_andnot_ps(sign, e0y); fz = _mm_andnot_ps(sign, e0z);
+        MELT_SSE41_AXIS_X(v0, v2, e0z, e0y, fz, fy);
+        MELT_SSE41_AXIS_Y(v0, v2, e0z, e0x, fz, fx);
+        MELT_SSE41_AXIS_Z(v2, v1, e0y, e0x, fy, fx);
+
+        fx = _mm_andnot_ps(sign, e1x); fy = _mm_andnot_ps(sign, e1y); fz = _mm_andnot_ps(sign, e1z);
+        MELT_SSE41_AXIS_X(v0, v2, e1z, e1y, fz, fy);
+        MELT_SSE41_AXIS_Y(v0, v2, e1z, e1x, fz, fx);
+        MELT_SSE41_AXIS_Z(v0, v1, e1y, e1x, fy, fx);
+
+        fx = _mm_andnot_ps(sign, e2x); fy = _mm_andnot_ps(sign, e2y); fz = _mm_andnot_ps(sign, e2z);
+        MELT_SSE41_AXIS_X(v0, v1, e2z, e2y, fz, fy);
+        MELT_SSE41_AXIS_Y(v0, v1, e2z, e2x, fz, fx);
+        MELT_SSE41_AXIS_Z(v2, v1, e2y, e2x, fy, fx);
+
+#undef MELT_SSE41_AXIS_X
+#undef MELT_SSE41_AXIS_Y
+#undef MELT_SSE41_AXIS_Z
+
+        separated = _mm_or_ps(separated, _sse41_extent_separated(v0x, v1x, v2x, hx));
+        separated = _mm_or_ps(separated, _sse41_extent_separated(v0y, v1y, v2y, hy));
+        separated = _mm_or_ps(separated, _sse41_extent_separated(v0z, v1z, v2z, hz));
+
+        const __m128 nx = _mm_sub_ps(_mm_mul_ps(e0y, e1z), _mm_mul_ps(e0z, e1y));
+        const __m128 ny = _mm_sub_ps(_mm_mul_ps(e0z, e1x), _mm_mul_ps(e0x, e1z));
+        const __m128 nz = _mm_sub_ps(_mm_mul_ps(e0x, e1y), _mm_mul_ps(e0y, e1x));
+        const __m128 distance = _mm_xor_ps(sign, _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, v0x), _mm_mul_ps(ny, v0y)), _mm_mul_ps(nz, v0z)));
+
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 neg_hx = _mm_xor_ps(sign, hx), neg_hy = _mm_xor_ps(sign, hy), neg_hz = _mm_xor_ps(sign, hz);
+        const __m128 px = _mm_cmpgt_ps(nx, zero), py = _mm_cmpgt_ps(ny, zero), pz = _mm_cmpgt_ps(nz, zero);
+        const __m128 vmin_x = _mm_blendv_ps(hx, neg_hx, px), vmax_x = _mm_blendv_ps(neg_hx, hx, px);
+        const __m128 vmin_y = _mm_blendv_ps(hy, neg_hy, py), vmax_y = _mm_blendv_ps(neg_hy, hy, py);
+        const __m128 vmin_z = _mm_blendv_ps(hz, neg_hz, pz), vmax_z = _mm_blendv_ps(neg_hz, hz, pz);
+        const __m128 dot_min = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, vmin_x), _mm_mul_ps(ny, vmin_y)), _mm_mul_ps(nz, vmin_z)), distance);
+        const __m128 dot_max = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, vmax_x), _mm_mul_ps(ny, vmax_y)), _mm_mul_ps(nz, vmax_z)), distance);
+
+        separated = _mm_or_ps(separated, _mm_cmpgt_ps(dot_min, zero));
+        separated = _mm_or_ps(separated, _mm_cmpnge_ps(dot_max, zero));
+
+        const int mask = ~_mm_movemask_ps(separated);
+        out_intersects[i + 0] = (uint8_t)((mask >> 0) & 1);
+        out_intersects[i + 1] = (uint8_t)((mask >> 1) & 1);
+        out_intersects[i + 2] = (uint8_t)((mask >> 2) & 1);
+        out_intersects[i + 3] = (uint8_t)((mask >> 3) & 1);
+    }
+
+    _triangle_intersects_voxel_row_scalar(triangle, center_x, center_y, center_z + i, count - i, half_voxel_extent, out_intersects + i);
+}
+
+MELT_TARGET("avx2")
+static inline __m256 _avx2_axis_separated(__m256 first, __m256 second, __m256 rad)
+{
+    const __m256 lt = _mm256_cmp_ps(first, second, _CMP_LT_OQ);
+    const __m256 min = _mm256_blendv_ps(second, first, lt);
+    const __m256 max = _mm256_blendv_ps(first, second, lt);
+    const __m256 neg_rad = _mm256_xor_ps(rad, _mm256_set1_ps(-0.0f));
+    return _mm256_or_ps(_mm256_cmp_ps(min, rad, _CMP_GT_OQ), _mm256_cmp_ps(max, neg_rad, _CMP_LT_OQ));
+}
+
+MELT_TARGET("avx2")
+static inline __m256 _avx2_extent_separated(__m256 a, __m256 b, __m256 c, __m256 half)
+{
+    __m256 min = a;
+    __m256 max = a;
+    min = _mm256_min_ps(b, min);
+    max = _mm256_max_ps(b, max);
+    min = _mm256_min_ps(c, min);
+    max = _mm256_max_ps(c, max);
+    const __m256 neg_half = _mm256_xor_ps(half, _mm256_set1_ps(-0.0f));
+    return _mm256_or_ps(_mm256_cmp_ps(min, half, _CMP_GT_OQ), _mm256_cmp_ps(max, neg_half, _CMP_LT_OQ));
+}
+
+MELT_TARGET("avx2")
+static void _triangle_intersects_voxel_row_avx2(const _triangle_t* triangle, float center_x, float center_y,
+    const float* center_z, uint32_t count, vec3_t half_voxel_extent, uint8_t* out_intersects)
+{
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    const __m256 hx = _mm256_set1_ps(half_voxel_extent.x);
+    const __m256 hy = _mm256_set1_ps(half_voxel_extent.y);
+    const __m256 hz = _mm256_set1_ps(half_voxel_extent.z);
+    const __m256 cx = _mm256_set1_ps(center_x);
+    const __m256 cy = _mm256_set1_ps(center_y);
+
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        const __m256 cz = _mm256_loadu_ps(center_z + i);
+
+        const __m256 v0x = _mm256_sub_ps(_mm256_set1_ps(triangle->v0.x), cx);
+        const __m256 v0y = _mm256_sub_ps(_mm256_set1_ps(triangle->v0.y), cy);
+        const __m256 v0z = _mm256_sub_ps(_mm256_set1_ps(triangle->v0.z), cz);
+        const __m256 v1x = _mm256_sub_ps(_mm256_set1_ps(triangle->v1.x), cx);
+        const __m256 v1y = _mm256_sub_ps(_mm256_set1_ps(triangle->v1.y), cy);
+        const __m256 v1z = _mm256_sub_ps(_mm256_set1_ps(triangle->v1.z), cz);
+        const __m256 v2x = _mm256_sub_ps(_mm256_set1_ps(triangle->v2.x), cx);
+        const __m256 v2y = _mm256_sub_ps(_mm256_set1_ps(triangle->v2.y), cy);
+        const __m256 v2z = _mm256_sub_ps(_mm256_set1_ps(triangle->v2.z), cz);
+
+        const __m256 e0x = _mm256_sub_ps(v1x, v0x), e0y = _mm256_sub_ps(v1y, v0y), e0z = _mm256_sub_ps(v1z, v0z);
+        const __m256 e1x = _mm256_sub_ps(v2x, v1x), e1y = _mm256_sub_ps(v2y, v1y), e1z = _mm256_sub_ps(v2z, v1z);
+        const __m256 e2x = _mm256_sub_ps(v0x, v2x), e2y = _mm256_sub_ps(v0y, v2y), e2z = _mm256_sub_ps(v0z, v2z);
+
+        __m256 separated = _mm256_setzero_ps();
+        __m256 fx, fy, fz;
+
+#define MELT_AVX2_AXIS_X(first_v, second_v, a, b, fa, fb)                                                        \
+        separated = _mm256_or_ps(separated, _avx2_axis_separated(                                             \
+            _mm256_sub_ps(_mm256_mul_ps(a, first_v##y), _mm256_mul_ps(b, first_v##z)),                       \
+            _mm256_sub_ps(_mm256_mul_ps(a, second_v##y), _mm256_mul_ps(b, second_v##z)),                     \
+            _mm256_add_ps(_mm256_mul_ps(fa, hy), _mm256_mul_ps(fb, hz))))
+#define MELT_AVX2_AXIS_Y(first_v, second_v, a, b, fa, fb)                                                        \
+        separated = _mm256_or_ps(separated, _avx2_axis_separated(                                             \
+            _mm256_sub_ps(_mm256_mul_ps(b, first_v##z), _mm256_mul_ps(a, first_v##x)),                       \
+            _mm256_sub_ps(_mm256_mul_ps(b, second_v##z), _mm256_mul_ps(a, second_v##x)),                     \
+            _mm256_add_ps(_mm256_mul_ps(fa, hx), _mm256_mul_ps(fb, hz))))
+#define MELT_AVX2_AXIS_Z(first_v, second_v, a, b, fa, fb)                                                        \
+        separated = _mm256_or_ps(separated, _avx2_axis_separated(                                             \
+            _mm256_sub_ps(_mm256_mul_ps(a, first_v##x), _mm256_mul_ps(b, first_v##y)),                       \
+            _mm256_sub_ps(_mm256_mul_ps(a, second_v##x), _mm256_mul_ps(b, second_v##y)),                     \
+            _mm256_add_ps(_mm256_mul_ps(fa, hx), _mm256_mul_ps(fb, hy))))
+
+        fx = _mm256_andnot_ps(sign, e0x); fy = _mm256_andnot_ps(sign, e0y); fz = _mm256_andnot_ps(sign, e0z);
+        MELT_AVX2_AXIS_X(v0, v2, e0z, e0y, fz, fy);
+        MELT_AVX2_AXIS_Y(v0, v2, e0z, e0x, fz, fx);
+        MELT_AVX2_AXIS_Z(v2, v1, e0y, e0x, fy, fx);
+
+        fx = _mm256_andnot_ps(sign, e1x); fy = _mm256_andnot_ps(sign, e1y); fz = _mm256_andnot_ps(sign, e1z);
+        MELT_AVX2_AXIS_X(v0, v2, e1z, e1y, fz, fy);
+        MELT_AVX2_AXIS_Y(v0, v2, e1z, e1x, fz, fx);
+        MELT_AVX2_AXIS_Z(v0, v1, e1y, e1x, fy, fx);
+
+        fx = _mm256_andnot_ps(sign, e2x); fy = _mm256_andnot_ps(sign, e2y); fz = _mm256_andnot_ps(sign, e2z);
+        MELT_AVX2_AXIS_X(v0, v1, e2z, e2y, fz, fy);
+        MELT_AVX2_AXIS_Y(v0, v1, e2z, e2x, fz, fx);
+        MELT_AVX2_AXIS_Z(v2, v1, e2y, e2x, fy, fx);
+
+#undef MELT_AVX2_AXIS_X
+#undef MELT_AVX2_AXIS_Y
+#undef MELT_AVX2_AXIS_Z
+
+        separated = _mm256_or_ps(separated, _avx2_extent_separated(v0x, v1x, v2x, hx));
+        separated = _mm256_or_ps(separated, _avx2_extent_separated(v0y, v1y, v2y, hy));
+        separated = _mm256_or_ps(separated, _avx2_extent_separated(v0z, v1z, v2z, hz));
+
+        const __m256 nx = _mm256_sub_ps(_mm256_mul_ps(e0y, e1z), _mm256_mul_ps(e0z, e1y));
+        const __m256 ny = _mm256_sub_ps(_mm256_mul_ps(e0z, e1x), _mm256_mul_ps(e0x, e1z));
+        const __m256 nz = _mm256_sub_ps(_mm256_mul_ps(e0x, e1y), _mm256_mul_ps(e0y, e1x));
+        const __m256 distance = _mm256_xor_ps(sign, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, v0x), _mm256_mul_ps(ny, v0y)), _mm256_mul_ps(nz, v0z)));
+
+        const __m256 zero = _mm256_setzero_ps();
+        const __m256 neg_hx = _mm256_xor_ps(sign, hx), neg_hy = _mm256_xor_ps(sign, hy), neg_hz = _mm256_xor_ps(sign, hz);
+        const __m256 px = _mm256_cmp_ps(nx, zero, _CMP_GT_OQ), py = _mm256_cmp_ps(ny, zero, _CMP_GT_OQ), pz = _mm256_cmp_ps(nz, zero, _CMP_GT_OQ);
+        const __m256 vmin_x = _mm256_blendv_ps(hx, neg_hx, px), vmax_x = _mm256_blendv_ps(neg_hx, hx, px);
+        const __m256 vmin_y = _mm256_blendv_ps(hy, neg_hy, py), vmax_y = _mm256_blendv_ps(neg_hy, hy, py);
+        const __m256 vmin_z = _mm256_blendv_ps(hz, neg_hz, pz), vmax_z = _mm256_blendv_ps(neg_hz, hz, pz);
+        const __m256 dot_min = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, vmin_x), _mm256_mul_ps(ny, vmin_y)), _mm256_mul_ps(nz, vmin_z)), distance);
+        const __m256 dot_max = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, vmax_x), _mm256_mul_ps(ny, vmax_y)), _mm256_mul_ps(nz, vmax_z)), distance);
+
+        separated = _mm256_or_ps(separated, _mm256_cmp_ps(dot_min, zero, _CMP_GT_OQ));
+        separated = _mm256_or_ps(separated, _mm256_cmp_ps(dot_max, zero, _CMP_NGE_UQ));
+
+        const int mask = ~_mm256_movemask_ps(separated);
+        for (uint32_t lane = 0; lane < 8; ++lane)
+            out_intersects[i + lane] = (uint8_t)((mask >> lane) & 1);
+    }
+
+    _triangle_intersects_voxel_row_scalar(triangle, center_x, center_y, center_z + i, count - i, half_voxel_extent, out_intersects + i);
+}
+
+#endif // MELT_SIMD_X86
+
 static inline uint32_t _flatten_3d(uvec3_t index, uvec3_t dimension)
 {
     uint32_t out_index = index.x + dimension.x * index.y + dimension.x * dimension.y * index.z;
@@ -790,902 +1603,5463 @@ static _aabb_t _generate_aabb_from_mesh(const melt_mesh_t mesh)
     return aabb;
 }
 
-static void _free_per_plane_voxel_set(_context_t* context)
+// Working buffers are allocated through the context so that the amount of memory
+// held at any point of the generation is known. Each buffer is released as soon
+// as the phase that needs it is over.
+// The scratch buffer is a stack, the buffer on top is reclaimed when released
+// and grows in place. Buffers that do not fit are allocated on the heap. The
+// size of scratch buffer the generation needs is measured on a virtual stack
+// where every buffer fits, the last allocated buffer being its top.
+static size_t _scratch_align(size_t byte_size)
 {
-    for (uint32_t i = 0; i < context->voxel_set_planes.x_count; ++i)
-        MELT_FREE(context->voxel_set_planes.x[i].voxels);
-    for (uint32_t i = 0; i < context->voxel_set_planes.y_count; ++i)
-        MELT_FREE(context->voxel_set_planes.y[i].voxels);
-    for (uint32_t i = 0; i < context->voxel_set_planes.z_count; ++i)
-        MELT_FREE(context->voxel_set_planes.z[i].voxels);
-
-    MELT_FREE(context->voxel_set_planes.x);
-    MELT_FREE(context->voxel_set_planes.y);
-    MELT_FREE(context->voxel_set_planes.z);
+    return (byte_size + MELT_SCRATCH_ALIGNMENT - 1) & ~(size_t)(MELT_SCRATCH_ALIGNMENT - 1);
 }
 
-static void _generate_per_plane_voxel_set(_context_t* context)
+static bool _scratch_owns(const _context_t* context, const void* data)
 {
-    MELT_PROFILE_BEGIN();
+    const uint8_t* byte = (const uint8_t*)data;
+    return context->scratch && byte >= context->scratch && byte < context->scratch + context->scratch_size;
+}
 
-    context->voxel_set_planes.x_count = context->dimension.y * context->dimension.z;
-    context->voxel_set_planes.y_count = context->dimension.x * context->dimension.z;
-    context->voxel_set_planes.z_count = context->dimension.x * context->dimension.y;
+static void* _scratch_alloc(_context_t* context, size_t byte_size)
+{
+    const size_t aligned_byte_size = _scratch_align(byte_size);
+    if (aligned_byte_size > context->scratch_size - context->scratch_top)
+        return MELT_MALLOC(uint8_t, byte_size);
 
-    context->voxel_set_planes.x = MELT_MALLOC(_voxel_set_plane_t, context->voxel_set_planes.x_count);
-    context->voxel_set_planes.y = MELT_MALLOC(_voxel_set_plane_t, context->voxel_set_planes.y_count);
-    context->voxel_set_planes.z = MELT_MALLOC(_voxel_set_plane_t, context->voxel_set_planes.z_count);
+    void* data = context->scratch + context->scratch_top;
+    context->scratch_top += aligned_byte_size;
+    return data;
+}
 
-    for (uint32_t i = 0; i < context->voxel_set_planes.x_count; ++i)
+static void _scratch_free(_context_t* context, void* data, size_t byte_size)
+{
+    if (!_scratch_owns(context, data))
     {
-        context->voxel_set_planes.x[i].voxels = MELT_MALLOC(_voxel_t, context->dimension.x);
-        context->voxel_set_planes.x[i].voxel_count = 0;
+        MELT_FREE(data);
+        return;
     }
-    for (uint32_t i = 0; i < context->voxel_set_planes.y_count; ++i)
+    if ((uint8_t*)data + _scratch_align(byte_size) == context->scratch + context->scratch_top)
+        context->scratch_top -= _scratch_align(byte_size);
+}
+
+static void _track_memory(_context_t* context, size_t byte_size, size_t virtual_top)
+{
+    context->memory_usage += byte_size;
+    if (context->memory_usage > context->memory_peak)
+        context->memory_peak = context->memory_usage;
+    context->scratch_virtual_top = virtual_top;
+    if (virtual_top > context->scratch_bytes)
+        context->scratch_bytes = virtual_top;
+}
+
+static void* _context_alloc(_context_t* context, size_t byte_size)
+{
+    _track_memory(context, byte_size, context->scratch_virtual_top + _scratch_align(byte_size));
+    context->scratch_last = _scratch_alloc(context, byte_size);
+    return context->scratch_last;
+}
+
+static void _context_release(_context_t* context, void* data, size_t byte_size)
+{
+    if (!data)
+        return;
+    MELT_ASSERT(context->memory_usage >= byte_size);
+    context->memory_usage -= byte_size;
+    if (data == context->scratch_last)
     {
-        context->voxel_set_planes.y[i].voxels = MELT_MALLOC(_voxel_t, context->dimension.y);
-        context->voxel_set_planes.y[i].voxel_count = 0;
+        context->scratch_virtual_top -= _scratch_align(byte_size);
+        context->scratch_last = NULL;
     }
-    for (uint32_t i = 0; i < context->voxel_set_planes.z_count; ++i)
+    _scratch_free(context, data, byte_size);
+}
+
+// Grows a buffer, keeping its content.
+static void* _context_grow(_context_t* context, void* data, size_t byte_size, size_t new_byte_size)
+{
+    MELT_ASSERT(new_byte_size >= byte_size);
+    if (!data || data != context->scratch_last)
     {
-        context->voxel_set_planes.z[i].voxels = MELT_MALLOC(_voxel_t, context->dimension.z);
-        context->voxel_set_planes.z[i].voxel_count = 0;
+        void* new_data = _context_alloc(context, new_byte_size);
+        if (data)
+            memcpy(new_data, data, byte_size);
+        _context_release(context, data, byte_size);
+        return new_data;
     }
 
-    uvec2_t dim_yz = _uvec2_init(context->dimension.y, context->dimension.z);
-    uvec2_t dim_xz = _uvec2_init(context->dimension.x, context->dimension.z);
-    uvec2_t dim_xy = _uvec2_init(context->dimension.x, context->dimension.y);
+    const size_t aligned_byte_size = _scratch_align(byte_size);
+    const size_t new_aligned_byte_size = _scratch_align(new_byte_size);
+    const size_t virtual_top = context->scratch_virtual_top - aligned_byte_size + new_aligned_byte_size;
 
-    for (uint32_t x = 0; x < context->dimension.x; ++x)
+    if (_scratch_owns(context, data) && new_aligned_byte_size - aligned_byte_size <= context->scratch_size - context->scratch_top)
     {
-        for (uint32_t y = 0; y < context->dimension.y; ++y)
-        {
-            for (uint32_t z = 0; z < context->dimension.z; ++z)
-            {
-                uvec3_t position = _uvec3_init(x, y, z);
-                int32_t voxel_index = context->voxel_indices[_flatten_3d(position, context->dimension)];
-                if (voxel_index != -1)
-                {
-                    uint32_t index_yz = _flatten_2d(_uvec2_init(y, z), dim_yz);
-                    uint32_t index_xz = _flatten_2d(_uvec2_init(x, z), dim_xz);
-                    uint32_t index_xy = _flatten_2d(_uvec2_init(x, y), dim_xy);
+        _track_memory(context, new_byte_size - byte_size, virtual_top);
+        context->scratch_top += new_aligned_byte_size - aligned_byte_size;
+        return data;
+    }
 
-                    _voxel_set_plane_t* voxels_x_planes = &context->voxel_set_planes.x[index_yz];
-                    _voxel_set_plane_t* voxels_y_planes = &context->voxel_set_planes.y[index_xz];
-                    _voxel_set_plane_t* voxels_z_planes = &context->voxel_set_planes.z[index_xy];
+    // Both buffers are held during the copy.
+    _track_memory(context, new_byte_size, virtual_top);
+    void* new_data = _scratch_alloc(context, new_byte_size);
+    memcpy(new_data, data, byte_size);
+    _scratch_free(context, data, byte_size);
+    context->memory_usage -= byte_size;
+    context->scratch_last = new_data;
+    return new_data;
+}
 
-                    voxels_x_planes->voxels[voxels_x_planes->voxel_count++] = context->voxel_set[voxel_index];
-                    voxels_y_planes->voxels[voxels_y_planes->voxel_count++] = context->voxel_set[voxel_index];
-                    voxels_z_planes->voxels[voxels_z_planes->voxel_count++] = context->voxel_set[voxel_index];
-                }
-            }
-        }
+#define MELT_CONTEXT_ALLOC(context, T, N) (T*)_context_alloc(context, (size_t)(N) * sizeof(T))
+#define MELT_CONTEXT_RELEASE(context, data, T, N) _context_release(context, data, (size_t)(N) * sizeof(T))
+#define MELT_CONTEXT_GROW(context, data, T, N, NEW_N) (T*)_context_grow(context, data, (size_t)(N) * sizeof(T), (size_t)(NEW_N) * sizeof(T))
+
+static inline bool _shell_mask_test_and_set(_context_t* context, uint32_t index)
+{
+    const uint32_t bit = 1u << (index & 31);
+    uint32_t* word = &context->shell_mask[index >> 5];
+    const bool was_set = (*word & bit) != 0;
+    *word |= bit;
+    return was_set;
+}
+
+static void _push_voxel(_context_t* context, const _voxel_t* voxel)
+{
+    if (context->voxel_set_count == context->voxel_set_capacity)
+    {
+        uint32_t capacity = context->voxel_set_capacity > 0 ? context->voxel_set_capacity * 2 : 256;
+        if (capacity > context->size)
+            capacity = context->size;
+
+        context->voxel_set = MELT_CONTEXT_GROW(context, context->voxel_set, _voxel_t, context->voxel_set_capacity, capacity);
+        context->voxel_set_capacity = capacity;
     }
 
-    MELT_PROFILE_END();
+    MELT_ASSERT(context->voxel_set_count < context->voxel_set_capacity);
+    context->voxel_set[context->voxel_set_count++] = *voxel;
 }
 
-static void _get_field(_context_t* context, uint32_t x, uint32_t y, uint32_t z, _min_distance_t* out_min_distance, _voxel_status_t* out_status)
+static void _free_voxel_set(_context_t* context)
 {
-    const svec3_t InfiniteDistance = _svec3_init(INT_MAX, INT_MAX, INT_MAX);
-    const svec3_t NullDistance = _svec3_init(0, 0, 0);
+    MELT_CONTEXT_RELEASE(context, context->voxel_set, _voxel_t, context->voxel_set_capacity);
+    context->voxel_set = NULL;
+    context->voxel_set_capacity = 0;
+}
 
-    out_min_distance->dist = InfiniteDistance;
-    out_min_distance->x = x;
-    out_min_distance->y = y;
-    out_min_distance->z = z;
+static bool _report_progress(_context_t* context, melt_phase_t phase, float fraction);
 
-    out_status->visibility = MELT_AXIS_VISIBILITY_NULL;
-    out_status->clipped = false;
-    out_status->inner = false;
+// Voxel centers are derived from the grid position alone, so that every triangle
+// tests a given voxel at exactly the same coordinates. On deterministic grids
+// the position in whole voxels is exact, the center is rounded once.
+static inline float _voxel_center_coordinate(const _context_t* context, uint32_t axis, uint32_t position)
+{
+    if (context->deterministic)
+        return (float)((&context->origin_cell.x)[axis] + (int32_t)position + 1) * context->voxel_size;
+    return (&context->origin.x)[axis] + (float)(position + 1) * context->voxel_size;
+}
 
-    uvec2_t dim_yz = _uvec2_init(context->dimension.y, context->dimension.z);
-    uint32_t index_yz = _flatten_2d(_uvec2_init(y, z), dim_yz);
-    const _voxel_set_plane_t* voxels_x_plane = &context->voxel_set_planes.x[index_yz];
-    for (uint32_t i = 0; i < voxels_x_plane->voxel_count; ++i)
-    {
-        const _voxel_t* voxel = &voxels_x_plane->voxels[i];
-        int32_t distance = voxel->position.x - x;
-        if (distance > 0)
-        {
-            out_status->visibility |= MELT_AXIS_VISIBILITY_PLUS_X;
-            out_min_distance->dist.x = _uint32_t_min(out_min_distance->dist.x, distance);
-        }
-        else if (distance < 0)
-            out_status->visibility |= MELT_AXIS_VISIBILITY_MINUS_X;
-        else
-            out_min_distance->dist.x = 0;
-    }
-    uvec2_t dim_xz = _uvec2_init(context->dimension.x, context->dimension.z);
-    uint32_t index_xz = _flatten_2d(_uvec2_init(x, z), dim_xz);
-    const _voxel_set_plane_t* voxels_y_plane = &context->voxel_set_planes.y[index_xz];
-    for (uint32_t i = 0; i < voxels_y_plane->voxel_count; ++i)
-    {
-        const _voxel_t* voxel = &voxels_y_plane->voxels[i];
-        int32_t distance = voxel->position.y - y;
-        if (distance > 0)
-        {
-            out_status->visibility |= MELT_AXIS_VISIBILITY_PLUS_Y;
-            out_min_distance->dist.y = _uint32_t_min(out_min_distance->dist.y, distance);
-        }
-        else if (distance < 0)
-            out_status->visibility |= MELT_AXIS_VISIBILITY_MINUS_Y;
-        else
-            out_min_distance->dist.y = 0;
-    }
-    uvec2_t dim_xy = _uvec2_init(context->dimension.x, context->dimension.y);
-    uint32_t index_xy = _flatten_2d(_uvec2_init(x, y), dim_xy);
-    const _voxel_set_plane_t* voxels_z_plane = &context->voxel_set_planes.z[index_xy];
-    for (uint32_t i = 0; i < voxels_z_plane->voxel_count; ++i)
-    {
-        const _voxel_t* voxel = &voxels_z_plane->voxels[i];
-        int32_t distance = voxel->position.z - z;
-        if (distance > 0)
-        {
-            out_status->visibility |= MELT_AXIS_VISIBILITY_PLUS_Z;
-            out_min_distance->dist.z = _uint32_t_min(out_min_distance->dist.z, distance);
-        }
-        else if (distance < 0)
-            out_status->visibility |= MELT_AXIS_VISIBILITY_MINUS_Z;
-        else
-            out_min_distance->dist.z = 0;
-    }
-    if (out_status->visibility == MELT_AXIS_VISIBILITY_ALL)
-    {
-        if (!_svec3_equals(out_min_distance->dist, InfiniteDistance) &&
-            !_svec3_equals(out_min_distance->dist, NullDistance))
-        {
-            out_status->inner = true;
-        }
-    }
+static vec3_t _voxel_center(const _context_t* context, uvec3_t position)
+{
+    return _vec3_init(
+        _voxel_center_coordinate(context, 0, position.x),
+        _voxel_center_coordinate(context, 1, position.y),
+        _voxel_center_coordinate(context, 2, position.z));
 }
 
-static void _generate_fields(_context_t* context)
+// First and last grid positions along an axis of the voxels that may overlap a
+// triangle extent, with a voxel of margin on each side.
+static uint32_t _voxel_range_begin(float value, float origin, float voxel_size, uint32_t dimension)
 {
-    MELT_PROFILE_BEGIN();
+    const int32_t position = (int32_t)floorf((value - origin) / voxel_size) - 2;
+    return position < 0 ? 0 : _uint32_t_min((uint32_t)position, dimension - 1);
+}
 
-    for (uint32_t i = 0; i < context->size; ++i)
-    {
-        _min_distance_t* min_distance = &context->min_distance_field[i];
-        _voxel_status_t* voxel_status = &context->voxel_field[i];
-        const uvec3_t position = _unflatten_3d(i, context->dimension);
-        _get_field(context, position.x, position.y, position.z, min_distance, voxel_status);
-    }
+static uint32_t _voxel_range_end(float value, float origin, float voxel_size, uint32_t dimension)
+{
+    const int32_t position = (int32_t)ceilf((value - origin) / voxel_size) + 1;
+    return position < 0 ? 0 : _uint32_t_min((uint32_t)position, dimension - 1);
+}
 
-    MELT_PROFILE_END();
+// Whether the voxels that may overlap a triangle extent are all past the grid,
+// only tile grids leave triangles out.
+static bool _voxel_range_outside(float min, float max, float origin, float voxel_size, uint32_t dimension)
+{
+    return (int32_t)floorf((min - origin) / voxel_size) - 2 > (int32_t)dimension - 1 ||
+           (int32_t)ceilf((max - origin) / voxel_size) + 1 < 0;
 }
 
-static inline bool _inner_voxel(_voxel_status_t voxel_status)
+static void _add_shell_voxel(_context_t* context, uvec3_t position)
 {
-    return voxel_status.inner && !voxel_status.clipped;
+    const uint32_t index = _flatten_3d(position, context->dimension);
+    if (_shell_mask_test_and_set(context, index))
+        return;
+
+    const float half_voxel_size = context->voxel_size * 0.5f;
+    const vec3_t half_voxel_extent = _vec3_init(half_voxel_size, half_voxel_size, half_voxel_size);
+    const vec3_t center = _voxel_center(context, position);
+
+    _voxel_t voxel;
+    voxel.aabb.min = _vec3_sub(center, half_voxel_extent);
+    voxel.aabb.max = _vec3_add(center, half_voxel_extent);
+    voxel.position = position;
+
+    _push_voxel(context, &voxel);
 }
 
-static uvec3_t _get_max_aabb_extent(const _context_t* context, const _min_distance_t* min_distance)
+// Voxelizes the triangles whose first index lies in [index_begin, index_end).
+static void _voxelize_shell(_context_t* context, const melt_mesh_t* mesh, uint32_t index_begin, uint32_t index_end)
 {
     MELT_PROFILE_BEGIN();
 
-    uvec2_t* max_aabb_extents = MELT_ALLOCA(uvec2_t, min_distance->z + min_distance->dist.z);
+    const float voxel_size = context->voxel_size;
+    const float half_voxel_size = voxel_size * 0.5f;
+    const vec3_t half_voxel_extent = _vec3_init(half_voxel_size, half_voxel_size, half_voxel_size);
+    const vec3_t origin = context->origin;
+    const uvec3_t dimension = context->dimension;
+
+    for (uint32_t i = index_begin; i < index_end; i += 3)
+    {
+        if ((i / 3) % MELT_POLL_TRIANGLE_COUNT == 0 &&
+            _report_progress(context, MELT_PHASE_VOXELIZATION, (float)i / mesh->index_count))
+            break;
+
+        _triangle_t triangle;
+
+        triangle.v0 = mesh->vertices[mesh->indices[i + 0]];
+        triangle.v1 = mesh->vertices[mesh->indices[i + 1]];
+        triangle.v2 = mesh->vertices[mesh->indices[i + 2]];
+
+        const _aabb_t triangle_aabb = _generate_aabb_from_triangle(&triangle);
+        if (_voxel_range_outside(triangle_aabb.min.x, triangle_aabb.max.x, origin.x, voxel_size, dimension.x) ||
+            _voxel_range_outside(triangle_aabb.min.y, triangle_aabb.max.y, origin.y, voxel_size, dimension.y) ||
+            _voxel_range_outside(triangle_aabb.min.z, triangle_aabb.max.z, origin.z, voxel_size, dimension.z))
+            continue;
+
+        const uvec3_t begin = _uvec3_init(
+            _voxel_range_begin(triangle_aabb.min.x, origin.x, voxel_size, dimension.x),
+            _voxel_range_begin(triangle_aabb.min.y, origin.y, voxel_size, dimension.y),
+            _voxel_range_begin(triangle_aabb.min.z, origin.z, voxel_size, dimension.z));
+        const uvec3_t end = _uvec3_init(
+            _voxel_range_end(triangle_aabb.max.x, origin.x, voxel_size, dimension.x),
+            _voxel_range_end(triangle_aabb.max.y, origin.y, voxel_size, dimension.y),
+            _voxel_range_end(triangle_aabb.max.z, origin.z, voxel_size, dimension.z));
+
+        for (uint32_t x = begin.x; x <= end.x; ++x)
+        {
+            const float center_x = _voxel_center_coordinate(context, 0, x);
+
+            for (uint32_t y = begin.y; y <= end.y; ++y)
+            {
+                const float center_y = _voxel_center_coordinate(context, 1, y);
+
+                // Voxels along z are tested against the triangle a row chunk at a time.
+                for (uint32_t z = begin.z; z <= end.z; z += MELT_VOXEL_ROW_CHUNK)
+                {
+                    float row_center_z[MELT_VOXEL_ROW_CHUNK];
+                    uint8_t row_intersects[MELT_VOXEL_ROW_CHUNK];
+                    const uint32_t row_count = _uint32_t_min(end.z - z + 1, MELT_VOXEL_ROW_CHUNK);
+
+                    for (uint32_t k = 0; k < row_count; ++k)
+                        row_center_z[k] = _voxel_center_coordinate(context, 2, z + k);
+
+                    context->kernels.triangle_intersects_voxel_row(&triangle, center_x, center_y, row_center_z, row_count, half_voxel_extent, row_intersects);
+
+                    for (uint32_t k = 0; k < row_count; ++k)
+                    {
+                        if (row_intersects[k])
+                            _add_shell_voxel(context, _uvec3_init(x, y, z + k));
+                    }
+                }
+            }
+        }
+    }
+
+    MELT_PROFILE_END();
+}
+
+static void _push_max_extent(_context_t* context, const _max_extent_t* max_extent)
+{
+    if (context->max_extents_count == context->max_extents_capacity)
+    {
+        uint32_t capacity = context->max_extents_capacity > 0 ? context->max_extents_capacity * 2 : 64;
+
+        context->max_extents = MELT_CONTEXT_GROW(context, context->max_extents, _max_extent_t, context->max_extents_capacity, capacity);
+        context->max_extents_capacity = capacity;
+    }
+
+    context->max_extents[context->max_extents_count++] = *max_extent;
+}
+
+static void _free_per_plane_voxel_set(_context_t* context)
+{
+    _voxel_set_planes_t* planes = &context->voxel_set_planes;
+
+    MELT_CONTEXT_RELEASE(context, planes->x_voxels, _voxel_t, planes->voxel_count);
+    MELT_CONTEXT_RELEASE(context, planes->y_voxels, _voxel_t, planes->voxel_count);
+    MELT_CONTEXT_RELEASE(context, planes->z_voxels, _voxel_t, planes->voxel_count);
+
+    MELT_CONTEXT_RELEASE(context, planes->x, _voxel_set_plane_t, planes->x_count);
+    MELT_CONTEXT_RELEASE(context, planes->y, _voxel_set_plane_t, planes->y_count);
+    MELT_CONTEXT_RELEASE(context, planes->z, _voxel_set_plane_t, planes->z_count);
+
+    memset(planes, 0, sizeof(_voxel_set_planes_t));
+}
+
+// The plane voxel lists are no longer needed once the fields are generated, hand
+// the storage of the x axis list over to the max extent list instead of going
+// back to the allocator. The memory stays accounted for in the context, the
+// extent list only grows out of it when more boxes are found than it can hold.
+static void _release_per_plane_voxel_set_to_max_extents(_context_t* context)
+{
+    _voxel_set_planes_t* planes = &context->voxel_set_planes;
+
+    MELT_ASSERT(context->max_extents == NULL);
+
+    if (planes->voxel_count * sizeof(_voxel_t) >= sizeof(_max_extent_t))
+    {
+        context->max_extents = (_max_extent_t*)planes->x_voxels;
+        context->max_extents_capacity = (uint32_t)(planes->voxel_count * sizeof(_voxel_t) / sizeof(_max_extent_t));
+        context->memory_usage -= planes->voxel_count * sizeof(_voxel_t);
+        context->memory_usage += context->max_extents_capacity * sizeof(_max_extent_t);
+        planes->x_voxels = NULL;
+    }
+
+    _free_per_plane_voxel_set(context);
+}
+
+// Generates the plane voxel lists from the voxel set: the voxels are counted
+// per list, each list is placed in the block of its axis, then the voxels are
+// copied to their lists. Each pass runs over a range so that time sliced
+// generations can spread it across steps.
+static void _begin_per_plane_voxel_set(_context_t* context)
+{
+    _voxel_set_planes_t* planes = &context->voxel_set_planes;
+
+    planes->x_count = context->dimension.y * context->dimension.z;
+    planes->y_count = context->dimension.x * context->dimension.z;
+    planes->z_count = context->dimension.x * context->dimension.y;
+
+    planes->x = MELT_CONTEXT_ALLOC(context, _voxel_set_plane_t, planes->x_count);
+    planes->y = MELT_CONTEXT_ALLOC(context, _voxel_set_plane_t, planes->y_count);
+    planes->z = MELT_CONTEXT_ALLOC(context, _voxel_set_plane_t, planes->z_count);
+
+    // Every shell voxel belongs to exactly one list per axis, so each axis needs
+    // a single block of voxel_set_count voxels split between its lists.
+    planes->voxel_count = context->voxel_set_count;
+    planes->x_voxels = MELT_CONTEXT_ALLOC(context, _voxel_t, planes->voxel_count);
+    planes->y_voxels = MELT_CONTEXT_ALLOC(context, _voxel_t, planes->voxel_count);
+    planes->z_voxels = MELT_CONTEXT_ALLOC(context, _voxel_t, planes->voxel_count);
+}
+
+static uint32_t _per_plane_list_count(const _context_t* context)
+{
+    const _voxel_set_planes_t* planes = &context->voxel_set_planes;
+    return planes->x_count + planes->y_count + planes->z_count;
+}
+
+// Lists are enumerated along x, then y, then z.
+static _voxel_set_plane_t* _per_plane_list(_context_t* context, uint32_t list, _voxel_t** out_axis_voxels, bool* out_axis_first)
+{
+    _voxel_set_planes_t* planes = &context->voxel_set_planes;
+    if (list < planes->x_count)
+    {
+        *out_axis_voxels = planes->x_voxels;
+        *out_axis_first = list == 0;
+        return &planes->x[list];
+    }
+    list -= planes->x_count;
+    if (list < planes->y_count)
+    {
+        *out_axis_voxels = planes->y_voxels;
+        *out_axis_first = list == 0;
+        return &planes->y[list];
+    }
+    list -= planes->y_count;
+    *out_axis_voxels = planes->z_voxels;
+    *out_axis_first = list == 0;
+    return &planes->z[list];
+}
+
+static void _clear_per_plane_lists(_context_t* context, uint32_t begin, uint32_t end)
+{
+    for (uint32_t list = begin; list < end; ++list)
+    {
+        _voxel_t* axis_voxels;
+        bool axis_first;
+        _voxel_set_plane_t* plane = _per_plane_list(context, list, &axis_voxels, &axis_first);
+        plane->voxels = NULL;
+        plane->voxel_count = 0;
+    }
+}
+
+static void _count_per_plane_voxels(_context_t* context, uint32_t begin, uint32_t end)
+{
+    _voxel_set_planes_t* planes = &context->voxel_set_planes;
+    uvec2_t dim_yz = _uvec2_init(context->dimension.y, context->dimension.z);
+    uvec2_t dim_xz = _uvec2_init(context->dimension.x, context->dimension.z);
+    uvec2_t dim_xy = _uvec2_init(context->dimension.x, context->dimension.y);
+
+    for (uint32_t i = begin; i < end; ++i)
+    {
+        const uvec3_t position = context->voxel_set[i].position;
+        ++planes->x[_flatten_2d(_uvec2_init(position.y, position.z), dim_yz)].voxel_count;
+        ++planes->y[_flatten_2d(_uvec2_init(position.x, position.z), dim_xz)].voxel_count;
+        ++planes->z[_flatten_2d(_uvec2_init(position.x, position.y), dim_xy)].voxel_count;
+    }
+}
+
+// Places the lists in [begin, end) after each other in the block of their axis,
+// offset is the end of the lists placed so far on the axis.
+static void _place_per_plane_lists(_context_t* context, uint32_t begin, uint32_t end, uint32_t* offset)
+{
+    for (uint32_t list = begin; list < end; ++list)
+    {
+        _voxel_t* axis_voxels;
+        bool axis_first;
+        _voxel_set_plane_t* plane = _per_plane_list(context, list, &axis_voxels, &axis_first);
+        if (axis_first)
+            *offset = 0;
+        plane->voxels = axis_voxels + *offset;
+        *offset += plane->voxel_count;
+        plane->voxel_count = 0;
+    }
+}
+
+static void _fill_per_plane_voxel_set(_context_t* context, uint32_t begin, uint32_t end)
+{
+    _voxel_set_planes_t* planes = &context->voxel_set_planes;
+    uvec2_t dim_yz = _uvec2_init(context->dimension.y, context->dimension.z);
+    uvec2_t dim_xz = _uvec2_init(context->dimension.x, context->dimension.z);
+    uvec2_t dim_xy = _uvec2_init(context->dimension.x, context->dimension.y);
+
+    for (uint32_t i = begin; i < end; ++i)
+    {
+        const _voxel_t* voxel = &context->voxel_set[i];
+
+        uint32_t index_yz = _flatten_2d(_uvec2_init(voxel->position.y, voxel->position.z), dim_yz);
+        uint32_t index_xz = _flatten_2d(_uvec2_init(voxel->position.x, voxel->position.z), dim_xz);
+        uint32_t index_xy = _flatten_2d(_uvec2_init(voxel->position.x, voxel->position.y), dim_xy);
+
+        _voxel_set_plane_t* voxels_x_planes = &planes->x[index_yz];
+        _voxel_set_plane_t* voxels_y_planes = &planes->y[index_xz];
+        _voxel_set_plane_t* voxels_z_planes = &planes->z[index_xy];
+
+        voxels_x_planes->voxels[voxels_x_planes->voxel_count++] = *voxel;
+        voxels_y_planes->voxels[voxels_y_planes->voxel_count++] = *voxel;
+        voxels_z_planes->voxels[voxels_z_planes->voxel_count++] = *voxel;
+    }
+}
+
+// The voxels on the border of a tile grid belong to the neighbour tiles, they
+// bound the distances and the watertightness scans of the tile like shell voxels
+// would. Shell voxels past the border are known from the lines of the tile.
+static void _apply_tile_lines(const _context_t* context, uint32_t x, uint32_t y, uint32_t z, _min_distance_t* min_distance, _voxel_status_t* status)
+{
+    const uvec3_t dimension = context->dimension;
+    if (x == 0 || y == 0 || z == 0 || x == dimension.x - 1 || y == dimension.y - 1 || z == dimension.z - 1)
+    {
+        min_distance->dist = _svec3_init(0, 0, 0);
+        status->visibility = MELT_AXIS_VISIBILITY_NULL;
+        return;
+    }
+
+    const uint32_t size_x = dimension.x - 2;
+    const uint32_t size_y = dimension.y - 2;
+    const uint8_t line_x = context->tile_lines[0][(y - 1) + (z - 1) * size_y];
+    const uint8_t line_y = context->tile_lines[1][(x - 1) + (z - 1) * size_x];
+    const uint8_t line_z = context->tile_lines[2][(x - 1) + (y - 1) * size_x];
+
+    status->visibility |= (line_x & MELT_TILE_LINE_BEFORE) ? MELT_AXIS_VISIBILITY_MINUS_X : 0;
+    status->visibility |= (line_x & MELT_TILE_LINE_AFTER) ? MELT_AXIS_VISIBILITY_PLUS_X : 0;
+    status->visibility |= (line_y & MELT_TILE_LINE_BEFORE) ? MELT_AXIS_VISIBILITY_MINUS_Y : 0;
+    status->visibility |= (line_y & MELT_TILE_LINE_AFTER) ? MELT_AXIS_VISIBILITY_PLUS_Y : 0;
+    status->visibility |= (line_z & MELT_TILE_LINE_BEFORE) ? MELT_AXIS_VISIBILITY_MINUS_Z : 0;
+    status->visibility |= (line_z & MELT_TILE_LINE_AFTER) ? MELT_AXIS_VISIBILITY_PLUS_Z : 0;
+
+    min_distance->dist.x = (int32_t)_uint32_t_min((uint32_t)min_distance->dist.x, dimension.x - 1 - x);
+    min_distance->dist.y = (int32_t)_uint32_t_min((uint32_t)min_distance->dist.y, dimension.y - 1 - y);
+    min_distance->dist.z = (int32_t)_uint32_t_min((uint32_t)min_distance->dist.z, dimension.z - 1 - z);
+}
+
+static void _get_field(_context_t* context, uint32_t x, uint32_t y, uint32_t z, _min_distance_t* out_min_distance, _voxel_status_t* out_status)
+{
+    const svec3_t InfiniteDistance = _svec3_init(INT_MAX, INT_MAX, INT_MAX);
+    const svec3_t NullDistance = _svec3_init(0, 0, 0);
+
+    out_min_distance->dist = InfiniteDistance;
+    out_min_distance->x = x;
+    out_min_distance->y = y;
+    out_min_distance->z = z;
+
+    out_status->visibility = MELT_AXIS_VISIBILITY_NULL;
+    out_status->clipped = false;
+    out_status->inner = false;
+
+    uvec2_t dim_yz = _uvec2_init(context->dimension.y, context->dimension.z);
+    uint32_t index_yz = _flatten_2d(_uvec2_init(y, z), dim_yz);
+    const _voxel_set_plane_t* voxels_x_plane = &context->voxel_set_planes.x[index_yz];
+    for (uint32_t i = 0; i < voxels_x_plane->voxel_count; ++i)
+    {
+        const _voxel_t* voxel = &voxels_x_plane->voxels[i];
+        int32_t distance = voxel->position.x - x;
+        if (distance > 0)
+        {
+            out_status->visibility |= MELT_AXIS_VISIBILITY_PLUS_X;
+            out_min_distance->dist.x = _uint32_t_min(out_min_distance->dist.x, distance);
+        }
+        else if (distance < 0)
+            out_status->visibility |= MELT_AXIS_VISIBILITY_MINUS_X;
+        else
+            out_min_distance->dist.x = 0;
+    }
+    uvec2_t dim_xz = _uvec2_init(context->dimension.x, context->dimension.z);
+    uint32_t index_xz = _flatten_2d(_uvec2_init(x, z), dim_xz);
+    const _voxel_set_plane_t* voxels_y_plane = &context->voxel_set_planes.y[index_xz];
+    for (uint32_t i = 0; i < voxels_y_plane->voxel_count; ++i)
+    {
+        const _voxel_t* voxel = &voxels_y_plane->voxels[i];
+        int32_t distance = voxel->position.y - y;
+        if (distance > 0)
+        {
+            out_status->visibility |= MELT_AXIS_VISIBILITY_PLUS_Y;
+            out_min_distance->dist.y = _uint32_t_min(out_min_distance->dist.y, distance);
+        }
+        else if (distance < 0)
+            out_status->visibility |= MELT_AXIS_VISIBILITY_MINUS_Y;
+        else
+            out_min_distance->dist.y = 0;
+    }
+    uvec2_t dim_xy = _uvec2_init(context->dimension.x, context->dimension.y);
+    uint32_t index_xy = _flatten_2d(_uvec2_init(x, y), dim_xy);
+    const _voxel_set_plane_t* voxels_z_plane = &context->voxel_set_planes.z[index_xy];
+    for (uint32_t i = 0; i < voxels_z_plane->voxel_count; ++i)
+    {
+        const _voxel_t* voxel = &voxels_z_plane->voxels[i];
+        int32_t distance = voxel->position.z - z;
+        if (distance > 0)
+        {
+            out_status->visibility |= MELT_AXIS_VISIBILITY_PLUS_Z;
+            out_min_distance->dist.z = _uint32_t_min(out_min_distance->dist.z, distance);
+        }
+        else if (distance < 0)
+            out_status->visibility |= MELT_AXIS_VISIBILITY_MINUS_Z;
+        else
+            out_min_distance->dist.z = 0;
+    }
+    if (context->tile_lines[0])
+        _apply_tile_lines(context, x, y, z, out_min_distance, out_status);
+    if (out_status->visibility == MELT_AXIS_VISIBILITY_ALL)
+    {
+        if (!_svec3_equals(out_min_distance->dist, InfiniteDistance) &&
+            !_svec3_equals(out_min_distance->dist, NullDistance))
+        {
+            out_status->inner = true;
+        }
+    }
+}
+
+static inline bool _inner_voxel(_voxel_status_t voxel_status)
+{
+    return voxel_status.inner && !voxel_status.clipped;
+}
+
+// Shell voxels see themselves in each of the plane voxel lists, so their minimum
+// distance is null on every axis. Distances of inner voxels are never null since
+// they require shell voxels on all sides, and only inner voxels get updated.
+static inline bool _shell_voxel(const _context_t* context, uint32_t index)
+{
+    return context->min_distance_field.x[index] == 0 &&
+           context->min_distance_field.y[index] == 0 &&
+           context->min_distance_field.z[index] == 0;
+}
+
+static inline _min_distance_t _load_min_distance(const _context_t* context, uint32_t index)
+{
+    _min_distance_t min_distance;
+    min_distance.dist.x = (int32_t)context->min_distance_field.x[index];
+    min_distance.dist.y = (int32_t)context->min_distance_field.y[index];
+    min_distance.dist.z = (int32_t)context->min_distance_field.z[index];
+    min_distance.position = _unflatten_3d(index, context->dimension);
+    return min_distance;
+}
+
+static uint32_t _count_inner_voxels_scalar(const _voxel_status_t* voxel_field, uint32_t count)
+{
+    uint32_t inner_count = 0;
+    for (uint32_t i = 0; i < count; ++i)
+        inner_count += _inner_voxel(voxel_field[i]);
+    return inner_count;
+}
+
+static uint32_t _find_inner_voxel_scalar(const _voxel_status_t* voxel_field, uint32_t begin, uint32_t end)
+{
+    for (uint32_t i = begin; i < end; ++i)
+    {
+        if (_inner_voxel(voxel_field[i]))
+            return i;
+    }
+    return end;
+}
+
+#if defined(MELT_SIMD_X86)
+
+// The vector scans compare whole voxel status bytes. The position of the inner
+// and clipped bits depends on how the compiler lays out the bit fields, so the
+// masks are derived from the type itself.
+static inline uint8_t _voxel_status_bits(_voxel_status_t voxel_status)
+{
+    uint8_t bits;
+    MELT_ASSERT(sizeof(_voxel_status_t) == sizeof(uint8_t));
+    memcpy(&bits, &voxel_status, sizeof(uint8_t));
+    return bits;
+}
+
+static inline void _voxel_status_inner_masks(uint8_t* out_mask, uint8_t* out_value)
+{
+    _voxel_status_t inner;
+    _voxel_status_t clipped;
+    memset(&inner, 0, sizeof(_voxel_status_t));
+    memset(&clipped, 0, sizeof(_voxel_status_t));
+    inner.inner = true;
+    clipped.clipped = true;
+    *out_mask = _voxel_status_bits(inner) | _voxel_status_bits(clipped);
+    *out_value = _voxel_status_bits(inner);
+}
+
+static inline uint32_t _popcount32(uint32_t value)
+{
+    value = value - ((value >> 1) & 0x55555555u);
+    value = (value & 0x33333333u) + ((value >> 2) & 0x33333333u);
+    return (((value + (value >> 4)) & 0x0f0f0f0fu) * 0x01010101u) >> 24;
+}
+
+static inline uint32_t _count_trailing_zeros32(uint32_t value)
+{
+    MELT_ASSERT(value != 0);
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, value);
+    return (uint32_t)index;
+#else
+    return (uint32_t)__builtin_ctz(value);
+#endif
+}
+
+MELT_TARGET("sse4.1")
+static uint32_t _count_inner_voxels_sse41(const _voxel_status_t* voxel_field, uint32_t count)
+{
+    uint8_t mask, value;
+    _voxel_status_inner_masks(&mask, &value);
+    const __m128i vmask = _mm_set1_epi8((char)mask);
+    const __m128i vvalue = _mm_set1_epi8((char)value);
+    const uint8_t* bytes = (const uint8_t*)voxel_field;
+
+    uint32_t inner_count = 0;
+    uint32_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        const __m128i status = _mm_loadu_si128((const __m128i*)(bytes + i));
+        const __m128i inner = _mm_cmpeq_epi8(_mm_and_si128(status, vmask), vvalue);
+        inner_count += _popcount32((uint32_t)_mm_movemask_epi8(inner));
+    }
+
+    return inner_count + _count_inner_voxels_scalar(voxel_field + i, count - i);
+}
+
+MELT_TARGET("sse4.1")
+static uint32_t _find_inner_voxel_sse41(const _voxel_status_t* voxel_field, uint32_t begin, uint32_t end)
+{
+    uint8_t mask, value;
+    _voxel_status_inner_masks(&mask, &value);
+    const __m128i vmask = _mm_set1_epi8((char)mask);
+    const __m128i vvalue = _mm_set1_epi8((char)value);
+    const uint8_t* bytes = (const uint8_t*)voxel_field;
+
+    uint32_t i = begin;
+    for (; i + 16 <= end; i += 16)
+    {
+        const __m128i status = _mm_loadu_si128((const __m128i*)(bytes + i));
+        const __m128i inner = _mm_cmpeq_epi8(_mm_and_si128(status, vmask), vvalue);
+        const uint32_t inner_bits = (uint32_t)_mm_movemask_epi8(inner);
+        if (inner_bits != 0)
+            return i + _count_trailing_zeros32(inner_bits);
+    }
+
+    return _find_inner_voxel_scalar(voxel_field, i, end);
+}
+
+MELT_TARGET("avx2")
+static uint32_t _count_inner_voxels_avx2(const _voxel_status_t* voxel_field, uint32_t count)
+{
+    uint8_t mask, value;
+    _voxel_status_inner_masks(&mask, &value);
+    const __m256i vmask = _mm256_set1_epi8((char)mask);
+    const __m256i vvalue = _mm256_set1_epi8((char)value);
+    const uint8_t* bytes = (const uint8_t*)voxel_field;
+
+    uint32_t inner_count = 0;
+    uint32_t i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        const __m256i status = _mm256_loadu_si256((const __m256i*)(bytes + i));
+        const __m256i inner = _mm256_cmpeq_epi8(_mm256_and_si256(status, vmask), vvalue);
+        inner_count += _popcount32((uint32_t)_mm256_movemask_epi8(inner));
+    }
+
+    return inner_count + _count_inner_voxels_scalar(voxel_field + i, count - i);
+}
+
+MELT_TARGET("avx2")
+static uint32_t _find_inner_voxel_avx2(const _voxel_status_t* voxel_field, uint32_t begin, uint32_t end)
+{
+    uint8_t mask, value;
+    _voxel_status_inner_masks(&mask, &value);
+    const __m256i vmask = _mm256_set1_epi8((char)mask);
+    const __m256i vvalue = _mm256_set1_epi8((char)value);
+    const uint8_t* bytes = (const uint8_t*)voxel_field;
+
+    uint32_t i = begin;
+    for (; i + 32 <= end; i += 32)
+    {
+        const __m256i status = _mm256_loadu_si256((const __m256i*)(bytes + i));
+        const __m256i inner = _mm256_cmpeq_epi8(_mm256_and_si256(status, vmask), vvalue);
+        const uint32_t inner_bits = (uint32_t)_mm256_movemask_epi8(inner);
+        if (inner_bits != 0)
+            return i + _count_trailing_zeros32(inner_bits);
+    }
+
+    return _find_inner_voxel_scalar(voxel_field, i, end);
+}
+
+MELT_TARGET("avx512f,avx512bw")
+static uint32_t _count_inner_voxels_avx512(const _voxel_status_t* voxel_field, uint32_t count)
+{
+    uint8_t mask, value;
+    _voxel_status_inner_masks(&mask, &value);
+    const __m512i vmask = _mm512_set1_epi8((char)mask);
+    const __m512i vvalue = _mm512_set1_epi8((char)value);
+    const uint8_t* bytes = (const uint8_t*)voxel_field;
+
+    uint32_t inner_count = 0;
+    uint32_t i = 0;
+    for (; i + 64 <= count; i += 64)
+    {
+        const __m512i status = _mm512_loadu_si512((const void*)(bytes + i));
+        const __mmask64 inner = _mm512_cmpeq_epi8_mask(_mm512_and_si512(status, vmask), vvalue);
+        inner_count += _popcount32((uint32_t)inner) + _popcount32((uint32_t)(inner >> 32));
+    }
+
+    return inner_count + _count_inner_voxels_scalar(voxel_field + i, count - i);
+}
+
+MELT_TARGET("avx512f,avx512bw")
+static uint32_t _find_inner_voxel_avx512(const _voxel_status_t* voxel_field, uint32_t begin, uint32_t end)
+{
+    uint8_t mask, value;
+    _voxel_status_inner_masks(&mask, &value);
+    const __m512i vmask = _mm512_set1_epi8((char)mask);
+    const __m512i vvalue = _mm512_set1_epi8((char)value);
+    const uint8_t* bytes = (const uint8_t*)voxel_field;
+
+    uint32_t i = begin;
+    for (; i + 64 <= end; i += 64)
+    {
+        const __m512i status = _mm512_loadu_si512((const void*)(bytes + i));
+        const __mmask64 inner = _mm512_cmpeq_epi8_mask(_mm512_and_si512(status, vmask), vvalue);
+        if (inner != 0)
+        {
+            const uint32_t low = (uint32_t)inner;
+            return low != 0 ? i + _count_trailing_zeros32(low) : i + 32 + _count_trailing_zeros32((uint32_t)(inner >> 32));
+        }
+    }
+
+    return _find_inner_voxel_scalar(voxel_field, i, end);
+}
+
+#endif // MELT_SIMD_X86
+
+static void _update_min_distance_row_scalar(uint32_t* distances, const _voxel_status_t* voxel_field, uint32_t count,
+    uint32_t value, uint32_t step)
+{
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        if (_inner_voxel(voxel_field[i]))
+            distances[i] = _uint32_t_min(value, distances[i]);
+        value -= step;
+    }
+}
+
+#if defined(MELT_SIMD_X86)
+
+// The distance is lowered with an unsigned min on every voxel of the row. Voxels
+// that are not inner or clipped get their candidate distance saturated so that
+// the min leaves them untouched, there is no branch per voxel.
+
+MELT_TARGET("sse4.1")
+static void _update_min_distance_row_sse41(uint32_t* distances, const _voxel_status_t* voxel_field, uint32_t count,
+    uint32_t value, uint32_t step)
+{
+    uint8_t mask, inner_value;
+    _voxel_status_inner_masks(&mask, &inner_value);
+    const __m128i vmask = _mm_set1_epi32(mask);
+    const __m128i vinner = _mm_set1_epi32(inner_value);
+    const __m128i vstep = _mm_set1_epi32((int)(step * 4));
+    __m128i vvalue = _mm_setr_epi32((int)value, (int)(value - step), (int)(value - step * 2), (int)(value - step * 3));
+    const uint8_t* bytes = (const uint8_t*)voxel_field;
+
+    uint32_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        int32_t status_bytes;
+        memcpy(&status_bytes, bytes + i, sizeof(int32_t));
+        const __m128i status = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(status_bytes));
+        const __m128i inner = _mm_cmpeq_epi32(_mm_and_si128(status, vmask), vinner);
+        const __m128i candidate = _mm_or_si128(vvalue, _mm_andnot_si128(inner, _mm_set1_epi32(-1)));
+        const __m128i current = _mm_loadu_si128((const __m128i*)(distances + i));
+        _mm_storeu_si128((__m128i*)(distances + i), _mm_min_epu32(current, candidate));
+        vvalue = _mm_sub_epi32(vvalue, vstep);
+    }
+
+    _update_min_distance_row_scalar(distances + i, voxel_field + i, count - i, value - step * i, step);
+}
+
+MELT_TARGET("avx2")
+static void _update_min_distance_row_avx2(uint32_t* distances, const _voxel_status_t* voxel_field, uint32_t count,
+    uint32_t value, uint32_t step)
+{
+    uint8_t mask, inner_value;
+    _voxel_status_inner_masks(&mask, &inner_value);
+    const __m256i vmask = _mm256_set1_epi32(mask);
+    const __m256i vinner = _mm256_set1_epi32(inner_value);
+    const __m256i vstep = _mm256_set1_epi32((int)(step * 8));
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i vvalue = _mm256_sub_epi32(_mm256_set1_epi32((int)value), _mm256_mullo_epi32(lanes, _mm256_set1_epi32((int)step)));
+    const uint8_t* bytes = (const uint8_t*)voxel_field;
+
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        const __m256i status = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(bytes + i)));
+        const __m256i inner = _mm256_cmpeq_epi32(_mm256_and_si256(status, vmask), vinner);
+        const __m256i candidate = _mm256_or_si256(vvalue, _mm256_andnot_si256(inner, _mm256_set1_epi32(-1)));
+        const __m256i current = _mm256_loadu_si256((const __m256i*)(distances + i));
+        _mm256_storeu_si256((__m256i*)(distances + i), _mm256_min_epu32(current, candidate));
+        vvalue = _mm256_sub_epi32(vvalue, vstep);
+    }
+
+    _update_min_distance_row_scalar(distances + i, voxel_field + i, count - i, value - step * i, step);
+}
+
+MELT_TARGET("avx512f,avx512bw")
+static void _update_min_distance_row_avx512(uint32_t* distances, const _voxel_status_t* voxel_field, uint32_t count,
+    uint32_t value, uint32_t step)
+{
+    uint8_t mask, inner_value;
+    _voxel_status_inner_masks(&mask, &inner_value);
+    const __m512i vmask = _mm512_set1_epi32(mask);
+    const __m512i vinner = _mm512_set1_epi32(inner_value);
+    const __m512i vstep = _mm512_set1_epi32((int)(step * 16));
+    const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    __m512i vvalue = _mm512_sub_epi32(_mm512_set1_epi32((int)value), _mm512_mullo_epi32(lanes, _mm512_set1_epi32((int)step)));
+    const uint8_t* bytes = (const uint8_t*)voxel_field;
+
+    uint32_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        const __m512i status = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)(bytes + i)));
+        const __mmask16 inner = _mm512_cmpeq_epi32_mask(_mm512_and_si512(status, vmask), vinner);
+        const __m512i current = _mm512_loadu_si512((const void*)(distances + i));
+        _mm512_storeu_si512((void*)(distances + i), _mm512_mask_min_epu32(current, inner, current, vvalue));
+        vvalue = _mm512_sub_epi32(vvalue, vstep);
+    }
+
+    _update_min_distance_row_scalar(distances + i, voxel_field + i, count - i, value - step * i, step);
+}
+
+#endif // MELT_SIMD_X86
+
+// Every variant of the box culling evaluates the same expressions in the same
+// order, they select the same boxes with the same sizes.
+static void _cull_boxes_scalar(const _box_arrays_t* boxes, uint32_t begin, uint32_t count,
+    const melt_selection_params_t* view, float* out_sizes)
+{
+    for (uint32_t i = begin; i < begin + count; ++i)
+    {
+        const float cx = boxes->center_x[i];
+        const float cy = boxes->center_y[i];
+        const float cz = boxes->center_z[i];
+        const float hx = boxes->half_x[i];
+        const float hy = boxes->half_y[i];
+        const float hz = boxes->half_z[i];
+
+        bool visible = true;
+        for (uint32_t p = 0; p < 6; ++p)
+        {
+            const float* plane = view->planes[p];
+            const float distance = plane[0] * cx + plane[1] * cy + plane[2] * cz + plane[3];
+            const float radius = fabsf(plane[0]) * hx + fabsf(plane[1]) * hy + fabsf(plane[2]) * hz;
+            visible = visible && !(distance + radius < 0.0f);
+        }
+
+        const float dx = cx - view->eye.x;
+        const float dy = cy - view->eye.y;
+        const float dz = cz - view->eye.z;
+        const float eye_distance2 = dx * dx + dy * dy + dz * dz;
+        const float radius2 = hx * hx + hy * hy + hz * hz;
+        const float size = eye_distance2 <= radius2 ? FLT_MAX : view->projection_scale * sqrtf(radius2 / eye_distance2);
+        out_sizes[i - begin] = visible ? size : -1.0f;
+    }
+}
+
+#if defined(MELT_SIMD_X86)
+
+MELT_TARGET("sse4.1")
+static void _cull_boxes_sse41(const _box_arrays_t* boxes, uint32_t begin, uint32_t count,
+    const melt_selection_params_t* view, float* out_sizes)
+{
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    const __m128 zero = _mm_setzero_ps();
+    for (uint32_t i = begin; i < begin + count; i += 4)
+    {
+        const __m128 cx = _mm_loadu_ps(boxes->center_x + i);
+        const __m128 cy = _mm_loadu_ps(boxes->center_y + i);
+        const __m128 cz = _mm_loadu_ps(boxes->center_z + i);
+        const __m128 hx = _mm_loadu_ps(boxes->half_x + i);
+        const __m128 hy = _mm_loadu_ps(boxes->half_y + i);
+        const __m128 hz = _mm_loadu_ps(boxes->half_z + i);
+
+        __m128 culled = _mm_setzero_ps();
+        for (uint32_t p = 0; p < 6; ++p)
+        {
+            const float* plane = view->planes[p];
+            const __m128 a = _mm_set1_ps(plane[0]);
+            const __m128 b = _mm_set1_ps(plane[1]);
+            const __m128 c = _mm_set1_ps(plane[2]);
+            __m128 distance = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(a, cx), _mm_mul_ps(b, cy)), _mm_mul_ps(c, cz)), _mm_set1_ps(plane[3]));
+            __m128 radius = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_andnot_ps(sign, a), hx), _mm_mul_ps(_mm_andnot_ps(sign, b), hy)), _mm_mul_ps(_mm_andnot_ps(sign, c), hz));
+            culled = _mm_or_ps(culled, _mm_cmplt_ps(_mm_add_ps(distance, radius), zero));
+        }
+
+        const __m128 dx = _mm_sub_ps(cx, _mm_set1_ps(view->eye.x));
+        const __m128 dy = _mm_sub_ps(cy, _mm_set1_ps(view->eye.y));
+        const __m128 dz = _mm_sub_ps(cz, _mm_set1_ps(view->eye.z));
+        const __m128 eye_distance2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+        const __m128 radius2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(hx, hx), _mm_mul_ps(hy, hy)), _mm_mul_ps(hz, hz));
+        __m128 size = _mm_mul_ps(_mm_set1_ps(view->projection_scale), _mm_sqrt_ps(_mm_div_ps(radius2, eye_distance2)));
+        size = _mm_blendv_ps(size, _mm_set1_ps(FLT_MAX), _mm_cmple_ps(eye_distance2, radius2));
+        _mm_storeu_ps(out_sizes + (i - begin), _mm_blendv_ps(size, _mm_set1_ps(-1.0f), culled));
+    }
+}
+
+MELT_TARGET("avx2")
+static void _cull_boxes_avx2(const _box_arrays_t* boxes, uint32_t begin, uint32_t count,
+    const melt_selection_params_t* view, float* out_sizes)
+{
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    const __m256 zero = _mm256_setzero_ps();
+    for (uint32_t i = begin; i < begin + count; i += 8)
+    {
+        const __m256 cx = _mm256_loadu_ps(boxes->center_x + i);
+        const __m256 cy = _mm256_loadu_ps(boxes->center_y + i);
+        const __m256 cz = _mm256_loadu_ps(boxes->center_z + i);
+        const __m256 hx = _mm256_loadu_ps(boxes->half_x + i);
+        const __m256 hy = _mm256_loadu_ps(boxes->half_y + i);
+        const __m256 hz = _mm256_loadu_ps(boxes->half_z + i);
+
+        __m256 culled = _mm256_setzero_ps();
+        for (uint32_t p = 0; p < 6; ++p)
+        {
+            const float* plane = view->planes[p];
+            const __m256 a = _mm256_set1_ps(plane[0]);
+            const __m256 b = _mm256_set1_ps(plane[1]);
+            const __m256 c = _mm256_set1_ps(plane[2]);
+            __m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(a, cx), _mm256_mul_ps(b, cy)), _mm256_mul_ps(c, cz)), _mm256_set1_ps(plane[3]));
+            __m256 radius = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_andnot_ps(sign, a), hx), _mm256_mul_ps(_mm256_andnot_ps(sign, b), hy)), _mm256_mul_ps(_mm256_andnot_ps(sign, c), hz));
+            culled = _mm256_or_ps(culled, _mm256_cmp_ps(_mm256_add_ps(distance, radius), zero, _CMP_LT_OQ));
+        }
+
+        const __m256 dx = _mm256_sub_ps(cx, _mm256_set1_ps(view->eye.x));
+        const __m256 dy = _mm256_sub_ps(cy, _mm256_set1_ps(view->eye.y));
+        const __m256 dz = _mm256_sub_ps(cz, _mm256_set1_ps(view->eye.z));
+        const __m256 eye_distance2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+        const __m256 radius2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(hx, hx), _mm256_mul_ps(hy, hy)), _mm256_mul_ps(hz, hz));
+        __m256 size = _mm256_mul_ps(_mm256_set1_ps(view->projection_scale), _mm256_sqrt_ps(_mm256_div_ps(radius2, eye_distance2)));
+        size = _mm256_blendv_ps(size, _mm256_set1_ps(FLT_MAX), _mm256_cmp_ps(eye_distance2, radius2, _CMP_LE_OQ));
+        _mm256_storeu_ps(out_sizes + (i - begin), _mm256_blendv_ps(size, _mm256_set1_ps(-1.0f), culled));
+    }
+}
+
+#endif // MELT_SIMD_X86
+
+static uvec3_t _get_max_aabb_extent(const _context_t* context, const _min_distance_t* min_distance)
+{
+    MELT_PROFILE_BEGIN();
+
+    uvec2_t* max_aabb_extents = MELT_ALLOCA(uvec2_t, min_distance->z + min_distance->dist.z);
     uint32_t max_aabb_extents_count = 0;
 
-    for (uint32_t z = min_distance->z; z < min_distance->z + min_distance->dist.z; ++z)
-    {
-        uvec3_t z_slice_position = _uvec3_init(min_distance->x, min_distance->y, z);
-        uint32_t z_slice_index = _flatten_3d(z_slice_position, context->dimension);
+    for (uint32_t z = min_distance->z; z < min_distance->z + min_distance->dist.z; ++z)
+    {
+        uvec3_t z_slice_position = _uvec3_init(min_distance->x, min_distance->y, z);
+        uint32_t z_slice_index = _flatten_3d(z_slice_position, context->dimension);
+
+        MELT_ASSERT(context->voxel_field[z_slice_index].inner);
+
+        if (context->voxel_field[z_slice_index].clipped)
+            continue;
+
+        const uint32_t sample_distance_x = context->min_distance_field.x[z_slice_index];
+        const uint32_t sample_distance_y = context->min_distance_field.y[z_slice_index];
+
+        uvec2_t max_extent = _uvec2_init(sample_distance_x, sample_distance_y);
+
+        uint32_t x = min_distance->x + 1;
+        uint32_t y = min_distance->y + 1;
+        uint32_t i = 1;
+        while (x < min_distance->x + sample_distance_x &&
+               y < min_distance->y + sample_distance_y)
+        {
+            const uint32_t index = _flatten_3d(_uvec3_init(x, y, z), context->dimension);
+            if (_inner_voxel(context->voxel_field[index]))
+            {
+                max_extent.x = _uint32_t_min(context->min_distance_field.x[index] + i, max_extent.x);
+                max_extent.y = _uint32_t_min(context->min_distance_field.y[index] + i, max_extent.y);
+            }
+            else
+            {
+                max_extent.x = i;
+                max_extent.y = i;
+                break;
+            }
+            ++x;
+            ++y;
+            ++i;
+        }
+
+        max_aabb_extents[max_aabb_extents_count++] = max_extent;
+    }
+
+    uvec2_t min_extent = _uvec2_init(UINT_MAX, UINT_MAX);
+
+    uint32_t z_slice = 1;
+    uint32_t max_volume = 0;
+
+    MELT_ASSERT(max_aabb_extents_count > 0);
+
+    for (uint32_t i = 0; i < max_aabb_extents_count; ++i)
+    {
+        const uvec2_t* extent = &max_aabb_extents[i];
+        min_extent.x = _uint32_t_min(extent->x, min_extent.x);
+        min_extent.y = _uint32_t_min(extent->y, min_extent.y);
+
+        const uint32_t volume = min_extent.x * min_extent.y * z_slice;
+        if (volume > max_volume)
+            max_volume = volume;
+
+        ++z_slice;
+    }
+
+    MELT_ASSERT(max_volume > 0);
+    MELT_ASSERT(min_extent.x > 0);
+    MELT_ASSERT(min_extent.y > 0);
+    MELT_ASSERT(z_slice > 1);
+    MELT_PROFILE_END();
+
+    return _uvec3_init(min_extent.x, min_extent.y, z_slice - 1);
+}
+
+static void _clip_voxel_field(const _context_t* context, const uvec3_t start_position, const uvec3_t extent)
+{
+    MELT_PROFILE_BEGIN();
+
+    for (uint32_t x = start_position.x; x < start_position.x + extent.x; ++x)
+    {
+        for (uint32_t y = start_position.y; y < start_position.y + extent.y; ++y)
+        {
+            for (uint32_t z = start_position.z; z < start_position.z + extent.z; ++z)
+            {
+                uint32_t index = _flatten_3d(_uvec3_init(x, y, z), context->dimension);
+                MELT_ASSERT(!context->voxel_field[index].clipped && "Clipping already clipped voxel field index");
+                context->voxel_field[index].clipped = true;
+            }
+        }
+    }
+
+    MELT_PROFILE_END();
+}
+
+// Threads only exist for the duration of a parallel pass, they are spawned and
+// joined by the calling thread. Work is distributed by the tasks themselves
+// through atomic counters, the thread index only selects per thread scratch.
+
+typedef void (*_parallel_task_t)(void* data, uint32_t thread_index);
+
+typedef struct
+{
+    _parallel_task_t task;
+    void* data;
+    uint32_t thread_index;
+} _parallel_thread_args_t;
+
+static inline uint32_t _atomic_load_u32(const volatile uint32_t* value)
+{
+#if defined(MELT_NO_THREADS)
+    return *value;
+#elif defined(_MSC_VER)
+    return (uint32_t)InterlockedCompareExchange((volatile LONG*)value, 0, 0);
+#else
+    return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+#endif
+}
+
+static inline void _atomic_store_u32(volatile uint32_t* value, uint32_t new_value)
+{
+#if defined(MELT_NO_THREADS)
+    *value = new_value;
+#elif defined(_MSC_VER)
+    InterlockedExchange((volatile LONG*)value, (LONG)new_value);
+#else
+    __atomic_store_n(value, new_value, __ATOMIC_RELEASE);
+#endif
+}
+
+// Returns the value before the addition.
+static inline uint32_t _atomic_fetch_add_u32(volatile uint32_t* value, uint32_t addend)
+{
+#if defined(MELT_NO_THREADS)
+    uint32_t previous = *value;
+    *value += addend;
+    return previous;
+#elif defined(_MSC_VER)
+    return (uint32_t)InterlockedExchangeAdd((volatile LONG*)value, (LONG)addend);
+#else
+    return __atomic_fetch_add(value, addend, __ATOMIC_ACQ_REL);
+#endif
+}
+
+// Cancellation is latched in the context so that every thread of a parallel
+// pass stops at its next poll.
+static bool _cancel_requested(_context_t* context)
+{
+    if (context->cancel_flag && _atomic_load_u32(context->cancel_flag))
+        _atomic_store_u32(&context->cancelled, 1);
+    return _atomic_load_u32(&context->cancelled) != 0;
+}
+
+// Reports progress and polls cancellation, only from the calling thread. The
+// callback is invoked when a phase starts, advances by a percent or when a box
+// is added. Returns true once the generation is cancelled.
+static bool _report_progress(_context_t* context, melt_phase_t phase, float fraction)
+{
+    if (context->progress_callback)
+    {
+        melt_progress_t* progress = &context->progress;
+        const melt_progress_t* reported = &context->reported_progress;
+
+        progress->phase = phase;
+        progress->fraction = _float_min(fraction, 1.0f);
+
+        if (progress->phase != reported->phase ||
+            progress->fraction >= reported->fraction + 0.01f ||
+            (progress->fraction == 1.0f && reported->fraction < 1.0f) ||
+            progress->box_count != reported->box_count)
+        {
+            context->progress_callback(progress, context->progress_user_data);
+            context->reported_progress = *progress;
+        }
+    }
+
+    return _cancel_requested(context);
+}
+
+#if !defined(MELT_NO_THREADS)
+#if defined(_WIN32)
+static DWORD WINAPI _parallel_thread_entry(LPVOID args)
+{
+    const _parallel_thread_args_t* thread_args = (const _parallel_thread_args_t*)args;
+    thread_args->task(thread_args->data, thread_args->thread_index);
+    return 0;
+}
+#else
+static void* _parallel_thread_entry(void* args)
+{
+    const _parallel_thread_args_t* thread_args = (const _parallel_thread_args_t*)args;
+    thread_args->task(thread_args->data, thread_args->thread_index);
+    return NULL;
+}
+#endif
+#endif // !MELT_NO_THREADS
+
+// Runs task on thread_count threads including the calling one, and returns once
+// all of them are done. A thread that fails to start has its share of the work
+// picked up by the others.
+static void _parallel_run(uint32_t thread_count, _parallel_task_t task, void* data)
+{
+    MELT_ASSERT(thread_count >= 1 && thread_count <= MELT_MAX_THREADS);
+
+#if !defined(MELT_NO_THREADS)
+    _parallel_thread_args_t thread_args[MELT_MAX_THREADS];
+#if defined(_WIN32)
+    HANDLE threads[MELT_MAX_THREADS];
+#else
+    pthread_t threads[MELT_MAX_THREADS];
+#endif
+    bool started[MELT_MAX_THREADS];
+
+    for (uint32_t i = 1; i < thread_count; ++i)
+    {
+        thread_args[i].task = task;
+        thread_args[i].data = data;
+        thread_args[i].thread_index = i;
+#if defined(_WIN32)
+        threads[i] = CreateThread(NULL, 0, _parallel_thread_entry, &thread_args[i], 0, NULL);
+        started[i] = threads[i] != NULL;
+#else
+        started[i] = pthread_create(&threads[i], NULL, _parallel_thread_entry, &thread_args[i]) == 0;
+#endif
+    }
+#endif // !MELT_NO_THREADS
+
+    task(data, 0);
+
+#if !defined(MELT_NO_THREADS)
+    for (uint32_t i = 1; i < thread_count; ++i)
+    {
+        if (!started[i])
+            continue;
+#if defined(_WIN32)
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+#else
+        pthread_join(threads[i], NULL);
+#endif
+    }
+#else
+    MELT_UNUSED(thread_count);
+#endif // !MELT_NO_THREADS
+}
+
+// Locks and conditions of the job queue, see melt_create_queue. They compile to
+// nothing without threads, the queue then runs its jobs on the waiting thread.
+#if defined(MELT_NO_THREADS)
+typedef int _mutex_t;
+typedef int _condition_t;
+#elif defined(_WIN32)
+typedef CRITICAL_SECTION _mutex_t;
+typedef CONDITION_VARIABLE _condition_t;
+#else
+typedef pthread_mutex_t _mutex_t;
+typedef pthread_cond_t _condition_t;
+#endif
+
+static void _mutex_init(_mutex_t* mutex)
+{
+#if defined(MELT_NO_THREADS)
+    *mutex = 0;
+#elif defined(_WIN32)
+    InitializeCriticalSection(mutex);
+#else
+    pthread_mutex_init(mutex, NULL);
+#endif
+}
+
+static void _mutex_destroy(_mutex_t* mutex)
+{
+#if defined(MELT_NO_THREADS)
+    MELT_UNUSED(mutex);
+#elif defined(_WIN32)
+    DeleteCriticalSection(mutex);
+#else
+    pthread_mutex_destroy(mutex);
+#endif
+}
+
+static void _mutex_lock(_mutex_t* mutex)
+{
+#if defined(MELT_NO_THREADS)
+    MELT_UNUSED(mutex);
+#elif defined(_WIN32)
+    EnterCriticalSection(mutex);
+#else
+    pthread_mutex_lock(mutex);
+#endif
+}
+
+static void _mutex_unlock(_mutex_t* mutex)
+{
+#if defined(MELT_NO_THREADS)
+    MELT_UNUSED(mutex);
+#elif defined(_WIN32)
+    LeaveCriticalSection(mutex);
+#else
+    pthread_mutex_unlock(mutex);
+#endif
+}
+
+static void _condition_init(_condition_t* condition)
+{
+#if defined(MELT_NO_THREADS)
+    *condition = 0;
+#elif defined(_WIN32)
+    InitializeConditionVariable(condition);
+#else
+    pthread_cond_init(condition, NULL);
+#endif
+}
+
+static void _condition_destroy(_condition_t* condition)
+{
+#if defined(MELT_NO_THREADS) || defined(_WIN32)
+    MELT_UNUSED(condition);
+#else
+    pthread_cond_destroy(condition);
+#endif
+}
+
+static void _condition_wait(_condition_t* condition, _mutex_t* mutex)
+{
+#if defined(MELT_NO_THREADS)
+    MELT_UNUSED(condition);
+    MELT_UNUSED(mutex);
+    MELT_ASSERT(!"Nothing can signal the condition without threads");
+#elif defined(_WIN32)
+    SleepConditionVariableCS(condition, mutex, INFINITE);
+#else
+    pthread_cond_wait(condition, mutex);
+#endif
+}
+
+static void _condition_broadcast(_condition_t* condition)
+{
+#if defined(MELT_NO_THREADS)
+    MELT_UNUSED(condition);
+#elif defined(_WIN32)
+    WakeAllConditionVariable(condition);
+#else
+    pthread_cond_broadcast(condition);
+#endif
+}
+
+// Per column state of the watertightness scan along z, see _classify_voxels.
+#define MELT_SCAN_OPEN         (1 << 0)
+#define MELT_SCAN_SEEN         (1 << 1)
+#define MELT_SCAN_HEAD_EXPOSED (1 << 2)
+
+typedef struct
+{
+    _context_t* context;
+
+    uint32_t thread_count;
+    uint32_t slab_count;
+    uint32_t slab_depth;
+    // Slabs below slab_end are classified by the current pass
+    uint32_t slab_end;
+    volatile uint32_t next_slab;
+    volatile uint32_t leaking;
+    volatile uint32_t completed_slices;
+
+    // Watertightness scan state of every column of every slab
+    uint8_t* slab_columns;
+    // Watertightness scan state along y of the slice being classified, per thread
+    uint8_t* thread_rows;
+    uint32_t* thread_inner_counts;
+} _classification_t;
+
+// Advances the watertightness scan of a line of voxels by one voxel. A mesh is
+// watertight when, walking any line along +x, +y or +z, every voxel between an
+// inner voxel and the next shell voxel is an inner voxel. Returns false when the
+// voxel breaks that rule.
+static inline bool _scan_voxel(uint8_t* state, bool shell, bool inner)
+{
+    if (shell)
+    {
+        *state = (uint8_t)((*state | MELT_SCAN_SEEN) & ~MELT_SCAN_OPEN);
+    }
+    else if (inner)
+    {
+        *state |= MELT_SCAN_SEEN | MELT_SCAN_OPEN;
+    }
+    else
+    {
+        if (*state & MELT_SCAN_OPEN)
+            return false;
+        // Leaks if the line enters the slab open, resolved when stitching slabs.
+        if (!(*state & MELT_SCAN_SEEN))
+            *state |= MELT_SCAN_HEAD_EXPOSED;
+    }
+    return true;
+}
+
+static void _classify_slab(_classification_t* classification, uint32_t slab, uint32_t thread_index)
+{
+    _context_t* context = classification->context;
+    const uvec3_t dimension = context->dimension;
+
+    uint8_t* columns = classification->slab_columns + (size_t)slab * dimension.x * dimension.y;
+    uint8_t* rows = classification->thread_rows + (size_t)thread_index * dimension.x;
+    uint32_t inner_count = 0;
+
+    memset(columns, 0, dimension.x * dimension.y);
+
+    const uint32_t z_begin = slab * classification->slab_depth;
+    const uint32_t z_end = _uint32_t_min(z_begin + classification->slab_depth, dimension.z);
+
+    for (uint32_t z = z_begin; z < z_end; ++z)
+    {
+        if (_atomic_load_u32(&classification->leaking) || _cancel_requested(context))
+            return;
+
+        bool leaking = false;
+        memset(rows, 0, dimension.x);
+
+        for (uint32_t y = 0; y < dimension.y; ++y)
+        {
+            uint8_t row = 0;
+            for (uint32_t x = 0; x < dimension.x; ++x)
+            {
+                const uint32_t index = _flatten_3d(_uvec3_init(x, y, z), dimension);
+
+                _min_distance_t min_distance;
+                _voxel_status_t* voxel_status = &context->voxel_field[index];
+                _get_field(context, x, y, z, &min_distance, voxel_status);
+                context->min_distance_field.x[index] = (uint32_t)min_distance.dist.x;
+                context->min_distance_field.y[index] = (uint32_t)min_distance.dist.y;
+                context->min_distance_field.z[index] = (uint32_t)min_distance.dist.z;
+
+                // A shell voxel finds itself in its own plane voxel lists.
+                const bool shell = min_distance.dist.x == 0;
+                const bool inner = voxel_status->inner;
+                inner_count += inner;
+
+                leaking |= !_scan_voxel(&row, shell, inner);
+                leaking |= !_scan_voxel(&rows[x], shell, inner);
+                leaking |= !_scan_voxel(&columns[x + y * dimension.x], shell, inner);
+            }
+        }
+
+        if (leaking)
+        {
+            _atomic_store_u32(&classification->leaking, 1);
+            return;
+        }
+
+        const uint32_t completed_slices = _atomic_fetch_add_u32(&classification->completed_slices, 1) + 1;
+        if (thread_index == 0)
+            _report_progress(context, MELT_PHASE_CLASSIFICATION, (float)completed_slices / dimension.z);
+    }
+
+    classification->thread_inner_counts[thread_index] += inner_count;
+}
+
+static void _classify_voxels_task(void* data, uint32_t thread_index)
+{
+    _classification_t* classification = (_classification_t*)data;
+
+    for (;;)
+    {
+        const uint32_t slab = _atomic_fetch_add_u32(&classification->next_slab, 1);
+        if (slab >= classification->slab_end || _atomic_load_u32(&classification->leaking) ||
+            _cancel_requested(classification->context))
+            break;
+        _classify_slab(classification, slab, thread_index);
+    }
+}
+
+// Splits the grid in slabs along z and allocates the scan state. A few slabs
+// per thread balance the load without too much stitching. Time sliced
+// classification runs on the calling thread, one slab of at most
+// MELT_STEP_VOXEL_COUNT voxels per step, instead of starting threads every step.
+static void _begin_classification(_classification_t* classification, _context_t* context, bool time_sliced)
+{
+    const uvec3_t dimension = context->dimension;
+    const uint32_t column_count = dimension.x * dimension.y;
+
+    memset(classification, 0, sizeof(_classification_t));
+    classification->context = context;
+
+    uint32_t thread_count = time_sliced ? 1 : _uint32_t_min(context->thread_count, dimension.z);
+    if (thread_count < 1)
+        thread_count = 1;
+    classification->thread_count = thread_count;
+
+    classification->slab_count = thread_count > 1 ? _uint32_t_min(dimension.z, thread_count * 4) : 1;
+    classification->slab_depth = (dimension.z + classification->slab_count - 1) / classification->slab_count;
+    if (time_sliced)
+    {
+        const uint32_t max_slab_depth = MELT_STEP_VOXEL_COUNT / column_count;
+        classification->slab_depth = _uint32_t_min(classification->slab_depth, max_slab_depth > 0 ? max_slab_depth : 1);
+    }
+    classification->slab_count = (dimension.z + classification->slab_depth - 1) / classification->slab_depth;
+
+    classification->slab_columns = MELT_CONTEXT_ALLOC(context, uint8_t, (size_t)classification->slab_count * column_count);
+    classification->thread_rows = MELT_CONTEXT_ALLOC(context, uint8_t, (size_t)thread_count * dimension.x);
+    classification->thread_inner_counts = MELT_CONTEXT_ALLOC(context, uint32_t, thread_count);
+    memset(classification->thread_inner_counts, 0, thread_count * sizeof(uint32_t));
+}
+
+static void _release_classification(_classification_t* classification)
+{
+    _context_t* context = classification->context;
+    const uvec3_t dimension = context->dimension;
+
+    MELT_CONTEXT_RELEASE(context, classification->slab_columns, uint8_t, (size_t)classification->slab_count * dimension.x * dimension.y);
+    MELT_CONTEXT_RELEASE(context, classification->thread_rows, uint8_t, (size_t)classification->thread_count * dimension.x);
+    MELT_CONTEXT_RELEASE(context, classification->thread_inner_counts, uint32_t, classification->thread_count);
+
+    classification->slab_columns = NULL;
+    classification->thread_rows = NULL;
+    classification->thread_inner_counts = NULL;
+}
+
+// Classifies the next slab_count slabs in parallel. Returns true while slabs
+// are left to classify.
+static bool _classify_slabs(_classification_t* classification, uint32_t slab_count)
+{
+    classification->slab_end = _uint32_t_min(classification->next_slab + slab_count, classification->slab_count);
+
+    _parallel_run(classification->thread_count, _classify_voxels_task, classification);
+
+    // Threads claim slabs past the end of the pass before they stop
+    classification->next_slab = classification->slab_end;
+
+    return classification->next_slab < classification->slab_count &&
+        !classification->leaking && !classification->context->cancelled;
+}
+
+// Stitches the slabs and releases the scan state. Returns whether the shell is
+// watertight.
+static bool _end_classification(_classification_t* classification, uint32_t* out_inner_count)
+{
+    const _context_t* context = classification->context;
+    const uint32_t column_count = context->dimension.x * context->dimension.y;
+
+    bool watertight = !classification->leaking && !context->cancelled &&
+        classification->next_slab == classification->slab_count;
+
+    // A line along z leaks when it enters a slab open and meets a voxel that is
+    // neither inner nor part of the shell before meeting one that is.
+    for (uint32_t column = 0; column < column_count && watertight; ++column)
+    {
+        bool open = false;
+        for (uint32_t slab = 0; slab < classification->slab_count; ++slab)
+        {
+            const uint8_t state = classification->slab_columns[(size_t)slab * column_count + column];
+            if (open && (state & MELT_SCAN_HEAD_EXPOSED))
+            {
+                watertight = false;
+                break;
+            }
+            if (state & MELT_SCAN_SEEN)
+                open = (state & MELT_SCAN_OPEN) != 0;
+        }
+    }
+
+    uint32_t inner_count = 0;
+    for (uint32_t i = 0; i < classification->thread_count; ++i)
+        inner_count += classification->thread_inner_counts[i];
+    *out_inner_count = inner_count;
+
+    _release_classification(classification);
+
+    return watertight;
+}
+
+// Generates the voxel status and minimum distance fields, checks that the shell
+// is watertight and counts the inner voxels, in a single pass over the grid. The
+// grid is split in slabs along z that are classified in parallel. Lines along x
+// and y are scanned within a slice, lines along z are scanned per slab and the
+// slabs are stitched once all of them are done. Returns false as soon as any
+// thread finds a leak, or when the generation is cancelled.
+static bool _classify_voxels(_context_t* context, uint32_t* out_inner_count)
+{
+    MELT_PROFILE_BEGIN();
+
+    _classification_t classification;
+    _begin_classification(&classification, context, false);
+    _classify_slabs(&classification, classification.slab_count);
+    const bool watertight = _end_classification(&classification, out_inner_count);
+
+    MELT_PROFILE_END();
+
+    return watertight;
+}
+
+static void _debug_validate_min_distance_field(const _context_t* context)
+{
+#if defined(MELT_DEBUG) && defined(MELT_ASSERT)
+    const uint32_t size = context->size;
+    for (uint32_t i = context->kernels.find_inner_voxel(context->voxel_field, 0, size); i < size;
+         i = context->kernels.find_inner_voxel(context->voxel_field, i + 1, size))
+    {
+        const _min_distance_t min_distance_value = _load_min_distance(context, i);
+        const _min_distance_t* min_distance = &min_distance_value;
+
+        for (uint32_t x = min_distance->x; x < min_distance->x + min_distance->dist.x; ++x)
+        {
+            const uint32_t y = min_distance->y;
+            const uint32_t z = min_distance->z;
+            const uint32_t index = _flatten_3d(_uvec3_init(x, y, z), context->dimension);
+            MELT_ASSERT(!_shell_voxel(context, index));
+            MELT_ASSERT(_inner_voxel(context->voxel_field[index]));
+        }
+        for (uint32_t y = min_distance->y; y < min_distance->y + min_distance->dist.y; ++y)
+        {
+            const uint32_t x = min_distance->x;
+            const uint32_t z = min_distance->z;
+            const uint32_t index = _flatten_3d(_uvec3_init(x, y, z), context->dimension);
+            MELT_ASSERT(!_shell_voxel(context, index));
+            MELT_ASSERT(_inner_voxel(context->voxel_field[index]));
+        }
+        for (uint32_t z = min_distance->z; z < min_distance->z + min_distance->dist.z; ++z)
+        {
+            const uint32_t x = min_distance->x;
+            const uint32_t y = min_distance->y;
+            const uint32_t index = _flatten_3d(_uvec3_init(x, y, z), context->dimension);
+            MELT_ASSERT(!_shell_voxel(context, index));
+            MELT_ASSERT(_inner_voxel(context->voxel_field[index]));
+        }
+    }
+#else
+    MELT_UNUSED(context);
+#endif
+}
+
+static void _debug_validate_max_extents(const _context_t* context, const _max_extent_t* max_extents, uint32_t max_extent_count)
+{
+#if defined(MELT_DEBUG) && defined(MELT_ASSERT)
+    for (uint32_t i = 0; i < max_extent_count; ++i)
+    {
+        const _max_extent_t* extent = &max_extents[i];
+        for (uint32_t x = extent->position.x; x < extent->position.x + extent->extent.x; ++x)
+        {
+            for (uint32_t y = extent->position.y; y < extent->position.y + extent->extent.y; ++y)
+            {
+                for (uint32_t z = extent->position.z; z < extent->position.z + extent->extent.z; ++z)
+                {
+                    const uint32_t index = _flatten_3d(_uvec3_init(x, y, z), context->dimension);
+                    MELT_ASSERT(!_shell_voxel(context, index));
+                }
+            }
+        }
+    }
+#else
+    MELT_UNUSED(context);
+    MELT_UNUSED(max_extents);
+    MELT_UNUSED(max_extent_count);
+#endif
+}
+
+static void _update_min_distance_field(const _context_t* context, uvec3_t start_position, uvec3_t extent)
+{
+    MELT_PROFILE_BEGIN();
+    MELT_ASSERT(start_position.x - 1 != ~0U);
+    MELT_ASSERT(start_position.y - 1 != ~0U);
+    MELT_ASSERT(start_position.z - 1 != ~0U);
+
+    const uvec3_t dimension = context->dimension;
+    const uint32_t row_stride = dimension.x;
+    const uint32_t slice_stride = dimension.x * dimension.y;
+
+    // Every inner voxel before the extent along an axis, and within the extent on
+    // the two other axes, gets its distance on that axis clamped to the extent.
+    // The rows are walked along x for all three axes since x is contiguous.
+
+    // -x, the distance decreases along the row, from start_position.x down to 1
+    for (uint32_t z = start_position.z; z < start_position.z + extent.z; ++z)
+    {
+        for (uint32_t y = start_position.y; y < start_position.y + extent.y; ++y)
+        {
+            const uint32_t row_index = z * slice_stride + y * row_stride;
+            context->kernels.update_min_distance_row(&context->min_distance_field.x[row_index],
+                &context->voxel_field[row_index], start_position.x, start_position.x, 1);
+        }
+    }
+
+    // -y, the distance is constant along each row
+    for (uint32_t z = start_position.z; z < start_position.z + extent.z; ++z)
+    {
+        for (uint32_t y = 0; y < start_position.y; ++y)
+        {
+            const uint32_t row_index = z * slice_stride + y * row_stride + start_position.x;
+            context->kernels.update_min_distance_row(&context->min_distance_field.y[row_index],
+                &context->voxel_field[row_index], extent.x, start_position.y - y, 0);
+        }
+    }
+
+    // -z, the distance is constant along each row
+    for (uint32_t z = 0; z < start_position.z; ++z)
+    {
+        for (uint32_t y = start_position.y; y < start_position.y + extent.y; ++y)
+        {
+            const uint32_t row_index = z * slice_stride + y * row_stride + start_position.x;
+            context->kernels.update_min_distance_row(&context->min_distance_field.z[row_index],
+                &context->voxel_field[row_index], extent.x, start_position.z - z, 0);
+        }
+    }
+
+    MELT_PROFILE_END();
+}
+
+static melt_occluder_box_type_t _select_voxel_indices(melt_occluder_box_type_flags_t box_type_flags, const uint16_t** out_indices, uint32_t* out_index_length)
+{
+#define CHECK_FLAG(flag) (box_type_flags & flag) == flag
+
+    if (CHECK_FLAG(MELT_OCCLUDER_BOX_TYPE_REGULAR))
+    {
+        *out_indices = (const uint16_t*)_voxel_cube_indices;
+        *out_index_length = MELT_ARRAY_LENGTH(_voxel_cube_indices);
+        return MELT_OCCLUDER_BOX_TYPE_REGULAR;
+    }
+    else if (CHECK_FLAG(MELT_OCCLUDER_BOX_TYPE_SIDES))
+    {
+        *out_indices = (const uint16_t*)_voxel_cube_indices_sides;
+        *out_index_length = MELT_ARRAY_LENGTH(_voxel_cube_indices_sides);
+        return MELT_OCCLUDER_BOX_TYPE_SIDES;
+    }
+    else if (CHECK_FLAG(MELT_OCCLUDER_BOX_TYPE_BOTTOM))
+    {
+        *out_indices = (const uint16_t*)_voxel_cube_indices_bottom;
+        *out_index_length = MELT_ARRAY_LENGTH(_voxel_cube_indices_bottom);
+        return MELT_OCCLUDER_BOX_TYPE_BOTTOM;
+    }
+    else if (CHECK_FLAG(MELT_OCCLUDER_BOX_TYPE_TOP))
+    {
+        *out_indices = (const uint16_t*)_voxel_cube_indices_top;
+        *out_index_length = MELT_ARRAY_LENGTH(_voxel_cube_indices_top);
+        return MELT_OCCLUDER_BOX_TYPE_TOP;
+    }
+    else if (CHECK_FLAG(MELT_OCCLUDER_BOX_TYPE_DIAGONALS))
+    {
+        *out_indices = (const uint16_t*)_voxel_cube_indices_diagonals;
+        *out_index_length = MELT_ARRAY_LENGTH(_voxel_cube_indices_diagonals);
+        return MELT_OCCLUDER_BOX_TYPE_DIAGONALS;
+    }
+
+#undef CHECK_FLAG
+
+    return MELT_OCCLUDER_BOX_TYPE_NONE;
+}
+
+static uint16_t _index_count_per_aabb(melt_occluder_box_type_flags_t box_type_flags)
+{
+    uint16_t index_count = 0;
+    while (box_type_flags != MELT_OCCLUDER_BOX_TYPE_NONE)
+    {
+        const uint16_t* indices = NULL;
+        uint32_t indices_length = 0;
+        melt_occluder_box_type_t selected_type = _select_voxel_indices(box_type_flags, &indices, &indices_length);
+        MELT_ASSERT(indices && indices_length > 0);
+        index_count += indices_length;
+        box_type_flags &= ~selected_type;
+    }
+    return index_count;
+}
+
+static uint32_t _vertex_count_per_aabb()
+{
+    return MELT_ARRAY_LENGTH(_voxel_cube_vertices);
+}
+
+// Keeps in max_extent the largest extent starting at the inner voxels of the
+// range, the first one found on ties. Searching consecutive ranges gives the
+// same extent as searching the whole grid at once.
+static void _find_max_extent(const _context_t* context, uint32_t begin, uint32_t end, _max_extent_t* max_extent)
+{
+    MELT_PROFILE_BEGIN();
+
+    for (uint32_t i = context->kernels.find_inner_voxel(context->voxel_field, begin, end); i < end;
+         i = context->kernels.find_inner_voxel(context->voxel_field, i + 1, end))
+    {
+        const _min_distance_t min_distance = _load_min_distance(context, i);
+        uvec3_t extent = _get_max_aabb_extent(context, &min_distance);
+        uint32_t volume = extent.x * extent.y * extent.z;
+        if (volume > max_extent->volume)
+        {
+            max_extent->extent = extent;
+            max_extent->position = min_distance.position;
+            max_extent->volume = max_extent->extent.x * max_extent->extent.y * max_extent->extent.z;
+        }
+    }
+
+    MELT_PROFILE_END();
+}
+
+// Reference implementations of the phases, selected with melt_params_t.reference.
+// They are written to be obviously correct rather than fast: no kernels, no
+// threads, no plane voxel lists and no incremental distance field. The optimized
+// phases have to produce exactly the same fields and extents.
+
+static inline bool _shell_mask_test(const _context_t* context, uint32_t index)
+{
+    return (context->shell_mask[index >> 5] & (1u << (index & 31))) != 0;
+}
+
+static inline uvec3_t _uvec3_step(uvec3_t position, uint32_t axis, int32_t step)
+{
+    if (axis == 0)
+        position.x += step;
+    else if (axis == 1)
+        position.y += step;
+    else
+        position.z += step;
+    return position;
+}
+
+static inline uint32_t _uvec3_axis(uvec3_t position, uint32_t axis)
+{
+    return axis == 0 ? position.x : (axis == 1 ? position.y : position.z);
+}
+
+// Shell repair before classification, see melt_params_t::closing_radius and
+// melt_params_t::ground_cap. Each pass runs over a range of voxels, lines or
+// columns so that time sliced generations can spread it across steps, the
+// buffers live in the repair state in between.
+typedef struct
+{
+    uint8_t* grid;
+    uint32_t* distances;
+    uint32_t max_length;
+    uint32_t* bottoms;
+    uint32_t* footprints;
+    uint32_t footprint_end;
+} _shell_repair_t;
+
+static uint32_t _grow_axis_line_count(uvec3_t dimension, uint32_t axis)
+{
+    return dimension.x * dimension.y * dimension.z / _uvec3_axis(dimension, axis);
+}
+
+// Grows the voxels equal to value by radius along one axis of a grid of one
+// byte per voxel, on the lines in [line_begin, line_end). Growing the zeros
+// erodes the ones, voxels outside of the grid count as ones.
+static void _grow_axis(uint8_t* grid, uvec3_t dimension, uint32_t axis, uint32_t radius, uint8_t value, uint32_t* distances,
+    uint32_t line_begin, uint32_t line_end)
+{
+    const uint32_t stride = axis == 0 ? 1 : (axis == 1 ? dimension.x : dimension.x * dimension.y);
+    const uint32_t length = _uvec3_axis(dimension, axis);
+
+    for (uint32_t line = line_begin; line < line_end; ++line)
+    {
+        // First voxel of the line, lines are enumerated in grid order without
+        // the axis.
+        uint32_t first;
+        if (axis == 0)
+            first = line * dimension.x;
+        else if (axis == 1)
+            first = line % dimension.x + line / dimension.x * dimension.x * dimension.y;
+        else
+            first = line;
+
+        // Distance to the closest voxel with the value before, then after
+        uint32_t distance = UINT32_MAX;
+        for (uint32_t i = 0; i < length; ++i)
+        {
+            distance = grid[first + i * stride] == value ? 0 : (distance == UINT32_MAX ? distance : distance + 1);
+            distances[i] = distance;
+        }
+        distance = UINT32_MAX;
+        for (uint32_t i = length; i-- > 0;)
+        {
+            distance = grid[first + i * stride] == value ? 0 : (distance == UINT32_MAX ? distance : distance + 1);
+            if (distances[i] <= radius || distance <= radius)
+                grid[first + i * stride] = value;
+        }
+    }
+}
+
+// Closes the shell by dilating then eroding it with a cube of 2 * radius + 1
+// voxels, separably along each axis, and adds the voxels it gained. Closing
+// only ever adds voxels. The shell is copied to a grid of one byte per voxel,
+// grown in 6 passes of _grow_axis and the grid is added back.
+static void _begin_close_shell(_context_t* context, _shell_repair_t* repair)
+{
+    const uvec3_t dimension = context->dimension;
+    repair->max_length = dimension.x > dimension.y ? (dimension.x > dimension.z ? dimension.x : dimension.z) : (dimension.y > dimension.z ? dimension.y : dimension.z);
+    repair->grid = MELT_CONTEXT_ALLOC(context, uint8_t, context->size);
+    repair->distances = MELT_CONTEXT_ALLOC(context, uint32_t, repair->max_length);
+}
+
+static void _fill_close_grid(const _context_t* context, _shell_repair_t* repair, uint32_t begin, uint32_t end)
+{
+    for (uint32_t i = begin; i < end; ++i)
+        repair->grid[i] = _shell_mask_test(context, i) ? 1 : 0;
+}
+
+// Passes 0 to 2 dilate along x, y and z, passes 3 to 5 erode.
+static void _grow_close_grid(const _context_t* context, _shell_repair_t* repair, uint32_t radius, uint32_t pass, uint32_t line_begin, uint32_t line_end)
+{
+    _grow_axis(repair->grid, context->dimension, pass % 3, radius, pass < 3 ? 1 : 0, repair->distances, line_begin, line_end);
+}
+
+static void _add_close_grid(_context_t* context, const _shell_repair_t* repair, uint32_t begin, uint32_t end)
+{
+    for (uint32_t i = begin; i < end; ++i)
+    {
+        if (repair->grid[i])
+            _add_shell_voxel(context, _unflatten_3d(i, context->dimension));
+    }
+}
+
+static void _end_close_shell(_context_t* context, _shell_repair_t* repair)
+{
+    MELT_CONTEXT_RELEASE(context, repair->distances, uint32_t, repair->max_length);
+    MELT_CONTEXT_RELEASE(context, repair->grid, uint8_t, context->size);
+    repair->distances = NULL;
+    repair->grid = NULL;
+}
+
+// Caps each footprint of the shell at its own lowest layer along y. Columns
+// along y holding shell voxels form a footprint with the columns they share a
+// side with in the xz plane, every column of a footprint gets a shell voxel at
+// the lowest layer of the footprint. The bottoms of the columns are found from
+// the voxel set, then the footprints are flooded from each seed column in turn.
+static void _begin_cap_shell(_context_t* context, _shell_repair_t* repair)
+{
+    const uint32_t column_count = context->dimension.x * context->dimension.z;
+    repair->bottoms = MELT_CONTEXT_ALLOC(context, uint32_t, column_count);
+    repair->footprints = MELT_CONTEXT_ALLOC(context, uint32_t, column_count);
+    repair->footprint_end = 0;
+}
+
+// Lowest shell voxel of each column in [begin, end), dimension.y when it has none
+static void _init_cap_bottoms(const _context_t* context, _shell_repair_t* repair, uint32_t begin, uint32_t end)
+{
+    for (uint32_t column = begin; column < end; ++column)
+        repair->bottoms[column] = context->dimension.y;
+}
+
+static void _find_cap_bottoms(const _context_t* context, _shell_repair_t* repair, uint32_t begin, uint32_t end)
+{
+    for (uint32_t i = begin; i < end; ++i)
+    {
+        const uvec3_t position = context->voxel_set[i].position;
+        const uint32_t column = position.x + position.z * context->dimension.x;
+        repair->bottoms[column] = _uint32_t_min(repair->bottoms[column], position.y);
+    }
+}
+
+// Floods the footprints of the seed columns in [seed_begin, seed_end), their
+// columns are listed contiguously in footprints. Listed columns are marked with
+// bit 31 of their bottom.
+static void _cap_footprints(_context_t* context, _shell_repair_t* repair, uint32_t seed_begin, uint32_t seed_end)
+{
+    const uvec3_t dimension = context->dimension;
+    uint32_t* bottoms = repair->bottoms;
+    uint32_t* footprints = repair->footprints;
+    const uint32_t listed = 1u << 31;
+
+    for (uint32_t seed = seed_begin; seed < seed_end; ++seed)
+    {
+        if (bottoms[seed] >= dimension.y)
+            continue;
+
+        const uint32_t footprint_begin = repair->footprint_end;
+        uint32_t footprint_end = footprint_begin;
+        uint32_t ground = bottoms[seed];
+        bottoms[seed] |= listed;
+        footprints[footprint_end++] = seed;
+
+        for (uint32_t i = footprint_begin; i < footprint_end; ++i)
+        {
+            const uint32_t column = footprints[i];
+            const uint32_t x = column % dimension.x;
+            const uint32_t z = column / dimension.x;
+            const uint32_t neighbors[4] = {
+                x > 0 ? column - 1 : UINT32_MAX,
+                x + 1 < dimension.x ? column + 1 : UINT32_MAX,
+                z > 0 ? column - dimension.x : UINT32_MAX,
+                z + 1 < dimension.z ? column + dimension.x : UINT32_MAX };
+            for (uint32_t n = 0; n < 4; ++n)
+            {
+                if (neighbors[n] == UINT32_MAX || bottoms[neighbors[n]] >= dimension.y)
+                    continue;
+                ground = _uint32_t_min(ground, bottoms[neighbors[n]]);
+                bottoms[neighbors[n]] |= listed;
+                footprints[footprint_end++] = neighbors[n];
+            }
+        }
+
+        for (uint32_t i = footprint_begin; i < footprint_end; ++i)
+        {
+            const uint32_t column = footprints[i];
+            _add_shell_voxel(context, _uvec3_init(column % dimension.x, ground, column / dimension.x));
+        }
+        repair->footprint_end = footprint_end;
+    }
+}
+
+static void _end_cap_shell(_context_t* context, _shell_repair_t* repair)
+{
+    const uint32_t column_count = context->dimension.x * context->dimension.z;
+    MELT_CONTEXT_RELEASE(context, repair->footprints, uint32_t, column_count);
+    MELT_CONTEXT_RELEASE(context, repair->bottoms, uint32_t, column_count);
+    repair->footprints = NULL;
+    repair->bottoms = NULL;
+}
+
+// Tests every triangle against every voxel of the grid.
+static void _voxelize_shell_reference(_context_t* context, const melt_mesh_t* mesh)
+{
+    MELT_PROFILE_BEGIN();
+
+    const float half_voxel_size = context->voxel_size * 0.5f;
+    const vec3_t half_voxel_extent = _vec3_init(half_voxel_size, half_voxel_size, half_voxel_size);
+
+    for (uint32_t index = 0; index < context->size; ++index)
+    {
+        const uvec3_t position = _unflatten_3d(index, context->dimension);
+        const vec3_t center = _voxel_center(context, position);
+
+        if (position.x == 0 && _report_progress(context, MELT_PHASE_VOXELIZATION, (float)index / context->size))
+            break;
+
+        for (uint32_t i = 0; i < mesh->index_count; i += 3)
+        {
+            _triangle_t triangle;
+
+            triangle.v0 = mesh->vertices[mesh->indices[i + 0]];
+            triangle.v1 = mesh->vertices[mesh->indices[i + 1]];
+            triangle.v2 = mesh->vertices[mesh->indices[i + 2]];
+
+            if (_aabb_intersects_triangle(&triangle, center, half_voxel_extent))
+            {
+                _add_shell_voxel(context, position);
+                break;
+            }
+        }
+    }
+
+    MELT_PROFILE_END();
+}
+
+// Classifies each voxel by walking the whole grid line through it on each axis,
+// then checks watertightness by walking from each inner voxel to the shell.
+static bool _classify_voxels_reference(_context_t* context, uint32_t* out_inner_count)
+{
+    MELT_PROFILE_BEGIN();
+
+    const svec3_t InfiniteDistance = _svec3_init(INT_MAX, INT_MAX, INT_MAX);
+    const svec3_t NullDistance = _svec3_init(0, 0, 0);
+    const int32_t plus_visibility[3] = { MELT_AXIS_VISIBILITY_PLUS_X, MELT_AXIS_VISIBILITY_PLUS_Y, MELT_AXIS_VISIBILITY_PLUS_Z };
+    const int32_t minus_visibility[3] = { MELT_AXIS_VISIBILITY_MINUS_X, MELT_AXIS_VISIBILITY_MINUS_Y, MELT_AXIS_VISIBILITY_MINUS_Z };
+    const uvec3_t dimension = context->dimension;
+    bool cancelled = false;
+
+    for (uint32_t index = 0; index < context->size; ++index)
+    {
+        const uvec3_t position = _unflatten_3d(index, dimension);
+        const bool shell = _shell_mask_test(context, index);
+
+        if (position.x == 0 && _report_progress(context, MELT_PHASE_CLASSIFICATION, (float)index / context->size))
+        {
+            cancelled = true;
+            break;
+        }
+
+        int32_t distances[3] = { INT_MAX, INT_MAX, INT_MAX };
+        _voxel_status_t status;
+        status.visibility = MELT_AXIS_VISIBILITY_NULL;
+        status.clipped = false;
+        status.inner = false;
+
+        for (uint32_t axis = 0; axis < 3; ++axis)
+        {
+            const uint32_t coordinate = _uvec3_axis(position, axis);
+            const uint32_t line_length = _uvec3_axis(dimension, axis);
+            for (uint32_t i = 0; i < line_length; ++i)
+            {
+                const uvec3_t line_position = _uvec3_step(position, axis, (int32_t)i - (int32_t)coordinate);
+                if (!_shell_mask_test(context, _flatten_3d(line_position, dimension)))
+                    continue;
+                if (i < coordinate)
+                    status.visibility |= minus_visibility[axis];
+                if (i > coordinate)
+                    status.visibility |= plus_visibility[axis];
+                if (i > coordinate && distances[axis] == INT_MAX)
+                    distances[axis] = (int32_t)(i - coordinate);
+            }
+            if (shell)
+                distances[axis] = 0;
+        }
+
+        const svec3_t distance = _svec3_init(distances[0], distances[1], distances[2]);
+        if (status.visibility == MELT_AXIS_VISIBILITY_ALL &&
+            !_svec3_equals(distance, InfiniteDistance) &&
+            !_svec3_equals(distance, NullDistance))
+        {
+            status.inner = true;
+        }
+
+        context->voxel_field[index] = status;
+        context->min_distance_field.x[index] = (uint32_t)distance.x;
+        context->min_distance_field.y[index] = (uint32_t)distance.y;
+        context->min_distance_field.z[index] = (uint32_t)distance.z;
+    }
+
+    bool watertight = !cancelled;
+    uint32_t inner_count = 0;
+
+    for (uint32_t index = 0; index < context->size && !cancelled; ++index)
+    {
+        if (!_inner_voxel(context->voxel_field[index]))
+            continue;
+
+        ++inner_count;
+
+        const uvec3_t position = _unflatten_3d(index, dimension);
+        const uint32_t distances[3] = { context->min_distance_field.x[index], context->min_distance_field.y[index], context->min_distance_field.z[index] };
+        for (uint32_t axis = 0; axis < 3; ++axis)
+        {
+            for (uint32_t i = 0; i < distances[axis]; ++i)
+            {
+                const uvec3_t line_position = _uvec3_step(position, axis, (int32_t)i);
+                if (!_inner_voxel(context->voxel_field[_flatten_3d(line_position, dimension)]))
+                    watertight = false;
+            }
+        }
+    }
+
+    *out_inner_count = inner_count;
+
+    MELT_PROFILE_END();
+
+    return watertight;
+}
+
+// Number of consecutive inner voxels that are not clipped, starting at a voxel
+// along +x, +y or +z. This is what the minimum distance field tracks incrementally.
+static uint32_t _inner_run_length_reference(const _context_t* context, uvec3_t position, uint32_t axis)
+{
+    uint32_t length = 0;
+    while (_uvec3_axis(position, axis) + length < _uvec3_axis(context->dimension, axis))
+    {
+        const uvec3_t run_position = _uvec3_step(position, axis, (int32_t)length);
+        if (!_inner_voxel(context->voxel_field[_flatten_3d(run_position, context->dimension)]))
+            break;
+        ++length;
+    }
+    return length;
+}
+
+static uvec3_t _get_max_aabb_extent_reference(const _context_t* context, uvec3_t position)
+{
+    const uint32_t depth = _inner_run_length_reference(context, position, 2);
+    uvec2_t min_extent = _uvec2_init(UINT_MAX, UINT_MAX);
+
+    for (uint32_t z = position.z; z < position.z + depth; ++z)
+    {
+        const uvec3_t slice_position = _uvec3_init(position.x, position.y, z);
+        const uint32_t sample_distance_x = _inner_run_length_reference(context, slice_position, 0);
+        const uint32_t sample_distance_y = _inner_run_length_reference(context, slice_position, 1);
+
+        uvec2_t max_extent = _uvec2_init(sample_distance_x, sample_distance_y);
+
+        for (uint32_t i = 1; i < sample_distance_x && i < sample_distance_y; ++i)
+        {
+            const uvec3_t diagonal_position = _uvec3_init(position.x + i, position.y + i, z);
+            if (!_inner_voxel(context->voxel_field[_flatten_3d(diagonal_position, context->dimension)]))
+            {
+                max_extent = _uvec2_init(i, i);
+                break;
+            }
+            max_extent.x = _uint32_t_min(_inner_run_length_reference(context, diagonal_position, 0) + i, max_extent.x);
+            max_extent.y = _uint32_t_min(_inner_run_length_reference(context, diagonal_position, 1) + i, max_extent.y);
+        }
+
+        min_extent.x = _uint32_t_min(max_extent.x, min_extent.x);
+        min_extent.y = _uint32_t_min(max_extent.y, min_extent.y);
+    }
+
+    return _uvec3_init(min_extent.x, min_extent.y, depth);
+}
+
+static _max_extent_t _get_max_extent_reference(const _context_t* context)
+{
+    MELT_PROFILE_BEGIN();
+
+    _max_extent_t max_extent;
+    max_extent.extent = _uvec3_init(0, 0, 0);
+    max_extent.position = _uvec3_init(0, 0, 0);
+    max_extent.volume = 0;
+
+    for (uint32_t index = 0; index < context->size; ++index)
+    {
+        if (!_inner_voxel(context->voxel_field[index]))
+            continue;
+
+        const uvec3_t position = _unflatten_3d(index, context->dimension);
+        const uvec3_t extent = _get_max_aabb_extent_reference(context, position);
+        const uint32_t volume = extent.x * extent.y * extent.z;
+        if (volume > max_extent.volume)
+        {
+            max_extent.extent = extent;
+            max_extent.position = position;
+            max_extent.volume = volume;
+        }
+    }
+
+    MELT_PROFILE_END();
+
+    return max_extent;
+}
+
+#if defined(MELT_SIMD_X86)
+static void _read_cpuid(uint32_t leaf, uint32_t subleaf, uint32_t out_registers[4])
+{
+#if defined(_MSC_VER)
+    int registers[4];
+    __cpuidex(registers, (int)leaf, (int)subleaf);
+    memcpy(out_registers, registers, sizeof(registers));
+#else
+    __cpuid_count(leaf, subleaf, out_registers[0], out_registers[1], out_registers[2], out_registers[3]);
+#endif
+}
+
+static uint64_t _read_xcr0(void)
+{
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    uint32_t eax, edx;
+    __asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((uint64_t)edx << 32) | eax;
+#endif
+}
+#endif // MELT_SIMD_X86
+
+static melt_isa_t _detect_isa(void)
+{
+#if defined(MELT_SIMD_X86)
+    uint32_t registers[4];
+
+    _read_cpuid(0, 0, registers);
+    const uint32_t max_leaf = registers[0];
+    if (max_leaf < 1)
+        return MELT_ISA_SCALAR;
+
+    _read_cpuid(1, 0, registers);
+    const bool sse41 = (registers[2] & (1u << 19)) != 0;
+    const bool osxsave = (registers[2] & (1u << 27)) != 0;
+    const bool avx = (registers[2] & (1u << 28)) != 0;
+    if (!sse41)
+        return MELT_ISA_SCALAR;
+
+    // The OS has to save the extended register state for the wider variants.
+    const uint64_t xcr0 = osxsave ? _read_xcr0() : 0;
+    const bool ymm_state = (xcr0 & 0x6) == 0x6;
+    const bool zmm_state = (xcr0 & 0xe6) == 0xe6;
+    if (!avx || !ymm_state || max_leaf < 7)
+        return MELT_ISA_SSE41;
+
+    _read_cpuid(7, 0, registers);
+    const bool avx2 = (registers[1] & (1u << 5)) != 0;
+    const bool avx512f = (registers[1] & (1u << 16)) != 0;
+    const bool avx512bw = (registers[1] & (1u << 30)) != 0;
+    if (!avx2)
+        return MELT_ISA_SSE41;
+    if (!avx512f || !avx512bw || !zmm_state)
+        return MELT_ISA_AVX2;
+
+    return MELT_ISA_AVX512;
+#else
+    return MELT_ISA_SCALAR;
+#endif
+}
+
+// Kernels without a variant for an instruction set keep the one of the closest
+// lower set, e.g. the triangle box test runs the AVX2 variant on AVX-512 CPUs.
+static void _select_kernels(_kernels_t* kernels, melt_isa_t requested_isa)
+{
+    melt_isa_t isa = _detect_isa();
+    if (requested_isa != MELT_ISA_AUTO && requested_isa < isa)
+        isa = requested_isa;
+
+    kernels->isa = isa;
+    kernels->triangle_intersects_voxel_row = _triangle_intersects_voxel_row_scalar;
+    kernels->update_min_distance_row = _update_min_distance_row_scalar;
+    kernels->count_inner_voxels = _count_inner_voxels_scalar;
+    kernels->find_inner_voxel = _find_inner_voxel_scalar;
+    kernels->cull_boxes = _cull_boxes_scalar;
+
+#if defined(MELT_SIMD_X86)
+    if (isa >= MELT_ISA_SSE41)
+    {
+        kernels->triangle_intersects_voxel_row = _triangle_intersects_voxel_row_sse41;
+        kernels->update_min_distance_row = _update_min_distance_row_sse41;
+        kernels->count_inner_voxels = _count_inner_voxels_sse41;
+        kernels->find_inner_voxel = _find_inner_voxel_sse41;
+        kernels->cull_boxes = _cull_boxes_sse41;
+    }
+    if (isa >= MELT_ISA_AVX2)
+    {
+        kernels->triangle_intersects_voxel_row = _triangle_intersects_voxel_row_avx2;
+        kernels->update_min_distance_row = _update_min_distance_row_avx2;
+        kernels->count_inner_voxels = _count_inner_voxels_avx2;
+        kernels->find_inner_voxel = _find_inner_voxel_avx2;
+        kernels->cull_boxes = _cull_boxes_avx2;
+    }
+    if (isa >= MELT_ISA_AVX512)
+    {
+        kernels->update_min_distance_row = _update_min_distance_row_avx512;
+        kernels->count_inner_voxels = _count_inner_voxels_avx512;
+        kernels->find_inner_voxel = _find_inner_voxel_avx512;
+    }
+#endif
+}
+
+melt_isa_t melt_get_supported_isa(void)
+{
+    return _detect_isa();
+}
+
+// Deterministic grids are computed in whole voxels from one correctly rounded
+// division per bound. The first and last voxels lie entirely outside the mesh.
+static uvec3_t _grid_dimension_exact(const melt_params_t* params, svec3_t* out_origin_cell)
+{
+    const _aabb_t mesh_aabb = _generate_aabb_from_mesh(params->mesh);
+    int32_t origin_cell[3];
+    uint32_t dimension[3];
+    for (uint32_t axis = 0; axis < 3; ++axis)
+    {
+        const float min_cells = floorf((&mesh_aabb.min.x)[axis] / params->voxel_size);
+        const float max_cells = ceilf((&mesh_aabb.max.x)[axis] / params->voxel_size);
+        MELT_ASSERT(fabsf(min_cells) < (float)(1 << 23) && fabsf(max_cells) < (float)(1 << 23) && "Mesh too far from the origin for a deterministic grid");
+        origin_cell[axis] = (int32_t)min_cells - 2 - (int32_t)params->closing_radius;
+        dimension[axis] = (uint32_t)((int32_t)max_cells + 1 + (int32_t)params->closing_radius - origin_cell[axis]);
+    }
+
+    *out_origin_cell = _svec3_init(origin_cell[0], origin_cell[1], origin_cell[2]);
+    return _uvec3_init(dimension[0], dimension[1], dimension[2]);
+}
+
+// The grid covers the mesh snapped to the voxel size, with a voxel of margin
+static uvec3_t _grid_dimension(const melt_params_t* params, vec3_t* out_origin, svec3_t* out_origin_cell)
+{
+    *out_origin_cell = _svec3_init(0, 0, 0);
+    if (params->deterministic)
+    {
+        const uvec3_t dimension = _grid_dimension_exact(params, out_origin_cell);
+        *out_origin = _vec3_init((float)out_origin_cell->x * params->voxel_size,
+            (float)out_origin_cell->y * params->voxel_size, (float)out_origin_cell->z * params->voxel_size);
+        return dimension;
+    }
+
+    _aabb_t mesh_aabb = _generate_aabb_from_mesh(params->mesh);
+    const float margin = params->voxel_size * (float)(1 + params->closing_radius);
+    const vec3_t voxel_extent = _vec3_init(margin, margin, margin);
+    mesh_aabb.min = _vec3_sub(_map_to_voxel_min_bound(mesh_aabb.min, params->voxel_size), voxel_extent);
+    mesh_aabb.max = _vec3_add(_map_to_voxel_max_bound(mesh_aabb.max, params->voxel_size), voxel_extent);
+    const vec3_t voxel_count = _vec3_div(_vec3_sub(mesh_aabb.max, mesh_aabb.min), params->voxel_size);
+
+    *out_origin = mesh_aabb.min;
+    return _vec3_to_uvev3(voxel_count);
+}
+
+static void _init_context_grid(_context_t* context, const melt_params_t* params, vec3_t origin, svec3_t origin_cell, uvec3_t dimension)
+{
+    memset(context, 0, sizeof(_context_t));
+
+    context->origin = origin;
+    context->deterministic = params->deterministic != 0;
+    context->origin_cell = origin_cell;
+    context->dimension = dimension;
+    context->size = context->dimension.x * context->dimension.y * context->dimension.z;
+    context->voxel_size = params->voxel_size;
+
+    context->progress_callback = params->progress_callback;
+    context->progress_user_data = params->progress_user_data;
+    context->cancel_flag = params->cancel_flag;
+    context->reported_progress.fraction = -1.0f;
+    _select_kernels(&context->kernels, params->isa);
+
+    if (params->scratch_buffer)
+    {
+        // Start on an aligned address, the padding is part of the demand.
+        const uintptr_t address = (uintptr_t)params->scratch_buffer;
+        const size_t padding = (size_t)(((address + MELT_SCRATCH_ALIGNMENT - 1) & ~(uintptr_t)(MELT_SCRATCH_ALIGNMENT - 1)) - address);
+        context->scratch = (uint8_t*)params->scratch_buffer;
+        context->scratch_size = params->scratch_buffer_size;
+        context->scratch_top = padding < context->scratch_size ? padding : context->scratch_size;
+    }
+    // Room for the alignment of any other buffer
+    context->scratch_virtual_top = MELT_SCRATCH_ALIGNMENT - 1;
+#if defined(MELT_NO_THREADS)
+    context->thread_count = 1;
+#else
+    context->thread_count = params->thread_count > 1 ? _uint32_t_min(params->thread_count, MELT_MAX_THREADS) : 1;
+#endif
+
+    // Only the shell voxelization buffers are allocated upfront, the fields are
+    // allocated once the shell is known and the voxelization buffers are gone.
+    const uint32_t shell_mask_count = (context->size + 31) / 32;
+    context->shell_mask = MELT_CONTEXT_ALLOC(context, uint32_t, shell_mask_count);
+    memset(context->shell_mask, 0, shell_mask_count * sizeof(uint32_t));
+}
+
+static void _init_context(_context_t* context, const melt_params_t* params)
+{
+    vec3_t origin;
+    svec3_t origin_cell;
+    const uvec3_t dimension = _grid_dimension(params, &origin, &origin_cell);
+    _init_context_grid(context, params, origin, origin_cell, dimension);
+}
+
+static void _free_shell_mask(_context_t* context)
+{
+    MELT_CONTEXT_RELEASE(context, context->shell_mask, uint32_t, (context->size + 31) / 32);
+    context->shell_mask = NULL;
+}
+
+static void _alloc_fields(_context_t* context)
+{
+    context->voxel_field = MELT_CONTEXT_ALLOC(context, _voxel_status_t, context->size);
+    context->min_distance_field.x = MELT_CONTEXT_ALLOC(context, uint32_t, context->size);
+    context->min_distance_field.y = MELT_CONTEXT_ALLOC(context, uint32_t, context->size);
+    context->min_distance_field.z = MELT_CONTEXT_ALLOC(context, uint32_t, context->size);
+}
+
+static void _free_context(_context_t* context)
+{
+    _free_shell_mask(context);
+    _free_voxel_set(context);
+    _free_per_plane_voxel_set(context);
+    MELT_CONTEXT_RELEASE(context, context->voxel_field, _voxel_status_t, context->size);
+    MELT_CONTEXT_RELEASE(context, context->min_distance_field.x, uint32_t, context->size);
+    MELT_CONTEXT_RELEASE(context, context->min_distance_field.y, uint32_t, context->size);
+    MELT_CONTEXT_RELEASE(context, context->min_distance_field.z, uint32_t, context->size);
+    MELT_CONTEXT_RELEASE(context, context->max_extents, _max_extent_t, context->max_extents_capacity);
+    MELT_ASSERT(context->memory_usage == 0);
+}
+
+// Index pattern of a box for a given set of box types, in the order the types
+// are selected by _select_voxel_indices.
+typedef struct
+{
+    uint16_t indices[MELT_MAX_BOX_INDEX_COUNT];
+    uint32_t index_count;
+} _box_pattern_t;
+
+static void _init_box_pattern(_box_pattern_t* pattern, melt_occluder_box_type_flags_t box_type_flags)
+{
+    pattern->index_count = 0;
+    while (box_type_flags != MELT_OCCLUDER_BOX_TYPE_NONE)
+    {
+        const uint16_t* indices = NULL;
+        uint32_t indices_length = 0;
+        melt_occluder_box_type_t selected_type = _select_voxel_indices(box_type_flags, &indices, &indices_length);
+        MELT_ASSERT(pattern->index_count + indices_length <= MELT_MAX_BOX_INDEX_COUNT);
+        memcpy(pattern->indices + pattern->index_count, indices, indices_length * sizeof(uint16_t));
+        pattern->index_count += indices_length;
+        box_type_flags &= ~selected_type;
+    }
+}
+
+// In half voxels, voxel p of a deterministic grid spans 2 * (origin_cell + p) + 1
+// to 2 * (origin_cell + p) + 3. Every coordinate is a single rounding of an exact
+// integer.
+static inline float _exact_half_voxel_coordinate(int32_t half_voxels, float voxel_size)
+{
+    return (float)half_voxels * (voxel_size * 0.5f);
+}
+
+static void _exact_box_bounds(const _context_t* context, const _max_extent_t* extent, vec3_t* out_min, vec3_t* out_max)
+{
+    const svec3_t cell = context->origin_cell;
+    const uvec3_t position = extent->position;
+    const uvec3_t size = extent->extent;
+    const float voxel_size = context->voxel_size;
+
+    *out_min = _vec3_init(
+        _exact_half_voxel_coordinate(2 * (cell.x + (int32_t)position.x) + 1, voxel_size),
+        _exact_half_voxel_coordinate(2 * (cell.y + (int32_t)position.y) + 1, voxel_size),
+        _exact_half_voxel_coordinate(2 * (cell.z + (int32_t)position.z) + 1, voxel_size));
+    *out_max = _vec3_init(
+        _exact_half_voxel_coordinate(2 * (cell.x + (int32_t)(position.x + size.x)) + 1, voxel_size),
+        _exact_half_voxel_coordinate(2 * (cell.y + (int32_t)(position.y + size.y)) + 1, voxel_size),
+        _exact_half_voxel_coordinate(2 * (cell.z + (int32_t)(position.z + size.z)) + 1, voxel_size));
+}
+
+// Face of a triangle of the cube, its vertices share the coordinate of an axis
+// when it lies on a side.
+static melt_face_t _box_triangle_face(const uint16_t* triangle)
+{
+    const vec3_t v0 = _voxel_cube_vertices[triangle[0]];
+    const vec3_t v1 = _voxel_cube_vertices[triangle[1]];
+    const vec3_t v2 = _voxel_cube_vertices[triangle[2]];
+    if (v0.x == v1.x && v0.x == v2.x)
+        return v0.x > 0.0f ? MELT_FACE_POSITIVE_X : MELT_FACE_NEGATIVE_X;
+    if (v0.y == v1.y && v0.y == v2.y)
+        return v0.y > 0.0f ? MELT_FACE_POSITIVE_Y : MELT_FACE_NEGATIVE_Y;
+    if (v0.z == v1.z && v0.z == v2.z)
+        return v0.z > 0.0f ? MELT_FACE_POSITIVE_Z : MELT_FACE_NEGATIVE_Z;
+    return MELT_FACE_DIAGONAL;
+}
+
+// Orders the triangles of a pattern by face, keeping their order within a face.
+// The triangles facing f are indices out_offsets[f] to out_offsets[f + 1].
+static void _sort_box_pattern_by_face(_box_pattern_t* pattern, uint32_t* out_offsets)
+{
+    const _box_pattern_t unsorted = *pattern;
+    uint32_t index_count = 0;
+    for (uint32_t face = 0; face < MELT_FACE_COUNT; ++face)
+    {
+        out_offsets[face] = index_count;
+        for (uint32_t i = 0; i < unsorted.index_count; i += 3)
+        {
+            if (_box_triangle_face(unsorted.indices + i) != (melt_face_t)face)
+                continue;
+            memcpy(pattern->indices + index_count, unsorted.indices + i, 3 * sizeof(uint16_t));
+            index_count += 3;
+        }
+    }
+    out_offsets[MELT_FACE_COUNT] = index_count;
+    MELT_ASSERT(index_count == unsorted.index_count);
+}
+
+// Writes the 8 corners of the boxes in [box_begin, box_end). The mapping to the
+// grid is resolved before the loop, each box is a straight write of its corners.
+static void _emit_box_vertices(const _context_t* context, uint32_t box_begin, uint32_t box_end, vec3_t* vertices)
+{
+    const uint32_t vertex_count = MELT_ARRAY_LENGTH(_voxel_cube_vertices);
+
+    if (context->deterministic)
+    {
+        for (uint32_t i = box_begin; i < box_end; ++i)
+        {
+            vec3_t min, max;
+            _exact_box_bounds(context, &context->max_extents[i], &min, &max);
+            vec3_t* box_vertices = vertices + (size_t)i * vertex_count;
+            for (uint32_t v = 0; v < vertex_count; ++v)
+            {
+                const vec3_t corner = _voxel_cube_vertices[v];
+                box_vertices[v] = _vec3_init(corner.x < 0.0f ? min.x : max.x,
+                    corner.y < 0.0f ? min.y : max.y, corner.z < 0.0f ? min.z : max.z);
+            }
+        }
+        return;
+    }
+
+    const vec3_t voxel_extent = _vec3_init(context->voxel_size, context->voxel_size, context->voxel_size);
+    const vec3_t half_voxel_extent = _vec3_mulf(voxel_extent, 0.5f);
+    for (uint32_t i = box_begin; i < box_end; ++i)
+    {
+        const _max_extent_t* extent = &context->max_extents[i];
+        vec3_t half_extent = _vec3_mul(_uvec3_to_vec3(extent->extent), half_voxel_extent);
+        vec3_t voxel_position = _vec3_mul(_uvec3_to_vec3(extent->position), voxel_extent);
+        vec3_t voxel_position_biased_to_center = _vec3_add(voxel_position, half_extent);
+        vec3_t aabb_center = _vec3_add(context->origin, voxel_position_biased_to_center);
+        const vec3_t center = _vec3_add(aabb_center, half_voxel_extent);
+        vec3_t* box_vertices = vertices + (size_t)i * vertex_count;
+        for (uint32_t v = 0; v < vertex_count; ++v)
+            box_vertices[v] = _vec3_add(_vec3_mul(half_extent, _voxel_cube_vertices[v]), center);
+    }
+}
+
+// Defines an emission of the indices of the boxes specialized for an index type,
+// an index count per box, a compile time constant or the pattern's own count for
+// the generic variant, and for grouping the indices by face. The box types and
+// the output format are resolved before the loop, each box is a straight write
+// of the pattern, or of each face of the pattern to the range of that face, see
+// _sort_box_pattern_by_face.
+#define MELT_DEFINE_EMIT_BOX_INDICES(name, index_t, box_index_count, by_face)                           \
+static void name(const _context_t* context, const _box_pattern_t* pattern, const uint32_t* pattern_offsets, \
+    uint32_t box_begin, uint32_t box_end, index_t* indices)                                              \
+{                                                                                                        \
+    const uint32_t index_count = (box_index_count);                                                      \
+    MELT_ASSERT(index_count == pattern->index_count);                                                    \
+    MELT_UNUSED(pattern_offsets);                                                                        \
+                                                                                                         \
+    for (uint32_t i = box_begin; i < box_end; ++i)                                                       \
+    {                                                                                                    \
+        const index_t base = (index_t)(i * MELT_ARRAY_LENGTH(_voxel_cube_vertices));                     \
+        if (by_face)                                                                                     \
+        {                                                                                                \
+            /* The triangles of a face are in box order within its range */                              \
+            for (uint32_t face = 0; face < MELT_FACE_COUNT; ++face)                                      \
+            {                                                                                            \
+                const uint32_t begin = pattern_offsets[face];                                            \
+                const uint32_t face_index_count = pattern_offsets[face + 1] - begin;                     \
+                index_t* face_indices = indices + (size_t)begin * context->max_extents_count +           \
+                    (size_t)i * face_index_count;                                                        \
+                for (uint32_t k = 0; k < face_index_count; ++k)                                          \
+                    face_indices[k] = (index_t)(pattern->indices[begin + k] + base);                     \
+            }                                                                                            \
+        }                                                                                                \
+        else                                                                                             \
+        {                                                                                                \
+            index_t* box_indices = indices + (size_t)i * index_count;                                    \
+            for (uint32_t k = 0; k < index_count; ++k)                                                   \
+                box_indices[k] = (index_t)(pattern->indices[k] + base);                                  \
+        }                                                                                                \
+    }                                                                                                    \
+}
+
+MELT_DEFINE_EMIT_BOX_INDICES(_emit_box_indices_u16, uint16_t, pattern->index_count, 0)
+MELT_DEFINE_EMIT_BOX_INDICES(_emit_box_indices_u32, uint32_t, pattern->index_count, 0)
+MELT_DEFINE_EMIT_BOX_INDICES(_emit_box_indices_regular_u16, uint16_t, MELT_ARRAY_LENGTH(_voxel_cube_indices), 0)
+MELT_DEFINE_EMIT_BOX_INDICES(_emit_box_indices_regular_u32, uint32_t, MELT_ARRAY_LENGTH(_voxel_cube_indices), 0)
+MELT_DEFINE_EMIT_BOX_INDICES(_emit_box_indices_sides_u16, uint16_t, MELT_ARRAY_LENGTH(_voxel_cube_indices_sides), 0)
+MELT_DEFINE_EMIT_BOX_INDICES(_emit_box_indices_sides_u32, uint32_t, MELT_ARRAY_LENGTH(_voxel_cube_indices_sides), 0)
+MELT_DEFINE_EMIT_BOX_INDICES(_emit_box_indices_by_face_u16, uint16_t, pattern->index_count, 1)
+MELT_DEFINE_EMIT_BOX_INDICES(_emit_box_indices_by_face_u32, uint32_t, pattern->index_count, 1)
+
+// Writes the boxes in [box_begin, box_end) to a mesh sized for all of them,
+// dispatching to the variant specialized for the configuration when there is
+// one. With face offsets the indices are grouped by face.
+static void _add_max_extents_to_mesh(const _context_t* context, melt_mesh_t* mesh, melt_occluder_box_type_flags_t box_type_flags, uint32_t* face_offsets,
+    uint32_t box_begin, uint32_t box_end)
+{
+    MELT_PROFILE_BEGIN();
+
+    _box_pattern_t pattern;
+    _init_box_pattern(&pattern, box_type_flags);
+    uint32_t pattern_offsets[MELT_FACE_COUNT + 1];
+    if (face_offsets)
+        _sort_box_pattern_by_face(&pattern, pattern_offsets);
+
+    const bool regular = box_type_flags == MELT_OCCLUDER_BOX_TYPE_REGULAR;
+    const bool sides = box_type_flags == MELT_OCCLUDER_BOX_TYPE_SIDES;
+
+    _emit_box_vertices(context, box_begin, box_end, mesh->vertices);
+    if (mesh->indices32)
+    {
+        if (face_offsets)
+            _emit_box_indices_by_face_u32(context, &pattern, pattern_offsets, box_begin, box_end, mesh->indices32);
+        else if (regular)
+            _emit_box_indices_regular_u32(context, &pattern, NULL, box_begin, box_end, mesh->indices32);
+        else if (sides)
+            _emit_box_indices_sides_u32(context, &pattern, NULL, box_begin, box_end, mesh->indices32);
+        else
+            _emit_box_indices_u32(context, &pattern, NULL, box_begin, box_end, mesh->indices32);
+    }
+    else
+    {
+        if (face_offsets)
+            _emit_box_indices_by_face_u16(context, &pattern, pattern_offsets, box_begin, box_end, mesh->indices);
+        else if (regular)
+            _emit_box_indices_regular_u16(context, &pattern, NULL, box_begin, box_end, mesh->indices);
+        else if (sides)
+            _emit_box_indices_sides_u16(context, &pattern, NULL, box_begin, box_end, mesh->indices);
+        else
+            _emit_box_indices_u16(context, &pattern, NULL, box_begin, box_end, mesh->indices);
+    }
+
+    if (face_offsets)
+    {
+        for (uint32_t face = 0; face <= MELT_FACE_COUNT; ++face)
+            face_offsets[face] = pattern_offsets[face] * context->max_extents_count;
+    }
+
+    mesh->vertex_count = context->max_extents_count * MELT_ARRAY_LENGTH(_voxel_cube_vertices);
+    mesh->index_count = context->max_extents_count * pattern.index_count;
+
+    MELT_PROFILE_END();
+}
+
+void melt_free_result(melt_result_t result)
+{
+    MELT_FREE(result.mesh.vertices);
+    MELT_FREE(result.mesh.indices);
+    MELT_FREE(result.mesh.indices32);
+    MELT_FREE(result.instances.cube.vertices);
+    MELT_FREE(result.instances.cube.indices);
+    MELT_FREE(result.instances.boxes);
+    MELT_FREE(result.instances.quantized_boxes);
+    MELT_FREE(result.occupancy.shell);
+    MELT_FREE(result.occupancy.inner);
+}
+
+int melt_write_file(const void* data, size_t byte_size, void* file)
+{
+    return fwrite(data, 1, byte_size, (FILE*)file) == byte_size ? 1 : 0;
+}
+
+// Buffers the export so that the callback sees large writes, a failed write
+// drops everything that follows.
+typedef struct
+{
+    melt_write_callback_t callback;
+    void* user_data;
+    uint8_t buffer[MELT_EXPORT_BUFFER_SIZE];
+    size_t size;
+    bool failed;
+} _export_writer_t;
+
+static void _export_flush(_export_writer_t* writer)
+{
+    if (writer->size > 0 && !writer->failed)
+        writer->failed = writer->callback(writer->buffer, writer->size, writer->user_data) == 0;
+    writer->size = 0;
+}
+
+static void _export_write(_export_writer_t* writer, const void* data, size_t byte_size)
+{
+    MELT_ASSERT(byte_size <= MELT_EXPORT_BUFFER_SIZE);
+    if (writer->size + byte_size > MELT_EXPORT_BUFFER_SIZE)
+        _export_flush(writer);
+    memcpy(writer->buffer + writer->size, data, byte_size);
+    writer->size += byte_size;
+}
+
+static void _export_printf(_export_writer_t* writer, const char* format, ...)
+{
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    const int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (length > 0)
+        _export_write(writer, line, _uint32_t_min((uint32_t)length, sizeof(line) - 1));
+}
+
+static uint8_t _export_voxel_state(const _context_t* context, uint32_t index, bool fields)
+{
+    uint8_t state = context->shell_mask && _shell_mask_test(context, index) ? 1 : 0;
+    if (fields && context->voxel_field[index].inner)
+        state |= context->voxel_field[index].clipped ? 4 : 2;
+    return state;
+}
+
+static bool _export_voxel_selected(uint8_t state, melt_export_type_flags_t flags)
+{
+    return ((state & 1) && (flags & MELT_EXPORT_TYPE_SHELL)) ||
+        ((state & 2) && (flags & MELT_EXPORT_TYPE_INNER)) ||
+        ((state & 4) && (flags & MELT_EXPORT_TYPE_CLIPPED));
+}
+
+// Streams the voxels and the boxes as a binary PLY in native byte order. The grid
+// is walked twice, to count the voxels for the header and to write them. fields
+// is false when the voxel and distance fields are not complete. Each pass runs
+// over a range so that time sliced generations can spread it across steps.
+static melt_export_type_flags_t _export_flags(const melt_params_t* params, bool fields)
+{
+    return fields ? params->export_flags : params->export_flags & MELT_EXPORT_TYPE_SHELL;
+}
+
+static void _begin_export(_export_writer_t* writer, const melt_params_t* params)
+{
+    writer->callback = params->export_callback;
+    writer->user_data = params->export_user_data;
+    writer->size = 0;
+    writer->failed = false;
+}
+
+static uint32_t _export_count_voxels(const _context_t* context, const melt_params_t* params, bool fields, uint32_t begin, uint32_t end)
+{
+    const melt_export_type_flags_t flags = _export_flags(params, fields);
+    uint32_t voxel_count = 0;
+    for (uint32_t i = begin; i < end; ++i)
+        voxel_count += _export_voxel_selected(_export_voxel_state(context, i, fields), flags) ? 1 : 0;
+    return voxel_count;
+}
+
+static uint32_t _export_box_count(const _context_t* context, const melt_params_t* params, bool fields)
+{
+    return (_export_flags(params, fields) & MELT_EXPORT_TYPE_BOXES) ? context->max_extents_count : 0;
+}
+
+static void _export_header(_export_writer_t* writer, const _context_t* context, const melt_params_t* params, bool fields, uint32_t voxel_count)
+{
+    const melt_export_type_flags_t flags = _export_flags(params, fields);
+    const uint16_t byte_order = 1;
+    const bool little_endian = *(const uint8_t*)&byte_order == 1;
+    const vec3_t origin = context->origin;
+    _export_printf(writer, "ply\nformat %s 1.0\n", little_endian ? "binary_little_endian" : "binary_big_endian");
+    _export_printf(writer, "comment melt voxel_size %.9g\n", context->voxel_size);
+    _export_printf(writer, "comment melt origin %.9g %.9g %.9g\n", origin.x, origin.y, origin.z);
+    _export_printf(writer, "comment melt dimension %u %u %u\n", context->dimension.x, context->dimension.y, context->dimension.z);
+    if (fields && (flags & MELT_EXPORT_TYPE_ITERATIONS))
+        _export_printf(writer, "comment melt iteration %u\n", context->max_extents_count);
+    _export_printf(writer, "element vertex %u\nproperty float x\nproperty float y\nproperty float z\nproperty uchar state\n", voxel_count);
+    if (flags & MELT_EXPORT_TYPE_DISTANCE)
+        _export_printf(writer, "property uint distance_x\nproperty uint distance_y\nproperty uint distance_z\n");
+    _export_printf(writer, "element box %u\n", _export_box_count(context, params, fields));
+    _export_printf(writer, "property float min_x\nproperty float min_y\nproperty float min_z\n");
+    _export_printf(writer, "property float max_x\nproperty float max_y\nproperty float max_z\n");
+    _export_printf(writer, "end_header\n");
+}
+
+static void _export_voxels(_export_writer_t* writer, const _context_t* context, const melt_params_t* params, bool fields, uint32_t begin, uint32_t end)
+{
+    const melt_export_type_flags_t flags = _export_flags(params, fields);
+    const bool distance = (flags & MELT_EXPORT_TYPE_DISTANCE) != 0;
+
+    for (uint32_t i = begin; i < end && !writer->failed; ++i)
+    {
+        const uint8_t state = _export_voxel_state(context, i, fields);
+        if (!_export_voxel_selected(state, flags))
+            continue;
+
+        const vec3_t center = _voxel_center(context, _unflatten_3d(i, context->dimension));
+        _export_write(writer, &center.x, sizeof(float));
+        _export_write(writer, &center.y, sizeof(float));
+        _export_write(writer, &center.z, sizeof(float));
+        _export_write(writer, &state, sizeof(uint8_t));
+        if (distance)
+        {
+            _export_write(writer, &context->min_distance_field.x[i], sizeof(uint32_t));
+            _export_write(writer, &context->min_distance_field.y[i], sizeof(uint32_t));
+            _export_write(writer, &context->min_distance_field.z[i], sizeof(uint32_t));
+        }
+    }
+}
+
+static void _export_boxes(_export_writer_t* writer, const _context_t* context, uint32_t box_begin, uint32_t box_end)
+{
+    const vec3_t origin = context->origin;
+    const vec3_t half_voxel_extent = _vec3_init(context->voxel_size * 0.5f, context->voxel_size * 0.5f, context->voxel_size * 0.5f);
+    if (context->deterministic)
+    {
+        for (uint32_t i = box_begin; i < box_end && !writer->failed; ++i)
+        {
+            vec3_t min, max;
+            _exact_box_bounds(context, &context->max_extents[i], &min, &max);
+            _export_write(writer, &min, sizeof(vec3_t));
+            _export_write(writer, &max, sizeof(vec3_t));
+        }
+    }
+    else
+    {
+        for (uint32_t i = box_begin; i < box_end && !writer->failed; ++i)
+        {
+            const _max_extent_t* extent = &context->max_extents[i];
+            const vec3_t min = _vec3_add(_vec3_add(origin, _vec3_mulf(_uvec3_to_vec3(extent->position), context->voxel_size)), half_voxel_extent);
+            const vec3_t max = _vec3_add(min, _vec3_mulf(_uvec3_to_vec3(extent->extent), context->voxel_size));
+            _export_write(writer, &min, sizeof(vec3_t));
+            _export_write(writer, &max, sizeof(vec3_t));
+        }
+    }
+}
+
+static void _export_ply(const _context_t* context, const melt_params_t* params, bool fields)
+{
+    MELT_PROFILE_BEGIN();
+
+    _export_writer_t writer;
+    _begin_export(&writer, params);
+    _export_header(&writer, context, params, fields, _export_count_voxels(context, params, fields, 0, context->size));
+    _export_voxels(&writer, context, params, fields, 0, context->size);
+    _export_boxes(&writer, context, 0, _export_box_count(context, params, fields));
+    _export_flush(&writer);
+
+    MELT_PROFILE_END();
+}
+
+typedef enum
+{
+    _GENERATION_STATE_VOXELIZATION,
+    _GENERATION_STATE_PREPARATION,
+    _GENERATION_STATE_CLASSIFICATION,
+    _GENERATION_STATE_EXTRACTION,
+    _GENERATION_STATE_OUTPUT,
+    _GENERATION_STATE_DONE
+} _generation_state_t;
+
+// Stages of the preparation of the shell for classification, in order. The
+// shell repair stages only run when enabled by the parameters.
+typedef enum
+{
+    _PREPARATION_STAGE_CLOSE_FILL,
+    _PREPARATION_STAGE_CLOSE_GROW,
+    _PREPARATION_STAGE_CLOSE_ADD,
+    _PREPARATION_STAGE_CAP_COLUMNS,
+    _PREPARATION_STAGE_CAP_BOTTOMS,
+    _PREPARATION_STAGE_CAP_FOOTPRINTS,
+    _PREPARATION_STAGE_PLANE_CLEAR,
+    _PREPARATION_STAGE_PLANE_COUNT,
+    _PREPARATION_STAGE_PLANE_PLACE,
+    _PREPARATION_STAGE_PLANE_FILL,
+    _PREPARATION_STAGE_END
+} _preparation_stage_t;
+
+// Stages of the output, in order. A leaking shell only runs the export.
+typedef enum
+{
+    _OUTPUT_STAGE_BOXES,
+    _OUTPUT_STAGE_OCCUPANCY,
+    _OUTPUT_STAGE_EXPORT_COUNT,
+    _OUTPUT_STAGE_EXPORT_VOXELS,
+    _OUTPUT_STAGE_EXPORT_BOXES,
+    _OUTPUT_STAGE_END
+} _output_stage_t;
+
+// All the state of a generation between two steps. A step runs units of work:
+// a chunk of triangles, a chunk of voxels, lines or boxes of a preparation or
+// output stage, a pass over one slab or one box.
+struct melt_generation_t
+{
+    melt_params_t params;
+    _context_t context;
+    _generation_state_t state;
+    // Time sliced generations run the phases in small units of work, otherwise
+    // each phase runs in one go.
+    bool time_sliced;
+    bool retain_shell_mask;
+
+    // First index of the next triangle to voxelize
+    uint32_t next_index;
+
+    // Preparation or output stage in progress, the first item of its next
+    // chunk and the pass of the stages that run several times over their items
+    uint32_t stage;
+    uint32_t cursor;
+    uint32_t pass;
+    // End of the plane voxel lists placed so far on the current axis
+    uint32_t plane_offset;
+    _shell_repair_t repair;
+
+    // Classification in progress, context is NULL when there is none
+    _classification_t classification;
+    bool leaking;
+
+    uint32_t total_volume;
+    uint32_t volume;
+    float fill_pct;
+    // Largest extent found so far by the search of the current iteration, which
+    // runs over z slices from the cursor
+    _max_extent_t max_extent;
+
+    size_t output_byte_size;
+    _export_writer_t export_writer;
+    uint32_t export_voxel_count;
+
+    melt_result_t result;
+};
+
+// Monotonic when available, only differences between two calls are used.
+static uint64_t _time_us(void)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000 +
+        (uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000 / (uint64_t)frequency.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000 + (uint64_t)time.tv_nsec / 1000;
+#else
+    struct timeval time;
+    gettimeofday(&time, NULL);
+    return (uint64_t)time.tv_sec * 1000000 + (uint64_t)time.tv_usec;
+#endif
+}
+
+static void _abort_generation(melt_generation_t* generation, melt_status_t status)
+{
+    if (generation->repair.grid)
+        _end_close_shell(&generation->context, &generation->repair);
+    if (generation->repair.bottoms)
+        _end_cap_shell(&generation->context, &generation->repair);
+    if (generation->classification.context)
+        _release_classification(&generation->classification);
+    _free_context(&generation->context);
+
+    // A generation ended during the output drops what it wrote
+    melt_free_result(generation->result);
+    memset(&generation->result, 0, sizeof(melt_result_t));
+    generation->result.status = status;
+    generation->state = _GENERATION_STATE_DONE;
+}
+
+// End of the chunk of a preparation or output stage of item_count items that a
+// step runs, all of them when the generation is not time sliced.
+static uint32_t _step_item_end(const melt_generation_t* generation, uint32_t item_count, uint32_t step_item_count)
+{
+    if (!generation->time_sliced || item_count - generation->cursor <= step_item_count)
+        return item_count;
+    return generation->cursor + step_item_count;
+}
+
+// Past voxelization the shell voxels are only needed by the export and the
+// occupancy output.
+static bool _output_needs_shell_mask(const melt_params_t* params)
+{
+    return params->occupancy || (params->export_callback && (params->export_flags & MELT_EXPORT_TYPE_SHELL));
+}
+
+// The context is initialized by the caller, on the grid of the mesh or of a tile.
+static void _reset_generation(melt_generation_t* generation, const melt_params_t* params, bool time_sliced)
+{
+    memset(generation, 0, sizeof(melt_generation_t));
+    generation->params = *params;
+    generation->time_sliced = time_sliced;
+
+    generation->retain_shell_mask = _output_needs_shell_mask(params);
+}
+
+static void _begin_generation(melt_generation_t* generation, const melt_params_t* params, bool time_sliced)
+{
+    _reset_generation(generation, params, time_sliced);
+    _init_context(&generation->context, params);
+}
+
+// First stage from stage on that the parameters enable
+static uint32_t _enabled_preparation_stage(const melt_params_t* params, uint32_t stage)
+{
+    if (stage < _PREPARATION_STAGE_CAP_COLUMNS && params->closing_radius == 0)
+        stage = _PREPARATION_STAGE_CAP_COLUMNS;
+    if (stage >= _PREPARATION_STAGE_CAP_COLUMNS && stage < _PREPARATION_STAGE_PLANE_CLEAR && !params->ground_cap)
+        stage = _PREPARATION_STAGE_PLANE_CLEAR;
+    return stage;
+}
+
+static void _step_voxelization(melt_generation_t* generation)
+{
+    _context_t* context = &generation->context;
+    const melt_params_t* params = &generation->params;
+    const uint32_t index_count = params->mesh.index_count;
+
+    // Perform shell voxelization
+    if (params->reference)
+    {
+        _voxelize_shell_reference(context, &params->mesh);
+        generation->next_index = index_count;
+    }
+    else
+    {
+        const uint32_t index_end = generation->time_sliced ?
+            _uint32_t_min(generation->next_index + MELT_STEP_TRIANGLE_COUNT * 3, index_count) : index_count;
+        _voxelize_shell(context, &params->mesh, generation->next_index, index_end);
+        generation->next_index = index_end;
+    }
+
+    if (generation->next_index < index_count && !context->cancelled)
+        return;
+
+    if (context->cancelled || _report_progress(context, MELT_PHASE_VOXELIZATION, 1.0f))
+    {
+        _abort_generation(generation, MELT_STATUS_CANCELLED);
+        return;
+    }
+
+    generation->stage = _enabled_preparation_stage(params, _PREPARATION_STAGE_CLOSE_FILL);
+    generation->cursor = 0;
+    generation->state = _GENERATION_STATE_PREPARATION;
+}
+
+// Repairs the shell and generates a flat voxel list per plane (x,y), (x,z),
+// (y,z) from the voxel set, a chunk of a stage at a time.
+static void _step_preparation(melt_generation_t* generation)
+{
+    _context_t* context = &generation->context;
+    const melt_params_t* params = &generation->params;
+    _shell_repair_t* repair = &generation->repair;
+    const uint32_t begin = generation->cursor;
+    const uint32_t column_count = context->dimension.x * context->dimension.z;
+    uint32_t item_count = 0;
+    uint32_t end = 0;
+
+    switch (generation->stage)
+    {
+        case _PREPARATION_STAGE_CLOSE_FILL:
+            if (begin == 0)
+                _begin_close_shell(context, repair);
+            item_count = context->size;
+            end = _step_item_end(generation, item_count, MELT_STEP_VOXEL_COUNT);
+            _fill_close_grid(context, repair, begin, end);
+            break;
+        case _PREPARATION_STAGE_CLOSE_GROW:
+        {
+            const uint32_t axis = generation->pass % 3;
+            const uint32_t line_length = _uvec3_axis(context->dimension, axis);
+            item_count = _grow_axis_line_count(context->dimension, axis);
+            end = _step_item_end(generation, item_count, line_length < MELT_STEP_VOXEL_COUNT ? MELT_STEP_VOXEL_COUNT / line_length : 1);
+            _grow_close_grid(context, repair, params->closing_radius, generation->pass, begin, end);
+            // Dilation then erosion, along each axis
+            if (end == item_count && ++generation->pass < 6)
+            {
+                generation->cursor = 0;
+                return;
+            }
+            break;
+        }
+        case _PREPARATION_STAGE_CLOSE_ADD:
+            item_count = context->size;
+            end = _step_item_end(generation, item_count, MELT_STEP_VOXEL_COUNT);
+            _add_close_grid(context, repair, begin, end);
+            if (end == item_count)
+                _end_close_shell(context, repair);
+            break;
+        case _PREPARATION_STAGE_CAP_COLUMNS:
+            if (begin == 0)
+                _begin_cap_shell(context, repair);
+            item_count = column_count;
+            end = _step_item_end(generation, item_count, MELT_STEP_VOXEL_COUNT);
+            _init_cap_bottoms(context, repair, begin, end);
+            break;
+        case _PREPARATION_STAGE_CAP_BOTTOMS:
+            item_count = context->voxel_set_count;
+            end = _step_item_end(generation, item_count, MELT_STEP_VOXEL_COUNT);
+            _find_cap_bottoms(context, repair, begin, end);
+            break;
+        case _PREPARATION_STAGE_CAP_FOOTPRINTS:
+            item_count = column_count;
+            end = _step_item_end(generation, item_count, MELT_STEP_VOXEL_COUNT);
+            _cap_footprints(context, repair, begin, end);
+            if (end == item_count)
+                _end_cap_shell(context, repair);
+            break;
+        case _PREPARATION_STAGE_PLANE_CLEAR:
+            if (begin == 0)
+            {
+                // The reference classification reads the shell from the mask
+                if (!params->reference && !generation->retain_shell_mask)
+                    _free_shell_mask(context);
+                _begin_per_plane_voxel_set(context);
+            }
+            item_count = _per_plane_list_count(context);
+            end = _step_item_end(generation, item_count, MELT_STEP_VOXEL_COUNT);
+            _clear_per_plane_lists(context, begin, end);
+            break;
+        case _PREPARATION_STAGE_PLANE_COUNT:
+            item_count = context->voxel_set_count;
+            end = _step_item_end(generation, item_count, MELT_STEP_VOXEL_COUNT);
+            _count_per_plane_voxels(context, begin, end);
+            break;
+        case _PREPARATION_STAGE_PLANE_PLACE:
+            item_count = _per_plane_list_count(context);
+            end = _step_item_end(generation, item_count, MELT_STEP_VOXEL_COUNT);
+            _place_per_plane_lists(context, begin, end, &generation->plane_offset);
+            break;
+        case _PREPARATION_STAGE_PLANE_FILL:
+            item_count = context->voxel_set_count;
+            end = _step_item_end(generation, item_count, MELT_STEP_VOXEL_COUNT);
+            _fill_per_plane_voxel_set(context, begin, end);
+            break;
+        default:
+            break;
+    }
+
+    generation->cursor = end;
+    if (end < item_count)
+        return;
+
+    generation->stage = _enabled_preparation_stage(params, generation->stage + 1);
+    generation->cursor = 0;
+    if (generation->stage != _PREPARATION_STAGE_END)
+        return;
+
+    _free_voxel_set(context);
+
+    // The minimum distance field is a data structure representing, for each voxel,
+    // the minimum distance that we can go in each of the positive directions x, y,
+    // z until we collide with a shell voxel. The voxel field is a data structure
+    // representing the state of the voxels. The clip status is a representation of
+    // whether a voxel is in the clip state, whether a voxel can 'see' a voxel in
+    // each of the directions +x,-x,+y,-y,+z,-z, and whether the voxel is an 'inner'
+    // voxel (contained within the shell voxels).
+
+    // Generate the minimum distance field, and voxel status from the initial shell.
+    // Approximate the volume of the mesh by the number of voxels that can fit within,
+    // each inner voxel adds one unit to the volume.
+
+    _alloc_fields(context);
+
+    generation->state = _GENERATION_STATE_CLASSIFICATION;
+}
+
+static void _begin_output(melt_generation_t* generation);
+
+static void _step_classification(melt_generation_t* generation)
+{
+    _context_t* context = &generation->context;
+    const melt_params_t* params = &generation->params;
+
+    bool watertight;
+    if (params->reference)
+    {
+        watertight = _classify_voxels_reference(context, &generation->total_volume);
+        if (!generation->retain_shell_mask)
+            _free_shell_mask(context);
+    }
+    else if (!generation->time_sliced)
+    {
+        watertight = _classify_voxels(context, &generation->total_volume);
+    }
+    else
+    {
+        // One slab per thread at a time
+        _classification_t* classification = &generation->classification;
+        if (!classification->context)
+            _begin_classification(classification, context, true);
+        if (_classify_slabs(classification, classification->thread_count))
+            return;
+        watertight = _end_classification(classification, &generation->total_volume);
+        classification->context = NULL;
+    }
+
+    _release_per_plane_voxel_set_to_max_extents(context);
+
+    if (context->cancelled || _report_progress(context, MELT_PHASE_CLASSIFICATION, 1.0f))
+    {
+        _abort_generation(generation, MELT_STATUS_CANCELLED);
+        return;
+    }
+
+    if (!watertight)
+    {
+        // The output only exports the shell
+        generation->leaking = true;
+        _begin_output(generation);
+        return;
+    }
+
+    _debug_validate_min_distance_field(context);
+    MELT_ASSERT(context->kernels.count_inner_voxels(context->voxel_field, context->size) == generation->total_volume);
+
+    generation->cursor = 0;
+    generation->state = _GENERATION_STATE_EXTRACTION;
+}
+
+// Lower corner of the first voxel of the grid
+static vec3_t _first_voxel_min(const _context_t* context)
+{
+    if (context->deterministic)
+    {
+        const svec3_t cell = context->origin_cell;
+        return _vec3_init(
+            _exact_half_voxel_coordinate(2 * cell.x + 1, context->voxel_size),
+            _exact_half_voxel_coordinate(2 * cell.y + 1, context->voxel_size),
+            _exact_half_voxel_coordinate(2 * cell.z + 1, context->voxel_size));
+    }
+    const float half_voxel_size = context->voxel_size * 0.5f;
+    return _vec3_add(context->origin, _vec3_init(half_voxel_size, half_voxel_size, half_voxel_size));
+}
+
+static void _alloc_occupancy(const _context_t* context, melt_occupancy_t* occupancy)
+{
+    const uint32_t word_count = (context->size + 31) / 32;
+
+    occupancy->min = _first_voxel_min(context);
+    occupancy->voxel_size = context->voxel_size;
+    occupancy->dimension_x = context->dimension.x;
+    occupancy->dimension_y = context->dimension.y;
+    occupancy->dimension_z = context->dimension.z;
+    occupancy->shell = MELT_MALLOC(uint32_t, word_count);
+    occupancy->inner = MELT_MALLOC(uint32_t, word_count);
+}
+
+// Fills the words in [word_begin, word_end) of both masks.
+static void _fill_occupancy(const _context_t* context, melt_occupancy_t* occupancy, uint32_t word_begin, uint32_t word_end)
+{
+    const uint32_t word_count = (context->size + 31) / 32;
+    memcpy(occupancy->shell + word_begin, context->shell_mask + word_begin, (word_end - word_begin) * sizeof(uint32_t));
+    memset(occupancy->inner + word_begin, 0, (word_end - word_begin) * sizeof(uint32_t));
+
+    const uint32_t end = word_end < word_count ? word_end * 32 : context->size;
+    for (uint32_t i = word_begin * 32; i < end; ++i)
+    {
+        if (context->voxel_field[i].inner)
+            occupancy->inner[i >> 5] |= 1u << (i & 31);
+    }
+}
+
+// Returns the size of the mesh, the boxes are written by _add_max_extents_to_mesh.
+static size_t _alloc_mesh(const _context_t* context, const melt_params_t* params, melt_mesh_t* mesh)
+{
+    const uint32_t vertex_count = _vertex_count_per_aabb() * context->max_extents_count;
+    const uint32_t index_count = _index_count_per_aabb(params->box_type_flags) * context->max_extents_count;
+
+    mesh->vertices = MELT_MALLOC(vec3_t, vertex_count);
+    size_t index_byte_size;
+    if (params->index_width == MELT_INDEX_WIDTH_32 || vertex_count > 65536)
+    {
+        mesh->indices32 = MELT_MALLOC(uint32_t, index_count);
+        index_byte_size = index_count * sizeof(uint32_t);
+    }
+    else
+    {
+        mesh->indices = MELT_MALLOC(uint16_t, index_count);
+        index_byte_size = index_count * sizeof(uint16_t);
+    }
+
+    return vertex_count * sizeof(vec3_t) + index_byte_size;
+}
+
+// Boxes are stored as a center and a half extent. Quantized boxes are exact:
+// in half voxel units from the center of the first voxel, the center of a box
+// is 2 * position + extent and its half extent is extent.
+static inline void _store_instance_box(float* box, vec3_t center, vec3_t half_extent)
+{
+    box[0] = center.x;
+    box[1] = center.y;
+    box[2] = center.z;
+    box[3] = half_extent.x;
+    box[4] = half_extent.y;
+    box[5] = half_extent.z;
+}
+
+// Returns the size of the instances, the boxes are written by _store_instances.
+static size_t _alloc_instances(const _context_t* context, const melt_params_t* params, melt_instances_t* instances, uint32_t* face_offsets)
+{
+    _box_pattern_t pattern;
+    _init_box_pattern(&pattern, params->box_type_flags);
+    if (params->face_buckets)
+        _sort_box_pattern_by_face(&pattern, face_offsets);
+
+    instances->cube.vertex_count = MELT_ARRAY_LENGTH(_voxel_cube_vertices);
+    instances->cube.vertices = MELT_MALLOC(vec3_t, instances->cube.vertex_count);
+    memcpy(instances->cube.vertices, _voxel_cube_vertices, sizeof(_voxel_cube_vertices));
+    instances->cube.index_count = pattern.index_count;
+    instances->cube.indices = MELT_MALLOC(uint16_t, pattern.index_count);
+    memcpy(instances->cube.indices, pattern.indices, pattern.index_count * sizeof(uint16_t));
+
+    const uint32_t count = context->max_extents_count;
+    instances->count = count;
+    instances->offset = _first_voxel_min(context);
+    instances->scale = context->voxel_size * 0.5f;
+
+    // Quantized centers go up to twice the dimension
+    const uvec3_t dimension = context->dimension;
+    const bool quantized = params->instance_format == MELT_INSTANCE_FORMAT_QUANTIZED &&
+        dimension.x <= 32767 && dimension.y <= 32767 && dimension.z <= 32767;
+
+    size_t box_byte_size;
+    if (quantized)
+    {
+        instances->quantized_boxes = MELT_MALLOC(uint16_t, (size_t)count * 6);
+        box_byte_size = (size_t)count * 6 * sizeof(uint16_t);
+    }
+    else
+    {
+        instances->boxes = MELT_MALLOC(float, (size_t)count * 6);
+        box_byte_size = (size_t)count * 6 * sizeof(float);
+    }
+
+    return sizeof(_voxel_cube_vertices) + pattern.index_count * sizeof(uint16_t) + box_byte_size;
+}
+
+// Writes the boxes in [box_begin, box_end) to instances sized for all of them,
+// in the format _alloc_instances picked.
+static void _store_instances(const _context_t* context, melt_instances_t* instances, uint32_t box_begin, uint32_t box_end)
+{
+    const float voxel_size = context->voxel_size;
+    const vec3_t half_voxel_extent = _vec3_init(voxel_size * 0.5f, voxel_size * 0.5f, voxel_size * 0.5f);
+
+    if (instances->quantized_boxes)
+    {
+        for (uint32_t i = box_begin; i < box_end; ++i)
+        {
+            const _max_extent_t* extent = &context->max_extents[i];
+            uint16_t* box = instances->quantized_boxes + (size_t)i * 6;
+            box[0] = (uint16_t)(2 * extent->position.x + extent->extent.x);
+            box[1] = (uint16_t)(2 * extent->position.y + extent->extent.y);
+            box[2] = (uint16_t)(2 * extent->position.z + extent->extent.z);
+            box[3] = (uint16_t)extent->extent.x;
+            box[4] = (uint16_t)extent->extent.y;
+            box[5] = (uint16_t)extent->extent.z;
+        }
+    }
+    else if (context->deterministic)
+    {
+        // Same computation as _emit_box_vertices, the corners of an instance are
+        // those of the mesh output. The mapping is resolved before the loops.
+        const svec3_t cell = context->origin_cell;
+        for (uint32_t i = box_begin; i < box_end; ++i)
+        {
+            const _max_extent_t* extent = &context->max_extents[i];
+            const vec3_t center = _vec3_init(
+                _exact_half_voxel_coordinate(2 * (cell.x + (int32_t)extent->position.x) + (int32_t)extent->extent.x + 1, voxel_size),
+                _exact_half_voxel_coordinate(2 * (cell.y + (int32_t)extent->position.y) + (int32_t)extent->extent.y + 1, voxel_size),
+                _exact_half_voxel_coordinate(2 * (cell.z + (int32_t)extent->position.z) + (int32_t)extent->extent.z + 1, voxel_size));
+            _store_instance_box(instances->boxes + (size_t)i * 6, center, _vec3_mul(_uvec3_to_vec3(extent->extent), half_voxel_extent));
+        }
+    }
+    else
+    {
+        const vec3_t voxel_extent = _vec3_init(voxel_size, voxel_size, voxel_size);
+        for (uint32_t i = box_begin; i < box_end; ++i)
+        {
+            const _max_extent_t* extent = &context->max_extents[i];
+            const vec3_t half_extent = _vec3_mul(_uvec3_to_vec3(extent->extent), half_voxel_extent);
+            const vec3_t voxel_position = _vec3_mul(_uvec3_to_vec3(extent->position), voxel_extent);
+            const vec3_t aabb_center = _vec3_add(context->origin, _vec3_add(voxel_position, half_extent));
+            _store_instance_box(instances->boxes + (size_t)i * 6, _vec3_add(aabb_center, half_voxel_extent), half_extent);
+        }
+    }
+}
+
+// First stage from stage on that the parameters and the classification enable
+static uint32_t _enabled_output_stage(const melt_generation_t* generation, uint32_t stage)
+{
+    const melt_params_t* params = &generation->params;
+    if (stage == _OUTPUT_STAGE_BOXES && generation->leaking)
+        ++stage;
+    if (stage == _OUTPUT_STAGE_OCCUPANCY && (generation->leaking || !params->occupancy))
+        ++stage;
+    if (stage < _OUTPUT_STAGE_END && stage >= _OUTPUT_STAGE_EXPORT_COUNT && !params->export_callback)
+        stage = _OUTPUT_STAGE_END;
+    return stage;
+}
+
+static void _end_output(melt_generation_t* generation)
+{
+    _context_t* context = &generation->context;
+    melt_result_t* result = &generation->result;
+
+    if (generation->leaking)
+    {
+        _abort_generation(generation, MELT_STATUS_NOT_WATERTIGHT);
+        return;
+    }
+
+    // The output outlives the context, it is accounted for in the peak only.
+    if (context->memory_usage + generation->output_byte_size > context->memory_peak)
+        context->memory_peak = context->memory_usage + generation->output_byte_size;
+    result->stats.peak_memory_bytes = context->memory_peak;
+    result->stats.scratch_bytes = context->scratch_bytes;
+
+    _free_context(context);
+
+    generation->state = _GENERATION_STATE_DONE;
+}
+
+static void _begin_output(melt_generation_t* generation)
+{
+    if (!generation->leaking)
+        _debug_validate_max_extents(&generation->context, generation->context.max_extents, generation->context.max_extents_count);
+
+    generation->stage = _enabled_output_stage(generation, _OUTPUT_STAGE_BOXES);
+    generation->cursor = 0;
+    generation->state = _GENERATION_STATE_OUTPUT;
+    if (generation->stage == _OUTPUT_STAGE_END)
+        _end_output(generation);
+}
+
+// Writes the boxes, the occupancy and the export, a chunk of a stage at a time.
+// The export of a leaking shell only has the shell.
+static void _step_output(melt_generation_t* generation)
+{
+    _context_t* context = &generation->context;
+    const melt_params_t* params = &generation->params;
+    melt_result_t* result = &generation->result;
+    _export_writer_t* writer = &generation->export_writer;
+    const bool fields = !generation->leaking;
+    const uint32_t begin = generation->cursor;
+    uint32_t item_count = 0;
+    uint32_t end = 0;
+
+    switch (generation->stage)
+    {
+        case _OUTPUT_STAGE_BOXES:
+            if (begin == 0)
+            {
+                if (params->instance_format != MELT_INSTANCE_FORMAT_NONE)
+                    generation->output_byte_size = _alloc_instances(context, params, &result->instances, result->face_offsets);
+                else
+                    generation->output_byte_size = _alloc_mesh(context, params, &result->mesh);
+            }
+            item_count = context->max_extents_count;
+            end = _step_item_end(generation, item_count, MELT_STEP_BOX_COUNT);
+            if (params->instance_format != MELT_INSTANCE_FORMAT_NONE)
+                _store_instances(context, &result->instances, begin, end);
+            else
+                _add_max_extents_to_mesh(context, &result->mesh, params->box_type_flags, params->face_buckets ? result->face_offsets : NULL, begin, end);
+            break;
+        case _OUTPUT_STAGE_OCCUPANCY:
+            if (begin == 0)
+            {
+                _alloc_occupancy(context, &result->occupancy);
+                generation->output_byte_size += (size_t)(context->size + 31) / 32 * 2 * sizeof(uint32_t);
+            }
+            item_count = (context->size + 31) / 32;
+            end = _step_item_end(generation, item_count, MELT_STEP_VOXEL_COUNT / 32);
+            _fill_occupancy(context, &result->occupancy, begin, end);
+            break;
+        case _OUTPUT_STAGE_EXPORT_COUNT:
+            if (begin == 0)
+            {
+                _begin_export(writer, params);
+                generation->export_voxel_count = 0;
+            }
+            item_count = context->size;
+            end = _step_item_end(generation, item_count, MELT_STEP_VOXEL_COUNT);
+            generation->export_voxel_count += _export_count_voxels(context, params, fields, begin, end);
+            if (end == item_count)
+                _export_header(writer, context, params, fields, generation->export_voxel_count);
+            break;
+        case _OUTPUT_STAGE_EXPORT_VOXELS:
+            item_count = context->size;
+            end = _step_item_end(generation, item_count, MELT_STEP_VOXEL_COUNT);
+            _export_voxels(writer, context, params, fields, begin, end);
+            break;
+        case _OUTPUT_STAGE_EXPORT_BOXES:
+            item_count = _export_box_count(context, params, fields);
+            end = _step_item_end(generation, item_count, MELT_STEP_BOX_COUNT);
+            _export_boxes(writer, context, begin, end);
+            if (end == item_count)
+                _export_flush(writer);
+            break;
+        default:
+            break;
+    }
+
+    generation->cursor = end;
+    if (end < item_count)
+        return;
+
+    generation->stage = _enabled_output_stage(generation, generation->stage + 1);
+    generation->cursor = 0;
+    if (generation->stage == _OUTPUT_STAGE_END)
+        _end_output(generation);
+}
+
+// Deterministic generations compare whole voxel counts instead of accumulating
+// the filled fraction.
+static bool _extraction_filled(const melt_generation_t* generation)
+{
+    if (generation->params.deterministic)
+        return (double)generation->volume >= (double)generation->params.fill_pct * generation->total_volume;
+    return generation->fill_pct >= generation->params.fill_pct;
+}
+
+// One iteration to find an extent does the following:
+// . Get the extent that maximizes the volume considering the minimum distance
+//    field, time sliced generations search a few z slices per step
+// . Clip the max extent found to the set of inner voxels
+// . Update the minimum distance field by adjusting the distances on the set
+//    of inner voxels. This is done by extending the extent cube to infinity
+//    on each of the axes +x, +y, +z
+static void _step_extraction(melt_generation_t* generation)
+{
+    _context_t* context = &generation->context;
+    const melt_params_t* params = &generation->params;
+
+    if (!_extraction_filled(generation) && generation->volume != generation->total_volume)
+    {
+        if (generation->cursor == 0)
+        {
+            if (_report_progress(context, MELT_PHASE_EXTRACTION, generation->fill_pct / params->fill_pct))
+            {
+                _abort_generation(generation, MELT_STATUS_CANCELLED);
+                return;
+            }
+
+            if (params->export_callback && (params->export_flags & MELT_EXPORT_TYPE_ITERATIONS))
+                _export_ply(context, params, true);
+
+            memset(&generation->max_extent, 0, sizeof(_max_extent_t));
+        }
+
+        if (params->reference)
+        {
+            generation->max_extent = _get_max_extent_reference(context);
+        }
+        else
+        {
+            const uvec3_t dimension = context->dimension;
+            const uint32_t slice_size = dimension.x * dimension.y;
+            const uint32_t end = _step_item_end(generation, dimension.z, slice_size < MELT_STEP_VOXEL_COUNT ? MELT_STEP_VOXEL_COUNT / slice_size : 1);
+            _find_max_extent(context, generation->cursor * slice_size, end * slice_size, &generation->max_extent);
+            generation->cursor = end;
+            if (end < dimension.z)
+                return;
+        }
+        generation->cursor = 0;
+
+        const _max_extent_t max_extent = generation->max_extent;
+
+        _clip_voxel_field(context, max_extent.position, max_extent.extent);
+
+        // The reference walks the voxel field instead of keeping distances
+        if (!params->reference)
+        {
+            _update_min_distance_field(context, max_extent.position, max_extent.extent);
+
+            _debug_validate_min_distance_field(context);
+        }
+
+        _push_max_extent(context, &max_extent);
+
+        generation->fill_pct += (float)max_extent.volume / generation->total_volume;
+        generation->volume += max_extent.volume;
+
+        context->progress.box_count = context->max_extents_count;
+        context->progress.fill_pct = generation->fill_pct;
+        return;
+    }
+
+    _report_progress(context, MELT_PHASE_EXTRACTION, 1.0f);
+
+    _begin_output(generation);
+}
+
+static void _step_generation_unit(melt_generation_t* generation)
+{
+    switch (generation->state)
+    {
+        case _GENERATION_STATE_VOXELIZATION:
+            _step_voxelization(generation);
+            break;
+        case _GENERATION_STATE_PREPARATION:
+            _step_preparation(generation);
+            break;
+        case _GENERATION_STATE_CLASSIFICATION:
+            _step_classification(generation);
+            break;
+        case _GENERATION_STATE_EXTRACTION:
+            _step_extraction(generation);
+            break;
+        case _GENERATION_STATE_OUTPUT:
+            _step_output(generation);
+            break;
+        default:
+            break;
+    }
+}
+
+// Runs units of work until the generation is done or the budget has elapsed,
+// a budget of 0 runs it to completion.
+static bool _step_generation(melt_generation_t* generation, uint32_t budget_us)
+{
+    const uint64_t start_us = budget_us > 0 ? _time_us() : 0;
+
+    while (generation->state != _GENERATION_STATE_DONE)
+    {
+        _step_generation_unit(generation);
+
+        if (budget_us > 0 && _time_us() - start_us >= budget_us)
+            break;
+    }
+
+    return generation->state == _GENERATION_STATE_DONE;
+}
+
+static int _end_generation(melt_generation_t* generation, melt_result_t* out_result)
+{
+    if (generation->state != _GENERATION_STATE_DONE)
+        _abort_generation(generation, MELT_STATUS_CANCELLED);
+
+    *out_result = generation->result;
+    return out_result->status == MELT_STATUS_SUCCESS;
+}
+
+melt_generation_t* melt_begin_generation(melt_params_t params)
+{
+    MELT_ASSERT(params._start_canary == 0 && params._end_canary == 0 && "Make sure to memset params to 0 before use");
+
+    melt_generation_t* generation = MELT_MALLOC(melt_generation_t, 1);
+    _begin_generation(generation, &params, true);
+    return generation;
+}
+
+int melt_step(melt_generation_t* generation, uint32_t budget_us)
+{
+    return _step_generation(generation, budget_us) ? 1 : 0;
+}
+
+int melt_end_generation(melt_generation_t* generation, melt_result_t* out_result)
+{
+    const int generated = _end_generation(generation, out_result);
+    MELT_FREE(generation);
+    return generated;
+}
+
+int melt_generate_occluder(melt_params_t params, melt_result_t* out_result)
+{
+    MELT_ASSERT(params._start_canary == 0 && params._end_canary == 0 && "Make sure to memset params to 0 before use");
+
+#if MELT_STACK_SCRATCH_SIZE > 0
+    uint64_t stack_scratch[MELT_STACK_SCRATCH_SIZE / sizeof(uint64_t)];
+    if (!params.scratch_buffer)
+    {
+        params.scratch_buffer = stack_scratch;
+        params.scratch_buffer_size = sizeof(stack_scratch);
+    }
+#endif
+
+    melt_generation_t generation;
+    _begin_generation(&generation, &params, false);
+    _step_generation(&generation, 0);
+    return _end_generation(&generation, out_result);
+}
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    vec3_t origin;
+    float voxel_size;
+    svec3_t origin_cell;
+    uint32_t deterministic;
+    uvec3_t dimension;
+    uint32_t total_volume;
+} _classification_header_t;
+
+// Snapshot of the context at the end of the classification. The serialized
+// form is the header followed by the shell mask, the voxel field and the
+// distance planes.
+struct melt_classification_t
+{
+    _classification_header_t header;
+    uint32_t* shell_mask;
+    _voxel_status_t* voxel_field;
+    _min_distance_field_t min_distance_field;
+};
+
+static size_t _classification_field_sizes(const _classification_header_t* header, size_t* out_shell_mask_size, size_t* out_voxel_field_size)
+{
+    const size_t size = (size_t)header->dimension.x * header->dimension.y * header->dimension.z;
+    *out_shell_mask_size = (size + 31) / 32 * sizeof(uint32_t);
+    *out_voxel_field_size = size * sizeof(_voxel_status_t);
+    return size * sizeof(uint32_t);
+}
+
+static melt_classification_t* _alloc_classification(const _classification_header_t* header)
+{
+    size_t shell_mask_size;
+    size_t voxel_field_size;
+    const size_t distance_size = _classification_field_sizes(header, &shell_mask_size, &voxel_field_size);
+
+    melt_classification_t* classification = MELT_MALLOC(melt_classification_t, 1);
+    classification->header = *header;
+    classification->shell_mask = MELT_MALLOC(uint32_t, (shell_mask_size / sizeof(uint32_t)));
+    classification->voxel_field = MELT_MALLOC(_voxel_status_t, (voxel_field_size / sizeof(_voxel_status_t)));
+    classification->min_distance_field.x = MELT_MALLOC(uint32_t, (distance_size / sizeof(uint32_t)));
+    classification->min_distance_field.y = MELT_MALLOC(uint32_t, (distance_size / sizeof(uint32_t)));
+    classification->min_distance_field.z = MELT_MALLOC(uint32_t, (distance_size / sizeof(uint32_t)));
+    return classification;
+}
+
+melt_classification_t* melt_classify(melt_params_t params, melt_status_t* out_status)
+{
+    MELT_ASSERT(params._start_canary == 0 && params._end_canary == 0 && "Make sure to memset params to 0 before use");
+
+#if MELT_STACK_SCRATCH_SIZE > 0
+    uint64_t stack_scratch[MELT_STACK_SCRATCH_SIZE / sizeof(uint64_t)];
+    if (!params.scratch_buffer)
+    {
+        params.scratch_buffer = stack_scratch;
+        params.scratch_buffer_size = sizeof(stack_scratch);
+    }
+#endif
+
+    melt_generation_t generation;
+    _begin_generation(&generation, &params, false);
+    generation.retain_shell_mask = true;
+
+    while (generation.state < _GENERATION_STATE_EXTRACTION)
+        _step_generation_unit(&generation);
+
+    // A leaking shell still runs its export
+    if (generation.state != _GENERATION_STATE_EXTRACTION)
+    {
+        _step_generation(&generation, 0);
+        *out_status = generation.result.status;
+        return NULL;
+    }
+
+    const _context_t* context = &generation.context;
+    _classification_header_t header;
+    memset(&header, 0, sizeof(_classification_header_t));
+    header.magic = MELT_CLASSIFICATION_MAGIC;
+    header.version = MELT_CLASSIFICATION_VERSION;
+    header.origin = context->origin;
+    header.voxel_size = context->voxel_size;
+    header.origin_cell = context->origin_cell;
+    header.deterministic = context->deterministic ? 1 : 0;
+    header.dimension = context->dimension;
+    header.total_volume = generation.total_volume;
+
+    size_t shell_mask_size;
+    size_t voxel_field_size;
+    const size_t distance_size = _classification_field_sizes(&header, &shell_mask_size, &voxel_field_size);
+
+    melt_classification_t* classification = _alloc_classification(&header);
+    memcpy(classification->shell_mask, context->shell_mask, shell_mask_size);
+    memcpy(classification->voxel_field, context->voxel_field, voxel_field_size);
+    memcpy(classification->min_distance_field.x, context->min_distance_field.x, distance_size);
+    memcpy(classification->min_distance_field.y, context->min_distance_field.y, distance_size);
+    memcpy(classification->min_distance_field.z, context->min_distance_field.z, distance_size);
+
+    _free_context(&generation.context);
+
+    *out_status = MELT_STATUS_SUCCESS;
+    return classification;
+}
+
+int melt_extract_occluder(const melt_classification_t* classification, melt_params_t params, melt_result_t* out_result)
+{
+    MELT_ASSERT(params._start_canary == 0 && params._end_canary == 0 && "Make sure to memset params to 0 before use");
+
+#if MELT_STACK_SCRATCH_SIZE > 0
+    uint64_t stack_scratch[MELT_STACK_SCRATCH_SIZE / sizeof(uint64_t)];
+    if (!params.scratch_buffer)
+    {
+        params.scratch_buffer = stack_scratch;
+        params.scratch_buffer_size = sizeof(stack_scratch);
+    }
+#endif
+
+    const _classification_header_t* header = &classification->header;
+    params.voxel_size = header->voxel_size;
+    params.deterministic = (int32_t)header->deterministic;
+
+    melt_generation_t generation;
+    memset(&generation, 0, sizeof(melt_generation_t));
+    generation.params = params;
+    generation.total_volume = header->total_volume;
+    generation.state = _GENERATION_STATE_EXTRACTION;
+
+    // Restores the fields as they were at the end of the classification
+    _context_t* context = &generation.context;
+    _init_context_grid(context, &params, header->origin, header->origin_cell, header->dimension);
+
+    size_t shell_mask_size;
+    size_t voxel_field_size;
+    const size_t distance_size = _classification_field_sizes(header, &shell_mask_size, &voxel_field_size);
+    if (_output_needs_shell_mask(&params))
+        memcpy(context->shell_mask, classification->shell_mask, shell_mask_size);
+    else
+        _free_shell_mask(context);
+
+    _alloc_fields(context);
+    memcpy(context->voxel_field, classification->voxel_field, voxel_field_size);
+    memcpy(context->min_distance_field.x, classification->min_distance_field.x, distance_size);
+    memcpy(context->min_distance_field.y, classification->min_distance_field.y, distance_size);
+    memcpy(context->min_distance_field.z, classification->min_distance_field.z, distance_size);
+
+    _step_generation(&generation, 0);
+    return _end_generation(&generation, out_result);
+}
+
+void melt_destroy_classification(melt_classification_t* classification)
+{
+    MELT_FREE(classification->shell_mask);
+    MELT_FREE(classification->voxel_field);
+    MELT_FREE(classification->min_distance_field.x);
+    MELT_FREE(classification->min_distance_field.y);
+    MELT_FREE(classification->min_distance_field.z);
+    MELT_FREE(classification);
+}
+
+size_t melt_get_classification_serialized_size(const melt_classification_t* classification)
+{
+    size_t shell_mask_size;
+    size_t voxel_field_size;
+    const size_t distance_size = _classification_field_sizes(&classification->header, &shell_mask_size, &voxel_field_size);
+    return sizeof(_classification_header_t) + shell_mask_size + voxel_field_size + distance_size * 3;
+}
+
+void melt_serialize_classification(const melt_classification_t* classification, void* buffer)
+{
+    size_t shell_mask_size;
+    size_t voxel_field_size;
+    const size_t distance_size = _classification_field_sizes(&classification->header, &shell_mask_size, &voxel_field_size);
+
+    uint8_t* bytes = (uint8_t*)buffer;
+    memcpy(bytes, &classification->header, sizeof(_classification_header_t));
+    bytes += sizeof(_classification_header_t);
+    memcpy(bytes, classification->shell_mask, shell_mask_size);
+    bytes += shell_mask_size;
+    memcpy(bytes, classification->voxel_field, voxel_field_size);
+    bytes += voxel_field_size;
+    memcpy(bytes, classification->min_distance_field.x, distance_size);
+    bytes += distance_size;
+    memcpy(bytes, classification->min_distance_field.y, distance_size);
+    bytes += distance_size;
+    memcpy(bytes, classification->min_distance_field.z, distance_size);
+}
+
+melt_classification_t* melt_deserialize_classification(const void* data, size_t byte_size)
+{
+    _classification_header_t header;
+    if (byte_size < sizeof(_classification_header_t))
+        return NULL;
+    memcpy(&header, data, sizeof(_classification_header_t));
+    if (header.magic != MELT_CLASSIFICATION_MAGIC || header.version != MELT_CLASSIFICATION_VERSION ||
+        !(header.voxel_size > 0.0f) || header.dimension.x == 0 || header.dimension.y == 0 || header.dimension.z == 0)
+        return NULL;
+
+    size_t shell_mask_size;
+    size_t voxel_field_size;
+    const size_t distance_size = _classification_field_sizes(&header, &shell_mask_size, &voxel_field_size);
+    if (byte_size != sizeof(_classification_header_t) + shell_mask_size + voxel_field_size + distance_size * 3)
+        return NULL;
+
+    melt_classification_t* classification = _alloc_classification(&header);
+    const uint8_t* bytes = (const uint8_t*)data + sizeof(_classification_header_t);
+    memcpy(classification->shell_mask, bytes, shell_mask_size);
+    bytes += shell_mask_size;
+    memcpy(classification->voxel_field, bytes, voxel_field_size);
+    bytes += voxel_field_size;
+    memcpy(classification->min_distance_field.x, bytes, distance_size);
+    bytes += distance_size;
+    memcpy(classification->min_distance_field.y, bytes, distance_size);
+    bytes += distance_size;
+    memcpy(classification->min_distance_field.z, bytes, distance_size);
+    return classification;
+}
+
+// The tile at tile coordinates t covers the voxels t * tile_size to
+// (t + 1) * tile_size of the grid along each axis, clamped to the grid.
+static void _tile_region(const melt_tiling_t* tiling, uint32_t tile, uvec3_t* out_min, uvec3_t* out_size)
+{
+    const uint32_t coordinates[3] = {
+        tile % tiling->tile_count[0],
+        tile / tiling->tile_count[0] % tiling->tile_count[1],
+        tile / (tiling->tile_count[0] * tiling->tile_count[1])
+    };
+    uint32_t min[3];
+    uint32_t size[3];
+    for (uint32_t axis = 0; axis < 3; ++axis)
+    {
+        min[axis] = coordinates[axis] * tiling->tile_size;
+        size[axis] = _uint32_t_min(tiling->tile_size, tiling->dimension[axis] - min[axis]);
+    }
+    *out_min = _uvec3_init(min[0], min[1], min[2]);
+    *out_size = _uvec3_init(size[0], size[1], size[2]);
+}
+
+// The grid of a tile has a voxel of margin on each side, see _apply_tile_lines.
+static uvec3_t _tile_grid(const melt_tiling_t* tiling, uint32_t tile, float voxel_size, vec3_t* out_origin, svec3_t* out_origin_cell)
+{
+    uvec3_t min;
+    uvec3_t size;
+    _tile_region(tiling, tile, &min, &size);
+
+    *out_origin_cell = _svec3_init(
+        tiling->origin_cell[0] + (int32_t)min.x - 1,
+        tiling->origin_cell[1] + (int32_t)min.y - 1,
+        tiling->origin_cell[2] + (int32_t)min.z - 1);
+    *out_origin = _vec3_init((float)out_origin_cell->x * voxel_size,
+        (float)out_origin_cell->y * voxel_size, (float)out_origin_cell->z * voxel_size);
+    return _uvec3_init(size.x + 2, size.y + 2, size.z + 2);
+}
+
+// Lines along x come first, then along y and z. Line (a, b) along an axis, with
+// a and b the coordinates on the two other axes in order, is at a + b * size a.
+static uint32_t _tile_line_offset(uvec3_t size, uint32_t axis)
+{
+    if (axis == 0)
+        return 0;
+    if (axis == 1)
+        return size.y * size.z;
+    return size.y * size.z + size.x * size.z;
+}
+
+static void _tile_params(melt_params_t* params)
+{
+    params->deterministic = 1;
+    params->reference = 0;
+    params->closing_radius = 0;
+    params->ground_cap = 0;
+}
+
+// Watertightness scan of the lines of a tile, along +x, +y and +z without the
+// margin, stitched across tiles the way _end_classification stitches slabs.
+static void _scan_tile_lines(const _context_t* context, uint8_t* out_states)
+{
+    const uvec3_t dimension = context->dimension;
+    const uvec3_t size = _uvec3_init(dimension.x - 2, dimension.y - 2, dimension.z - 2);
+    uint8_t* states_x = out_states + _tile_line_offset(size, 0);
+    uint8_t* states_y = out_states + _tile_line_offset(size, 1);
+    uint8_t* states_z = out_states + _tile_line_offset(size, 2);
+    memset(out_states, 0, _tile_line_offset(size, 2) + size.x * size.y);
+
+    for (uint32_t z = 1; z <= size.z; ++z)
+    {
+        for (uint32_t y = 1; y <= size.y; ++y)
+        {
+            for (uint32_t x = 1; x <= size.x; ++x)
+            {
+                const uint32_t index = _flatten_3d(_uvec3_init(x, y, z), dimension);
+                const bool shell = _shell_voxel(context, index);
+                const bool inner = context->voxel_field[index].inner;
+
+                // Leaks within the tile already failed the classification
+                _scan_voxel(&states_x[(y - 1) + (z - 1) * size.y], shell, inner);
+                _scan_voxel(&states_y[(x - 1) + (z - 1) * size.x], shell, inner);
+                _scan_voxel(&states_z[(x - 1) + (y - 1) * size.x], shell, inner);
+            }
+        }
+    }
+}
+
+void melt_plan_tiling(melt_params_t params, uint32_t tile_size, melt_tiling_t* out_tiling)
+{
+    MELT_ASSERT(tile_size > 0);
+
+    svec3_t origin_cell;
+    const uvec3_t dimension = _grid_dimension_exact(&params, &origin_cell);
+
+    memset(out_tiling, 0, sizeof(melt_tiling_t));
+    out_tiling->tile_size = tile_size;
+    for (uint32_t axis = 0; axis < 3; ++axis)
+    {
+        out_tiling->origin_cell[axis] = (&origin_cell.x)[axis];
+        out_tiling->dimension[axis] = _uvec3_axis(dimension, axis);
+        out_tiling->tile_count[axis] = (out_tiling->dimension[axis] + tile_size - 1) / tile_size;
+    }
+}
+
+uint32_t melt_get_tile_count(const melt_tiling_t* tiling)
+{
+    return tiling->tile_count[0] * tiling->tile_count[1] * tiling->tile_count[2];
+}
+
+uint32_t melt_get_tile_line_count(const melt_tiling_t* tiling, uint32_t tile)
+{
+    uvec3_t min;
+    uvec3_t size;
+    _tile_region(tiling, tile, &min, &size);
+    return _tile_line_offset(size, 2) + size.x * size.y;
+}
+
+int melt_scan_tile(melt_params_t params, const melt_tiling_t* tiling, uint32_t tile, uint8_t* out_lines)
+{
+    MELT_ASSERT(params._start_canary == 0 && params._end_canary == 0 && "Make sure to memset params to 0 before use");
+
+#if MELT_STACK_SCRATCH_SIZE > 0
+    uint64_t stack_scratch[MELT_STACK_SCRATCH_SIZE / sizeof(uint64_t)];
+    if (!params.scratch_buffer)
+    {
+        params.scratch_buffer = stack_scratch;
+        params.scratch_buffer_size = sizeof(stack_scratch);
+    }
+#endif
+
+    _tile_params(&params);
+
+    vec3_t origin;
+    svec3_t origin_cell;
+    const uvec3_t dimension = _tile_grid(tiling, tile, params.voxel_size, &origin, &origin_cell);
+
+    _context_t context;
+    _init_context_grid(&context, &params, origin, origin_cell, dimension);
+    _voxelize_shell(&context, &params.mesh, 0, params.mesh.index_count);
+
+    const bool cancelled = context.cancelled || _report_progress(&context, MELT_PHASE_VOXELIZATION, 1.0f);
+    if (!cancelled)
+    {
+        const uvec3_t size = _uvec3_init(dimension.x - 2, dimension.y - 2, dimension.z - 2);
+        uint8_t* lines_x = out_lines + _tile_line_offset(size, 0);
+        uint8_t* lines_y = out_lines + _tile_line_offset(size, 1);
+        uint8_t* lines_z = out_lines + _tile_line_offset(size, 2);
+        memset(out_lines, 0, _tile_line_offset(size, 2) + size.x * size.y);
+
+        for (uint32_t z = 1; z <= size.z; ++z)
+        {
+            for (uint32_t y = 1; y <= size.y; ++y)
+            {
+                for (uint32_t x = 1; x <= size.x; ++x)
+                {
+                    if (!_shell_mask_test(&context, _flatten_3d(_uvec3_init(x, y, z), dimension)))
+                        continue;
+                    lines_x[(y - 1) + (z - 1) * size.y] = MELT_TILE_LINE_SHELL;
+                    lines_y[(x - 1) + (z - 1) * size.x] = MELT_TILE_LINE_SHELL;
+                    lines_z[(x - 1) + (y - 1) * size.x] = MELT_TILE_LINE_SHELL;
+                }
+            }
+        }
+    }
+
+    _free_context(&context);
+    return cancelled ? 0 : 1;
+}
+
+// Tiles of a column along an axis by tile coordinate along the axis, with the
+// offset of their lines along the axis. Every tile of a column has the same
+// lines along the axis, returns their number.
+static uint32_t _tile_column(const melt_tiling_t* tiling, uint32_t axis, uint32_t column, uint32_t* out_tiles, uint32_t* out_offsets)
+{
+    const uint32_t other_axis_a = axis == 0 ? 1 : 0;
+    const uint32_t other_axis_b = axis == 2 ? 1 : 2;
+    uint32_t coordinates[3];
+    coordinates[other_axis_a] = column % tiling->tile_count[other_axis_a];
+    coordinates[other_axis_b] = column / tiling->tile_count[other_axis_a];
+
+    uint32_t line_count = 0;
+    for (coordinates[axis] = 0; coordinates[axis] < tiling->tile_count[axis]; ++coordinates[axis])
+    {
+        const uint32_t tile = coordinates[0] + tiling->tile_count[0] * (coordinates[1] + tiling->tile_count[1] * coordinates[2]);
+        uvec3_t min;
+        uvec3_t size;
+        _tile_region(tiling, tile, &min, &size);
+        out_tiles[coordinates[axis]] = tile;
+        out_offsets[coordinates[axis]] = _tile_line_offset(size, axis);
+        line_count = _uvec3_axis(size, other_axis_a) * _uvec3_axis(size, other_axis_b);
+    }
+    return line_count;
+}
+
+static uint32_t _tile_column_count(const melt_tiling_t* tiling, uint32_t axis)
+{
+    return melt_get_tile_count(tiling) / tiling->tile_count[axis];
+}
+
+void melt_resolve_tile_lines(const melt_tiling_t* tiling, uint8_t* const* tile_lines)
+{
+    for (uint32_t axis = 0; axis < 3; ++axis)
+    {
+        const uint32_t tile_count = tiling->tile_count[axis];
+        uint32_t* column_tiles = MELT_MALLOC(uint32_t, (tile_count * 2));
+        uint32_t* column_offsets = column_tiles + tile_count;
+
+        for (uint32_t column = 0; column < _tile_column_count(tiling, axis); ++column)
+        {
+            const uint32_t line_count = _tile_column(tiling, axis, column, column_tiles, column_offsets);
+            for (uint32_t line = 0; line < line_count; ++line)
+            {
+                // Shell voxels before the tile walking forward, after it walking backward
+                bool shell = false;
+                for (uint32_t i = 0; i < tile_count; ++i)
+                {
+                    uint8_t* state = tile_lines[column_tiles[i]] + column_offsets[i] + line;
+                    const bool tile_shell = (*state & MELT_TILE_LINE_SHELL) != 0;
+                    *state = (uint8_t)((tile_shell ? MELT_TILE_LINE_SHELL : 0) | (shell ? MELT_TILE_LINE_BEFORE : 0));
+                    shell |= tile_shell;
+                }
+                shell = false;
+                for (uint32_t i = tile_count; i-- > 0;)
+                {
+                    uint8_t* state = tile_lines[column_tiles[i]] + column_offsets[i] + line;
+                    *state |= shell ? MELT_TILE_LINE_AFTER : 0;
+                    shell |= (*state & MELT_TILE_LINE_SHELL) != 0;
+                }
+            }
+        }
+
+        MELT_FREE(column_tiles);
+    }
+}
+
+int melt_generate_tile(melt_params_t params, const melt_tiling_t* tiling, uint32_t tile, const uint8_t* lines,
+    uint8_t* out_states, melt_result_t* out_result)
+{
+    MELT_ASSERT(params._start_canary == 0 && params._end_canary == 0 && "Make sure to memset params to 0 before use");
+
+#if MELT_STACK_SCRATCH_SIZE > 0
+    uint64_t stack_scratch[MELT_STACK_SCRATCH_SIZE / sizeof(uint64_t)];
+    if (!params.scratch_buffer)
+    {
+        params.scratch_buffer = stack_scratch;
+        params.scratch_buffer_size = sizeof(stack_scratch);
+    }
+#endif
+
+    _tile_params(&params);
+
+    vec3_t origin;
+    svec3_t origin_cell;
+    const uvec3_t dimension = _tile_grid(tiling, tile, params.voxel_size, &origin, &origin_cell);
+
+    melt_generation_t generation;
+    _reset_generation(&generation, &params, false);
+    _init_context_grid(&generation.context, &params, origin, origin_cell, dimension);
+
+    _context_t* context = &generation.context;
+    const uvec3_t size = _uvec3_init(dimension.x - 2, dimension.y - 2, dimension.z - 2);
+    for (uint32_t axis = 0; axis < 3; ++axis)
+        context->tile_lines[axis] = lines + _tile_line_offset(size, axis);
+
+    while (generation.state < _GENERATION_STATE_EXTRACTION)
+        _step_generation_unit(&generation);
+
+    if (generation.state == _GENERATION_STATE_EXTRACTION)
+        _scan_tile_lines(context, out_states);
+
+    _step_generation(&generation, 0);
+    return _end_generation(&generation, out_result);
+}
+
+int melt_stitch_tile_lines(const melt_tiling_t* tiling, const uint8_t* const* tile_states)
+{
+    bool watertight = true;
+    for (uint32_t axis = 0; axis < 3 && watertight; ++axis)
+    {
+        const uint32_t tile_count = tiling->tile_count[axis];
+        uint32_t* column_tiles = MELT_MALLOC(uint32_t, (tile_count * 2));
+        uint32_t* column_offsets = column_tiles + tile_count;
+
+        for (uint32_t column = 0; column < _tile_column_count(tiling, axis) && watertight; ++column)
+        {
+            const uint32_t line_count = _tile_column(tiling, axis, column, column_tiles, column_offsets);
+            for (uint32_t line = 0; line < line_count && watertight; ++line)
+            {
+                bool open = false;
+                for (uint32_t i = 0; i < tile_count; ++i)
+                {
+                    const uint8_t state = tile_states[column_tiles[i]][column_offsets[i] + line];
+                    if (open && (state & MELT_SCAN_HEAD_EXPOSED))
+                    {
+                        watertight = false;
+                        break;
+                    }
+                    if (state & MELT_SCAN_SEEN)
+                        open = (state & MELT_SCAN_OPEN) != 0;
+                }
+            }
+        }
+
+        MELT_FREE(column_tiles);
+    }
+    return watertight ? 1 : 0;
+}
+
+typedef enum
+{
+    _JOB_STATE_PENDING,
+    _JOB_STATE_RUNNING,
+    _JOB_STATE_DONE
+} _job_state_t;
+
+typedef struct _job_t
+{
+    melt_queue_t* queue;
+    melt_job_t id;
+    melt_params_t params;
+    int32_t priority;
+    uint32_t size;
+    uint64_t memory_estimate;
+    _job_state_t state;
+    // A thread blocks on the job in melt_wait, melt_wait_any skips it
+    bool waited;
+    int generated;
+    melt_result_t result;
+    struct _job_t* next;
+} _job_t;
+
+struct melt_queue_t
+{
+    melt_queue_params_t params;
+
+    _mutex_t mutex;
+    // Signalled when a job may start, and when a job is complete
+    _condition_t job_ready;
+    _condition_t job_done;
+
+    // Jobs not collected yet, in submission order
+    _job_t* jobs;
+    melt_job_t next_id;
+    uint32_t running_count;
+    uint64_t running_memory;
+    // Tasks handed over to the caller owned pool that did not return yet
+    uint32_t scheduled_count;
+    bool shutdown;
+
+    uint32_t thread_count;
+#if !defined(MELT_NO_THREADS)
+    _parallel_thread_args_t thread_args[MELT_MAX_THREADS];
+#if defined(_WIN32)
+    HANDLE threads[MELT_MAX_THREADS];
+#else
+    pthread_t threads[MELT_MAX_THREADS];
+#endif
+#endif
+};
+
+// The fields, the shell mask and the voxel lists dominate the memory held by a
+// generation, see _init_context and _alloc_fields.
+static uint64_t _estimate_generation_memory(uint32_t size)
+{
+    const uint64_t voxel_byte_size = sizeof(_voxel_status_t) + 3 * sizeof(uint32_t);
+    return (uint64_t)size * voxel_byte_size + size / 8;
+}
 
-        MELT_ASSERT(context->voxel_field[z_slice_index].inner);
+static bool _queue_synchronous(const melt_queue_t* queue)
+{
+    return queue->thread_count == 0 && !queue->params.schedule_callback;
+}
 
-        if (context->voxel_field[z_slice_index].clipped)
+// Returns the pending job to start next if it fits in the memory budget, NULL
+// otherwise. Called with the queue locked.
+static _job_t* _next_job(melt_queue_t* queue)
+{
+    if (queue->shutdown)
+        return NULL;
+
+    _job_t* next = NULL;
+    for (_job_t* job = queue->jobs; job; job = job->next)
+    {
+        if (job->state != _JOB_STATE_PENDING)
             continue;
+        if (!next || job->priority > next->priority || (job->priority == next->priority && job->size > next->size))
+            next = job;
+    }
 
-        const _min_distance_t* sample_min_distance = &context->min_distance_field[z_slice_index];
+    const uint64_t budget = queue->params.memory_budget_bytes;
+    if (next && budget > 0 && queue->running_count > 0 && queue->running_memory + next->memory_estimate > budget)
+        return NULL;
 
-        uvec2_t max_extent = _uvec2_init(sample_min_distance->dist.x, sample_min_distance->dist.y);
+    return next;
+}
 
-        uint32_t x = sample_min_distance->x + 1;
-        uint32_t y = sample_min_distance->y + 1;
-        uint32_t i = 1;
-        while (x < sample_min_distance->x + sample_min_distance->dist.x &&
-               y < sample_min_distance->y + sample_min_distance->dist.y)
-        {
-            const uint32_t index = _flatten_3d(_uvec3_init(x, y, z), context->dimension);
-            if (_inner_voxel(context->voxel_field[index]))
-            {
-                const _min_distance_t* distance = &context->min_distance_field[index];
-                max_extent.x = _uint32_t_min(distance->dist.x + i, max_extent.x);
-                max_extent.y = _uint32_t_min(distance->dist.y + i, max_extent.y);
-            }
-            else
-            {
-                max_extent.x = i;
-                max_extent.y = i;
-                break;
-            }
-            ++x;
-            ++y;
-            ++i;
-        }
+static void _start_job(melt_queue_t* queue, _job_t* job)
+{
+    job->state = _JOB_STATE_RUNNING;
+    queue->running_count++;
+    queue->running_memory += job->memory_estimate;
+}
 
-        max_aabb_extents[max_aabb_extents_count++] = max_extent;
-    }
+static void _run_job(_job_t* job)
+{
+    job->generated = melt_generate_occluder(job->params, &job->result);
+}
 
-    uvec2_t min_extent = _uvec2_init(UINT_MAX, UINT_MAX);
+static void _complete_job(melt_queue_t* queue, _job_t* job)
+{
+    job->state = _JOB_STATE_DONE;
+    queue->running_count--;
+    queue->running_memory -= job->memory_estimate;
 
-    uint32_t z_slice = 1;
-    uint32_t max_volume = 0;
+    // The memory released may let pending jobs start
+    _condition_broadcast(&queue->job_ready);
+    _condition_broadcast(&queue->job_done);
+}
 
-    MELT_ASSERT(max_aabb_extents_count > 0);
+static void _schedule_jobs(melt_queue_t* queue);
 
-    for (uint32_t i = 0; i < max_aabb_extents_count; ++i)
-    {
-        const uvec2_t* extent = &max_aabb_extents[i];
-        min_extent.x = _uint32_t_min(extent->x, min_extent.x);
-        min_extent.y = _uint32_t_min(extent->y, min_extent.y);
+static void _queue_task(void* task_data)
+{
+    _job_t* job = (_job_t*)task_data;
+    melt_queue_t* queue = job->queue;
 
-        const uint32_t volume = min_extent.x * min_extent.y * z_slice;
-        if (volume > max_volume)
-            max_volume = volume;
+    _run_job(job);
 
-        ++z_slice;
-    }
+    _mutex_lock(&queue->mutex);
+    _complete_job(queue, job);
+    _mutex_unlock(&queue->mutex);
 
-    MELT_ASSERT(max_volume > 0);
-    MELT_ASSERT(min_extent.x > 0);
-    MELT_ASSERT(min_extent.y > 0);
-    MELT_ASSERT(z_slice > 1);
-    MELT_PROFILE_END();
+    _schedule_jobs(queue);
 
-    return _uvec3_init(min_extent.x, min_extent.y, z_slice - 1);
+    // Last access to the queue, melt_destroy_queue waits for it
+    _mutex_lock(&queue->mutex);
+    queue->scheduled_count--;
+    _condition_broadcast(&queue->job_done);
+    _mutex_unlock(&queue->mutex);
 }
 
-static void _clip_voxel_field(const _context_t* context, const uvec3_t start_position, const uvec3_t extent)
+// Hands the jobs that may start over to the caller owned pool.
+static void _schedule_jobs(melt_queue_t* queue)
 {
-    MELT_PROFILE_BEGIN();
-
-    for (uint32_t x = start_position.x; x < start_position.x + extent.x; ++x)
+    for (;;)
     {
-        for (uint32_t y = start_position.y; y < start_position.y + extent.y; ++y)
+        _mutex_lock(&queue->mutex);
+        _job_t* job = _next_job(queue);
+        if (job)
         {
-            for (uint32_t z = start_position.z; z < start_position.z + extent.z; ++z)
-            {
-                uint32_t index = _flatten_3d(_uvec3_init(x, y, z), context->dimension);
-                MELT_ASSERT(!context->voxel_field[index].clipped && "Clipping already clipped voxel field index");
-                context->voxel_field[index].clipped = true;
-            }
+            _start_job(queue, job);
+            queue->scheduled_count++;
         }
-    }
+        _mutex_unlock(&queue->mutex);
 
-    MELT_PROFILE_END();
+        if (!job)
+            break;
+        queue->params.schedule_callback(_queue_task, job, queue->params.schedule_user_data);
+    }
 }
 
-static bool _water_tight_mesh(const _context_t* context)
+#if !defined(MELT_NO_THREADS)
+static void _queue_worker(void* data, uint32_t thread_index)
 {
-    for (uint32_t i = 0; i < context->size; ++i)
+    melt_queue_t* queue = (melt_queue_t*)data;
+    MELT_UNUSED(thread_index);
+
+    _mutex_lock(&queue->mutex);
+    for (;;)
     {
-        const _min_distance_t* min_distance = &context->min_distance_field[i];
-        if (!_inner_voxel(context->voxel_field[_flatten_3d(min_distance->position, context->dimension)]))
+        _job_t* job = _next_job(queue);
+        if (!job)
+        {
+            if (queue->shutdown)
+                break;
+            _condition_wait(&queue->job_ready, &queue->mutex);
             continue;
+        }
 
-        for (uint32_t x = min_distance->x; x < min_distance->x + min_distance->dist.x; ++x)
+        _start_job(queue, job);
+        _mutex_unlock(&queue->mutex);
+
+        _run_job(job);
+
+        _mutex_lock(&queue->mutex);
+        _complete_job(queue, job);
+    }
+    _mutex_unlock(&queue->mutex);
+}
+#endif // !MELT_NO_THREADS
+
+// Waits for a job to complete, any job that nobody waits for when id is 0.
+// Without workers, the next pending job runs on the calling thread instead, only
+// once when not blocking, and the thread waits for the others when no job can
+// start. Called with the queue locked, returns NULL when there is no such job
+// complete.
+static _job_t* _wait_job(melt_queue_t* queue, melt_job_t id, bool block)
+{
+    bool ran = false;
+
+    for (;;)
+    {
+        _job_t* done = NULL;
+        bool outstanding = false;
+        for (_job_t* job = queue->jobs; job && !done; job = job->next)
         {
-            const uint32_t y = min_distance->y;
-            const uint32_t z = min_distance->z;
-            const uint32_t index = _flatten_3d(_uvec3_init(x, y, z), context->dimension);
-            if (!_inner_voxel(context->voxel_field[index]))
-            {
-                return false;
-            }
+            if (id != 0 && job->id != id)
+                continue;
+            if (id == 0 && job->waited)
+                continue;
+            if (id != 0 && block)
+                job->waited = true;
+            outstanding = true;
+            if (job->state == _JOB_STATE_DONE)
+                done = job;
         }
-        for (uint32_t y = min_distance->y; y < min_distance->y + min_distance->dist.y; ++y)
+
+        if (done || !outstanding || (ran && !block))
+            return done;
+
+        // Another waiting thread may run the remaining jobs, or hold the memory
+        // budget, nothing can start until it completes them.
+        _job_t* job = _queue_synchronous(queue) ? _next_job(queue) : NULL;
+        if (job)
         {
-            const uint32_t x = min_distance->x;
-            const uint32_t z = min_distance->z;
-            const uint32_t index = _flatten_3d(_uvec3_init(x, y, z), context->dimension);
-            if (!_inner_voxel(context->voxel_field[index]))
-            {
-                return false;
-            }
+            _start_job(queue, job);
+            _mutex_unlock(&queue->mutex);
+            _run_job(job);
+            _mutex_lock(&queue->mutex);
+            _complete_job(queue, job);
+            ran = true;
         }
-        for (uint32_t z = min_distance->z; z < min_distance->z + min_distance->dist.z; ++z)
+        else if (block)
         {
-            const uint32_t x = min_distance->x;
-            const uint32_t y = min_distance->y;
-            const uint32_t index = _flatten_3d(_uvec3_init(x, y, z), context->dimension);
-            if (!_inner_voxel(context->voxel_field[index]))
-            {
-                return false;
-            }
+            _condition_wait(&queue->job_done, &queue->mutex);
+        }
+        else
+        {
+            return NULL;
         }
     }
+}
 
-    return true;
+// Unlinks a complete job and hands its result over. Called with the queue locked.
+static int _collect_job(melt_queue_t* queue, _job_t* job, melt_result_t* out_result)
+{
+    _job_t** link = &queue->jobs;
+    while (*link != job)
+        link = &(*link)->next;
+    *link = job->next;
+
+    const int generated = job->generated;
+    *out_result = job->result;
+    MELT_FREE(job);
+    return generated;
 }
 
-static void _debug_validate_min_distance_field(const _context_t* context)
+melt_queue_t* melt_create_queue(melt_queue_params_t params)
 {
-#if defined(MELT_DEBUG) && defined(MELT_ASSERT)
-    for (uint32_t i = 0; i < context->size; ++i)
+    melt_queue_t* queue = MELT_MALLOC(melt_queue_t, 1);
+    memset(queue, 0, sizeof(melt_queue_t));
+    queue->params = params;
+    queue->next_id = 1;
+
+    _mutex_init(&queue->mutex);
+    _condition_init(&queue->job_ready);
+    _condition_init(&queue->job_done);
+
+#if !defined(MELT_NO_THREADS)
+    // Workers that fail to start are not replaced, the queue runs on fewer
+    // threads, or on the waiting thread if none started.
+    const uint32_t thread_count = _uint32_t_min(params.thread_count, MELT_MAX_THREADS);
+    for (uint32_t i = 0; i < thread_count; ++i)
     {
-        const _min_distance_t* min_distance = &context->min_distance_field[i];
-        if (!_inner_voxel(context->voxel_field[_flatten_3d(min_distance->position, context->dimension)]))
-            continue;
-
-        for (uint32_t x = min_distance->x; x < min_distance->x + min_distance->dist.x; ++x)
-        {
-            const uint32_t y = min_distance->y;
-            const uint32_t z = min_distance->z;
-            const uint32_t index = _flatten_3d(_uvec3_init(x, y, z), context->dimension);
-            for (uint32_t i = 0; i < context->voxel_set_count; ++i)
-                MELT_ASSERT(!_uvec3_equals(context->voxel_set[i].position, _uvec3_init(x, y, z)));
-            MELT_ASSERT(_inner_voxel(context->voxel_field[index]));
-        }
-        for (uint32_t y = min_distance->y; y < min_distance->y + min_distance->dist.y; ++y)
-        {
-            const uint32_t x = min_distance->x;
-            const uint32_t z = min_distance->z;
-            const uint32_t index = _flatten_3d(_uvec3_init(x, y, z), context->dimension);
-            for (uint32_t i = 0; i < context->voxel_set_count; ++i)
-                MELT_ASSERT(!_uvec3_equals(context->voxel_set[i].position, _uvec3_init(x, y, z)));
-            MELT_ASSERT(_inner_voxel(context->voxel_field[index]));
-        }
-        for (uint32_t z = min_distance->z; z < min_distance->z + min_distance->dist.z; ++z)
-        {
-            const uint32_t x = min_distance->x;
-            const uint32_t y = min_distance->y;
-            const uint32_t index = _flatten_3d(_uvec3_init(x, y, z), context->dimension);
-            for (uint32_t i = 0; i < context->voxel_set_count; ++i)
-                MELT_ASSERT(!_uvec3_equals(context->voxel_set[i].position, _uvec3_init(x, y, z)));
-            MELT_ASSERT(_inner_voxel(context->voxel_field[index]));
-        }
+        _parallel_thread_args_t* thread_args = &queue->thread_args[queue->thread_count];
+        thread_args->task = _queue_worker;
+        thread_args->data = queue;
+        thread_args->thread_index = queue->thread_count;
+#if defined(_WIN32)
+        queue->threads[queue->thread_count] = CreateThread(NULL, 0, _parallel_thread_entry, thread_args, 0, NULL);
+        const bool started = queue->threads[queue->thread_count] != NULL;
+#else
+        const bool started = pthread_create(&queue->threads[queue->thread_count], NULL, _parallel_thread_entry, thread_args) == 0;
+#endif
+        if (started)
+            queue->thread_count++;
     }
 #else
-    MELT_UNUSED(context);
+    // Without threads, a caller owned pool could not signal completion either.
+    queue->params.schedule_callback = NULL;
 #endif
+
+    return queue;
 }
 
-static void _debug_validate_max_extents(const _context_t* context, const _max_extent_t* max_extents, uint32_t max_extent_count)
+void melt_destroy_queue(melt_queue_t* queue)
 {
-#if defined(MELT_DEBUG) && defined(MELT_ASSERT)
-    for (uint32_t i = 0; i < max_extent_count; ++i)
+    _mutex_lock(&queue->mutex);
+    queue->shutdown = true;
+    _condition_broadcast(&queue->job_ready);
+    while (queue->scheduled_count > 0)
+        _condition_wait(&queue->job_done, &queue->mutex);
+    _mutex_unlock(&queue->mutex);
+
+#if !defined(MELT_NO_THREADS)
+    for (uint32_t i = 0; i < queue->thread_count; ++i)
     {
-        const _max_extent_t* extent = &max_extents[i];
-        for (uint32_t x = extent->position.x; x < extent->position.x + extent->extent.x; ++x)
-        {
-            for (uint32_t y = extent->position.y; y < extent->position.y + extent->extent.y; ++y)
-            {
-                for (uint32_t z = extent->position.z; z < extent->position.z + extent->extent.z; ++z)
-                {
-                    for (uint32_t i = 0; i < context->voxel_set_count; ++i)
-                    {
-                        const _voxel_t* voxel = &context->voxel_set[i];
-                        MELT_ASSERT(!_uvec3_equals(voxel->position, _uvec3_init(x, y, z)));
-                    }
-                }
-            }
-        }
-    }
+#if defined(_WIN32)
+        WaitForSingleObject(queue->threads[i], INFINITE);
+        CloseHandle(queue->threads[i]);
 #else
-    MELT_UNUSED(context);
-    MELT_UNUSED(max_extents);
-    MELT_UNUSED(max_extent_count);
+        pthread_join(queue->threads[i], NULL);
+#endif
+    }
 #endif
+
+    while (queue->jobs)
+    {
+        _job_t* job = queue->jobs;
+        queue->jobs = job->next;
+        if (job->state == _JOB_STATE_DONE && job->generated)
+            melt_free_result(job->result);
+        MELT_FREE(job);
+    }
+
+    _condition_destroy(&queue->job_done);
+    _condition_destroy(&queue->job_ready);
+    _mutex_destroy(&queue->mutex);
+    MELT_FREE(queue);
 }
 
-static void _update_min_distance_field(const _context_t* context, uvec3_t start_position, uvec3_t extent)
+melt_job_t melt_submit(melt_queue_t* queue, melt_params_t params, int32_t priority)
 {
-    MELT_PROFILE_BEGIN();
-    MELT_ASSERT(start_position.x - 1 != ~0U);
-    MELT_ASSERT(start_position.y - 1 != ~0U);
-    MELT_ASSERT(start_position.z - 1 != ~0U);
+    MELT_ASSERT(params._start_canary == 0 && params._end_canary == 0 && "Make sure to memset params to 0 before use");
+
+    _job_t* job = MELT_MALLOC(_job_t, 1);
+    memset(job, 0, sizeof(_job_t));
+    job->queue = queue;
+    job->params = params;
+    job->priority = priority;
 
-    for (uint32_t x = start_position.x - 1; x != ~0U; --x)
+    vec3_t origin;
+    svec3_t origin_cell;
+    const uvec3_t dimension = _grid_dimension(&params, &origin, &origin_cell);
+    job->size = dimension.x * dimension.y * dimension.z;
+    job->memory_estimate = _estimate_generation_memory(job->size);
+
+    _mutex_lock(&queue->mutex);
+    job->id = queue->next_id++;
+    if (queue->next_id == 0)
+        queue->next_id = 1;
+
+    _job_t** link = &queue->jobs;
+    while (*link)
+        link = &(*link)->next;
+    *link = job;
+
+    const melt_job_t id = job->id;
+    _condition_broadcast(&queue->job_ready);
+    _mutex_unlock(&queue->mutex);
+
+    if (queue->params.schedule_callback)
+        _schedule_jobs(queue);
+
+    return id;
+}
+
+int melt_poll(melt_queue_t* queue, melt_job_t job, melt_result_t* result)
+{
+    _mutex_lock(&queue->mutex);
+    _job_t* done = _wait_job(queue, job, false);
+    if (done)
+        _collect_job(queue, done, result);
+    _mutex_unlock(&queue->mutex);
+
+    return done != NULL;
+}
+
+int melt_wait(melt_queue_t* queue, melt_job_t job, melt_result_t* result)
+{
+    _mutex_lock(&queue->mutex);
+    _job_t* done = _wait_job(queue, job, true);
+    int generated = 0;
+    if (done)
     {
-        for (uint32_t y = start_position.y; y < start_position.y + extent.y; ++y)
-        {
-            for (uint32_t z = start_position.z; z < start_position.z + extent.z; ++z)
-            {
-                const uint32_t index = _flatten_3d(_uvec3_init(x, y, z), context->dimension);
-                if (_inner_voxel(context->voxel_field[index]))
-                {
-                    _min_distance_t* min_distance = &context->min_distance_field[index];
-                    const uint32_t updated_distance_x = start_position.x - min_distance->x;
-                    min_distance->dist.x = _uint32_t_min(updated_distance_x, min_distance->dist.x);
-                }
-            }
-        }
+        generated = _collect_job(queue, done, result);
     }
-    for (uint32_t x = start_position.x; x < start_position.x + extent.x; ++x)
+    else
     {
-        for (uint32_t y = start_position.y - 1; y != ~0U; --y)
-        {
-            for (uint32_t z = start_position.z; z < start_position.z + extent.z; ++z)
-            {
-                const uint32_t index = _flatten_3d(_uvec3_init(x, y, z), context->dimension);
-                if (_inner_voxel(context->voxel_field[index]))
-                {
-                    _min_distance_t* min_distance = &context->min_distance_field[index];
-                    const uint32_t updated_distance_y = start_position.y - min_distance->y;
-                    min_distance->dist.y = _uint32_t_min(updated_distance_y, min_distance->dist.y);
-                }
-            }
-        }
+        memset(result, 0, sizeof(melt_result_t));
+        result->status = MELT_STATUS_UNKNOWN_JOB;
     }
-    for (uint32_t x = start_position.x; x < start_position.x + extent.x; ++x)
+    _mutex_unlock(&queue->mutex);
+
+    return generated;
+}
+
+melt_job_t melt_wait_any(melt_queue_t* queue, melt_result_t* result)
+{
+    _mutex_lock(&queue->mutex);
+    _job_t* done = _wait_job(queue, 0, true);
+    melt_job_t id = 0;
+    if (done)
     {
-        for (uint32_t y = start_position.y; y < start_position.y + extent.y; ++y)
-        {
-            for (uint32_t z = start_position.z - 1; z != ~0U; --z)
-            {
-                const uint32_t index = _flatten_3d(_uvec3_init(x, y, z), context->dimension);
-                if (_inner_voxel(context->voxel_field[index]))
-                {
-                    _min_distance_t* min_distance = &context->min_distance_field[index];
-                    const uint32_t updated_distance_z = start_position.z - min_distance->z;
-                    min_distance->dist.z = _uint32_t_min(updated_distance_z, min_distance->dist.z);
-                }
-            }
-        }
+        id = done->id;
+        _collect_job(queue, done, result);
     }
+    _mutex_unlock(&queue->mutex);
 
-    MELT_PROFILE_END();
+    return id;
 }
 
-static melt_occluder_box_type_t _select_voxel_indices(melt_occluder_box_type_flags_t box_type_flags, const uint16_t** out_indices, uint32_t* out_index_length)
+// Boxes are numbered in the order they are added, their arrays grow together.
+struct melt_box_set_t
 {
-#define CHECK_FLAG(flag) (box_type_flags & flag) == flag
+    _box_arrays_t boxes;
+    uint32_t count;
+    uint32_t capacity;
+};
 
-    if (CHECK_FLAG(MELT_OCCLUDER_BOX_TYPE_REGULAR))
-    {
-        *out_indices = (const uint16_t*)_voxel_cube_indices;
-        *out_index_length = MELT_ARRAY_LENGTH(_voxel_cube_indices);
-        return MELT_OCCLUDER_BOX_TYPE_REGULAR;
-    }
-    else if (CHECK_FLAG(MELT_OCCLUDER_BOX_TYPE_SIDES))
-    {
-        *out_indices = (const uint16_t*)_voxel_cube_indices_sides;
-        *out_index_length = MELT_ARRAY_LENGTH(_voxel_cube_indices_sides);
-        return MELT_OCCLUDER_BOX_TYPE_SIDES;
-    }
-    else if (CHECK_FLAG(MELT_OCCLUDER_BOX_TYPE_BOTTOM))
+melt_box_set_t* melt_create_box_set(void)
+{
+    melt_box_set_t* set = MELT_MALLOC(melt_box_set_t, 1);
+    memset(set, 0, sizeof(melt_box_set_t));
+    return set;
+}
+
+void melt_destroy_box_set(melt_box_set_t* set)
+{
+    MELT_FREE(set->boxes.center_x);
+    MELT_FREE(set);
+}
+
+// The six arrays share one allocation starting with center_x, the boxes past
+// count are empty.
+static void _reserve_boxes(melt_box_set_t* set, uint32_t count)
+{
+    if (count <= set->capacity)
+        return;
+
+    uint32_t capacity = set->capacity > 0 ? set->capacity * 2 : 256;
+    while (capacity < count)
+        capacity *= 2;
+    MELT_ASSERT(capacity % MELT_CULL_CHUNK == 0);
+
+    float* data = MELT_MALLOC(float, (size_t)capacity * 6);
+    memset(data, 0, (size_t)capacity * 6 * sizeof(float));
+
+    float** arrays[6] = { &set->boxes.center_x, &set->boxes.center_y, &set->boxes.center_z,
+        &set->boxes.half_x, &set->boxes.half_y, &set->boxes.half_z };
+    float* previous = set->boxes.center_x;
+    for (uint32_t i = 0; i < 6; ++i)
     {
-        *out_indices = (const uint16_t*)_voxel_cube_indices_bottom;
-        *out_index_length = MELT_ARRAY_LENGTH(_voxel_cube_indices_bottom);
-        return MELT_OCCLUDER_BOX_TYPE_BOTTOM;
+        float* array = data + (size_t)i * capacity;
+        if (set->count > 0)
+            memcpy(array, *arrays[i], set->count * sizeof(float));
+        *arrays[i] = array;
     }
-    else if (CHECK_FLAG(MELT_OCCLUDER_BOX_TYPE_TOP))
+
+    MELT_FREE(previous);
+    set->capacity = capacity;
+}
+
+static void _store_box(melt_box_set_t* set, uint32_t box, vec3_t center, vec3_t half_extent)
+{
+    set->boxes.center_x[box] = center.x;
+    set->boxes.center_y[box] = center.y;
+    set->boxes.center_z[box] = center.z;
+    set->boxes.half_x[box] = half_extent.x;
+    set->boxes.half_y[box] = half_extent.y;
+    set->boxes.half_z[box] = half_extent.z;
+}
+
+uint32_t melt_add_box(melt_box_set_t* set, melt_vec3_t center, melt_vec3_t half_extent)
+{
+    _reserve_boxes(set, set->count + 1);
+    _store_box(set, set->count, center, half_extent);
+    return set->count++;
+}
+
+uint32_t melt_add_result_boxes(melt_box_set_t* set, const melt_result_t* result)
+{
+    const uint32_t first = set->count;
+    const melt_instances_t* instances = &result->instances;
+
+    if (instances->boxes || instances->quantized_boxes)
     {
-        *out_indices = (const uint16_t*)_voxel_cube_indices_top;
-        *out_index_length = MELT_ARRAY_LENGTH(_voxel_cube_indices_top);
-        return MELT_OCCLUDER_BOX_TYPE_TOP;
+        _reserve_boxes(set, first + instances->count);
+        for (uint32_t i = 0; i < instances->count; ++i)
+        {
+            vec3_t center, half_extent;
+            if (instances->boxes)
+            {
+                const float* box = instances->boxes + (size_t)i * 6;
+                center = _vec3_init(box[0], box[1], box[2]);
+                half_extent = _vec3_init(box[3], box[4], box[5]);
+            }
+            else
+            {
+                const uint16_t* box = instances->quantized_boxes + (size_t)i * 6;
+                center = _vec3_add(instances->offset, _vec3_mulf(_vec3_init(box[0], box[1], box[2]), instances->scale));
+                half_extent = _vec3_mulf(_vec3_init(box[3], box[4], box[5]), instances->scale);
+            }
+            _store_box(set, first + i, center, half_extent);
+        }
+        set->count += instances->count;
+        return first;
     }
-    else if (CHECK_FLAG(MELT_OCCLUDER_BOX_TYPE_DIAGONALS))
+
+    // Corners 0 and 6 of a box of the mesh are its opposite corners, see
+    // _voxel_cube_vertices.
+    const uint32_t box_count = result->mesh.vertex_count / _vertex_count_per_aabb();
+    _reserve_boxes(set, first + box_count);
+    for (uint32_t i = 0; i < box_count; ++i)
     {
-        *out_indices = (const uint16_t*)_voxel_cube_indices_diagonals;
-        *out_index_length = MELT_ARRAY_LENGTH(_voxel_cube_indices_diagonals);
-        return MELT_OCCLUDER_BOX_TYPE_DIAGONALS;
+        const vec3_t* corners = result->mesh.vertices + (size_t)i * _vertex_count_per_aabb();
+        const vec3_t min = _vec3_min(corners[0], corners[6]);
+        const vec3_t max = _vec3_max(corners[0], corners[6]);
+        _store_box(set, first + i, _vec3_mulf(_vec3_add(min, max), 0.5f), _vec3_mulf(_vec3_sub(max, min), 0.5f));
     }
+    set->count += box_count;
+    return first;
+}
 
-#undef CHECK_FLAG
+uint32_t melt_get_box_count(const melt_box_set_t* set)
+{
+    return set->count;
+}
 
-    return MELT_OCCLUDER_BOX_TYPE_NONE;
+void melt_get_box(const melt_box_set_t* set, uint32_t box, melt_vec3_t* out_center, melt_vec3_t* out_half_extent)
+{
+    MELT_ASSERT(box < set->count);
+    *out_center = _vec3_init(set->boxes.center_x[box], set->boxes.center_y[box], set->boxes.center_z[box]);
+    *out_half_extent = _vec3_init(set->boxes.half_x[box], set->boxes.half_y[box], set->boxes.half_z[box]);
 }
 
-static uint16_t _index_count_per_aabb(melt_occluder_box_type_flags_t box_type_flags)
+// Box of whole half voxels, see melt_merge_boxes
+typedef struct
 {
-    uint16_t index_count = 0;
-    while (box_type_flags != MELT_OCCLUDER_BOX_TYPE_NONE)
+    int32_t min[3];
+    int32_t max[3];
+} _half_voxel_box_t;
+
+// Orders the boxes by their extent on the two axes other than axis, then along
+// axis. Boxes that can merge along axis end up next to each other.
+static int _compare_half_voxel_boxes(const _half_voxel_box_t* a, const _half_voxel_box_t* b, uint32_t axis)
+{
+    const uint32_t axes[3] = { axis == 0 ? 1u : 0u, axis == 2 ? 1u : 2u, axis };
+    for (uint32_t i = 0; i < 3; ++i)
     {
-        const uint16_t* indices = NULL;
-        uint32_t indices_length = 0;
-        melt_occluder_box_type_t selected_type = _select_voxel_indices(box_type_flags, &indices, &indices_length);
-        MELT_ASSERT(indices && indices_length > 0);
-        index_count += indices_length;
-        box_type_flags &= ~selected_type;
+        const uint32_t key = axes[i];
+        if (a->min[key] != b->min[key])
+            return a->min[key] < b->min[key] ? -1 : 1;
+        if (a->max[key] != b->max[key])
+            return a->max[key] < b->max[key] ? -1 : 1;
     }
-    return index_count;
+    return 0;
 }
 
-static uint32_t _vertex_count_per_aabb()
+static int _compare_half_voxel_boxes_x(const void* a, const void* b)
 {
-    return MELT_ARRAY_LENGTH(_voxel_cube_vertices);
+    return _compare_half_voxel_boxes((const _half_voxel_box_t*)a, (const _half_voxel_box_t*)b, 0);
+}
+
+static int _compare_half_voxel_boxes_y(const void* a, const void* b)
+{
+    return _compare_half_voxel_boxes((const _half_voxel_box_t*)a, (const _half_voxel_box_t*)b, 1);
 }
 
-static void _add_voxel_to_mesh_with_color(vec3_t voxel_center, vec3_t half_voxel_size, melt_mesh_t* mesh, melt_occluder_box_type_flags_t box_type_flags, const color_3u8_t color)
+static int _compare_half_voxel_boxes_z(const void* a, const void* b)
 {
-    bool has_color = !_uvec3_equals(color, _color_null);
-    uint16_t index_offset = (uint16_t)(has_color ? mesh->vertex_count / 2 : mesh->vertex_count);
+    return _compare_half_voxel_boxes((const _half_voxel_box_t*)a, (const _half_voxel_box_t*)b, 2);
+}
 
-    for (uint32_t i = 0; i < MELT_ARRAY_LENGTH(_voxel_cube_vertices); ++i)
-    {
-        vec3_t vertex = _vec3_add(_vec3_mul(half_voxel_size, _voxel_cube_vertices[i]), voxel_center);
-        mesh->vertices[mesh->vertex_count++] = vertex;
-        if (has_color) mesh->vertices[mesh->vertex_count++] = _vec3_div(_uvec3_to_vec3(color), 255.0f);
-    }
+// Merges runs of boxes along axis, returns the number of boxes left.
+static uint32_t _merge_boxes_along(_half_voxel_box_t* boxes, uint32_t count, uint32_t axis)
+{
+    static int (*const compare[3])(const void*, const void*) = {
+        _compare_half_voxel_boxes_x, _compare_half_voxel_boxes_y, _compare_half_voxel_boxes_z
+    };
+    qsort(boxes, count, sizeof(_half_voxel_box_t), compare[axis]);
 
-    while (box_type_flags != MELT_OCCLUDER_BOX_TYPE_NONE)
+    const uint32_t axis_a = axis == 0 ? 1 : 0;
+    const uint32_t axis_b = axis == 2 ? 1 : 2;
+    uint32_t merged_count = 0;
+    for (uint32_t i = 0; i < count; ++i)
     {
-        const uint16_t* indices = NULL;
-        uint32_t indices_length = 0;
+        _half_voxel_box_t* last = merged_count > 0 ? &boxes[merged_count - 1] : NULL;
+        if (last && last->max[axis] == boxes[i].min[axis] &&
+            last->min[axis_a] == boxes[i].min[axis_a] && last->max[axis_a] == boxes[i].max[axis_a] &&
+            last->min[axis_b] == boxes[i].min[axis_b] && last->max[axis_b] == boxes[i].max[axis_b])
+        {
+            last->max[axis] = boxes[i].max[axis];
+            continue;
+        }
+        boxes[merged_count++] = boxes[i];
+    }
+    return merged_count;
+}
 
-        melt_occluder_box_type_t selected_type = _select_voxel_indices(box_type_flags, &indices, &indices_length);
+uint32_t melt_merge_boxes(melt_box_set_t* set, float voxel_size)
+{
+    const uint32_t count = set->count;
+    if (count == 0)
+        return 0;
 
-        MELT_ASSERT(indices && indices_length > 0);
-        for (uint32_t i = 0; i < indices_length; ++i)
+    // Corners in half voxels, rounded to absorb the rounding of the centers
+    const float half_voxel_size = voxel_size * 0.5f;
+    _half_voxel_box_t* boxes = MELT_MALLOC(_half_voxel_box_t, count);
+    const float* centers[3] = { set->boxes.center_x, set->boxes.center_y, set->boxes.center_z };
+    const float* halves[3] = { set->boxes.half_x, set->boxes.half_y, set->boxes.half_z };
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        for (uint32_t axis = 0; axis < 3; ++axis)
         {
-            mesh->indices[mesh->index_count++] = indices[i] + index_offset;
+            boxes[i].min[axis] = (int32_t)floorf((centers[axis][i] - halves[axis][i]) / half_voxel_size + 0.5f);
+            boxes[i].max[axis] = (int32_t)floorf((centers[axis][i] + halves[axis][i]) / half_voxel_size + 0.5f);
         }
+    }
 
-        box_type_flags &= ~selected_type;
+    // Merging along an axis can line boxes up along another, a round over the
+    // three axes is repeated until no box merges.
+    uint32_t merged_count = count;
+    for (uint32_t previous_count = 0; merged_count != previous_count;)
+    {
+        previous_count = merged_count;
+        for (uint32_t axis = 0; axis < 3; ++axis)
+            merged_count = _merge_boxes_along(boxes, merged_count, axis);
+    }
+
+    for (uint32_t i = 0; i < merged_count; ++i)
+    {
+        const vec3_t min = _vec3_init(
+            _exact_half_voxel_coordinate(boxes[i].min[0], voxel_size),
+            _exact_half_voxel_coordinate(boxes[i].min[1], voxel_size),
+            _exact_half_voxel_coordinate(boxes[i].min[2], voxel_size));
+        const vec3_t max = _vec3_init(
+            _exact_half_voxel_coordinate(boxes[i].max[0], voxel_size),
+            _exact_half_voxel_coordinate(boxes[i].max[1], voxel_size),
+            _exact_half_voxel_coordinate(boxes[i].max[2], voxel_size));
+        _store_box(set, i, _vec3_mulf(_vec3_add(min, max), 0.5f), _vec3_mulf(_vec3_sub(max, min), 0.5f));
     }
+    for (uint32_t i = merged_count; i < count; ++i)
+        _store_box(set, i, _vec3_init(0.0f, 0.0f, 0.0f), _vec3_init(0.0f, 0.0f, 0.0f));
+    set->count = merged_count;
+
+    MELT_FREE(boxes);
+    return merged_count;
 }
 
-static void _add_voxel_to_mesh(vec3_t voxel_center, vec3_t half_voxel_size, melt_mesh_t* mesh, melt_occluder_box_type_flags_t box_type_flags)
+// The selection is a min heap on the size, the smallest selected box at the root.
+// On equal sizes the box added last is the smaller one.
+static bool _selection_less(float size, uint32_t box, float other_size, uint32_t other_box)
 {
-    _add_voxel_to_mesh_with_color(voxel_center, half_voxel_size, mesh, box_type_flags, _color_null);
+    return size < other_size || (size == other_size && box > other_box);
 }
 
-#if defined(MELT_DEBUG)
-static void _add_voxel_set_to_mesh(const _voxel_t* voxel_set, const uint32_t voxel_set_count, vec3_t half_voxel_extent, melt_mesh_t* mesh)
+static void _selection_sift_down(uint32_t* boxes, float* sizes, uint32_t count, uint32_t index)
 {
-    for (uint32_t i = 0; i < voxel_set_count; ++i)
+    for (;;)
     {
-        _add_voxel_to_mesh_with_color(_aabb_center(voxel_set[i].aabb), half_voxel_extent, mesh, MELT_OCCLUDER_BOX_TYPE_REGULAR, _color_steel_blue);
+        const uint32_t left = index * 2 + 1;
+        const uint32_t right = left + 1;
+        uint32_t smallest = index;
+        if (left < count && _selection_less(sizes[left], boxes[left], sizes[smallest], boxes[smallest]))
+            smallest = left;
+        if (right < count && _selection_less(sizes[right], boxes[right], sizes[smallest], boxes[smallest]))
+            smallest = right;
+        if (smallest == index)
+            return;
+
+        const uint32_t box = boxes[index];
+        const float size = sizes[index];
+        boxes[index] = boxes[smallest];
+        sizes[index] = sizes[smallest];
+        boxes[smallest] = box;
+        sizes[smallest] = size;
+        index = smallest;
+    }
+}
+
+static void _selection_sift_up(uint32_t* boxes, float* sizes, uint32_t index)
+{
+    while (index > 0)
+    {
+        const uint32_t parent = (index - 1) / 2;
+        if (!_selection_less(sizes[index], boxes[index], sizes[parent], boxes[parent]))
+            return;
+
+        const uint32_t box = boxes[index];
+        const float size = sizes[index];
+        boxes[index] = boxes[parent];
+        sizes[index] = sizes[parent];
+        boxes[parent] = box;
+        sizes[parent] = size;
+        index = parent;
     }
 }
-#endif
 
-static _max_extent_t _get_max_extent(const _context_t* context)
+// The boxes are culled in chunks, the sizes of a chunk stay on the stack. Only
+// the boxes larger than the smallest selected one reach the heap.
+uint32_t melt_select_occluders(const melt_box_set_t* set, const melt_selection_params_t* params,
+    uint32_t* out_boxes, float* out_sizes)
 {
     MELT_PROFILE_BEGIN();
 
-    _max_extent_t max_extent;
-    max_extent.extent = _uvec3_init(0, 0, 0);
-    max_extent.position = _uvec3_init(0, 0, 0);
-    max_extent.volume = 0;
+    _kernels_t kernels;
+    _select_kernels(&kernels, params->isa);
+
+    const float min_size = params->min_projected_size > 0.0f ? params->min_projected_size : 0.0f;
+    float sizes[MELT_CULL_CHUNK];
+    uint32_t count = 0;
 
-    for (uint32_t i = 0; i < context->size; ++i)
+    for (uint32_t begin = 0; begin < set->count && params->max_count > 0; begin += MELT_CULL_CHUNK)
     {
-        const _min_distance_t* min_distance = &context->min_distance_field[i];
-        _voxel_status_t voxel_status = context->voxel_field[_flatten_3d(min_distance->position, context->dimension)];
-        if (_inner_voxel(voxel_status))
+        const uint32_t end = _uint32_t_min(begin + MELT_CULL_CHUNK, set->count);
+        const uint32_t padded_count = (end - begin + MELT_CULL_BLOCK - 1) / MELT_CULL_BLOCK * MELT_CULL_BLOCK;
+        kernels.cull_boxes(&set->boxes, begin, padded_count, params, sizes);
+
+        for (uint32_t box = begin; box < end; ++box)
         {
-            uvec3_t extent = _get_max_aabb_extent(context, min_distance);
-            uint32_t volume = extent.x * extent.y * extent.z;
-            if (volume > max_extent.volume)
+            const float size = sizes[box - begin];
+            if (!(size > 0.0f) || size < min_size)
+                continue;
+
+            if (count < params->max_count)
             {
-                max_extent.extent = extent;
-                max_extent.position = min_distance->position;
-                max_extent.volume = max_extent.extent.x * max_extent.extent.y * max_extent.extent.z;
+                out_boxes[count] = box;
+                out_sizes[count] = size;
+                _selection_sift_up(out_boxes, out_sizes, count++);
+            }
+            else if (_selection_less(out_sizes[0], out_boxes[0], size, box))
+            {
+                out_boxes[0] = box;
+                out_sizes[0] = size;
+                _selection_sift_down(out_boxes, out_sizes, count, 0);
             }
         }
     }
 
+    // Popping the smallest box to the end leaves the largest first.
+    for (uint32_t heap_count = count; heap_count > 1; --heap_count)
+    {
+        const uint32_t box = out_boxes[0];
+        const float size = out_sizes[0];
+        out_boxes[0] = out_boxes[heap_count - 1];
+        out_sizes[0] = out_sizes[heap_count - 1];
+        out_boxes[heap_count - 1] = box;
+        out_sizes[heap_count - 1] = size;
+        _selection_sift_down(out_boxes, out_sizes, heap_count - 1, 0);
+    }
+
     MELT_PROFILE_END();
 
-    return max_extent;
+    return count;
 }
 
-void _init_context(_context_t* context, vec3_t voxel_count)
+
+// Children of a node are in structure of arrays form. A child with a count is a
+// leaf of count boxes from first, a child without is the node at index first.
+// Unused children have a count of 0 and a first of UINT32_MAX.
+typedef struct
 {
-    memset(context, 0, sizeof(_context_t));
-    context->dimension = _vec3_to_uvev3(voxel_count);
-    context->size = (uint32_t)voxel_count.x * (uint32_t)voxel_count.y * (uint32_t)voxel_count.z;
-    context->voxel_field = MELT_MALLOC(_voxel_status_t, context->size);
-    context->min_distance_field = MELT_MALLOC(_min_distance_t, context->size);
-    context->voxel_indices = MELT_MALLOC(int32_t, context->size);
-    context->voxel_set = MELT_MALLOC(_voxel_t, context->size);
-    for (uint32_t i = 0; i < context->size; ++i)
-        context->voxel_indices[i] = -1;
-}
+    float min_x[4];
+    float min_y[4];
+    float min_z[4];
+    float max_x[4];
+    float max_y[4];
+    float max_z[4];
+    uint32_t first[4];
+    uint32_t count[4];
+} _bvh_node_t;
+
+// Boxes are stored in leaf order as their center and half extent followed by
+// their number in the box set. The serialized form is the header followed by
+// the nodes and the boxes.
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t node_count;
+    uint32_t box_count;
+    uint32_t depth;
+    uint32_t reserved;
+} _bvh_header_t;
+
+struct melt_bvh_t
+{
+    _bvh_header_t header;
+    _bvh_node_t* nodes;
+    float* boxes;
+    uint32_t* box_numbers;
+};
 
-void _free_context(_context_t* context)
+typedef struct
 {
-    _free_per_plane_voxel_set(context);
-    MELT_FREE(context->voxel_indices);
-    MELT_FREE(context->voxel_field);
-    MELT_FREE(context->min_distance_field);
-    MELT_FREE(context->voxel_set);
+    const melt_box_set_t* set;
+    uint32_t* order;
+    _bvh_node_t* nodes;
+    uint32_t node_count;
+    uint32_t depth;
+} _bvh_builder_t;
+
+static float _aabb_half_area(_aabb_t aabb)
+{
+    const vec3_t size = _vec3_sub(aabb.max, aabb.min);
+    return size.x * size.y + size.y * size.z + size.z * size.x;
 }
 
-void melt_free_result(melt_result_t result)
+static _aabb_t _aabb_empty(void)
 {
-    MELT_FREE(result.mesh.vertices);
-    MELT_FREE(result.mesh.indices);
-    MELT_FREE(result.debug_mesh.vertices);
-    MELT_FREE(result.debug_mesh.indices);
+    _aabb_t aabb;
+    aabb.min = _vec3_init(FLT_MAX, FLT_MAX, FLT_MAX);
+    aabb.max = _vec3_init(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    return aabb;
 }
 
-int melt_generate_occluder(melt_params_t params, melt_result_t* out_result)
+static _aabb_t _aabb_merge(_aabb_t a, _aabb_t b)
 {
-    MELT_ASSERT(params._start_canary == 0 && params._end_canary == 0 && "Make sure to memset params to 0 before use");
-
-    vec3_t voxel_extent = _vec3_init(params.voxel_size, params.voxel_size, params.voxel_size);
-    vec3_t half_voxel_extent = _vec3_mulf(voxel_extent, 0.5f);
+    _aabb_t aabb;
+    aabb.min = _vec3_min(a.min, b.min);
+    aabb.max = _vec3_max(a.max, b.max);
+    return aabb;
+}
 
-    _aabb_t mesh_aabb = _generate_aabb_from_mesh(params.mesh);
+static vec3_t _set_box_center(const melt_box_set_t* set, uint32_t box)
+{
+    return _vec3_init(set->boxes.center_x[box], set->boxes.center_y[box], set->boxes.center_z[box]);
+}
 
-    mesh_aabb.min = _vec3_sub(_map_to_voxel_min_bound(mesh_aabb.min, params.voxel_size), voxel_extent);
-    mesh_aabb.max = _vec3_add(_map_to_voxel_max_bound(mesh_aabb.max, params.voxel_size), voxel_extent);
+static _aabb_t _set_box_aabb(const melt_box_set_t* set, uint32_t box)
+{
+    const vec3_t center = _set_box_center(set, box);
+    const vec3_t half_extent = _vec3_init(set->boxes.half_x[box], set->boxes.half_y[box], set->boxes.half_z[box]);
+    _aabb_t aabb;
+    aabb.min = _vec3_sub(center, half_extent);
+    aabb.max = _vec3_add(center, half_extent);
+    return aabb;
+}
 
-    vec3_t mesh_extent = _vec3_sub(mesh_aabb.max, mesh_aabb.min);
-    vec3_t inv_mesh_extent = _vec3_init(1.0f / mesh_extent.x, 1.0f / mesh_extent.y, 1.0f / mesh_extent.z);
-    vec3_t voxel_count = _vec3_div(mesh_extent, params.voxel_size);
-    vec3_t voxel_resolution = _vec3_mul(voxel_count, inv_mesh_extent);
+static _aabb_t _bvh_range_aabb(const _bvh_builder_t* builder, uint32_t begin, uint32_t end)
+{
+    _aabb_t aabb = _aabb_empty();
+    for (uint32_t i = begin; i < end; ++i)
+        aabb = _aabb_merge(aabb, _set_box_aabb(builder->set, builder->order[i]));
+    return aabb;
+}
 
-    _context_t context;
-    _init_context(&context, voxel_count);
+// Splits [begin, end) in two non empty ranges at the best of the bin boundaries
+// along the axis where the box centers spread the most. Returns the end of the
+// first range.
+static uint32_t _bvh_split(_bvh_builder_t* builder, uint32_t begin, uint32_t end)
+{
+    const melt_box_set_t* set = builder->set;
+    uint32_t* order = builder->order;
 
-    // Perform shell voxelization
-    for (uint32_t i = 0; i < params.mesh.index_count; i += 3)
+    _aabb_t centers = _aabb_empty();
+    for (uint32_t i = begin; i < end; ++i)
     {
-        MELT_PROFILE_BEGIN();
+        const vec3_t center = _set_box_center(set, order[i]);
+        centers.min = _vec3_min(centers.min, center);
+        centers.max = _vec3_max(centers.max, center);
+    }
 
-        _triangle_t triangle;
+    const vec3_t spread = _vec3_sub(centers.max, centers.min);
+    const uint32_t axis = spread.x >= spread.y && spread.x >= spread.z ? 0 : (spread.y >= spread.z ? 1 : 2);
+    const float axis_min = (&centers.min.x)[axis];
+    const float axis_spread = (&spread.x)[axis];
+    if (!(axis_spread > 0.0f))
+        return begin + (end - begin) / 2;
 
-        triangle.v0 = params.mesh.vertices[params.mesh.indices[i + 0]];
-        triangle.v1 = params.mesh.vertices[params.mesh.indices[i + 1]];
-        triangle.v2 = params.mesh.vertices[params.mesh.indices[i + 2]];
+    _aabb_t bins[MELT_BVH_BIN_COUNT];
+    uint32_t bin_counts[MELT_BVH_BIN_COUNT];
+    for (uint32_t bin = 0; bin < MELT_BVH_BIN_COUNT; ++bin)
+    {
+        bins[bin] = _aabb_empty();
+        bin_counts[bin] = 0;
+    }
 
-        _aabb_t triangle_aabb = _generate_aabb_from_triangle(&triangle);
+    const float bin_scale = MELT_BVH_BIN_COUNT / axis_spread;
+    for (uint32_t i = begin; i < end; ++i)
+    {
+        const float center = (&set->boxes.center_x)[axis][order[i]];
+        const uint32_t bin = _uint32_t_min((uint32_t)((center - axis_min) * bin_scale), MELT_BVH_BIN_COUNT - 1);
+        bins[bin] = _aabb_merge(bins[bin], _set_box_aabb(set, order[i]));
+        ++bin_counts[bin];
+    }
 
-        // Voxel snapping, snap the triangle extent to find the 3d grid to iterate on.
-        triangle_aabb.min = _vec3_sub(_map_to_voxel_min_bound(triangle_aabb.min, params.voxel_size), voxel_extent);
-        triangle_aabb.max = _vec3_add(_map_to_voxel_max_bound(triangle_aabb.max, params.voxel_size), voxel_extent);
+    // Cost of the split after each bin, from the areas swept from both sides
+    float right_costs[MELT_BVH_BIN_COUNT];
+    _aabb_t right = _aabb_empty();
+    uint32_t right_count = 0;
+    for (uint32_t bin = MELT_BVH_BIN_COUNT - 1; bin > 0; --bin)
+    {
+        right = _aabb_merge(right, bins[bin]);
+        right_count += bin_counts[bin];
+        right_costs[bin - 1] = right_count > 0 ? _aabb_half_area(right) * right_count : 0.0f;
+    }
 
-        for (float x = triangle_aabb.min.x; x <= triangle_aabb.max.x; x += params.voxel_size)
+    _aabb_t left = _aabb_empty();
+    uint32_t left_count = 0;
+    uint32_t best_bin = MELT_BVH_BIN_COUNT;
+    float best_cost = FLT_MAX;
+    for (uint32_t bin = 0; bin + 1 < MELT_BVH_BIN_COUNT; ++bin)
+    {
+        left = _aabb_merge(left, bins[bin]);
+        left_count += bin_counts[bin];
+        if (left_count == 0 || left_count == end - begin)
+            continue;
+        const float cost = _aabb_half_area(left) * left_count + right_costs[bin];
+        if (cost < best_cost)
         {
-            for (float y = triangle_aabb.min.y; y <= triangle_aabb.max.y; y += params.voxel_size)
-            {
-                for (float z = triangle_aabb.min.z; z <= triangle_aabb.max.z; z += params.voxel_size)
-                {
-                    _voxel_t voxel;
-
-                    voxel.aabb.min = _vec3_sub(_vec3_init(x, y, z), half_voxel_extent);
-                    voxel.aabb.max = _vec3_add(_vec3_init(x, y, z), half_voxel_extent);
-
-                    MELT_ASSERT(voxel.aabb.min.x >= mesh_aabb.min.x - half_voxel_extent.x);
-                    MELT_ASSERT(voxel.aabb.min.y >= mesh_aabb.min.y - half_voxel_extent.y);
-                    MELT_ASSERT(voxel.aabb.min.z >= mesh_aabb.min.z - half_voxel_extent.z);
+            best_cost = cost;
+            best_bin = bin;
+        }
+    }
 
-                    MELT_ASSERT(voxel.aabb.max.x <= mesh_aabb.max.x + half_voxel_extent.x);
-                    MELT_ASSERT(voxel.aabb.max.y <= mesh_aabb.max.y + half_voxel_extent.y);
-                    MELT_ASSERT(voxel.aabb.max.z <= mesh_aabb.max.z + half_voxel_extent.z);
+    if (best_bin == MELT_BVH_BIN_COUNT)
+        return begin + (end - begin) / 2;
 
-                    vec3_t voxel_center = _aabb_center(voxel.aabb);
-                    vec3_t relative_to_origin = _vec3_sub(_vec3_sub(voxel_center, mesh_aabb.min), half_voxel_extent);
+    uint32_t mid = begin;
+    for (uint32_t i = begin; i < end; ++i)
+    {
+        const float center = (&set->boxes.center_x)[axis][order[i]];
+        const uint32_t bin = _uint32_t_min((uint32_t)((center - axis_min) * bin_scale), MELT_BVH_BIN_COUNT - 1);
+        if (bin <= best_bin)
+        {
+            const uint32_t box = order[i];
+            order[i] = order[mid];
+            order[mid++] = box;
+        }
+    }
 
-                    if (!_aabb_intersects_triangle(&triangle, voxel_center, half_voxel_extent))
-                        continue;
-                    voxel.position = _vec3_to_uvev3(_vec3_mul(relative_to_origin, voxel_resolution));
+    MELT_ASSERT(mid > begin && mid < end);
+    return mid;
+}
 
-                    const uint32_t index = _flatten_3d(voxel.position, context.dimension);
-                    if (context.voxel_indices[index] != -1)
-                        continue;
+// Splits the range in up to four children by splitting the largest child
+// until there are four or all fit in a leaf. Returns the index of the node.
+static uint32_t _bvh_build_node(_bvh_builder_t* builder, uint32_t begin, uint32_t end, uint32_t depth)
+{
+    const uint32_t node_index = builder->node_count++;
+    if (depth + 1 > builder->depth)
+        builder->depth = depth + 1;
 
-                    context.voxel_indices[index] = (int32_t)context.voxel_set_count;
-                    context.voxel_set[context.voxel_set_count] = voxel;
-                    ++context.voxel_set_count;
-                }
-            }
+    uint32_t ranges[4][2] = { { begin, end } };
+    uint32_t range_count = 1;
+    while (range_count < 4)
+    {
+        uint32_t largest = range_count;
+        for (uint32_t i = 0; i < range_count; ++i)
+        {
+            const uint32_t count = ranges[i][1] - ranges[i][0];
+            if (count > MELT_BVH_LEAF_SIZE && (largest == range_count || count > ranges[largest][1] - ranges[largest][0]))
+                largest = i;
         }
-
-        MELT_PROFILE_END();
+        if (largest == range_count)
+            break;
+
+        const uint32_t mid = _bvh_split(builder, ranges[largest][0], ranges[largest][1]);
+        ranges[range_count][0] = mid;
+        ranges[range_count][1] = ranges[largest][1];
+        ranges[largest][1] = mid;
+        ++range_count;
     }
 
-    // Generate a flat voxel list per plane (x,y), (x,z), (y,z)
-    _generate_per_plane_voxel_set(&context);
-
-    // The minimum distance field is a data structure representing, for each voxel,
-    // the minimum distance that we can go in each of the positive directions x, y,
-    // z until we collide with a shell voxel. The voxel field is a data structure
-    // representing the state of the voxels. The clip status is a representation of
-    // whether a voxel is in the clip state, whether a voxel can 'see' a voxel in
-    // each of the directions +x,-x,+y,-y,+z,-z, and whether the voxel is an 'inner'
-    // voxel (contained within the shell voxels).
-
-    // Generate the minimum distance field, and voxel status from the initial shell.
+    _bvh_node_t node;
+    for (uint32_t i = 0; i < 4; ++i)
+    {
+        if (i >= range_count)
+        {
+            node.min_x[i] = node.min_y[i] = node.min_z[i] = FLT_MAX;
+            node.max_x[i] = node.max_y[i] = node.max_z[i] = -FLT_MAX;
+            node.first[i] = UINT32_MAX;
+            node.count[i] = 0;
+            continue;
+        }
 
-    _generate_fields(&context);
+        const _aabb_t aabb = _bvh_range_aabb(builder, ranges[i][0], ranges[i][1]);
+        node.min_x[i] = aabb.min.x;
+        node.min_y[i] = aabb.min.y;
+        node.min_z[i] = aabb.min.z;
+        node.max_x[i] = aabb.max.x;
+        node.max_y[i] = aabb.max.y;
+        node.max_z[i] = aabb.max.z;
 
-    if (!_water_tight_mesh(&context))
-    {
-        _free_context(&context);
-        return 0;
+        const uint32_t count = ranges[i][1] - ranges[i][0];
+        if (count <= MELT_BVH_LEAF_SIZE)
+        {
+            node.first[i] = ranges[i][0];
+            node.count[i] = count;
+        }
+        else
+        {
+            node.first[i] = _bvh_build_node(builder, ranges[i][0], ranges[i][1], depth + 1);
+            node.count[i] = 0;
+        }
     }
 
-    _debug_validate_min_distance_field(&context);
+    builder->nodes[node_index] = node;
+    return node_index;
+}
 
-    uint32_t volume = 0;
-    uint32_t total_volume = 0;
-    float fill_pct = 0.0f;
+static melt_bvh_t* _alloc_bvh(const _bvh_header_t* header)
+{
+    melt_bvh_t* bvh = MELT_MALLOC(melt_bvh_t, 1);
+    bvh->header = *header;
+    bvh->nodes = MELT_MALLOC(_bvh_node_t, (header->node_count > 0 ? header->node_count : 1));
+    bvh->boxes = MELT_MALLOC(float, ((size_t)header->box_count * 6 + 1));
+    bvh->box_numbers = MELT_MALLOC(uint32_t, (header->box_count + 1));
+    return bvh;
+}
 
-    // Approximate the volume of the mesh by the number of voxels that can fit within.
-    for (uint32_t i = 0; i < context.size; ++i)
-    {
-        const _min_distance_t* min_distance = &context.min_distance_field[i];
-        _voxel_status_t voxel_status = context.voxel_field[_flatten_3d(min_distance->position, context.dimension)];
+melt_bvh_t* melt_build_bvh(const melt_box_set_t* set)
+{
+    MELT_PROFILE_BEGIN();
 
-        // Each inner voxel adds one unit to the volume.
-        if (_inner_voxel(voxel_status))
-            ++total_volume;
+    // Every node has at least two children or a leaf, there are at most as
+    // many nodes as boxes.
+    _bvh_builder_t builder;
+    memset(&builder, 0, sizeof(_bvh_builder_t));
+    builder.set = set;
+    builder.order = MELT_MALLOC(uint32_t, (set->count + 1));
+    builder.nodes = MELT_MALLOC(_bvh_node_t, (set->count + 1));
+    for (uint32_t i = 0; i < set->count; ++i)
+        builder.order[i] = i;
+
+    if (set->count > 0)
+        _bvh_build_node(&builder, 0, set->count, 0);
+
+    _bvh_header_t header;
+    memset(&header, 0, sizeof(_bvh_header_t));
+    header.magic = MELT_BVH_MAGIC;
+    header.version = MELT_BVH_VERSION;
+    header.node_count = builder.node_count;
+    header.box_count = set->count;
+    header.depth = builder.depth;
+
+    melt_bvh_t* bvh = _alloc_bvh(&header);
+    memcpy(bvh->nodes, builder.nodes, builder.node_count * sizeof(_bvh_node_t));
+    for (uint32_t i = 0; i < set->count; ++i)
+    {
+        const uint32_t box = builder.order[i];
+        float* stored = bvh->boxes + (size_t)i * 6;
+        stored[0] = set->boxes.center_x[box];
+        stored[1] = set->boxes.center_y[box];
+        stored[2] = set->boxes.center_z[box];
+        stored[3] = set->boxes.half_x[box];
+        stored[4] = set->boxes.half_y[box];
+        stored[5] = set->boxes.half_z[box];
+        bvh->box_numbers[i] = box;
     }
 
-    _max_extent_t* max_extents = MELT_MALLOC(_max_extent_t, total_volume);
-    uint32_t max_extent_count = 0;
+    MELT_FREE(builder.order);
+    MELT_FREE(builder.nodes);
 
-    // One iteration to find an extent does the following:
-    // . Get the extent that maximizes the volume considering the minimum distance
-    //    field
-    // . Clip the max extent found to the set of inner voxels
-    // . Update the minimum distance field by adjusting the distances on the set
-    //    of inner voxels. This is done by extending the extent cube to infinity
-    //    on each of the axes +x, +y, +z
-    while (fill_pct < params.fill_pct && volume != total_volume)
-    {
-        _max_extent_t max_extent = _get_max_extent(&context);
+    MELT_PROFILE_END();
 
-        _clip_voxel_field(&context, max_extent.position, max_extent.extent);
+    return bvh;
+}
 
-        _update_min_distance_field(&context, max_extent.position, max_extent.extent);
+void melt_destroy_bvh(melt_bvh_t* bvh)
+{
+    MELT_FREE(bvh->nodes);
+    MELT_FREE(bvh->boxes);
+    MELT_FREE(bvh->box_numbers);
+    MELT_FREE(bvh);
+}
 
-        _debug_validate_min_distance_field(&context);
+size_t melt_get_bvh_serialized_size(const melt_bvh_t* bvh)
+{
+    return sizeof(_bvh_header_t) + bvh->header.node_count * sizeof(_bvh_node_t) +
+        (size_t)bvh->header.box_count * (6 * sizeof(float) + sizeof(uint32_t));
+}
 
-        max_extents[max_extent_count++] = max_extent;
+void melt_serialize_bvh(const melt_bvh_t* bvh, void* buffer)
+{
+    uint8_t* bytes = (uint8_t*)buffer;
+    memcpy(bytes, &bvh->header, sizeof(_bvh_header_t));
+    bytes += sizeof(_bvh_header_t);
+    memcpy(bytes, bvh->nodes, bvh->header.node_count * sizeof(_bvh_node_t));
+    bytes += bvh->header.node_count * sizeof(_bvh_node_t);
+    memcpy(bytes, bvh->boxes, (size_t)bvh->header.box_count * 6 * sizeof(float));
+    bytes += (size_t)bvh->header.box_count * 6 * sizeof(float);
+    memcpy(bytes, bvh->box_numbers, bvh->header.box_count * sizeof(uint32_t));
+}
 
-        fill_pct += (float)max_extent.volume / total_volume;
-        volume += max_extent.volume;
+// Checks that every child refers to a later node or to boxes in range, children
+// come after their parent so there is no cycle, and recomputes the depth the
+// traversal stack is sized from.
+static bool _validate_bvh(melt_bvh_t* bvh)
+{
+    const _bvh_header_t* header = &bvh->header;
+    uint32_t* depths = MELT_MALLOC(uint32_t, (header->node_count + 1));
+    memset(depths, 0, header->node_count * sizeof(uint32_t));
+
+    bool valid = true;
+    uint32_t depth = header->node_count > 0 ? 1 : 0;
+    if (header->node_count > 0)
+        depths[0] = 1;
+    for (uint32_t n = 0; n < header->node_count && valid; ++n)
+    {
+        const _bvh_node_t* node = &bvh->nodes[n];
+        for (uint32_t i = 0; i < 4 && valid; ++i)
+        {
+            const uint32_t first = node->first[i];
+            const uint32_t count = node->count[i];
+            if (first == UINT32_MAX)
+                continue;
+            if (count > 0)
+            {
+                valid = count <= MELT_BVH_LEAF_SIZE && first <= header->box_count && count <= header->box_count - first;
+                continue;
+            }
+            valid = first > n && first < header->node_count;
+            if (valid && depths[n] + 1 > depths[first])
+            {
+                depths[first] = depths[n] + 1;
+                if (depths[first] > depth)
+                    depth = depths[first];
+            }
+        }
     }
 
-    memset(out_result, 0, sizeof(melt_result_t));
+    MELT_FREE(depths);
+    bvh->header.depth = depth;
+    return valid;
+}
 
-    out_result->mesh.vertices = MELT_MALLOC(vec3_t, _vertex_count_per_aabb() * max_extent_count);
-    out_result->mesh.indices = MELT_MALLOC(uint16_t, _index_count_per_aabb(params.box_type_flags) * max_extent_count);
+melt_bvh_t* melt_deserialize_bvh(const void* data, size_t byte_size)
+{
+    _bvh_header_t header;
+    if (byte_size < sizeof(_bvh_header_t))
+        return NULL;
+    memcpy(&header, data, sizeof(_bvh_header_t));
+    if (header.magic != MELT_BVH_MAGIC || header.version != MELT_BVH_VERSION ||
+        header.node_count > header.box_count || (header.box_count > 0 && header.node_count == 0))
+        return NULL;
+
+    const size_t expected_size = sizeof(_bvh_header_t) + header.node_count * sizeof(_bvh_node_t) +
+        (size_t)header.box_count * (6 * sizeof(float) + sizeof(uint32_t));
+    if (byte_size != expected_size)
+        return NULL;
+
+    melt_bvh_t* bvh = _alloc_bvh(&header);
+    const uint8_t* bytes = (const uint8_t*)data + sizeof(_bvh_header_t);
+    memcpy(bvh->nodes, bytes, header.node_count * sizeof(_bvh_node_t));
+    bytes += header.node_count * sizeof(_bvh_node_t);
+    memcpy(bvh->boxes, bytes, (size_t)header.box_count * 6 * sizeof(float));
+    bytes += (size_t)header.box_count * 6 * sizeof(float);
+    memcpy(bvh->box_numbers, bytes, header.box_count * sizeof(uint32_t));
+
+    if (!_validate_bvh(bvh))
+    {
+        melt_destroy_bvh(bvh);
+        return NULL;
+    }
+    return bvh;
+}
 
-    for (uint32_t i = 0; i < max_extent_count; ++i)
+// Same test as the culling kernels
+static bool _box_visible(const melt_selection_params_t* view, vec3_t center, vec3_t half_extent)
+{
+    for (uint32_t p = 0; p < 6; ++p)
     {
-        const _max_extent_t* extent = &max_extents[i];
+        const float* plane = view->planes[p];
+        const float distance = plane[0] * center.x + plane[1] * center.y + plane[2] * center.z + plane[3];
+        const float radius = fabsf(plane[0]) * half_extent.x + fabsf(plane[1]) * half_extent.y + fabsf(plane[2]) * half_extent.z;
+        if (distance + radius < 0.0f)
+            return false;
+    }
+    return true;
+}
 
-        vec3_t half_extent = _vec3_mul(_uvec3_to_vec3(extent->extent), half_voxel_extent);
-        vec3_t voxel_position = _vec3_mul(_uvec3_to_vec3(extent->position), voxel_extent);
-        vec3_t voxel_position_biased_to_center = _vec3_add(voxel_position, half_extent);
-        vec3_t aabb_center = _vec3_add(mesh_aabb.min, voxel_position_biased_to_center);
+typedef struct
+{
+    uint32_t first;
+    uint32_t count;
+    float distance2;
+} _bvh_visit_t;
+
+// Children are visited by increasing distance from the eye to their center, the
+// nearest child is pushed last. Leaves are expanded the same way when popped.
+uint32_t melt_traverse_bvh(const melt_bvh_t* bvh, const melt_selection_params_t* view, uint32_t* out_boxes)
+{
+    if (bvh->header.node_count == 0 || view->max_count == 0)
+        return 0;
 
-        _add_voxel_to_mesh(_vec3_add(aabb_center, half_voxel_extent), half_extent, &out_result->mesh, params.box_type_flags);
-    }
+    MELT_PROFILE_BEGIN();
 
-    _debug_validate_max_extents(&context, max_extents, max_extent_count);
+    uint32_t box_count = 0;
 
-#if defined(MELT_DEBUG)
-    if (params.debug.flags > 0)
-    {
-        // _add_voxel_to_mesh(aabb_center(mesh_aabb), (mesh_aabb.max - mesh_aabb.min) * 0.5f, out_result->debug_mesh, _colors[0]);
+    const float min_size = view->min_projected_size > 0.0f ? view->min_projected_size : 0.0f;
+    _bvh_visit_t* stack = MELT_ALLOCA(_bvh_visit_t, (bvh->header.depth * 3 + 1 + MELT_BVH_LEAF_SIZE));
+    uint32_t stack_count = 0;
+    stack[stack_count].first = 0;
+    stack[stack_count++].count = 0;
 
-        if (params.debug.flags & MELT_DEBUG_TYPE_SHOW_OUTER)
+    while (stack_count > 0 && box_count < view->max_count)
+    {
+        const _bvh_visit_t visit = stack[--stack_count];
+        if (visit.count > 0)
         {
-            _add_voxel_set_to_mesh(context.voxel_set, context.voxel_set_count, _vec3_mulf(half_voxel_extent, params.debug.voxelScale), &out_result->debug_mesh);
+            const float* box = bvh->boxes + (size_t)visit.first * 6;
+            const vec3_t center = _vec3_init(box[0], box[1], box[2]);
+            const vec3_t half_extent = _vec3_init(box[3], box[4], box[5]);
+            const float dx = center.x - view->eye.x;
+            const float dy = center.y - view->eye.y;
+            const float dz = center.z - view->eye.z;
+            const float eye_distance2 = dx * dx + dy * dy + dz * dz;
+            const float radius2 = half_extent.x * half_extent.x + half_extent.y * half_extent.y + half_extent.z * half_extent.z;
+            const float size = eye_distance2 <= radius2 ? FLT_MAX : view->projection_scale * sqrtf(radius2 / eye_distance2);
+            if (visit.count == 1 && size >= min_size && _box_visible(view, center, half_extent))
+                out_boxes[box_count++] = bvh->box_numbers[visit.first];
+            if (visit.count == 1)
+                continue;
         }
-        if (params.debug.flags & MELT_DEBUG_TYPE_SHOW_SLICE_SELECTION)
+
+        _bvh_visit_t children[4];
+        uint32_t child_count = 0;
+        if (visit.count > 1)
         {
-            if (params.debug.voxel_y > 0 && params.debug.voxel_z > 0)
-            {
-                uint32_t index = _flatten_2d(_uvec2_init(params.debug.voxel_y, params.debug.voxel_z), _uvec2_init(context.dimension.y, context.dimension.z));
-                const _voxel_set_plane_t* voxels_x = &context.voxel_set_planes.x[index];
-                _add_voxel_set_to_mesh(voxels_x->voxels, voxels_x->voxel_count, _vec3_mulf(half_voxel_extent, params.debug.voxelScale), &out_result->debug_mesh);
-            }
-            if (params.debug.voxel_x > 0 && params.debug.voxel_z > 0)
+            // A leaf, its boxes are pushed one by one
+            for (uint32_t i = 0; i < visit.count; ++i)
             {
-                uint32_t index = _flatten_2d(_uvec2_init(params.debug.voxel_x, params.debug.voxel_z), _uvec2_init(context.dimension.x, context.dimension.z));
-                const _voxel_set_plane_t* voxels_y = &context.voxel_set_planes.y[index];
-                _add_voxel_set_to_mesh(voxels_y->voxels, voxels_y->voxel_count, _vec3_mulf(half_voxel_extent, params.debug.voxelScale), &out_result->debug_mesh);
-            }
-            if (params.debug.voxel_x > 0 && params.debug.voxel_y > 0)
-            {
-                uint32_t index = _flatten_2d(_uvec2_init(params.debug.voxel_x, params.debug.voxel_y), _uvec2_init(context.dimension.x, context.dimension.y));
-                const _voxel_set_plane_t* voxels_z = &context.voxel_set_planes.z[index];
-                _add_voxel_set_to_mesh(voxels_z->voxels, voxels_z->voxel_count, _vec3_mulf(half_voxel_extent, params.debug.voxelScale), &out_result->debug_mesh);
+                const float* box = bvh->boxes + (size_t)(visit.first + i) * 6;
+                const float dx = box[0] - view->eye.x;
+                const float dy = box[1] - view->eye.y;
+                const float dz = box[2] - view->eye.z;
+                children[child_count].first = visit.first + i;
+                children[child_count].count = 1;
+                children[child_count++].distance2 = dx * dx + dy * dy + dz * dz;
             }
         }
-        if (params.debug.flags & MELT_DEBUG_TYPE_SHOW_INNER)
+        else
         {
-            for (uint32_t i = 0; i < context.size; ++i)
+            const _bvh_node_t* node = &bvh->nodes[visit.first];
+            for (uint32_t i = 0; i < 4; ++i)
             {
-                const _min_distance_t* min_distance = &context.min_distance_field[i];
-                const uint32_t index = _flatten_3d(min_distance->position, context.dimension);
-                if (!context.voxel_field[index].inner)
+                if (node->first[i] == UINT32_MAX)
+                    continue;
+                const vec3_t min = _vec3_init(node->min_x[i], node->min_y[i], node->min_z[i]);
+                const vec3_t max = _vec3_init(node->max_x[i], node->max_y[i], node->max_z[i]);
+                const vec3_t center = _vec3_mulf(_vec3_add(min, max), 0.5f);
+                if (!_box_visible(view, center, _vec3_mulf(_vec3_sub(max, min), 0.5f)))
                     continue;
 
-                vec3_t voxel_position = _vec3_mul(_uvec3_to_vec3(min_distance->position), voxel_extent);
-                vec3_t voxel_center = _vec3_add(mesh_aabb.min, voxel_position);
-                if (params.debug.voxel_x < 0 ||
-                    params.debug.voxel_y < 0 ||
-                    params.debug.voxel_z < 0)
-                {
-                    _add_voxel_to_mesh_with_color(_vec3_add(voxel_center, voxel_extent), half_voxel_extent,
-                        &out_result->debug_mesh, MELT_OCCLUDER_BOX_TYPE_REGULAR, _color_steel_blue);
-                }
+                const vec3_t offset = _vec3_sub(center, view->eye);
+                children[child_count].first = node->first[i];
+                children[child_count].count = node->count[i];
+                children[child_count++].distance2 = offset.x * offset.x + offset.y * offset.y + offset.z * offset.z;
             }
         }
-        if (params.debug.flags & MELT_DEBUG_TYPE_SHOW_MIN_DISTANCE)
-        {
-            for (uint32_t i = 0; i < context.size; ++i)
-            {
-                const _min_distance_t* min_distance = &context.min_distance_field[i];
-                vec3_t voxel_center = _vec3_add(mesh_aabb.min, _vec3_mul(_uvec3_to_vec3(min_distance->position), voxel_extent));
-                if ((uint32_t)params.debug.voxel_x == min_distance->x &&
-                    (uint32_t)params.debug.voxel_y == min_distance->y &&
-                    (uint32_t)params.debug.voxel_z == min_distance->z)
-                {
-                    _add_voxel_to_mesh_with_color(_vec3_add(voxel_center, voxel_extent), half_voxel_extent, &out_result->debug_mesh,
-                        MELT_OCCLUDER_BOX_TYPE_REGULAR, _color_steel_blue);
 
-                    for (uint32_t x = min_distance->x; x < min_distance->x + min_distance->dist.x; ++x)
-                    {
-                        vec3_t voxel_center_x = _vec3_add(mesh_aabb.min, _vec3_mul(_vec3_init(x, min_distance->y, min_distance->z), voxel_extent));
-                        _add_voxel_to_mesh_with_color(_vec3_add(voxel_center_x, voxel_extent), half_voxel_extent,
-                            &out_result->debug_mesh, MELT_OCCLUDER_BOX_TYPE_REGULAR, _color_steel_blue);
-                    }
-                    for (uint32_t y = min_distance->y; y < min_distance->y + min_distance->dist.y; ++y)
-                    {
-                        vec3_t voxel_center_y = _vec3_add(mesh_aabb.min, _vec3_mul(_vec3_init(min_distance->x, y, min_distance->z), voxel_extent));
-                        _add_voxel_to_mesh_with_color(_vec3_add(voxel_center_y, voxel_extent), half_voxel_extent,
-                            &out_result->debug_mesh, MELT_OCCLUDER_BOX_TYPE_REGULAR, _color_steel_blue);
-                    }
-                    for (uint32_t z = min_distance->z; z < min_distance->z + min_distance->dist.z; ++z)
-                    {
-                        vec3_t voxel_center_z = _vec3_add(mesh_aabb.min, _vec3_mul(_vec3_init(min_distance->x, min_distance->y, z), voxel_extent));
-                        _add_voxel_to_mesh_with_color(_vec3_add(voxel_center_z, voxel_extent), half_voxel_extent,
-                            &out_result->debug_mesh, MELT_OCCLUDER_BOX_TYPE_REGULAR, _color_steel_blue);
-                    }
-                }
-            }
-        }
-        if (params.debug.flags & MELT_DEBUG_TYPE_SHOW_EXTENT)
-        {
-            for (uint32_t i = 0; i < context.size; ++i)
-            {
-                const _min_distance_t* min_distance = &context.min_distance_field[i];
-                uvec3_t max_extent = _get_max_aabb_extent(&context, min_distance);
-                for (uint32_t x = min_distance->x; x < min_distance->x + max_extent.x; ++x)
-                {
-                    for (uint32_t y = min_distance->y; y < min_distance->y + max_extent.y; ++y)
-                    {
-                        for (uint32_t z = min_distance->z; z < min_distance->z + max_extent.z; ++z)
-                        {
-                            vec3_t voxel_center = _vec3_add(mesh_aabb.min, _vec3_mul(_vec3_init(x, y, z), voxel_extent));
-                            _add_voxel_to_mesh_with_color(_vec3_add(voxel_center, voxel_extent), half_voxel_extent, &out_result->debug_mesh,
-                                MELT_OCCLUDER_BOX_TYPE_REGULAR, _color_steel_blue);
-                        }
-                    }
-                }
-            }
-        }
-        if (params.debug.flags & MELT_DEBUG_TYPE_SHOW_RESULT)
+        // Insertion sort by decreasing distance, then pushed in that order
+        for (uint32_t i = 1; i < child_count; ++i)
         {
-            out_result->debug_mesh.vertices = MELT_MALLOC(vec3_t, _vertex_count_per_aabb() * max_extent_count * 2);
-            out_result->debug_mesh.indices = MELT_MALLOC(uint16_t, _index_count_per_aabb(params.box_type_flags) * max_extent_count);
-
-            for (size_t i = 0; i < max_extent_count; ++i)
-            {
-                const _max_extent_t* extent = &max_extents[i];
-                if ((int32_t)i == params.debug.extent_index || params.debug.extent_index < 0)
-                {
-                    vec3_t half_extent = _vec3_mul(_uvec3_to_vec3(extent->extent), half_voxel_extent);
-                    vec3_t voxel_position = _vec3_mul(_uvec3_to_vec3(extent->position), voxel_extent);
-                    vec3_t voxel_position_biased_to_center = _vec3_add(voxel_position, half_extent);
-                    vec3_t aabb_center = _vec3_add(mesh_aabb.min, voxel_position_biased_to_center);
-                    color_3u8_t color = _colors[i % MELT_ARRAY_LENGTH(_colors)];
-                    _add_voxel_to_mesh_with_color(_vec3_add(aabb_center, half_voxel_extent), half_extent, &out_result->debug_mesh, params.box_type_flags, color);
-                }
-            }
-
-            MELT_ASSERT(out_result->debug_mesh.vertex_count == _vertex_count_per_aabb() * max_extent_count * 2);
-            MELT_ASSERT(out_result->debug_mesh.index_count ==  _index_count_per_aabb(params.box_type_flags) * max_extent_count);
+            const _bvh_visit_t child = children[i];
+            uint32_t j = i;
+            for (; j > 0 && children[j - 1].distance2 < child.distance2; --j)
+                children[j] = children[j - 1];
+            children[j] = child;
         }
+        for (uint32_t i = 0; i < child_count; ++i)
+            stack[stack_count++] = children[i];
     }
-#endif
 
-    _free_context(&context);
-    MELT_FREE(max_extents);
-    return 1;
+    MELT_PROFILE_END();
+
+    return box_count;
 }
 
 #ifdef _MSC_VER
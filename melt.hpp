@@ -0,0 +1,277 @@
+//
+// The MIT License (MIT)
+//
+// Copyright (c) 2019 Karim Naaji, karim.naaji@gmail.com
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// Optional C++17 interface over melt.h.
+//
+// How to use:
+//  Include melt.hpp instead of melt.h, the implementation is still compiled in a
+//  single compilation unit that defines MELT_IMPLEMENTATION before including it.
+//
+//  std::vector<melt_vec3_t> vertices = ...;
+//  std::vector<uint16_t> indices = ...;
+//  melt::Result result = melt::generate(vertices, indices, melt::Params().voxel_size(0.25f));
+//  if (result)
+//      upload(result.vertices(), result.indices());
+//
+// Meshes are viewed, never copied. Results own the output buffers, they are
+// move-only and free the buffers when destroyed.
+//
+
+#ifndef MELT_HPP
+#define MELT_HPP
+
+#include "melt.h"
+
+#include <cstddef>
+#include <cstring>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+
+#if defined(__has_include)
+#if __has_include(<span>) && __cplusplus > 201703L
+#include <span>
+#define MELT_STD_SPAN
+#endif
+#endif
+
+namespace melt
+{
+
+#if defined(MELT_STD_SPAN)
+template <typename T>
+using Span = std::span<T>;
+#else
+// Subset of std::span for C++17, a view over contiguous elements.
+template <typename T>
+class Span
+{
+public:
+    using element_type = T;
+    using value_type = std::remove_cv_t<T>;
+    using size_type = std::size_t;
+    using pointer = T*;
+    using reference = T&;
+    using iterator = T*;
+
+    constexpr Span() noexcept = default;
+    constexpr Span(T* data, size_type size) noexcept : data_(data), size_(size) {}
+
+    template <std::size_t N>
+    constexpr Span(T (&array)[N]) noexcept : data_(array), size_(N) {}
+
+    // Any contiguous container of compatible elements: std::vector, std::array,
+    // another span.
+    template <typename Container,
+        typename = std::enable_if_t<!std::is_array<std::remove_reference_t<Container>>::value>,
+        typename Data = decltype(std::data(std::declval<Container&>())),
+        typename = std::enable_if_t<std::is_convertible<Data, T*>::value>,
+        typename = decltype(std::size(std::declval<Container&>()))>
+    constexpr Span(Container&& container) noexcept : data_(std::data(container)), size_(std::size(container)) {}
+
+    constexpr T* data() const noexcept { return data_; }
+    constexpr size_type size() const noexcept { return size_; }
+    constexpr bool empty() const noexcept { return size_ == 0; }
+    constexpr T& operator[](size_type index) const noexcept { return data_[index]; }
+    constexpr T* begin() const noexcept { return data_; }
+    constexpr T* end() const noexcept { return data_ + size_; }
+
+private:
+    T* data_ = nullptr;
+    size_type size_ = 0;
+};
+#endif
+
+// Owns the buffers of a generation, see melt_generate_occluder.
+class Result
+{
+public:
+    Result() noexcept { std::memset(&result_, 0, sizeof(melt_result_t)); }
+
+    // Takes ownership of a result returned by the C interface.
+    explicit Result(const melt_result_t& result) noexcept : result_(result), generated_(result.status == MELT_STATUS_SUCCESS) {}
+
+    ~Result() { reset(); }
+
+    Result(Result&& other) noexcept : result_(other.result_), generated_(other.generated_)
+    {
+        other.forget();
+    }
+
+    Result& operator=(Result&& other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            result_ = other.result_;
+            generated_ = other.generated_;
+            other.forget();
+        }
+        return *this;
+    }
+
+    Result(const Result&) = delete;
+    Result& operator=(const Result&) = delete;
+
+    // True when the occluder was generated, status() tells why otherwise.
+    explicit operator bool() const noexcept { return generated_; }
+    melt_status_t status() const noexcept { return result_.status; }
+
+    Span<const melt_vec3_t> vertices() const noexcept { return { result_.mesh.vertices, result_.mesh.vertex_count }; }
+    Span<const uint16_t> indices() const noexcept { return { result_.mesh.indices, result_.mesh.indices ? result_.mesh.index_count : 0 }; }
+    Span<const uint32_t> indices32() const noexcept { return { result_.mesh.indices32, result_.mesh.indices32 ? result_.mesh.index_count : 0 }; }
+    const melt_instances_t& instances() const noexcept { return result_.instances; }
+    const melt_occupancy_t& occupancy() const noexcept { return result_.occupancy; }
+
+    // Indices facing a direction, see melt_params_t::face_buckets.
+    Span<const uint16_t> face_indices(melt_face_t face) const noexcept
+    {
+        return { result_.mesh.indices ? result_.mesh.indices + result_.face_offsets[face] : nullptr,
+            result_.mesh.indices ? result_.face_offsets[face + 1] - result_.face_offsets[face] : 0 };
+    }
+    Span<const uint32_t> face_indices32(melt_face_t face) const noexcept
+    {
+        return { result_.mesh.indices32 ? result_.mesh.indices32 + result_.face_offsets[face] : nullptr,
+            result_.mesh.indices32 ? result_.face_offsets[face + 1] - result_.face_offsets[face] : 0 };
+    }
+    const melt_stats_t& stats() const noexcept { return result_.stats; }
+
+    const melt_result_t& get() const noexcept { return result_; }
+
+    // Hands the buffers over, they have to be freed with melt_free_result.
+    melt_result_t release() noexcept
+    {
+        melt_result_t result = result_;
+        forget();
+        return result;
+    }
+
+    void reset() noexcept
+    {
+        if (generated_)
+            melt_free_result(result_);
+        forget();
+    }
+
+private:
+    void forget() noexcept
+    {
+        std::memset(&result_, 0, sizeof(melt_result_t));
+        generated_ = false;
+    }
+
+    melt_result_t result_;
+    bool generated_ = false;
+};
+
+// Builds melt_params_t, zero initialized with a full regular occluder by default.
+class Params
+{
+public:
+    Params() noexcept
+    {
+        std::memset(&params_, 0, sizeof(melt_params_t));
+        params_.fill_pct = 1.0f;
+        params_.box_type_flags = MELT_OCCLUDER_BOX_TYPE_REGULAR;
+    }
+
+    // The mesh is viewed, it has to outlive the generation. It is never written
+    // to, the C interface only takes it as non-const.
+    Params& mesh(Span<const melt_vec3_t> vertices, Span<const uint16_t> indices) noexcept
+    {
+        params_.mesh.vertices = const_cast<melt_vec3_t*>(vertices.data());
+        params_.mesh.vertex_count = static_cast<uint32_t>(vertices.size());
+        params_.mesh.indices = const_cast<uint16_t*>(indices.data());
+        params_.mesh.index_count = static_cast<uint32_t>(indices.size());
+        return *this;
+    }
+
+    Params& voxel_size(float voxel_size) noexcept { params_.voxel_size = voxel_size; return *this; }
+    Params& fill_pct(float fill_pct) noexcept { params_.fill_pct = fill_pct; return *this; }
+    Params& box_types(melt_occluder_box_type_flags_t flags) noexcept { params_.box_type_flags = flags; return *this; }
+    Params& isa(melt_isa_t isa) noexcept { params_.isa = isa; return *this; }
+    Params& thread_count(uint32_t thread_count) noexcept { params_.thread_count = thread_count; return *this; }
+    Params& index_width(melt_index_width_t index_width) noexcept { params_.index_width = index_width; return *this; }
+    Params& reference(bool reference) noexcept { params_.reference = reference ? 1 : 0; return *this; }
+    Params& instance_format(melt_instance_format_t format) noexcept { params_.instance_format = format; return *this; }
+    Params& occupancy(bool occupancy) noexcept { params_.occupancy = occupancy ? 1 : 0; return *this; }
+    Params& deterministic(bool deterministic) noexcept { params_.deterministic = deterministic ? 1 : 0; return *this; }
+    Params& face_buckets(bool face_buckets) noexcept { params_.face_buckets = face_buckets ? 1 : 0; return *this; }
+    Params& closing_radius(uint32_t closing_radius) noexcept { params_.closing_radius = closing_radius; return *this; }
+    Params& ground_cap(bool ground_cap) noexcept { params_.ground_cap = ground_cap ? 1 : 0; return *this; }
+
+    Params& progress(melt_progress_callback_t callback, void* user_data = nullptr) noexcept
+    {
+        params_.progress_callback = callback;
+        params_.progress_user_data = user_data;
+        return *this;
+    }
+
+    Params& cancel_flag(const volatile uint32_t* cancel_flag) noexcept { params_.cancel_flag = cancel_flag; return *this; }
+
+    // Binary PLY export, see melt_params_t::export_flags.
+    Params& export_ply(melt_export_type_flags_t flags, melt_write_callback_t callback, void* user_data) noexcept
+    {
+        params_.export_flags = flags;
+        params_.export_callback = callback;
+        params_.export_user_data = user_data;
+        return *this;
+    }
+
+    // Working memory, see melt_params_t::scratch_buffer.
+    Params& scratch_buffer(void* buffer, std::size_t size) noexcept
+    {
+        params_.scratch_buffer = buffer;
+        params_.scratch_buffer_size = size;
+        return *this;
+    }
+
+    const melt_params_t& get() const noexcept { return params_; }
+
+private:
+    melt_params_t params_;
+};
+
+inline Result generate(const Params& params)
+{
+    melt_result_t result;
+    melt_generate_occluder(params.get(), &result);
+    return Result(result);
+}
+
+inline Result generate(Span<const melt_vec3_t> vertices, Span<const uint16_t> indices, Params params = Params())
+{
+    return generate(params.mesh(vertices, indices));
+}
+
+// Contiguous containers of melt_vec3_t and uint16_t, e.g. std::vector or std::array.
+template <typename Vertices, typename Indices>
+inline auto generate(const Vertices& vertices, const Indices& indices, Params params = Params())
+    -> decltype(Span<const melt_vec3_t>(vertices), Span<const uint16_t>(indices), Result())
+{
+    return generate(Span<const melt_vec3_t>(vertices), Span<const uint16_t>(indices), std::move(params));
+}
+
+} // namespace melt
+
+#endif // MELT_HPP
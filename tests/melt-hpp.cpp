@@ -0,0 +1,136 @@
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+#define MELT_IMPLEMENTATION
+#include "melt.hpp"
+
+#include <algorithm>
+#include <array>
+#include <type_traits>
+#include <vector>
+
+// Unit cube, triangles facing outwards
+static const std::array<melt_vec3_t, 8> cube_vertices =
+{{
+    { -1.0f, -1.0f, -1.0f }, {  1.0f, -1.0f, -1.0f }, {  1.0f,  1.0f, -1.0f }, { -1.0f,  1.0f, -1.0f },
+    { -1.0f, -1.0f,  1.0f }, {  1.0f, -1.0f,  1.0f }, {  1.0f,  1.0f,  1.0f }, { -1.0f,  1.0f,  1.0f },
+}};
+
+static const std::vector<uint16_t> cube_indices =
+{
+    0, 2, 1, 0, 3, 2,
+    4, 5, 6, 4, 6, 7,
+    0, 1, 5, 0, 5, 4,
+    3, 6, 2, 3, 7, 6,
+    0, 4, 7, 0, 7, 3,
+    1, 2, 6, 1, 6, 5,
+};
+
+static_assert(!std::is_copy_constructible<melt::Result>::value, "Results are move-only");
+static_assert(std::is_nothrow_move_constructible<melt::Result>::value, "Results are move-only");
+
+TEST_CASE("melt.hpp.generate", "")
+{
+    melt::Params params;
+    params.voxel_size(0.25f).fill_pct(1.0f).box_types(MELT_OCCLUDER_BOX_TYPE_REGULAR);
+
+    // The builder matches hand filled parameters.
+    melt_params_t c_params;
+    memset(&c_params, 0, sizeof(melt_params_t));
+    c_params.mesh.vertices = const_cast<melt_vec3_t*>(cube_vertices.data());
+    c_params.mesh.vertex_count = (uint32_t)cube_vertices.size();
+    c_params.mesh.indices = const_cast<uint16_t*>(cube_indices.data());
+    c_params.mesh.index_count = (uint32_t)cube_indices.size();
+    c_params.voxel_size = 0.25f;
+    c_params.fill_pct = 1.0f;
+    c_params.box_type_flags = MELT_OCCLUDER_BOX_TYPE_REGULAR;
+
+    melt_result_t expected;
+    REQUIRE(melt_generate_occluder(c_params, &expected));
+
+    melt::Result result = melt::generate(cube_vertices, cube_indices, params);
+    REQUIRE(result);
+    REQUIRE(result.status() == MELT_STATUS_SUCCESS);
+
+    // Views alias the result buffers.
+    REQUIRE(result.vertices().size() == expected.mesh.vertex_count);
+    REQUIRE(result.indices().size() == expected.mesh.index_count);
+    REQUIRE(result.vertices().data() == result.get().mesh.vertices);
+    REQUIRE(memcmp(result.vertices().data(), expected.mesh.vertices, expected.mesh.vertex_count * sizeof(melt_vec3_t)) == 0);
+    REQUIRE(memcmp(result.indices().data(), expected.mesh.indices, expected.mesh.index_count * sizeof(uint16_t)) == 0);
+
+    uint32_t index_count = 0;
+    for (uint16_t index : result.indices())
+    {
+        REQUIRE(index < result.vertices().size());
+        ++index_count;
+    }
+    REQUIRE(index_count == expected.mesh.index_count);
+
+    const uint32_t expected_vertex_count = expected.mesh.vertex_count;
+    melt_free_result(expected);
+
+    // Moving hands the buffers over without copying them.
+    const melt_vec3_t* vertices = result.vertices().data();
+    melt::Result moved = std::move(result);
+    REQUIRE(!result);
+    REQUIRE(result.vertices().empty());
+    REQUIRE(moved);
+    REQUIRE(moved.vertices().data() == vertices);
+
+    melt::Result assigned;
+    REQUIRE(!assigned);
+    assigned = std::move(moved);
+    REQUIRE(assigned.vertices().data() == vertices);
+
+    // Released buffers are owned by the caller again.
+    melt_result_t released = assigned.release();
+    REQUIRE(!assigned);
+    REQUIRE(released.mesh.vertices == vertices);
+    melt_free_result(released);
+
+    // Raw pointers and spans select the same mesh as containers.
+    melt::Result from_spans = melt::generate(melt::Span<const melt_vec3_t>(cube_vertices.data(), cube_vertices.size()),
+        melt::Span<const uint16_t>(cube_indices), params);
+    REQUIRE(from_spans);
+    REQUIRE(from_spans.vertices().size() == expected_vertex_count);
+
+    melt::Result from_params = melt::generate(melt::Params(params).mesh(cube_vertices, cube_indices));
+    REQUIRE(from_params);
+    REQUIRE(from_params.vertices().size() == expected_vertex_count);
+
+    melt::Result wide = melt::generate(cube_vertices, cube_indices, melt::Params(params).index_width(MELT_INDEX_WIDTH_32));
+    REQUIRE(wide);
+    REQUIRE(wide.indices().empty());
+    REQUIRE(wide.indices32().size() == from_params.indices().size());
+    REQUIRE(std::equal(wide.indices32().begin(), wide.indices32().end(), from_params.indices().begin()));
+
+    // Face buckets are the same with either index width.
+    melt::Result buckets = melt::generate(cube_vertices, cube_indices, melt::Params(params).face_buckets(true));
+    melt::Result wide_buckets = melt::generate(cube_vertices, cube_indices, melt::Params(params).face_buckets(true).index_width(MELT_INDEX_WIDTH_32));
+    REQUIRE(buckets);
+    REQUIRE(wide_buckets);
+    for (uint32_t face = 0; face < MELT_FACE_COUNT; ++face)
+    {
+        REQUIRE(buckets.face_indices32((melt_face_t)face).empty());
+        REQUIRE(wide_buckets.face_indices((melt_face_t)face).empty());
+        const melt::Span<const uint16_t> indices = buckets.face_indices((melt_face_t)face);
+        const melt::Span<const uint32_t> indices32 = wide_buckets.face_indices32((melt_face_t)face);
+        REQUIRE(indices32.size() == indices.size());
+        REQUIRE(std::equal(indices32.begin(), indices32.end(), indices.begin()));
+    }
+}
+
+TEST_CASE("melt.hpp.failure", "")
+{
+    // A cancelled generation owns nothing.
+    const uint32_t cancel_flag = 1;
+    melt::Result result = melt::generate(cube_vertices, cube_indices, melt::Params().voxel_size(0.25f).cancel_flag(&cancel_flag));
+    REQUIRE(!result);
+    REQUIRE(result.status() == MELT_STATUS_CANCELLED);
+    REQUIRE(result.vertices().empty());
+    REQUIRE(result.indices().empty());
+
+    melt::Result moved = std::move(result);
+    REQUIRE(!moved);
+    REQUIRE(moved.status() == MELT_STATUS_CANCELLED);
+}
@@ -0,0 +1,118 @@
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+#include <atomic>
+#include <stdlib.h>
+// Counts the heap allocations of melt. This configuration is kept out of the
+// unit tests, which run the default one.
+static std::atomic<uint32_t> g_malloc_count(0);
+#define MELT_MALLOC(T, N) (++g_malloc_count, (T*)malloc(N * sizeof(T)))
+#define MELT_FREE(T) free(T)
+// Small grids are generated from the stack
+#define MELT_STACK_SCRATCH_SIZE (64 * 1024)
+#define MELT_DEBUG
+#define MELT_ASSERT(stmt) assert(stmt)
+#define MELT_IMPLEMENTATION
+#include "melt.h"
+#define TINYOBJLOADER_IMPLEMENTATION
+#include "tiny_obj_loader.h"
+
+#include <vector>
+
+static bool LoadModelMesh(const char* model_path, melt_params_t& melt_params)
+{
+    std::vector<tinyobj::shape_t> shapes;
+    std::vector<tinyobj::material_t> materials;
+    std::string error;
+    if (!tinyobj::LoadObj(shapes, materials, error, model_path, NULL) || !error.empty() || shapes.empty())
+        return false;
+
+    const tinyobj::mesh_t& mesh = shapes[0].mesh;
+    MELT_FREE(melt_params.mesh.vertices);
+    MELT_FREE(melt_params.mesh.indices);
+    melt_params.mesh.vertex_count = (uint32_t)(mesh.positions.size() / 3);
+    melt_params.mesh.index_count = (uint32_t)mesh.indices.size();
+    melt_params.mesh.vertices = MELT_MALLOC(melt_vec3_t, melt_params.mesh.vertex_count);
+    melt_params.mesh.indices = MELT_MALLOC(uint16_t, melt_params.mesh.index_count);
+
+    for (uint32_t i = 0; i < melt_params.mesh.index_count; ++i)
+        melt_params.mesh.indices[i] = (uint16_t)mesh.indices[i];
+    for (uint32_t v = 0; v < melt_params.mesh.vertex_count; ++v)
+    {
+        melt_params.mesh.vertices[v].x = mesh.positions[3 * v + 0];
+        melt_params.mesh.vertices[v].y = mesh.positions[3 * v + 1];
+        melt_params.mesh.vertices[v].z = mesh.positions[3 * v + 2];
+    }
+
+    return true;
+}
+
+static void RequireSameMesh(const melt_mesh_t& a, const melt_mesh_t& b)
+{
+    REQUIRE(a.vertex_count == b.vertex_count);
+    REQUIRE(a.index_count == b.index_count);
+    REQUIRE(memcmp(a.vertices, b.vertices, a.vertex_count * sizeof(melt_vec3_t)) == 0);
+    REQUIRE(memcmp(a.indices, b.indices, a.index_count * sizeof(uint16_t)) == 0);
+}
+
+TEST_CASE("melt.scratch", "")
+{
+    melt_params_t params;
+    memset(&params, 0, sizeof(melt_params_t));
+    params.fill_pct = 1.0f;
+    params.box_type_flags = MELT_OCCLUDER_BOX_TYPE_REGULAR;
+
+    REQUIRE(LoadModelMesh("models/cube.obj", params));
+
+    // A tiny grid fits the stack scratch buffer, only the output is allocated.
+    params.voxel_size = 0.5f;
+    uint32_t malloc_count = g_malloc_count;
+    melt_result_t tiny;
+    REQUIRE(melt_generate_occluder(params, &tiny));
+    REQUIRE(g_malloc_count == malloc_count + 2);
+    REQUIRE(tiny.stats.scratch_bytes <= MELT_STACK_SCRATCH_SIZE);
+    melt_free_result(tiny);
+
+    REQUIRE(LoadModelMesh("models/suzanne.obj", params));
+    params.voxel_size = 0.1f;
+
+    melt_result_t heap;
+    malloc_count = g_malloc_count;
+    REQUIRE(melt_generate_occluder(params, &heap));
+    REQUIRE(g_malloc_count > malloc_count + 2);
+
+    // The reported size serves the whole generation from the caller's buffer,
+    // which changes where the buffers live and nothing else.
+    std::vector<uint8_t> scratch(heap.stats.scratch_bytes);
+    params.scratch_buffer = scratch.data();
+    params.scratch_buffer_size = scratch.size();
+
+    melt_result_t scratched;
+    malloc_count = g_malloc_count;
+    REQUIRE(melt_generate_occluder(params, &scratched));
+    REQUIRE(g_malloc_count == malloc_count + 2);
+    RequireSameMesh(heap.mesh, scratched.mesh);
+    REQUIRE(scratched.stats.scratch_bytes <= scratch.size());
+
+    // Time sliced generations keep using it across steps.
+    melt_generation_t* generation = melt_begin_generation(params);
+    while (!melt_step(generation, 1))
+        ;
+    melt_result_t sliced;
+    REQUIRE(melt_end_generation(generation, &sliced));
+    RequireSameMesh(heap.mesh, sliced.mesh);
+
+    // Buffers that do not fit fall back to the heap.
+    params.scratch_buffer_size = scratch.size() / 4;
+    melt_result_t partial;
+    malloc_count = g_malloc_count;
+    REQUIRE(melt_generate_occluder(params, &partial));
+    REQUIRE(g_malloc_count > malloc_count + 2);
+    RequireSameMesh(heap.mesh, partial.mesh);
+
+    melt_free_result(heap);
+    melt_free_result(scratched);
+    melt_free_result(sliced);
+    melt_free_result(partial);
+    MELT_FREE(params.mesh.vertices);
+    MELT_FREE(params.mesh.indices);
+}
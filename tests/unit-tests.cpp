@@ -8,6 +8,12 @@
 #include "tiny_obj_loader.h"
 
 #include <math.h>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
 
 #define FABS(x) ((float)fabs(x))
 #define USE_EPSILON_TEST TRUE
@@ -418,6 +424,34 @@ TEST_CASE("melt.cube", "")
     REQUIRE(melt_generate_occluder(params, &result));
     REQUIRE(EnsureMeshExclusive(params.mesh, result.mesh));
 
+    melt_free_result(result);
+
+    // The shell mask, the shell voxels and the plane voxel lists are released
+    // once their phase is done, the peak stays below all of them held at once
+    // with the fields and the output.
+    melt_generation_t* generation = melt_begin_generation(params);
+    const uint32_t size = generation->context.size;
+    size_t voxel_set_byte_size = 0;
+    size_t planes_byte_size = 0;
+    while (generation->state != _GENERATION_STATE_DONE)
+    {
+        const _context_t& context = generation->context;
+        const _voxel_set_planes_t& planes = context.voxel_set_planes;
+        voxel_set_byte_size = std::max(voxel_set_byte_size, context.voxel_set_capacity * sizeof(_voxel_t));
+        planes_byte_size = std::max(planes_byte_size, (planes.x_count + planes.y_count + planes.z_count) * sizeof(_voxel_set_plane_t) +
+            3 * planes.voxel_count * sizeof(_voxel_t));
+        _step_generation_unit(generation);
+    }
+    REQUIRE(melt_end_generation(generation, &result));
+
+    const size_t shell_mask_byte_size = (size + 31) / 32 * sizeof(uint32_t);
+    const size_t fields_byte_size = size * (sizeof(_voxel_status_t) + 3 * sizeof(uint32_t));
+    const size_t output_byte_size = result.mesh.vertex_count * sizeof(melt_vec3_t) + result.mesh.index_count * sizeof(uint16_t);
+    REQUIRE(voxel_set_byte_size > 0);
+    REQUIRE(planes_byte_size > 0);
+    REQUIRE(result.stats.peak_memory_bytes >= fields_byte_size + output_byte_size);
+    REQUIRE(result.stats.peak_memory_bytes < shell_mask_byte_size + voxel_set_byte_size + planes_byte_size + fields_byte_size + output_byte_size);
+
     melt_free_result(result);
     MELT_FREE(params.mesh.vertices);
     MELT_FREE(params.mesh.indices);
@@ -482,3 +516,2057 @@ TEST_CASE("melt.column", "")
     MELT_FREE(params.mesh.vertices);
     MELT_FREE(params.mesh.indices);
 }
+
+static bool MeshEquals(const melt_mesh_t& mesh0, const melt_mesh_t& mesh1)
+{
+    return mesh0.vertex_count == mesh1.vertex_count &&
+           mesh0.index_count == mesh1.index_count &&
+           memcmp(mesh0.vertices, mesh1.vertices, mesh0.vertex_count * sizeof(melt_vec3_t)) == 0 &&
+           memcmp(mesh0.indices, mesh1.indices, mesh0.index_count * sizeof(uint16_t)) == 0;
+}
+
+TEST_CASE("melt.isa", "")
+{
+    const char* model_paths[] = { "models/bunny.obj", "models/suzanne.obj", "models/sphere.obj", "models/column.obj" };
+
+    melt_params_t params;
+    memset(&params, 0, sizeof(melt_params_t));
+    params.voxel_size = 0.15f;
+    params.fill_pct = 1.0f;
+    params.box_type_flags = MELT_OCCLUDER_BOX_TYPE_REGULAR;
+
+    const melt_isa_t supported_isa = melt_get_supported_isa();
+    REQUIRE(supported_isa >= MELT_ISA_SCALAR);
+
+    for (const char* model_path : model_paths)
+    {
+        REQUIRE(LoadModelMesh(model_path, params));
+
+        melt_result_t expected;
+        params.isa = MELT_ISA_SCALAR;
+        const int expected_status = melt_generate_occluder(params, &expected);
+
+        // Every variant available on this CPU has to generate the scalar result.
+        for (int isa = MELT_ISA_SCALAR + 1; isa <= supported_isa; ++isa)
+        {
+            melt_result_t result;
+            params.isa = (melt_isa_t)isa;
+            REQUIRE(melt_generate_occluder(params, &result) == expected_status);
+            if (expected_status)
+            {
+                REQUIRE(MeshEquals(result.mesh, expected.mesh));
+                melt_free_result(result);
+            }
+        }
+
+        if (expected_status)
+            melt_free_result(expected);
+    }
+
+    MELT_FREE(params.mesh.vertices);
+    MELT_FREE(params.mesh.indices);
+}
+
+TEST_CASE("melt.threads", "")
+{
+    struct Model
+    {
+        const char* path;
+        float voxel_size;
+        bool watertight;
+    };
+
+    const Model models[] =
+    {
+        { "models/bunny.obj",   0.15f, true  },
+        { "models/bunny.obj",   0.05f, false },
+        { "models/suzanne.obj", 0.15f, true  },
+        { "models/teapot.obj",  0.25f, false },
+        { "models/teapot.obj",  0.5f,  true  },
+        { "models/column.obj",  0.25f, true  },
+    };
+
+    melt_params_t params;
+    memset(&params, 0, sizeof(melt_params_t));
+    params.fill_pct = 1.0f;
+    params.box_type_flags = MELT_OCCLUDER_BOX_TYPE_REGULAR;
+
+    for (const Model& model : models)
+    {
+        REQUIRE(LoadModelMesh(model.path, params));
+        params.voxel_size = model.voxel_size;
+
+        melt_result_t expected;
+        params.thread_count = 1;
+        REQUIRE(melt_generate_occluder(params, &expected) == model.watertight);
+
+        // The slabs classified in parallel have to be stitched into the same
+        // result, leaks crossing slabs included.
+        for (uint32_t thread_count : { 2u, 3u, 8u })
+        {
+            melt_result_t result;
+            params.thread_count = thread_count;
+            REQUIRE(melt_generate_occluder(params, &result) == model.watertight);
+            if (model.watertight)
+            {
+                REQUIRE(MeshEquals(result.mesh, expected.mesh));
+                melt_free_result(result);
+            }
+        }
+
+        if (model.watertight)
+            melt_free_result(expected);
+    }
+
+    MELT_FREE(params.mesh.vertices);
+    MELT_FREE(params.mesh.indices);
+}
+
+TEST_CASE("melt.concurrent", "[stress]")
+{
+    struct Model
+    {
+        const char* path;
+        float voxel_size;
+        melt_params_t params;
+        melt_result_t expected;
+    };
+
+    Model models[] =
+    {
+        { "models/bunny.obj",   0.25f },
+        { "models/suzanne.obj", 0.15f },
+        { "models/cube.obj",    0.25f },
+        { "models/sphere.obj",  0.25f },
+        { "models/teapot.obj",  0.5f  },
+        { "models/column.obj",  0.25f },
+    };
+    const uint32_t model_count = sizeof(models) / sizeof(*models);
+
+    for (uint32_t i = 0; i < model_count; ++i)
+    {
+        melt_params_t& params = models[i].params;
+        memset(&params, 0, sizeof(melt_params_t));
+        params.voxel_size = models[i].voxel_size;
+        params.fill_pct = 1.0f;
+        params.box_type_flags = MELT_OCCLUDER_BOX_TYPE_REGULAR;
+
+        REQUIRE(LoadModelMesh(models[i].path, params));
+        REQUIRE(melt_generate_occluder(params, &models[i].expected));
+    }
+
+    // Every thread generates all models in a different order, each result has
+    // to match the one generated serially.
+    const uint32_t thread_count = std::max(4u, std::thread::hardware_concurrency());
+    const uint32_t iteration_count = 2;
+
+    std::vector<std::thread> threads;
+    std::vector<uint32_t> mismatch_counts(thread_count, 0);
+
+    for (uint32_t t = 0; t < thread_count; ++t)
+    {
+        threads.emplace_back([&, t]()
+        {
+            for (uint32_t iteration = 0; iteration < iteration_count * model_count; ++iteration)
+            {
+                const Model& model = models[(iteration + t) % model_count];
+                melt_result_t result;
+                if (!melt_generate_occluder(model.params, &result))
+                {
+                    ++mismatch_counts[t];
+                    continue;
+                }
+
+                if (!MeshEquals(result.mesh, model.expected.mesh))
+                    ++mismatch_counts[t];
+
+                melt_free_result(result);
+            }
+        });
+    }
+
+    for (std::thread& thread : threads)
+        thread.join();
+
+    for (uint32_t t = 0; t < thread_count; ++t)
+        REQUIRE(mismatch_counts[t] == 0);
+
+    for (uint32_t i = 0; i < model_count; ++i)
+    {
+        melt_free_result(models[i].expected);
+        MELT_FREE(models[i].params.mesh.vertices);
+        MELT_FREE(models[i].params.mesh.indices);
+    }
+}
+
+// Random meshes for the differential tests: a few perturbed spheres and boxes,
+// possibly overlapping, with an occasional triangle missing.
+struct RandomMesh
+{
+    std::vector<melt_vec3_t> vertices;
+    std::vector<uint16_t> indices;
+};
+
+static void AddRandomSphere(std::mt19937& rng, RandomMesh& mesh)
+{
+    std::uniform_real_distribution<float> position(-1.0f, 1.0f);
+    std::uniform_real_distribution<float> radius(0.3f, 1.0f);
+    std::uniform_real_distribution<float> perturbation(0.7f, 1.3f);
+    std::uniform_int_distribution<uint32_t> stacks(3, 8);
+    std::uniform_int_distribution<uint32_t> slices(4, 12);
+
+    const melt_vec3_t center = { position(rng), position(rng), position(rng) };
+    const float sphere_radius = radius(rng);
+    const uint32_t stack_count = stacks(rng);
+    const uint32_t slice_count = slices(rng);
+    const uint16_t base = (uint16_t)mesh.vertices.size();
+
+    auto add_vertex = [&](float theta, float phi)
+    {
+        const float r = sphere_radius * perturbation(rng);
+        mesh.vertices.push_back({ center.x + r * sinf(theta) * cosf(phi), center.y + r * cosf(theta), center.z + r * sinf(theta) * sinf(phi) });
+    };
+
+    add_vertex(0.0f, 0.0f);
+    for (uint32_t stack = 1; stack < stack_count; ++stack)
+        for (uint32_t slice = 0; slice < slice_count; ++slice)
+            add_vertex(3.14159265f * stack / stack_count, 2.0f * 3.14159265f * slice / slice_count);
+    add_vertex(3.14159265f, 0.0f);
+
+    const uint16_t south_pole = (uint16_t)(mesh.vertices.size() - 1);
+    auto ring_vertex = [&](uint32_t stack, uint32_t slice)
+    {
+        return (uint16_t)(base + 1 + (stack - 1) * slice_count + slice % slice_count);
+    };
+
+    for (uint32_t slice = 0; slice < slice_count; ++slice)
+    {
+        mesh.indices.insert(mesh.indices.end(), { base, ring_vertex(1, slice), ring_vertex(1, slice + 1) });
+        mesh.indices.insert(mesh.indices.end(), { south_pole, ring_vertex(stack_count - 1, slice + 1), ring_vertex(stack_count - 1, slice) });
+        for (uint32_t stack = 1; stack < stack_count - 1; ++stack)
+        {
+            mesh.indices.insert(mesh.indices.end(), { ring_vertex(stack, slice), ring_vertex(stack + 1, slice), ring_vertex(stack + 1, slice + 1) });
+            mesh.indices.insert(mesh.indices.end(), { ring_vertex(stack, slice), ring_vertex(stack + 1, slice + 1), ring_vertex(stack, slice + 1) });
+        }
+    }
+}
+
+static void AddRandomBox(std::mt19937& rng, RandomMesh& mesh)
+{
+    std::uniform_real_distribution<float> position(-1.0f, 1.0f);
+    std::uniform_real_distribution<float> extent(0.2f, 1.0f);
+    std::uniform_real_distribution<float> angle(0.0f, 3.14159265f);
+
+    const melt_vec3_t center = { position(rng), position(rng), position(rng) };
+    const melt_vec3_t half_extent = { extent(rng), extent(rng), extent(rng) };
+    const float rotation = angle(rng);
+    const uint16_t base = (uint16_t)mesh.vertices.size();
+
+    // Rotated around y so that faces are not always aligned with the grid
+    for (uint32_t i = 0; i < 8; ++i)
+    {
+        const float x = (i & 1 ? 1.0f : -1.0f) * half_extent.x;
+        const float y = (i & 2 ? 1.0f : -1.0f) * half_extent.y;
+        const float z = (i & 4 ? 1.0f : -1.0f) * half_extent.z;
+        mesh.vertices.push_back({ center.x + x * cosf(rotation) - z * sinf(rotation), center.y + y, center.z + x * sinf(rotation) + z * cosf(rotation) });
+    }
+
+    const uint16_t faces[6][4] = { { 0, 1, 3, 2 }, { 4, 6, 7, 5 }, { 0, 4, 5, 1 }, { 2, 3, 7, 6 }, { 0, 2, 6, 4 }, { 1, 5, 7, 3 } };
+    for (const auto& face : faces)
+    {
+        mesh.indices.insert(mesh.indices.end(), { (uint16_t)(base + face[0]), (uint16_t)(base + face[1]), (uint16_t)(base + face[2]) });
+        mesh.indices.insert(mesh.indices.end(), { (uint16_t)(base + face[0]), (uint16_t)(base + face[2]), (uint16_t)(base + face[3]) });
+    }
+}
+
+static void GenerateRandomMesh(std::mt19937& rng, RandomMesh& mesh)
+{
+    mesh.vertices.clear();
+    mesh.indices.clear();
+
+    const uint32_t shape_count = std::uniform_int_distribution<uint32_t>(1, 3)(rng);
+    for (uint32_t i = 0; i < shape_count; ++i)
+    {
+        if (rng() % 2)
+            AddRandomSphere(rng, mesh);
+        else
+            AddRandomBox(rng, mesh);
+    }
+
+    // Punch a hole now and then, the shell may or may not stay watertight.
+    if (rng() % 5 == 0)
+    {
+        const size_t triangle = rng() % (mesh.indices.size() / 3);
+        mesh.indices.erase(mesh.indices.begin() + triangle * 3, mesh.indices.begin() + triangle * 3 + 3);
+    }
+}
+
+// Runs each optimized phase next to its reference implementation and compares
+// the fields they produce, then the extents picked on every iteration.
+static bool UVec3Equals(uvec3_t a, uvec3_t b)
+{
+    return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+
+static void CheckPhasesAgainstReference(const melt_params_t& params)
+{
+    _context_t context;
+    _context_t reference;
+    _init_context(&context, &params);
+    _init_context(&reference, &params);
+
+    _voxelize_shell(&context, &params.mesh, 0, params.mesh.index_count);
+    _voxelize_shell_reference(&reference, &params.mesh);
+
+    REQUIRE(context.voxel_set_count == reference.voxel_set_count);
+    REQUIRE(memcmp(context.shell_mask, reference.shell_mask, (context.size + 31) / 32 * sizeof(uint32_t)) == 0);
+
+    uint32_t plane_offset = 0;
+    _begin_per_plane_voxel_set(&context);
+    _clear_per_plane_lists(&context, 0, _per_plane_list_count(&context));
+    _count_per_plane_voxels(&context, 0, context.voxel_set_count);
+    _place_per_plane_lists(&context, 0, _per_plane_list_count(&context), &plane_offset);
+    _fill_per_plane_voxel_set(&context, 0, context.voxel_set_count);
+    _alloc_fields(&context);
+    _alloc_fields(&reference);
+
+    uint32_t total_volume = 0;
+    uint32_t reference_total_volume = 0;
+    const bool watertight = _classify_voxels(&context, &total_volume);
+    REQUIRE(watertight == _classify_voxels_reference(&reference, &reference_total_volume));
+
+    if (watertight)
+    {
+        REQUIRE(total_volume == reference_total_volume);
+        REQUIRE(memcmp(context.voxel_field, reference.voxel_field, context.size * sizeof(_voxel_status_t)) == 0);
+        REQUIRE(memcmp(context.min_distance_field.x, reference.min_distance_field.x, context.size * sizeof(uint32_t)) == 0);
+        REQUIRE(memcmp(context.min_distance_field.y, reference.min_distance_field.y, context.size * sizeof(uint32_t)) == 0);
+        REQUIRE(memcmp(context.min_distance_field.z, reference.min_distance_field.z, context.size * sizeof(uint32_t)) == 0);
+
+        uint32_t volume = 0;
+        float fill_pct = 0.0f;
+        while (fill_pct < params.fill_pct && volume != total_volume)
+        {
+            _max_extent_t max_extent;
+            memset(&max_extent, 0, sizeof(_max_extent_t));
+            _find_max_extent(&context, 0, context.size, &max_extent);
+            const _max_extent_t reference_max_extent = _get_max_extent_reference(&reference);
+
+            REQUIRE(UVec3Equals(max_extent.position, reference_max_extent.position));
+            REQUIRE(UVec3Equals(max_extent.extent, reference_max_extent.extent));
+            REQUIRE(max_extent.volume == reference_max_extent.volume);
+
+            _clip_voxel_field(&context, max_extent.position, max_extent.extent);
+            _clip_voxel_field(&reference, reference_max_extent.position, reference_max_extent.extent);
+            _update_min_distance_field(&context, max_extent.position, max_extent.extent);
+
+            // The incremental distances of the remaining inner voxels have to
+            // match the runs of inner voxels walked in the reference field.
+            for (uint32_t i = 0; i < context.size; ++i)
+            {
+                if (!_inner_voxel(context.voxel_field[i]))
+                    continue;
+
+                const uvec3_t position = _unflatten_3d(i, context.dimension);
+                REQUIRE(context.min_distance_field.x[i] == _inner_run_length_reference(&reference, position, 0));
+                REQUIRE(context.min_distance_field.y[i] == _inner_run_length_reference(&reference, position, 1));
+                REQUIRE(context.min_distance_field.z[i] == _inner_run_length_reference(&reference, position, 2));
+            }
+
+            fill_pct += (float)max_extent.volume / total_volume;
+            volume += max_extent.volume;
+        }
+    }
+
+    _free_context(&context);
+    _free_context(&reference);
+}
+
+TEST_CASE("melt.reference", "")
+{
+    const float fill_pcts[] = { 0.25f, 0.5f, 0.75f, 1.0f };
+    const melt_occluder_box_type_flags_t box_types[] =
+    {
+        MELT_OCCLUDER_BOX_TYPE_REGULAR,
+        MELT_OCCLUDER_BOX_TYPE_SIDES,
+        MELT_OCCLUDER_BOX_TYPE_TOP | MELT_OCCLUDER_BOX_TYPE_BOTTOM,
+        MELT_OCCLUDER_BOX_TYPE_DIAGONALS,
+    };
+
+    std::mt19937 rng(0x6d656c74);
+    RandomMesh mesh;
+    uint32_t watertight_count = 0;
+
+    for (uint32_t iteration = 0; iteration < 100; ++iteration)
+    {
+        GenerateRandomMesh(rng, mesh);
+
+        melt_params_t params;
+        memset(&params, 0, sizeof(melt_params_t));
+        params.mesh.vertices = mesh.vertices.data();
+        params.mesh.vertex_count = (uint32_t)mesh.vertices.size();
+        params.mesh.indices = mesh.indices.data();
+        params.mesh.index_count = (uint32_t)mesh.indices.size();
+        params.voxel_size = std::uniform_real_distribution<float>(0.12f, 0.4f)(rng);
+        params.fill_pct = fill_pcts[rng() % 4];
+        params.box_type_flags = box_types[rng() % 4];
+        params.thread_count = 1 + rng() % 4;
+
+        CheckPhasesAgainstReference(params);
+
+        melt_result_t expected;
+        params.reference = 1;
+        const int expected_status = melt_generate_occluder(params, &expected);
+        watertight_count += expected_status;
+
+        melt_result_t result;
+        params.reference = 0;
+        REQUIRE(melt_generate_occluder(params, &result) == expected_status);
+        if (expected_status)
+        {
+            REQUIRE(MeshEquals(result.mesh, expected.mesh));
+            melt_free_result(result);
+            melt_free_result(expected);
+        }
+    }
+
+    // Both outcomes have to be covered for the comparison to mean anything.
+    REQUIRE(watertight_count > 0);
+    REQUIRE(watertight_count < 100);
+}
+
+struct ProgressLog
+{
+    std::vector<melt_progress_t> reports;
+    melt_phase_t cancel_phase;
+    bool cancel;
+    uint32_t cancel_flag;
+};
+
+static void LogProgress(const melt_progress_t* progress, void* user_data)
+{
+    ProgressLog* log = (ProgressLog*)user_data;
+    log->reports.push_back(*progress);
+    if (log->cancel && progress->phase == log->cancel_phase && progress->fraction > 0.0f)
+        _atomic_store_u32(&log->cancel_flag, 1);
+}
+
+TEST_CASE("melt.progress", "")
+{
+    melt_params_t params;
+    memset(&params, 0, sizeof(melt_params_t));
+    params.fill_pct = 1.0f;
+    params.box_type_flags = MELT_OCCLUDER_BOX_TYPE_REGULAR;
+    params.progress_callback = LogProgress;
+
+    REQUIRE(LoadModelMesh("models/suzanne.obj", params));
+
+    for (int32_t reference : { 0, 1 })
+    {
+        for (uint32_t thread_count : { 1u, 4u })
+        {
+            // The reference visits every voxel against every triangle
+            params.reference = reference;
+            params.voxel_size = reference ? 0.3f : 0.1f;
+            params.thread_count = thread_count;
+
+            ProgressLog log = {};
+            params.progress_user_data = &log;
+            params.cancel_flag = &log.cancel_flag;
+
+            melt_result_t result;
+            REQUIRE(melt_generate_occluder(params, &result));
+            REQUIRE(result.status == MELT_STATUS_SUCCESS);
+
+            // Phases and fractions only move forward, the last report is the
+            // completed extraction with the final box count.
+            REQUIRE(!log.reports.empty());
+            for (size_t i = 1; i < log.reports.size(); ++i)
+            {
+                const melt_progress_t& previous = log.reports[i - 1];
+                const melt_progress_t& current = log.reports[i];
+                REQUIRE(current.phase >= previous.phase);
+                if (current.phase == previous.phase)
+                    REQUIRE(current.fraction >= previous.fraction);
+                REQUIRE(current.box_count >= previous.box_count);
+                REQUIRE(current.fraction >= 0.0f);
+                REQUIRE(current.fraction <= 1.0f);
+            }
+            const melt_progress_t& last = log.reports.back();
+            REQUIRE(last.phase == MELT_PHASE_EXTRACTION);
+            REQUIRE(last.fraction == 1.0f);
+            REQUIRE(result.mesh.vertex_count == last.box_count * 8);
+            REQUIRE(last.fill_pct >= params.fill_pct - 1e-4f);
+            melt_free_result(result);
+
+            // Cancelling in any phase stops the generation, everything allocated
+            // so far is released by the time it returns.
+            for (melt_phase_t phase : { MELT_PHASE_VOXELIZATION, MELT_PHASE_CLASSIFICATION, MELT_PHASE_EXTRACTION })
+            {
+                ProgressLog cancelled = {};
+                cancelled.cancel = true;
+                cancelled.cancel_phase = phase;
+                params.progress_user_data = &cancelled;
+                params.cancel_flag = &cancelled.cancel_flag;
+
+                REQUIRE(!melt_generate_occluder(params, &result));
+                REQUIRE(result.status == MELT_STATUS_CANCELLED);
+                REQUIRE(cancelled.cancel_flag == 1);
+                REQUIRE(cancelled.reports.back().phase == phase);
+            }
+        }
+    }
+
+    params.reference = 0;
+    params.progress_callback = NULL;
+    params.cancel_flag = NULL;
+
+    melt_result_t result;
+    uint32_t cancel_flag = 1;
+    params.cancel_flag = &cancel_flag;
+    REQUIRE(!melt_generate_occluder(params, &result));
+    REQUIRE(result.status == MELT_STATUS_CANCELLED);
+
+    params.cancel_flag = NULL;
+    params.voxel_size = 0.05f;
+    REQUIRE(LoadModelMesh("models/bunny.obj", params));
+    REQUIRE(!melt_generate_occluder(params, &result));
+    REQUIRE(result.status == MELT_STATUS_NOT_WATERTIGHT);
+
+    MELT_FREE(params.mesh.vertices);
+    MELT_FREE(params.mesh.indices);
+}
+
+TEST_CASE("melt.step", "")
+{
+    struct Model
+    {
+        const char* path;
+        float voxel_size;
+        bool watertight;
+    };
+
+    const Model models[] =
+    {
+        { "models/bunny.obj",   0.15f, true  },
+        { "models/bunny.obj",   0.05f, false },
+        { "models/suzanne.obj", 0.1f,  true  },
+        { "models/column.obj",  0.25f, true  },
+    };
+
+    melt_params_t params;
+    memset(&params, 0, sizeof(melt_params_t));
+    params.fill_pct = 1.0f;
+    params.box_type_flags = MELT_OCCLUDER_BOX_TYPE_REGULAR;
+
+    for (const Model& model : models)
+    {
+        REQUIRE(LoadModelMesh(model.path, params));
+        params.voxel_size = model.voxel_size;
+
+        for (uint32_t thread_count : { 1u, 3u })
+        {
+            params.thread_count = thread_count;
+
+            melt_result_t expected;
+            REQUIRE(melt_generate_occluder(params, &expected) == model.watertight);
+
+            // Resuming across steps gives the same occluder as a single call.
+            melt_generation_t* generation = melt_begin_generation(params);
+            uint32_t step_count = 1;
+            while (!melt_step(generation, 100))
+                ++step_count;
+            REQUIRE(step_count > 1);
+
+            melt_result_t result;
+            REQUIRE(melt_end_generation(generation, &result) == model.watertight);
+            REQUIRE(result.status == expected.status);
+            if (model.watertight)
+            {
+                REQUIRE(MeshEquals(result.mesh, expected.mesh));
+                melt_free_result(result);
+                melt_free_result(expected);
+            }
+
+            // A budget of 0 completes in one step.
+            generation = melt_begin_generation(params);
+            REQUIRE(melt_step(generation, 0));
+            REQUIRE(melt_end_generation(generation, &result) == model.watertight);
+            if (model.watertight)
+                melt_free_result(result);
+
+            // Ending a generation early cancels it, whatever the phase it is in.
+            for (uint32_t cancel_step : { 0u, 1u, step_count / 2, step_count - 1 })
+            {
+                generation = melt_begin_generation(params);
+                for (uint32_t i = 0; i < cancel_step; ++i)
+                    melt_step(generation, 100);
+                if (!melt_end_generation(generation, &result))
+                    REQUIRE(result.status != MELT_STATUS_SUCCESS);
+                else
+                    melt_free_result(result);
+            }
+        }
+    }
+
+    MELT_FREE(params.mesh.vertices);
+    MELT_FREE(params.mesh.indices);
+}
+
+struct ScheduledTask
+{
+    melt_task_t task;
+    void* task_data;
+};
+
+static void ScheduleTask(melt_task_t task, void* task_data, void* user_data)
+{
+    std::vector<ScheduledTask>* tasks = (std::vector<ScheduledTask>*)user_data;
+    tasks->push_back({ task, task_data });
+}
+
+TEST_CASE("melt.queue", "")
+{
+    struct Model
+    {
+        const char* path;
+        float voxel_size;
+        int32_t priority;
+        melt_params_t params;
+        melt_result_t expected;
+        int generated;
+    };
+
+    Model models[] =
+    {
+        { "models/bunny.obj",   0.25f,  0 },
+        { "models/suzanne.obj", 0.15f,  2 },
+        { "models/cube.obj",    0.25f,  0 },
+        { "models/sphere.obj",  0.25f, -1 },
+        { "models/teapot.obj",  0.25f,  2 },
+        { "models/column.obj",  0.25f,  1 },
+    };
+    const uint32_t model_count = sizeof(models) / sizeof(*models);
+
+    for (uint32_t i = 0; i < model_count; ++i)
+    {
+        melt_params_t& params = models[i].params;
+        memset(&params, 0, sizeof(melt_params_t));
+        params.voxel_size = models[i].voxel_size;
+        params.fill_pct = 1.0f;
+        params.box_type_flags = MELT_OCCLUDER_BOX_TYPE_REGULAR;
+
+        REQUIRE(LoadModelMesh(models[i].path, params));
+        models[i].generated = melt_generate_occluder(params, &models[i].expected);
+    }
+
+    // Jobs start by priority, then from the largest grid. Without workers
+    // they run one at a time on the waiting thread, in that order.
+    std::vector<uint32_t> expected_order(model_count);
+    for (uint32_t i = 0; i < model_count; ++i)
+        expected_order[i] = i;
+    std::vector<uint32_t> sizes(model_count);
+    for (uint32_t i = 0; i < model_count; ++i)
+    {
+        _context_t context;
+        _init_context(&context, &models[i].params);
+        sizes[i] = context.size;
+        _free_context(&context);
+    }
+    std::stable_sort(expected_order.begin(), expected_order.end(), [&](uint32_t a, uint32_t b)
+    {
+        return models[a].priority != models[b].priority ? models[a].priority > models[b].priority : sizes[a] > sizes[b];
+    });
+
+    std::vector<ScheduledTask> tasks;
+    melt_queue_params_t scheduled_queue_params;
+    memset(&scheduled_queue_params, 0, sizeof(melt_queue_params_t));
+    scheduled_queue_params.schedule_callback = ScheduleTask;
+    scheduled_queue_params.schedule_user_data = &tasks;
+    scheduled_queue_params.memory_budget_bytes = 1;
+
+    melt_queue_params_t synchronous_queue_params;
+    memset(&synchronous_queue_params, 0, sizeof(melt_queue_params_t));
+
+    melt_queue_params_t threaded_queue_params;
+    memset(&threaded_queue_params, 0, sizeof(melt_queue_params_t));
+    threaded_queue_params.thread_count = 3;
+
+    for (const melt_queue_params_t& queue_params : { synchronous_queue_params, scheduled_queue_params, threaded_queue_params })
+    {
+        melt_queue_t* queue = melt_create_queue(queue_params);
+
+        std::vector<melt_job_t> jobs(model_count);
+        for (uint32_t i = 0; i < model_count; ++i)
+            jobs[i] = melt_submit(queue, models[i].params, models[i].priority);
+
+        std::vector<uint32_t> order;
+        for (;;)
+        {
+            // The caller owned pool runs its tasks one at a time, the budget
+            // only lets one job run at once.
+            if (queue_params.schedule_callback)
+            {
+                REQUIRE(tasks.size() <= 1);
+                if (tasks.empty())
+                    break;
+                ScheduledTask task = tasks.back();
+                tasks.pop_back();
+                task.task(task.task_data);
+            }
+
+            melt_result_t result;
+            const melt_job_t job = queue_params.schedule_callback ? 0 : melt_wait_any(queue, &result);
+            uint32_t index = 0;
+            if (queue_params.schedule_callback)
+            {
+                while (index < model_count && !melt_poll(queue, jobs[index], &result))
+                    ++index;
+                REQUIRE(index < model_count);
+            }
+            else
+            {
+                if (job == 0)
+                    break;
+                index = (uint32_t)(std::find(jobs.begin(), jobs.end(), job) - jobs.begin());
+                REQUIRE(index < model_count);
+            }
+
+            order.push_back(index);
+            REQUIRE((result.status == MELT_STATUS_SUCCESS) == (models[index].generated != 0));
+            if (models[index].generated)
+            {
+                REQUIRE(MeshEquals(result.mesh, models[index].expected.mesh));
+                melt_free_result(result);
+            }
+        }
+
+        // The first job submitted to the caller owned pool starts right away.
+        REQUIRE(order.size() == model_count);
+        if (queue_params.schedule_callback)
+        {
+            REQUIRE(order[0] == 0);
+            expected_order.erase(std::find(expected_order.begin(), expected_order.end(), 0u));
+            expected_order.insert(expected_order.begin(), 0u);
+        }
+        if (queue_params.thread_count == 0)
+            REQUIRE(order == expected_order);
+
+        // Collected jobs are released, a job can be waited for directly, and
+        // the results left behind are freed with the queue.
+        melt_result_t result;
+        REQUIRE(melt_wait_any(queue, &result) == 0);
+        REQUIRE(!melt_poll(queue, jobs[0], &result));
+        const melt_job_t job = melt_submit(queue, models[1].params, 0);
+        melt_submit(queue, models[0].params, 0);
+        if (queue_params.schedule_callback)
+        {
+            ScheduledTask task = tasks.back();
+            tasks.pop_back();
+            task.task(task.task_data);
+        }
+        REQUIRE(melt_wait(queue, job, &result));
+        REQUIRE(MeshEquals(result.mesh, models[1].expected.mesh));
+        melt_free_result(result);
+
+        if (queue_params.schedule_callback)
+        {
+            ScheduledTask task = tasks.back();
+            tasks.pop_back();
+            task.task(task.task_data);
+        }
+        melt_destroy_queue(queue);
+    }
+
+    // Two threads wait on a synchronous queue. The first runs the job of the
+    // second, which starts higher, the second runs the other job and then
+    // waits, with no job left or with the budget held by the first thread.
+    for (uint64_t memory_budget_bytes : { (uint64_t)0, (uint64_t)1 })
+    {
+        melt_queue_params_t queue_params;
+        memset(&queue_params, 0, sizeof(melt_queue_params_t));
+        queue_params.memory_budget_bytes = memory_budget_bytes;
+        melt_queue_t* queue = melt_create_queue(queue_params);
+
+        const melt_job_t first_job = melt_submit(queue, models[2].params, 0);
+        const melt_job_t second_job = melt_submit(queue, models[1].params, 1);
+
+        melt_result_t first_result;
+        int first_generated = 0;
+        std::thread first_thread([&]() { first_generated = melt_wait(queue, first_job, &first_result); });
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        melt_result_t second_result;
+        const int second_generated = melt_wait(queue, second_job, &second_result);
+        first_thread.join();
+
+        REQUIRE(first_generated == models[2].generated);
+        REQUIRE(second_generated == models[1].generated);
+        REQUIRE(MeshEquals(first_result.mesh, models[2].expected.mesh));
+        REQUIRE(MeshEquals(second_result.mesh, models[1].expected.mesh));
+        melt_free_result(first_result);
+        melt_free_result(second_result);
+        melt_destroy_queue(queue);
+    }
+
+    // A job a thread waits for is left to it by melt_wait_any, and waiting
+    // again for a collected job fails.
+    {
+        melt_queue_params_t queue_params;
+        memset(&queue_params, 0, sizeof(melt_queue_params_t));
+        queue_params.thread_count = 2;
+        melt_queue_t* queue = melt_create_queue(queue_params);
+
+        const melt_job_t first_job = melt_submit(queue, models[1].params, 0);
+        const melt_job_t second_job = melt_submit(queue, models[2].params, 0);
+
+        melt_result_t first_result;
+        int first_generated = 0;
+        std::thread first_thread([&]() { first_generated = melt_wait(queue, first_job, &first_result); });
+        for (bool waited = false; !waited; std::this_thread::yield())
+        {
+            _mutex_lock(&queue->mutex);
+            for (_job_t* job = queue->jobs; job; job = job->next)
+                waited |= job->id == first_job && job->waited;
+            _mutex_unlock(&queue->mutex);
+        }
+
+        melt_result_t second_result;
+        REQUIRE(melt_wait_any(queue, &second_result) == second_job);
+        REQUIRE((second_result.status == MELT_STATUS_SUCCESS) == (models[2].generated != 0));
+        melt_free_result(second_result);
+        first_thread.join();
+
+        REQUIRE(first_generated == models[1].generated);
+        REQUIRE(MeshEquals(first_result.mesh, models[1].expected.mesh));
+        melt_free_result(first_result);
+
+        melt_result_t result;
+        REQUIRE(!melt_wait(queue, first_job, &result));
+        REQUIRE(result.status == MELT_STATUS_UNKNOWN_JOB);
+        REQUIRE(result.mesh.vertex_count == 0);
+        melt_destroy_queue(queue);
+    }
+
+    for (uint32_t i = 0; i < model_count; ++i)
+    {
+        if (models[i].generated)
+            melt_free_result(models[i].expected);
+        MELT_FREE(models[i].params.mesh.vertices);
+        MELT_FREE(models[i].params.mesh.indices);
+    }
+}
+
+// Emits one box at a time, to compare with the boxes emitted by _add_max_extents_to_mesh.
+static void AddBoxToMesh(vec3_t voxel_center, vec3_t half_voxel_size, melt_mesh_t* mesh, melt_occluder_box_type_flags_t box_type_flags)
+{
+    uint16_t index_offset = (uint16_t)mesh->vertex_count;
+
+    for (uint32_t i = 0; i < MELT_ARRAY_LENGTH(_voxel_cube_vertices); ++i)
+    {
+        vec3_t vertex = _vec3_add(_vec3_mul(half_voxel_size, _voxel_cube_vertices[i]), voxel_center);
+        mesh->vertices[mesh->vertex_count++] = vertex;
+    }
+
+    while (box_type_flags != MELT_OCCLUDER_BOX_TYPE_NONE)
+    {
+        const uint16_t* indices = NULL;
+        uint32_t indices_length = 0;
+
+        melt_occluder_box_type_t selected_type = _select_voxel_indices(box_type_flags, &indices, &indices_length);
+
+        MELT_ASSERT(indices && indices_length > 0);
+        for (uint32_t i = 0; i < indices_length; ++i)
+        {
+            mesh->indices[mesh->index_count++] = indices[i] + index_offset;
+        }
+
+        box_type_flags &= ~selected_type;
+    }
+}
+
+TEST_CASE("melt.emission", "")
+{
+    melt_params_t params;
+    memset(&params, 0, sizeof(melt_params_t));
+    params.voxel_size = 0.15f;
+    params.fill_pct = 1.0f;
+
+    REQUIRE(LoadModelMesh("models/suzanne.obj", params));
+
+    // Every combination of box types goes through a specialized or the generic
+    // emission, both have to write what the per box path writes.
+    for (melt_occluder_box_type_flags_t box_type_flags = 1; box_type_flags <= MELT_OCCLUDER_BOX_TYPE_REGULAR; ++box_type_flags)
+    {
+        params.box_type_flags = box_type_flags;
+        params.index_width = MELT_INDEX_WIDTH_16;
+
+        melt_result_t result;
+        REQUIRE(melt_generate_occluder(params, &result));
+        REQUIRE(result.mesh.indices32 == NULL);
+
+        params.index_width = MELT_INDEX_WIDTH_32;
+        melt_result_t result32;
+        REQUIRE(melt_generate_occluder(params, &result32));
+        REQUIRE(result32.mesh.indices == NULL);
+        REQUIRE(result32.mesh.index_count == result.mesh.index_count);
+        REQUIRE(memcmp(result32.mesh.vertices, result.mesh.vertices, result.mesh.vertex_count * sizeof(melt_vec3_t)) == 0);
+        for (uint32_t i = 0; i < result.mesh.index_count; ++i)
+            REQUIRE(result32.mesh.indices32[i] == result.mesh.indices[i]);
+
+        const uint32_t box_count = result.mesh.vertex_count / _vertex_count_per_aabb();
+        melt_mesh_t expected;
+        memset(&expected, 0, sizeof(melt_mesh_t));
+        expected.vertices = MELT_MALLOC(melt_vec3_t, result.mesh.vertex_count);
+        expected.indices = MELT_MALLOC(uint16_t, _index_count_per_aabb(box_type_flags) * box_count);
+
+        // The corners of each box give back its center and half extent.
+        for (uint32_t box = 0; box < box_count; ++box)
+        {
+            const vec3_t* corners = &result.mesh.vertices[box * _vertex_count_per_aabb()];
+            const vec3_t half_extent = _vec3_init(corners[3].x - corners[0].x, corners[0].y - corners[1].y, corners[0].z - corners[4].z);
+            const vec3_t center = _vec3_sub(corners[0], _vec3_mul(_vec3_mulf(half_extent, 0.5f), _vec3_init(-1.0f, 1.0f, 1.0f)));
+            AddBoxToMesh(center, _vec3_mulf(half_extent, 0.5f), &expected, box_type_flags);
+        }
+
+        REQUIRE(expected.index_count == result.mesh.index_count);
+        REQUIRE(memcmp(expected.indices, result.mesh.indices, result.mesh.index_count * sizeof(uint16_t)) == 0);
+        for (uint32_t i = 0; i < result.mesh.vertex_count; ++i)
+        {
+            REQUIRE(fabsf(expected.vertices[i].x - result.mesh.vertices[i].x) < 1e-4f);
+            REQUIRE(fabsf(expected.vertices[i].y - result.mesh.vertices[i].y) < 1e-4f);
+            REQUIRE(fabsf(expected.vertices[i].z - result.mesh.vertices[i].z) < 1e-4f);
+        }
+
+        MELT_FREE(expected.vertices);
+        MELT_FREE(expected.indices);
+        melt_free_result(result);
+        melt_free_result(result32);
+    }
+
+    MELT_FREE(params.mesh.vertices);
+    MELT_FREE(params.mesh.indices);
+}
+
+static void RequireSameMesh(const melt_mesh_t& a, const melt_mesh_t& b)
+{
+    REQUIRE(a.vertex_count == b.vertex_count);
+    REQUIRE(a.index_count == b.index_count);
+    REQUIRE(memcmp(a.vertices, b.vertices, a.vertex_count * sizeof(melt_vec3_t)) == 0);
+    REQUIRE(memcmp(a.indices, b.indices, a.index_count * sizeof(uint16_t)) == 0);
+}
+
+struct ExportLog
+{
+    std::vector<uint8_t> bytes;
+    uint32_t write_count = 0;
+    uint32_t fail_after = UINT32_MAX;
+};
+
+static int WriteExport(const void* data, size_t byte_size, void* user_data)
+{
+    ExportLog* log = (ExportLog*)user_data;
+    if (log->write_count++ >= log->fail_after)
+        return 0;
+    log->bytes.insert(log->bytes.end(), (const uint8_t*)data, (const uint8_t*)data + byte_size);
+    return 1;
+}
+
+// Splits an exported PLY into its header and its binary payload.
+static std::string ParsePly(const ExportLog& log, uint32_t* vertex_count, uint32_t* box_count, size_t* payload)
+{
+    const std::string text(log.bytes.begin(), log.bytes.end());
+    const size_t end = text.find("end_header\n");
+    REQUIRE(end != std::string::npos);
+    const std::string header = text.substr(0, end);
+    REQUIRE(sscanf(strstr(header.c_str(), "element vertex"), "element vertex %u", vertex_count) == 1);
+    REQUIRE(sscanf(strstr(header.c_str(), "element box"), "element box %u", box_count) == 1);
+    *payload = end + strlen("end_header\n");
+    return header;
+}
+
+TEST_CASE("melt.export", "")
+{
+    melt_params_t params;
+    memset(&params, 0, sizeof(melt_params_t));
+    params.voxel_size = 0.1f;
+    params.fill_pct = 1.0f;
+    params.box_type_flags = MELT_OCCLUDER_BOX_TYPE_REGULAR;
+    params.export_flags = MELT_EXPORT_TYPE_SHELL | MELT_EXPORT_TYPE_INNER | MELT_EXPORT_TYPE_CLIPPED |
+        MELT_EXPORT_TYPE_DISTANCE | MELT_EXPORT_TYPE_BOXES;
+    params.export_callback = WriteExport;
+
+    REQUIRE(LoadModelMesh("models/suzanne.obj", params));
+
+    ExportLog log;
+    params.export_user_data = &log;
+    melt_result_t result;
+    REQUIRE(melt_generate_occluder(params, &result));
+
+    uint32_t vertex_count, box_count;
+    size_t payload;
+    const std::string header = ParsePly(log, &vertex_count, &box_count, &payload);
+    REQUIRE(header.find("property uint distance_z") != std::string::npos);
+    REQUIRE(result.mesh.vertex_count == box_count * _vertex_count_per_aabb());
+    REQUIRE(log.bytes.size() == payload + vertex_count * (3 * sizeof(float) + 1 + 3 * sizeof(uint32_t)) + box_count * 6 * sizeof(float));
+
+    // Every voxel has a state, the boxes bound the corners of the output boxes.
+    uint32_t shell_count = 0;
+    for (uint32_t i = 0; i < vertex_count; ++i)
+    {
+        const uint8_t state = log.bytes[payload + i * 25 + 12];
+        REQUIRE((state == 1 || state == 2 || state == 4));
+        shell_count += state == 1 ? 1 : 0;
+    }
+    REQUIRE(shell_count > 0);
+
+    const uint8_t* boxes = log.bytes.data() + payload + vertex_count * 25;
+    for (uint32_t box = 0; box < box_count; ++box)
+    {
+        float bounds[6];
+        memcpy(bounds, boxes + box * sizeof(bounds), sizeof(bounds));
+        for (uint32_t v = 0; v < _vertex_count_per_aabb(); ++v)
+        {
+            const melt_vec3_t corner = result.mesh.vertices[box * _vertex_count_per_aabb() + v];
+            REQUIRE(fabsf(fminf(fabsf(corner.x - bounds[0]), fabsf(corner.x - bounds[3]))) < 1e-4f);
+            REQUIRE(fabsf(fminf(fabsf(corner.y - bounds[1]), fabsf(corner.y - bounds[4]))) < 1e-4f);
+            REQUIRE(fabsf(fminf(fabsf(corner.z - bounds[2]), fabsf(corner.z - bounds[5]))) < 1e-4f);
+        }
+    }
+    melt_free_result(result);
+
+    // A failed write stops the export.
+    ExportLog failing;
+    failing.fail_after = 1;
+    params.export_user_data = &failing;
+    REQUIRE(melt_generate_occluder(params, &result));
+    REQUIRE(failing.write_count == 2);
+    melt_free_result(result);
+
+    // Each extraction iteration streams a document with the boxes found so far,
+    // the last one is the document of the final state.
+    ExportLog iterations;
+    params.export_flags |= MELT_EXPORT_TYPE_ITERATIONS;
+    params.export_user_data = &iterations;
+    REQUIRE(melt_generate_occluder(params, &result));
+    const uint32_t result_box_count = result.mesh.vertex_count / _vertex_count_per_aabb();
+    size_t offset = 0;
+    uint32_t document_count = 0;
+    size_t last_offset = 0;
+    uint32_t previous_inner_count = UINT32_MAX;
+    while (offset < iterations.bytes.size())
+    {
+        ExportLog document;
+        document.bytes.assign(iterations.bytes.begin() + offset, iterations.bytes.end());
+        const std::string document_header = ParsePly(document, &vertex_count, &box_count, &payload);
+        uint32_t iteration;
+        REQUIRE(sscanf(strstr(document_header.c_str(), "comment melt iteration"), "comment melt iteration %u", &iteration) == 1);
+        REQUIRE(iteration == document_count);
+        REQUIRE(box_count == document_count);
+
+        uint32_t inner_count = 0;
+        for (uint32_t i = 0; i < vertex_count; ++i)
+            inner_count += document.bytes[payload + i * 25 + 12] == 2 ? 1 : 0;
+        REQUIRE(inner_count < previous_inner_count);
+        previous_inner_count = inner_count;
+
+        last_offset = offset;
+        offset += payload + vertex_count * 25 + box_count * 6 * sizeof(float);
+        ++document_count;
+    }
+    REQUIRE(offset == iterations.bytes.size());
+    REQUIRE(document_count == result_box_count + 1);
+    std::string last(iterations.bytes.begin() + last_offset, iterations.bytes.end());
+    const size_t comment = last.find("comment melt iteration");
+    last.erase(comment, last.find('\n', comment) + 1 - comment);
+    REQUIRE(last == std::string(log.bytes.begin(), log.bytes.end()));
+    params.export_flags &= ~MELT_EXPORT_TYPE_ITERATIONS;
+    melt_free_result(result);
+
+    // A leaking shell only exports the shell, the other fields are incomplete.
+    REQUIRE(LoadModelMesh("models/bunny.obj", params));
+    params.voxel_size = 0.05f;
+    ExportLog leaking;
+    params.export_user_data = &leaking;
+    REQUIRE(!melt_generate_occluder(params, &result));
+    REQUIRE(result.status == MELT_STATUS_NOT_WATERTIGHT);
+
+    ParsePly(leaking, &vertex_count, &box_count, &payload);
+    REQUIRE(vertex_count > 0);
+    REQUIRE(box_count == 0);
+    REQUIRE(leaking.bytes.size() == payload + vertex_count * 13);
+    for (uint32_t i = 0; i < vertex_count; ++i)
+        REQUIRE(leaking.bytes[payload + i * 13 + 12] == 1);
+
+    MELT_FREE(params.mesh.vertices);
+    MELT_FREE(params.mesh.indices);
+}
+
+TEST_CASE("melt.slicing", "")
+{
+    struct Model
+    {
+        const char* path;
+        float voxel_size;
+        uint32_t closing_radius;
+        bool watertight;
+    };
+
+    const Model models[] =
+    {
+        { "models/suzanne.obj", 0.03f, 1, true  },
+        { "models/bunny.obj",   0.05f, 0, false },
+    };
+
+    melt_params_t params;
+    memset(&params, 0, sizeof(melt_params_t));
+    params.fill_pct = 0.5f;
+    params.box_type_flags = MELT_OCCLUDER_BOX_TYPE_REGULAR;
+    params.thread_count = 3;
+    params.occupancy = 1;
+    params.export_flags = MELT_EXPORT_TYPE_SHELL | MELT_EXPORT_TYPE_INNER | MELT_EXPORT_TYPE_DISTANCE | MELT_EXPORT_TYPE_BOXES;
+    params.export_callback = WriteExport;
+
+    for (const Model& model : models)
+    {
+        REQUIRE(LoadModelMesh(model.path, params));
+        params.voxel_size = model.voxel_size;
+        params.closing_radius = model.closing_radius;
+        params.ground_cap = model.closing_radius > 0 ? 1 : 0;
+
+        ExportLog expected_log;
+        params.export_user_data = &expected_log;
+        melt_result_t expected;
+        REQUIRE(melt_generate_occluder(params, &expected) == model.watertight);
+
+        // The preparation of the shell and the output run in chunks of voxels, and
+        // the classification runs on the calling thread.
+        ExportLog log;
+        params.export_user_data = &log;
+        melt_generation_t* generation = melt_begin_generation(params);
+        const uint32_t chunk_count = (generation->context.size + MELT_STEP_VOXEL_COUNT - 1) / MELT_STEP_VOXEL_COUNT;
+        uint32_t state_units[_GENERATION_STATE_DONE + 1] = {};
+        while (generation->state != _GENERATION_STATE_DONE)
+        {
+            ++state_units[generation->state];
+            _step_generation_unit(generation);
+            if (generation->classification.context)
+                REQUIRE(generation->classification.thread_count == 1);
+        }
+
+        // The export walks the grid twice in chunks, closing walks it 8 times,
+        // and the search for every box walks it once.
+        REQUIRE(state_units[_GENERATION_STATE_OUTPUT] >= 2 * chunk_count);
+        if (model.watertight)
+            REQUIRE(state_units[_GENERATION_STATE_EXTRACTION] >= expected.mesh.vertex_count / _vertex_count_per_aabb() * chunk_count);
+        if (model.closing_radius > 0)
+        {
+            REQUIRE(chunk_count > 1);
+            REQUIRE(state_units[_GENERATION_STATE_PREPARATION] >= 8 * chunk_count);
+        }
+
+        melt_result_t result;
+        REQUIRE(melt_end_generation(generation, &result) == model.watertight);
+        REQUIRE(result.status == expected.status);
+        REQUIRE(log.bytes == expected_log.bytes);
+        if (model.watertight)
+        {
+            const size_t mask_size = (result.occupancy.dimension_x * result.occupancy.dimension_y * result.occupancy.dimension_z + 31) / 32 * sizeof(uint32_t);
+            RequireSameMesh(expected.mesh, result.mesh);
+            REQUIRE(memcmp(expected.occupancy.shell, result.occupancy.shell, mask_size) == 0);
+            REQUIRE(memcmp(expected.occupancy.inner, result.occupancy.inner, mask_size) == 0);
+            melt_free_result(result);
+            melt_free_result(expected);
+        }
+
+        // Ending a generation in the middle of a preparation stage, a search or
+        // an output stage releases what it holds.
+        for (_generation_state_t cancel_state : { _GENERATION_STATE_PREPARATION, _GENERATION_STATE_EXTRACTION, _GENERATION_STATE_OUTPUT })
+        {
+            ExportLog cancelled_log;
+            params.export_user_data = &cancelled_log;
+            generation = melt_begin_generation(params);
+            uint32_t units = 0;
+            while (generation->state != _GENERATION_STATE_DONE && units < state_units[cancel_state] / 2)
+            {
+                _step_generation_unit(generation);
+                units += generation->state == cancel_state ? 1 : 0;
+            }
+            REQUIRE(!melt_end_generation(generation, &result));
+            REQUIRE(result.status == MELT_STATUS_CANCELLED);
+        }
+    }
+
+    MELT_FREE(params.mesh.vertices);
+    MELT_FREE(params.mesh.indices);
+}
+
+static bool OccupancyTest(const uint32_t* mask, const melt_occupancy_t& occupancy, uint32_t x, uint32_t y, uint32_t z)
+{
+    const uint32_t index = x + occupancy.dimension_x * (y + occupancy.dimension_y * z);
+    return (mask[index >> 5] & (1u << (index & 31))) != 0;
+}
+
+TEST_CASE("melt.occupancy", "")
+{
+    melt_params_t params;
+    memset(&params, 0, sizeof(melt_params_t));
+    params.voxel_size = 0.1f;
+    params.fill_pct = 1.0f;
+    params.box_type_flags = MELT_OCCLUDER_BOX_TYPE_REGULAR;
+
+    REQUIRE(LoadModelMesh("models/suzanne.obj", params));
+
+    melt_result_t plain;
+    REQUIRE(melt_generate_occluder(params, &plain));
+    REQUIRE(plain.occupancy.shell == NULL);
+
+    params.occupancy = 1;
+    melt_result_t result;
+    REQUIRE(melt_generate_occluder(params, &result));
+    RequireSameMesh(plain.mesh, result.mesh);
+
+    const melt_occupancy_t& occupancy = result.occupancy;
+    REQUIRE(occupancy.voxel_size == params.voxel_size);
+    const uint32_t voxel_count = occupancy.dimension_x * occupancy.dimension_y * occupancy.dimension_z;
+
+    uint32_t shell_count = 0;
+    uint32_t inner_count = 0;
+    for (uint32_t i = 0; i < (voxel_count + 31) / 32; ++i)
+    {
+        REQUIRE((occupancy.shell[i] & occupancy.inner[i]) == 0);
+        shell_count += _popcount32(occupancy.shell[i]);
+        inner_count += _popcount32(occupancy.inner[i]);
+    }
+    REQUIRE(shell_count > 0);
+    REQUIRE(inner_count > 0);
+
+    // The boxes are made of inner voxels, on the voxel boundaries of the grid.
+    for (uint32_t box = 0; box < result.mesh.vertex_count / _vertex_count_per_aabb(); ++box)
+    {
+        melt_vec3_t min = result.mesh.vertices[box * _vertex_count_per_aabb()];
+        melt_vec3_t max = min;
+        for (uint32_t v = 1; v < _vertex_count_per_aabb(); ++v)
+        {
+            const melt_vec3_t corner = result.mesh.vertices[box * _vertex_count_per_aabb() + v];
+            min = _vec3_min(min, corner);
+            max = _vec3_max(max, corner);
+        }
+
+        const float begin[3] = { (min.x - occupancy.min.x) / occupancy.voxel_size, (min.y - occupancy.min.y) / occupancy.voxel_size, (min.z - occupancy.min.z) / occupancy.voxel_size };
+        const float end[3] = { (max.x - occupancy.min.x) / occupancy.voxel_size, (max.y - occupancy.min.y) / occupancy.voxel_size, (max.z - occupancy.min.z) / occupancy.voxel_size };
+        for (uint32_t axis = 0; axis < 3; ++axis)
+        {
+            REQUIRE(fabsf(begin[axis] - roundf(begin[axis])) < 1e-3f);
+            REQUIRE(fabsf(end[axis] - roundf(end[axis])) < 1e-3f);
+        }
+
+        for (uint32_t z = (uint32_t)roundf(begin[2]); z < (uint32_t)roundf(end[2]); ++z)
+            for (uint32_t y = (uint32_t)roundf(begin[1]); y < (uint32_t)roundf(end[1]); ++y)
+                for (uint32_t x = (uint32_t)roundf(begin[0]); x < (uint32_t)roundf(end[0]); ++x)
+                    REQUIRE(OccupancyTest(occupancy.inner, occupancy, x, y, z));
+    }
+
+    melt_free_result(plain);
+    melt_free_result(result);
+    MELT_FREE(params.mesh.vertices);
+    MELT_FREE(params.mesh.indices);
+}
+
+TEST_CASE("melt.instances", "")
+{
+    melt_params_t params;
+    memset(&params, 0, sizeof(melt_params_t));
+    params.voxel_size = 0.1f;
+    params.fill_pct = 1.0f;
+
+    REQUIRE(LoadModelMesh("models/suzanne.obj", params));
+
+    const melt_occluder_box_type_flags_t box_types[] = { MELT_OCCLUDER_BOX_TYPE_REGULAR, MELT_OCCLUDER_BOX_TYPE_SIDES, MELT_OCCLUDER_BOX_TYPE_TOP };
+    for (melt_occluder_box_type_flags_t box_type_flags : box_types)
+    {
+        params.box_type_flags = box_type_flags;
+        params.instance_format = MELT_INSTANCE_FORMAT_NONE;
+        melt_result_t mesh;
+        REQUIRE(melt_generate_occluder(params, &mesh));
+
+        params.instance_format = MELT_INSTANCE_FORMAT_FLOAT;
+        melt_result_t instanced;
+        REQUIRE(melt_generate_occluder(params, &instanced));
+        REQUIRE(instanced.mesh.vertices == NULL);
+
+        const melt_instances_t& instances = instanced.instances;
+        REQUIRE(mesh.mesh.vertex_count == instances.count * instances.cube.vertex_count);
+        REQUIRE(mesh.mesh.index_count == instances.count * instances.cube.index_count);
+        REQUIRE(memcmp(instances.cube.indices, mesh.mesh.indices, instances.cube.index_count * sizeof(uint16_t)) == 0);
+
+        // Scaling and moving the cube gives back the mesh output exactly.
+        for (uint32_t i = 0; i < instances.count; ++i)
+        {
+            const float* box = &instances.boxes[i * 6];
+            for (uint32_t v = 0; v < instances.cube.vertex_count; ++v)
+            {
+                const melt_vec3_t corner = _vec3_add(_vec3_mul(_vec3_init(box[3], box[4], box[5]), instances.cube.vertices[v]), _vec3_init(box[0], box[1], box[2]));
+                REQUIRE(memcmp(&corner, &mesh.mesh.vertices[i * instances.cube.vertex_count + v], sizeof(melt_vec3_t)) == 0);
+            }
+        }
+
+        params.instance_format = MELT_INSTANCE_FORMAT_QUANTIZED;
+        melt_result_t quantized;
+        REQUIRE(melt_generate_occluder(params, &quantized));
+        REQUIRE(quantized.instances.boxes == NULL);
+        REQUIRE(quantized.instances.count == instances.count);
+        for (uint32_t i = 0; i < instances.count * 6; ++i)
+        {
+            const uint16_t* box = &quantized.instances.quantized_boxes[i / 6 * 6];
+            const float offset = i % 6 < 3 ? (&quantized.instances.offset.x)[i % 6] : 0.0f;
+            REQUIRE(fabsf(offset + box[i % 6] * quantized.instances.scale - instances.boxes[i]) < 1e-4f);
+        }
+
+        melt_free_result(mesh);
+        melt_free_result(instanced);
+        melt_free_result(quantized);
+    }
+
+    // Past 8192 boxes the mesh falls back to 32 bit indices, and past 32767
+    // voxels on an axis the instances fall back to floats.
+    _context_t context;
+    memset(&context, 0, sizeof(_context_t));
+    context.voxel_size = params.voxel_size;
+    context.dimension = _uvec3_init(32768, 1, 1);
+    context.max_extents_count = 8193;
+    params.index_width = MELT_INDEX_WIDTH_16;
+    params.instance_format = MELT_INSTANCE_FORMAT_QUANTIZED;
+    melt_result_t fallback;
+    memset(&fallback, 0, sizeof(melt_result_t));
+    _alloc_mesh(&context, &params, &fallback.mesh);
+    REQUIRE(fallback.mesh.indices == NULL);
+    REQUIRE(fallback.mesh.indices32 != NULL);
+    _alloc_instances(&context, &params, &fallback.instances, fallback.face_offsets);
+    REQUIRE(fallback.instances.quantized_boxes == NULL);
+    REQUIRE(fallback.instances.boxes != NULL);
+    melt_free_result(fallback);
+
+    MELT_FREE(params.mesh.vertices);
+    MELT_FREE(params.mesh.indices);
+}
+
+TEST_CASE("melt.selection", "")
+{
+    melt_params_t params;
+    memset(&params, 0, sizeof(melt_params_t));
+    params.voxel_size = 0.1f;
+    params.fill_pct = 1.0f;
+    params.box_type_flags = MELT_OCCLUDER_BOX_TYPE_REGULAR;
+
+    REQUIRE(LoadModelMesh("models/suzanne.obj", params));
+
+    melt_result_t mesh;
+    REQUIRE(melt_generate_occluder(params, &mesh));
+    params.instance_format = MELT_INSTANCE_FORMAT_QUANTIZED;
+    melt_result_t instanced;
+    REQUIRE(melt_generate_occluder(params, &instanced));
+
+    // The boxes of a mesh and of its instances are the same.
+    melt_box_set_t* set = melt_create_box_set();
+    REQUIRE(melt_add_result_boxes(set, &mesh) == 0);
+    const uint32_t result_box_count = melt_get_box_count(set);
+    REQUIRE(melt_add_result_boxes(set, &instanced) == result_box_count);
+    REQUIRE(melt_get_box_count(set) == result_box_count * 2);
+    const float* arrays[6] = { set->boxes.center_x, set->boxes.center_y, set->boxes.center_z, set->boxes.half_x, set->boxes.half_y, set->boxes.half_z };
+    for (uint32_t a = 0; a < 6; ++a)
+        for (uint32_t i = 0; i < result_box_count; ++i)
+            REQUIRE(fabsf(arrays[a][i] - arrays[a][result_box_count + i]) < 1e-5f);
+
+    std::mt19937 generator(7);
+    std::uniform_real_distribution<float> position(-40.0f, 40.0f);
+    std::uniform_real_distribution<float> extent(0.05f, 3.0f);
+    for (uint32_t i = 0; i < 5000; ++i)
+        melt_add_box(set, _vec3_init(position(generator), position(generator), position(generator)), _vec3_init(extent(generator), extent(generator), extent(generator)));
+    const uint32_t box_count = melt_get_box_count(set);
+    const float* grown_arrays[6] = { set->boxes.center_x, set->boxes.center_y, set->boxes.center_z, set->boxes.half_x, set->boxes.half_y, set->boxes.half_z };
+    memcpy(arrays, grown_arrays, sizeof(arrays));
+
+    // A frustum looking down +z from the eye, boxes around the eye included.
+    melt_selection_params_t selection;
+    memset(&selection, 0, sizeof(melt_selection_params_t));
+    const float planes[6][4] = {
+        {  0.8f, 0.0f, 0.6f, 12.0f }, { -0.8f, 0.0f, 0.6f, 12.0f },
+        {  0.0f, 0.8f, 0.6f, 12.0f }, {  0.0f, -0.8f, 0.6f, 12.0f },
+        {  0.0f, 0.0f, 1.0f, 20.0f }, {  0.0f, 0.0f, -1.0f, 30.0f } };
+    memcpy(selection.planes, planes, sizeof(planes));
+    selection.eye = _vec3_init(0.0f, 0.0f, -20.0f);
+    selection.projection_scale = 540.0f;
+    selection.min_projected_size = 4.0f;
+    selection.max_count = 100;
+
+    // Expected selection, from every box
+    std::vector<std::pair<float, uint32_t>> expected;
+    for (uint32_t i = 0; i < box_count; ++i)
+    {
+        const float center[3] = { arrays[0][i], arrays[1][i], arrays[2][i] };
+        const float half[3] = { arrays[3][i], arrays[4][i], arrays[5][i] };
+        bool visible = true;
+        for (uint32_t p = 0; p < 6; ++p)
+        {
+            const float distance = planes[p][0] * center[0] + planes[p][1] * center[1] + planes[p][2] * center[2] + planes[p][3];
+            const float radius = fabsf(planes[p][0]) * half[0] + fabsf(planes[p][1]) * half[1] + fabsf(planes[p][2]) * half[2];
+            visible = visible && !(distance + radius < 0.0f);
+        }
+        const float dx = center[0] - selection.eye.x;
+        const float dy = center[1] - selection.eye.y;
+        const float dz = center[2] - selection.eye.z;
+        const float eye_distance2 = dx * dx + dy * dy + dz * dz;
+        const float radius2 = half[0] * half[0] + half[1] * half[1] + half[2] * half[2];
+        const float size = eye_distance2 <= radius2 ? FLT_MAX : selection.projection_scale * sqrtf(radius2 / eye_distance2);
+        if (visible && size >= selection.min_projected_size)
+            expected.push_back(std::make_pair(size, i));
+    }
+    std::sort(expected.begin(), expected.end(), [](const std::pair<float, uint32_t>& a, const std::pair<float, uint32_t>& b)
+    {
+        return a.first > b.first || (a.first == b.first && a.second < b.second);
+    });
+    REQUIRE(expected.size() > selection.max_count);
+    REQUIRE(expected.back().second < box_count);
+
+    std::vector<uint32_t> boxes(selection.max_count);
+    std::vector<float> sizes(selection.max_count);
+    for (melt_isa_t isa = MELT_ISA_SCALAR; isa <= melt_get_supported_isa(); isa = (melt_isa_t)(isa + 1))
+    {
+        selection.isa = isa;
+        REQUIRE(melt_select_occluders(set, &selection, boxes.data(), sizes.data()) == selection.max_count);
+        for (uint32_t i = 0; i < selection.max_count; ++i)
+        {
+            REQUIRE(boxes[i] == expected[i].second);
+            REQUIRE(sizes[i] == expected[i].first);
+        }
+    }
+
+    // Fewer candidates than requested
+    selection.min_projected_size = expected[10].first;
+    REQUIRE(melt_select_occluders(set, &selection, boxes.data(), sizes.data()) == 11);
+    REQUIRE(boxes[10] == expected[10].second);
+
+    // The hierarchy yields the same boxes, nearest first
+    melt_bvh_t* bvh = melt_build_bvh(set);
+    selection.min_projected_size = 4.0f;
+    selection.max_count = box_count;
+    std::vector<uint32_t> traversed(box_count);
+    const uint32_t traversed_count = melt_traverse_bvh(bvh, &selection, traversed.data());
+    REQUIRE(traversed_count == expected.size());
+
+    std::vector<uint32_t> expected_boxes;
+    for (const std::pair<float, uint32_t>& box : expected)
+        expected_boxes.push_back(box.second);
+    std::vector<uint32_t> sorted_boxes(traversed.begin(), traversed.begin() + traversed_count);
+    std::sort(expected_boxes.begin(), expected_boxes.end());
+    std::sort(sorted_boxes.begin(), sorted_boxes.end());
+    REQUIRE(sorted_boxes == expected_boxes);
+
+    auto eye_distance = [&](uint32_t box)
+    {
+        return sqrtf(powf(arrays[0][box] - selection.eye.x, 2.0f) + powf(arrays[1][box] - selection.eye.y, 2.0f) + powf(arrays[2][box] - selection.eye.z, 2.0f));
+    };
+    const uint32_t quarter = traversed_count / 4;
+    float near_distance = 0.0f;
+    float far_distance = 0.0f;
+    for (uint32_t i = 0; i < quarter; ++i)
+    {
+        near_distance += eye_distance(traversed[i]);
+        far_distance += eye_distance(traversed[traversed_count - 1 - i]);
+    }
+    REQUIRE(far_distance > 2.0f * near_distance);
+
+    // Stops after max_count boxes, with the nearest ones
+    selection.max_count = 10;
+    REQUIRE(melt_traverse_bvh(bvh, &selection, boxes.data()) == 10);
+    REQUIRE(std::equal(boxes.begin(), boxes.begin() + 10, traversed.begin()));
+
+    // Every box is in a leaf once
+    memset(selection.planes, 0, sizeof(selection.planes));
+    selection.min_projected_size = 0.0f;
+    selection.max_count = box_count;
+    REQUIRE(melt_traverse_bvh(bvh, &selection, traversed.data()) == box_count);
+    std::sort(traversed.begin(), traversed.end());
+    for (uint32_t i = 0; i < box_count; ++i)
+        REQUIRE(traversed[i] == i);
+
+    std::vector<uint8_t> serialized(melt_get_bvh_serialized_size(bvh));
+    melt_serialize_bvh(bvh, serialized.data());
+    REQUIRE(melt_deserialize_bvh(serialized.data(), serialized.size() - 1) == NULL);
+    melt_bvh_t* loaded = melt_deserialize_bvh(serialized.data(), serialized.size());
+    REQUIRE(loaded != NULL);
+    std::vector<uint8_t> reserialized(melt_get_bvh_serialized_size(loaded));
+    melt_serialize_bvh(loaded, reserialized.data());
+    REQUIRE(reserialized == serialized);
+
+    // The depth is recomputed, children out of range or back to their parent
+    // are rejected
+    _bvh_header_t header;
+    memcpy(&header, serialized.data(), sizeof(_bvh_header_t));
+    _bvh_node_t root;
+    memcpy(&root, serialized.data() + sizeof(_bvh_header_t), sizeof(_bvh_node_t));
+    std::vector<uint8_t> corrupted = serialized;
+    _bvh_header_t deep_header = header;
+    deep_header.depth = 1u << 30;
+    memcpy(corrupted.data(), &deep_header, sizeof(_bvh_header_t));
+    melt_bvh_t* deep = melt_deserialize_bvh(corrupted.data(), corrupted.size());
+    REQUIRE(deep != NULL);
+    REQUIRE(deep->header.depth == bvh->header.depth);
+    melt_destroy_bvh(deep);
+    for (uint32_t i = 0; i < 3; ++i)
+    {
+        _bvh_node_t node = root;
+        node.first[0] = i == 0 ? 0 : i == 1 ? header.node_count : header.box_count - 1;
+        node.count[0] = i == 2 ? 2 : 0;
+        corrupted = serialized;
+        memcpy(corrupted.data() + sizeof(_bvh_header_t), &node, sizeof(_bvh_node_t));
+        REQUIRE(melt_deserialize_bvh(corrupted.data(), corrupted.size()) == NULL);
+    }
+
+    serialized[0] ^= 1;
+    REQUIRE(melt_deserialize_bvh(serialized.data(), serialized.size()) == NULL);
+
+    melt_destroy_bvh(loaded);
+    melt_destroy_bvh(bvh);
+
+    melt_box_set_t* empty_set = melt_create_box_set();
+    melt_bvh_t* empty_bvh = melt_build_bvh(empty_set);
+    REQUIRE(melt_traverse_bvh(empty_bvh, &selection, traversed.data()) == 0);
+    melt_destroy_bvh(empty_bvh);
+    melt_destroy_box_set(empty_set);
+
+    melt_destroy_box_set(set);
+    melt_free_result(mesh);
+    melt_free_result(instanced);
+    MELT_FREE(params.mesh.vertices);
+    MELT_FREE(params.mesh.indices);
+}
+
+TEST_CASE("melt.classification", "")
+{
+    melt_params_t params;
+    memset(&params, 0, sizeof(melt_params_t));
+    params.voxel_size = 0.1f;
+    params.fill_pct = 1.0f;
+    params.box_type_flags = MELT_OCCLUDER_BOX_TYPE_REGULAR;
+
+    REQUIRE(LoadModelMesh("models/suzanne.obj", params));
+
+    melt_status_t status;
+    melt_classification_t* classification = melt_classify(params, &status);
+    REQUIRE(classification != NULL);
+    REQUIRE(status == MELT_STATUS_SUCCESS);
+
+    std::vector<uint8_t> serialized(melt_get_classification_serialized_size(classification));
+    melt_serialize_classification(classification, serialized.data());
+    REQUIRE(melt_deserialize_classification(serialized.data(), serialized.size() - 1) == NULL);
+    melt_classification_t* loaded = melt_deserialize_classification(serialized.data(), serialized.size());
+    REQUIRE(loaded != NULL);
+
+    // Any extraction matches a full generation with the same settings, and
+    // leaves the classification untouched for the next one.
+    const float fill_pcts[] = { 1.0f, 0.5f, 0.2f };
+    const melt_occluder_box_type_flags_t box_types[] = { MELT_OCCLUDER_BOX_TYPE_REGULAR, MELT_OCCLUDER_BOX_TYPE_SIDES,
+        MELT_OCCLUDER_BOX_TYPE_DIAGONALS | MELT_OCCLUDER_BOX_TYPE_TOP };
+    for (uint32_t i = 0; i < MELT_ARRAY_LENGTH(fill_pcts); ++i)
+    {
+        params.fill_pct = fill_pcts[i];
+        params.box_type_flags = box_types[i];
+
+        melt_result_t expected;
+        REQUIRE(melt_generate_occluder(params, &expected));
+        melt_result_t extracted;
+        REQUIRE(melt_extract_occluder(classification, params, &extracted));
+        RequireSameMesh(expected.mesh, extracted.mesh);
+        melt_free_result(extracted);
+        REQUIRE(melt_extract_occluder(loaded, params, &extracted));
+        RequireSameMesh(expected.mesh, extracted.mesh);
+        melt_free_result(extracted);
+        melt_free_result(expected);
+    }
+
+    params.occupancy = 1;
+    melt_result_t expected;
+    REQUIRE(melt_generate_occluder(params, &expected));
+    melt_result_t extracted;
+    REQUIRE(melt_extract_occluder(classification, params, &extracted));
+    const uint32_t word_count = (expected.occupancy.dimension_x * expected.occupancy.dimension_y * expected.occupancy.dimension_z + 31) / 32;
+    REQUIRE(memcmp(expected.occupancy.shell, extracted.occupancy.shell, word_count * sizeof(uint32_t)) == 0);
+    REQUIRE(memcmp(expected.occupancy.inner, extracted.occupancy.inner, word_count * sizeof(uint32_t)) == 0);
+    melt_free_result(expected);
+    melt_free_result(extracted);
+
+    melt_destroy_classification(loaded);
+    melt_destroy_classification(classification);
+
+    params.voxel_size = 0.05f;
+    REQUIRE(LoadModelMesh("models/bunny.obj", params));
+    REQUIRE(melt_classify(params, &status) == NULL);
+    REQUIRE(status == MELT_STATUS_NOT_WATERTIGHT);
+
+    MELT_FREE(params.mesh.vertices);
+    MELT_FREE(params.mesh.indices);
+}
+
+static uint64_t HashBytes(uint64_t hash, const void* data, size_t byte_size)
+{
+    const uint8_t* bytes = (const uint8_t*)data;
+    for (size_t i = 0; i < byte_size; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static uint64_t HashResult(const melt_result_t& result)
+{
+    uint64_t hash = 14695981039346656037ull;
+    hash = HashBytes(hash, result.mesh.vertices, result.mesh.vertex_count * sizeof(melt_vec3_t));
+    hash = HashBytes(hash, result.mesh.indices, result.mesh.index_count * sizeof(uint16_t));
+    return hash;
+}
+
+TEST_CASE("melt.deterministic", "")
+{
+    const char* models[] = { "models/suzanne.obj", "models/column.obj" };
+    const float voxel_sizes[] = { 0.5f, 0.25f };
+    const float fill_pcts[] = { 1.0f, 0.6f };
+
+    melt_params_t params;
+    memset(&params, 0, sizeof(melt_params_t));
+    params.box_type_flags = MELT_OCCLUDER_BOX_TYPE_REGULAR;
+    params.deterministic = 1;
+
+    for (const char* model : models)
+    {
+        REQUIRE(LoadModelMesh(model, params));
+        for (float voxel_size : voxel_sizes)
+        {
+            for (float fill_pct : fill_pcts)
+            {
+                params.voxel_size = voxel_size;
+                params.fill_pct = fill_pct;
+                params.isa = MELT_ISA_SCALAR;
+                params.thread_count = 1;
+
+                melt_result_t expected;
+                REQUIRE(melt_generate_occluder(params, &expected));
+                REQUIRE(expected.mesh.vertex_count > 0);
+                const uint64_t expected_hash = HashResult(expected);
+
+                // Every coordinate is a whole number of half voxels
+                const float half_voxel_size = voxel_size * 0.5f;
+                for (uint32_t i = 0; i < expected.mesh.vertex_count; ++i)
+                {
+                    const float* coordinates = &expected.mesh.vertices[i].x;
+                    for (uint32_t axis = 0; axis < 3; ++axis)
+                    {
+                        const float half_voxels = roundf(coordinates[axis] / half_voxel_size);
+                        REQUIRE(coordinates[axis] == half_voxels * half_voxel_size);
+                    }
+                }
+                melt_free_result(expected);
+
+                for (melt_isa_t isa = MELT_ISA_SCALAR; isa <= melt_get_supported_isa(); isa = (melt_isa_t)(isa + 1))
+                {
+                    for (uint32_t thread_count : { 1u, 3u })
+                    {
+                        params.isa = isa;
+                        params.thread_count = thread_count;
+                        melt_result_t result;
+                        REQUIRE(melt_generate_occluder(params, &result));
+                        REQUIRE(HashResult(result) == expected_hash);
+                        melt_free_result(result);
+                    }
+                }
+            }
+        }
+    }
+
+    MELT_FREE(params.mesh.vertices);
+    MELT_FREE(params.mesh.indices);
+}
+
+TEST_CASE("melt.faces", "")
+{
+    melt_params_t params;
+    memset(&params, 0, sizeof(melt_params_t));
+    params.voxel_size = 0.15f;
+    params.fill_pct = 1.0f;
+
+    REQUIRE(LoadModelMesh("models/suzanne.obj", params));
+
+    const melt_occluder_box_type_flags_t box_types[] = { MELT_OCCLUDER_BOX_TYPE_REGULAR, MELT_OCCLUDER_BOX_TYPE_SIDES,
+        MELT_OCCLUDER_BOX_TYPE_REGULAR | MELT_OCCLUDER_BOX_TYPE_DIAGONALS };
+    for (melt_occluder_box_type_flags_t box_type_flags : box_types)
+    {
+        for (melt_index_width_t index_width : { MELT_INDEX_WIDTH_16, MELT_INDEX_WIDTH_32 })
+        {
+            params.box_type_flags = box_type_flags;
+            params.index_width = index_width;
+            params.face_buckets = 0;
+            melt_result_t plain;
+            REQUIRE(melt_generate_occluder(params, &plain));
+            params.face_buckets = 1;
+            melt_result_t bucketed;
+            REQUIRE(melt_generate_occluder(params, &bucketed));
+
+            REQUIRE(plain.mesh.vertex_count == bucketed.mesh.vertex_count);
+            REQUIRE(memcmp(plain.mesh.vertices, bucketed.mesh.vertices, plain.mesh.vertex_count * sizeof(melt_vec3_t)) == 0);
+            REQUIRE(bucketed.face_offsets[0] == 0);
+            REQUIRE(bucketed.face_offsets[MELT_FACE_COUNT] == bucketed.mesh.index_count);
+
+            auto index = [](const melt_mesh_t& mesh, uint32_t i) { return mesh.indices32 ? mesh.indices32[i] : mesh.indices[i]; };
+
+            // The same triangles, each on the side of its box it is bucketed for
+            std::vector<std::array<uint32_t, 3>> plain_triangles;
+            std::vector<std::array<uint32_t, 3>> bucketed_triangles;
+            for (uint32_t face = 0; face < MELT_FACE_COUNT; ++face)
+            {
+                REQUIRE(bucketed.face_offsets[face] <= bucketed.face_offsets[face + 1]);
+                for (uint32_t i = bucketed.face_offsets[face]; i < bucketed.face_offsets[face + 1]; i += 3)
+                {
+                    const std::array<uint32_t, 3> triangle = { { index(bucketed.mesh, i), index(bucketed.mesh, i + 1), index(bucketed.mesh, i + 2) } };
+                    bucketed_triangles.push_back(triangle);
+                    if (face == MELT_FACE_DIAGONAL)
+                        continue;
+
+                    const uint32_t axis = face / 2;
+                    const melt_vec3_t* box = bucketed.mesh.vertices + triangle[0] / 8 * 8;
+                    float side = (&box[0].x)[axis];
+                    for (uint32_t v = 1; v < 8; ++v)
+                        side = face % 2 == 0 ? std::max(side, (&box[v].x)[axis]) : std::min(side, (&box[v].x)[axis]);
+                    for (uint32_t v : triangle)
+                        REQUIRE((&bucketed.mesh.vertices[v].x)[axis] == side);
+                }
+            }
+            for (uint32_t i = 0; i < plain.mesh.index_count; i += 3)
+                plain_triangles.push_back({ { index(plain.mesh, i), index(plain.mesh, i + 1), index(plain.mesh, i + 2) } });
+            std::sort(plain_triangles.begin(), plain_triangles.end());
+            std::sort(bucketed_triangles.begin(), bucketed_triangles.end());
+            REQUIRE(plain_triangles == bucketed_triangles);
+
+            const bool diagonals = (box_type_flags & MELT_OCCLUDER_BOX_TYPE_DIAGONALS) != 0;
+            REQUIRE((bucketed.face_offsets[MELT_FACE_DIAGONAL] != bucketed.face_offsets[MELT_FACE_COUNT]) == diagonals);
+
+            melt_free_result(plain);
+            melt_free_result(bucketed);
+        }
+    }
+
+    // Instances share the buckets of the cube
+    params.box_type_flags = MELT_OCCLUDER_BOX_TYPE_SIDES;
+    params.index_width = MELT_INDEX_WIDTH_16;
+    params.instance_format = MELT_INSTANCE_FORMAT_FLOAT;
+    melt_result_t instanced;
+    REQUIRE(melt_generate_occluder(params, &instanced));
+    REQUIRE(instanced.face_offsets[MELT_FACE_COUNT] == instanced.instances.cube.index_count);
+    uint32_t side_count = 0;
+    for (uint32_t face = 0; face < MELT_FACE_COUNT; ++face)
+    {
+        const uint32_t index_count = instanced.face_offsets[face + 1] - instanced.face_offsets[face];
+        REQUIRE((index_count == 0 || index_count == 6));
+        side_count += index_count == 6 ? 1 : 0;
+    }
+    REQUIRE(side_count == 4);
+    melt_free_result(instanced);
+
+    MELT_FREE(params.mesh.vertices);
+    MELT_FREE(params.mesh.indices);
+}
+
+// Box from -1 to 1 with tile_count x tile_count quads per side, a quad is
+// left out when skip returns true for its side and position.
+template <typename Skip>
+static void AddTiledBox(RandomMesh& mesh, uint32_t tile_count, Skip skip)
+{
+    for (uint32_t side = 0; side < 6; ++side)
+    {
+        const uint32_t axis = side / 2;
+        const float sign = side % 2 == 0 ? 1.0f : -1.0f;
+        for (uint32_t u = 0; u < tile_count; ++u)
+        {
+            for (uint32_t v = 0; v < tile_count; ++v)
+            {
+                if (skip(side, u, v))
+                    continue;
+
+                const uint16_t base = (uint16_t)mesh.vertices.size();
+                for (uint32_t corner = 0; corner < 4; ++corner)
+                {
+                    float coordinates[3];
+                    coordinates[axis] = sign;
+                    coordinates[(axis + 1) % 3] = -1.0f + 2.0f * (u + (corner & 1)) / tile_count;
+                    coordinates[(axis + 2) % 3] = -1.0f + 2.0f * (v + (corner >> 1)) / tile_count;
+                    mesh.vertices.push_back({ coordinates[0], coordinates[1], coordinates[2] });
+                }
+                const uint16_t quad[6] = { 0, 1, 3, 0, 3, 2 };
+                for (uint16_t index : quad)
+                    mesh.indices.push_back((uint16_t)(base + index));
+            }
+        }
+    }
+}
+
+TEST_CASE("melt.closing", "")
+{
+    melt_params_t params;
+    memset(&params, 0, sizeof(melt_params_t));
+    params.voxel_size = 0.1f;
+    params.fill_pct = 1.0f;
+    params.box_type_flags = MELT_OCCLUDER_BOX_TYPE_REGULAR;
+
+    auto use_mesh = [&](RandomMesh& mesh)
+    {
+        params.mesh.vertices = mesh.vertices.data();
+        params.mesh.vertex_count = (uint32_t)mesh.vertices.size();
+        params.mesh.indices = mesh.indices.data();
+        params.mesh.index_count = (uint32_t)mesh.indices.size();
+    };
+
+    // Repaired shells classify the same in the optimized and reference phases,
+    // and stay within the box.
+    auto require_repaired = [&]()
+    {
+        params.reference = 0;
+        melt_result_t result;
+        REQUIRE(melt_generate_occluder(params, &result));
+        params.reference = 1;
+        melt_result_t reference;
+        REQUIRE(melt_generate_occluder(params, &reference));
+        REQUIRE(MeshEquals(result.mesh, reference.mesh));
+        REQUIRE(result.mesh.vertex_count > 0);
+        for (uint32_t i = 0; i < result.mesh.vertex_count; ++i)
+        {
+            REQUIRE(fabsf(result.mesh.vertices[i].x) <= 1.0f + params.voxel_size);
+            REQUIRE(fabsf(result.mesh.vertices[i].y) <= 1.0f + params.voxel_size);
+            REQUIRE(fabsf(result.mesh.vertices[i].z) <= 1.0f + params.voxel_size);
+        }
+        melt_free_result(result);
+        melt_free_result(reference);
+        params.reference = 0;
+    };
+
+    // A hole of 5 voxels in a side
+    RandomMesh holed;
+    AddTiledBox(holed, 8, [](uint32_t side, uint32_t u, uint32_t v) { return side == 0 && (u == 3 || u == 4) && (v == 3 || v == 4); });
+    use_mesh(holed);
+
+    melt_result_t result;
+    REQUIRE(!melt_generate_occluder(params, &result));
+    REQUIRE(result.status == MELT_STATUS_NOT_WATERTIGHT);
+    params.closing_radius = 1;
+    REQUIRE(!melt_generate_occluder(params, &result));
+    params.closing_radius = 2;
+    require_repaired();
+    params.deterministic = 1;
+    require_repaired();
+    params.deterministic = 0;
+    params.closing_radius = 0;
+
+    // An open bottom, where no voxel is enclosed
+    RandomMesh open;
+    AddTiledBox(open, 4, [](uint32_t side, uint32_t, uint32_t) { return side == 3; });
+    use_mesh(open);
+
+    REQUIRE(melt_generate_occluder(params, &result));
+    REQUIRE(result.mesh.vertex_count == 0);
+    melt_free_result(result);
+    params.ground_cap = 1;
+    require_repaired();
+
+    // Two open bottoms standing at different heights, each is capped at its
+    // own base and not at the lowest one.
+    RandomMesh standing;
+    AddTiledBox(standing, 4, [](uint32_t side, uint32_t, uint32_t) { return side == 3; });
+    const size_t raised_begin = standing.vertices.size();
+    AddTiledBox(standing, 4, [](uint32_t side, uint32_t, uint32_t) { return side == 3; });
+    for (size_t i = raised_begin; i < standing.vertices.size(); ++i)
+    {
+        standing.vertices[i].x += 3.0f;
+        standing.vertices[i].y += 1.0f;
+    }
+    use_mesh(standing);
+    params.occupancy = 1;
+
+    for (int32_t reference : { 0, 1 })
+    {
+        params.reference = reference;
+        REQUIRE(melt_generate_occluder(params, &result));
+        REQUIRE(result.mesh.vertex_count > 0);
+
+        // Lowest shell voxel under each box
+        const melt_occupancy_t& occupancy = result.occupancy;
+        float min_y[2] = { FLT_MAX, FLT_MAX };
+        for (uint32_t z = 0; z < occupancy.dimension_z; ++z)
+            for (uint32_t y = 0; y < occupancy.dimension_y; ++y)
+                for (uint32_t x = 0; x < occupancy.dimension_x; ++x)
+                {
+                    if (!OccupancyTest(occupancy.shell, occupancy, x, y, z))
+                        continue;
+                    const float center_x = occupancy.min.x + (x + 0.5f) * occupancy.voxel_size;
+                    const float center_y = occupancy.min.y + (y + 0.5f) * occupancy.voxel_size;
+                    float& box_min_y = min_y[center_x > 1.5f ? 1 : 0];
+                    box_min_y = std::min(box_min_y, center_y);
+                }
+        REQUIRE(fabsf(min_y[0] + 1.0f) <= params.voxel_size);
+        REQUIRE(fabsf(min_y[1]) <= params.voxel_size);
+        melt_free_result(result);
+    }
+    params.occupancy = 0;
+    params.reference = 0;
+
+    // Closing keeps watertight shells generating
+    params.ground_cap = 0;
+    params.closing_radius = 2;
+    params.voxel_size = 0.15f;
+    memset(&params.mesh, 0, sizeof(melt_mesh_t));
+    REQUIRE(LoadModelMesh("models/suzanne.obj", params));
+    REQUIRE(melt_generate_occluder(params, &result));
+    melt_free_result(result);
+
+    MELT_FREE(params.mesh.vertices);
+    MELT_FREE(params.mesh.indices);
+}
+
+// Runs the steps of a sharded generation in process and adds the boxes of the
+// tiles to the set, in reverse tile order when asked. Returns whether every
+// tile generated and the tiles stitched.
+static bool GenerateTiles(const melt_params_t& params, uint32_t tile_size, bool reverse, melt_box_set_t* set)
+{
+    melt_tiling_t tiling;
+    melt_plan_tiling(params, tile_size, &tiling);
+    const uint32_t tile_count = melt_get_tile_count(&tiling);
+
+    std::vector<std::vector<uint8_t>> lines(tile_count);
+    std::vector<std::vector<uint8_t>> states(tile_count);
+    std::vector<uint8_t*> tile_lines(tile_count);
+    std::vector<const uint8_t*> tile_states(tile_count);
+    for (uint32_t tile = 0; tile < tile_count; ++tile)
+    {
+        lines[tile].resize(melt_get_tile_line_count(&tiling, tile));
+        states[tile].resize(lines[tile].size());
+        tile_lines[tile] = lines[tile].data();
+        tile_states[tile] = states[tile].data();
+        REQUIRE(melt_scan_tile(params, &tiling, tile, tile_lines[tile]));
+    }
+
+    melt_resolve_tile_lines(&tiling, tile_lines.data());
+
+    bool generated = true;
+    for (uint32_t i = 0; i < tile_count; ++i)
+    {
+        const uint32_t tile = reverse ? tile_count - 1 - i : i;
+        melt_result_t result;
+        if (!melt_generate_tile(params, &tiling, tile, tile_lines[tile], states[tile].data(), &result))
+        {
+            REQUIRE(result.status == MELT_STATUS_NOT_WATERTIGHT);
+            generated = false;
+            continue;
+        }
+        melt_add_result_boxes(set, &result);
+        melt_free_result(result);
+    }
+
+    return generated && melt_stitch_tile_lines(&tiling, tile_states.data());
+}
+
+TEST_CASE("melt.tiles", "")
+{
+    melt_params_t params;
+    memset(&params, 0, sizeof(melt_params_t));
+    params.fill_pct = 1.0f;
+    params.box_type_flags = MELT_OCCLUDER_BOX_TYPE_REGULAR;
+    params.deterministic = 1;
+
+    const char* models[] = { "models/suzanne.obj", "models/column.obj" };
+    for (const char* model : models)
+    {
+        REQUIRE(LoadModelMesh(model, params));
+
+        // Small tiles on a coarse grid, larger ones on a finer grid
+        const std::pair<float, uint32_t> tile_cases[] = { { 0.25f, 5 }, { 0.15f, 12 } };
+        for (const auto& tile_case : tile_cases)
+        {
+            params.voxel_size = tile_case.first;
+            const uint32_t tile_size = tile_case.second;
+            params.occupancy = 1;
+            melt_result_t single;
+            REQUIRE(melt_generate_occluder(params, &single));
+            params.occupancy = 0;
+
+            melt_box_set_t* set = melt_create_box_set();
+            REQUIRE(GenerateTiles(params, tile_size, false, set));
+            const uint32_t tile_box_count = melt_get_box_count(set);
+            REQUIRE(melt_merge_boxes(set, params.voxel_size) <= tile_box_count);
+
+            // The merged boxes cover each inner voxel of the single process
+            // generation once, and nothing else.
+            const melt_occupancy_t& occupancy = single.occupancy;
+            std::vector<uint8_t> covered(occupancy.dimension_x * occupancy.dimension_y * occupancy.dimension_z, 0);
+            for (uint32_t box = 0; box < melt_get_box_count(set); ++box)
+            {
+                melt_vec3_t box_center, box_half_extent;
+                melt_get_box(set, box, &box_center, &box_half_extent);
+                const float center[3] = { box_center.x, box_center.y, box_center.z };
+                const float half[3] = { box_half_extent.x, box_half_extent.y, box_half_extent.z };
+                const float min[3] = { occupancy.min.x, occupancy.min.y, occupancy.min.z };
+                uint32_t begin[3];
+                uint32_t end[3];
+                for (uint32_t axis = 0; axis < 3; ++axis)
+                {
+                    begin[axis] = (uint32_t)roundf((center[axis] - half[axis] - min[axis]) / occupancy.voxel_size);
+                    end[axis] = (uint32_t)roundf((center[axis] + half[axis] - min[axis]) / occupancy.voxel_size);
+                }
+                for (uint32_t z = begin[2]; z < end[2]; ++z)
+                    for (uint32_t y = begin[1]; y < end[1]; ++y)
+                        for (uint32_t x = begin[0]; x < end[0]; ++x)
+                            covered[x + occupancy.dimension_x * (y + occupancy.dimension_y * z)]++;
+            }
+            uint32_t mismatch_count = 0;
+            for (uint32_t z = 0; z < occupancy.dimension_z; ++z)
+                for (uint32_t y = 0; y < occupancy.dimension_y; ++y)
+                    for (uint32_t x = 0; x < occupancy.dimension_x; ++x)
+                        mismatch_count += covered[x + occupancy.dimension_x * (y + occupancy.dimension_y * z)] != (OccupancyTest(occupancy.inner, occupancy, x, y, z) ? 1 : 0);
+            REQUIRE(mismatch_count == 0);
+
+            // Merging does not depend on the order the tiles complete in
+            melt_box_set_t* reversed = melt_create_box_set();
+            REQUIRE(GenerateTiles(params, tile_size, true, reversed));
+            REQUIRE(melt_merge_boxes(reversed, params.voxel_size) == melt_get_box_count(set));
+            for (uint32_t box = 0; box < melt_get_box_count(set); ++box)
+            {
+                melt_vec3_t center, half_extent, reversed_center, reversed_half_extent;
+                melt_get_box(set, box, &center, &half_extent);
+                melt_get_box(reversed, box, &reversed_center, &reversed_half_extent);
+                REQUIRE(memcmp(&reversed_center, &center, sizeof(melt_vec3_t)) == 0);
+                REQUIRE(memcmp(&reversed_half_extent, &half_extent, sizeof(melt_vec3_t)) == 0);
+            }
+
+            melt_destroy_box_set(reversed);
+            melt_destroy_box_set(set);
+            melt_free_result(single);
+        }
+    }
+
+    // Leaks are found across tiles of 5 voxels and within tiles of 7 voxels
+    RandomMesh holed;
+    AddTiledBox(holed, 8, [](uint32_t side, uint32_t u, uint32_t v) { return side == 0 && u == 3 && v == 3; });
+    MELT_FREE(params.mesh.vertices);
+    MELT_FREE(params.mesh.indices);
+    params.mesh.vertices = holed.vertices.data();
+    params.mesh.vertex_count = (uint32_t)holed.vertices.size();
+    params.mesh.indices = holed.indices.data();
+    params.mesh.index_count = (uint32_t)holed.indices.size();
+    params.voxel_size = 0.1f;
+
+    melt_result_t result;
+    REQUIRE(!melt_generate_occluder(params, &result));
+    for (uint32_t tile_size : { 5u, 7u })
+    {
+        melt_box_set_t* set = melt_create_box_set();
+        REQUIRE(!GenerateTiles(params, tile_size, false, set));
+        melt_destroy_box_set(set);
+    }
+}
@@ -0,0 +1,445 @@
+// Sharded generation
+//  Generates the occluder of a model tile by tile in worker processes, so that
+//  no process holds the grid of the whole model, see melt_plan_tiling. The
+//  driver forks at most --workers workers at a time, each runs one step for one
+//  tile and hands its output back through a file of the work directory:
+//    tile-<n>.lines    lines of the tile, scanned by the worker then resolved
+//                      in place by the driver
+//    tile-<n>.states   line states of the generated tile
+//    tile-<n>.boxes    boxes of the tile
+//  The driver then checks that the shell is watertight across the tiles and
+//  merges the boxes cut at the tile borders. Boxes are written as 6 floats each,
+//  center x, y, z then half extent x, y, z.
+//
+//  Usage: melt-shard <model.obj> [options]
+//    --voxel-size <size>   0.1 by default
+//    --tile-size <voxels>  64 by default
+//    --workers <count>     4 by default
+//    --fill <percentage>   fill percentage of each tile, 1 by default
+//    --work-dir <path>     where the tile files are exchanged, . by default
+//    --output <path>       merged boxes, boxes.bin by default
+//    --verify              compares the boxes to a single process generation,
+//                          only with a fill of 1
+//
+//  Exits with 1 when the occluder can't be generated.
+
+#define MELT_IMPLEMENTATION
+#include "melt.h"
+#define TINYOBJLOADER_IMPLEMENTATION
+#include "tiny_obj_loader.h"
+
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Worker exit codes
+enum
+{
+    WORKER_SUCCESS = 0,
+    WORKER_FAILED = 1,
+    WORKER_NOT_WATERTIGHT = 2
+};
+
+struct Shard
+{
+    melt_params_t params;
+    melt_tiling_t tiling;
+    std::string work_dir = ".";
+    uint32_t worker_count = 4;
+};
+
+// Concatenates every shape of the scene, the indices of each shape are rebased
+// past the vertices of the shapes before it.
+static bool LoadModelMesh(const char* model_path, melt_mesh_t& mesh)
+{
+    std::vector<tinyobj::shape_t> shapes;
+    std::vector<tinyobj::material_t> materials;
+    std::string error;
+    if (!tinyobj::LoadObj(shapes, materials, error, model_path, NULL) || shapes.empty())
+        return false;
+
+    size_t vertex_count = 0;
+    size_t index_count = 0;
+    for (const tinyobj::shape_t& shape : shapes)
+    {
+        vertex_count += shape.mesh.positions.size() / 3;
+        index_count += shape.mesh.indices.size();
+    }
+    if (vertex_count > 65536)
+    {
+        fprintf(stderr, "%s has %zu vertices, meshes are limited to 65536\n", model_path, vertex_count);
+        return false;
+    }
+
+    mesh.vertex_count = (uint32_t)vertex_count;
+    mesh.index_count = (uint32_t)index_count;
+    mesh.vertices = MELT_MALLOC(melt_vec3_t, mesh.vertex_count);
+    mesh.indices = MELT_MALLOC(uint16_t, mesh.index_count);
+
+    uint32_t vertex_offset = 0;
+    uint32_t index_offset = 0;
+    for (const tinyobj::shape_t& shape : shapes)
+    {
+        const tinyobj::mesh_t& shape_mesh = shape.mesh;
+        const uint32_t shape_vertex_count = (uint32_t)(shape_mesh.positions.size() / 3);
+        for (size_t i = 0; i < shape_mesh.indices.size(); ++i)
+            mesh.indices[index_offset++] = (uint16_t)(shape_mesh.indices[i] + vertex_offset);
+        for (uint32_t v = 0; v < shape_vertex_count; ++v)
+        {
+            const float* position = &shape_mesh.positions[3 * v];
+            mesh.vertices[vertex_offset + v] = { position[0], position[1], position[2] };
+        }
+        vertex_offset += shape_vertex_count;
+    }
+
+    return true;
+}
+
+static std::string TilePath(const Shard& shard, uint32_t tile, const char* extension)
+{
+    return shard.work_dir + "/tile-" + std::to_string(tile) + extension;
+}
+
+static bool WriteFile(const std::string& path, const void* data, size_t size)
+{
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file)
+        return false;
+    const bool written = fwrite(data, 1, size, file) == size;
+    return fclose(file) == 0 && written;
+}
+
+static bool ReadFile(const std::string& path, std::vector<uint8_t>& data)
+{
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file)
+        return false;
+    data.clear();
+    uint8_t buffer[4096];
+    size_t size;
+    while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        data.insert(data.end(), buffer, buffer + size);
+    const bool read = !ferror(file);
+    fclose(file);
+    return read;
+}
+
+// Runs step(shard, tile) for every tile, each in a forked worker, at most worker_count
+// at a time. Stops forking on the first failed worker and returns its exit code.
+template <typename Step>
+static int RunWorkers(const Shard& shard, Step step)
+{
+    const uint32_t tile_count = melt_get_tile_count(&shard.tiling);
+    uint32_t next_tile = 0;
+    uint32_t running_count = 0;
+    int code = WORKER_SUCCESS;
+
+    while (running_count > 0 || (next_tile < tile_count && code == WORKER_SUCCESS))
+    {
+        if (next_tile < tile_count && code == WORKER_SUCCESS && running_count < shard.worker_count)
+        {
+            // Workers leave with _exit, output buffered before the fork is only
+            // flushed once by the driver.
+            const uint32_t tile = next_tile++;
+            fflush(stdout);
+            const pid_t pid = fork();
+            if (pid == 0)
+                _exit(step(shard, tile));
+            if (pid < 0)
+            {
+                perror("fork");
+                code = WORKER_FAILED;
+                continue;
+            }
+            running_count++;
+            continue;
+        }
+
+        int status;
+        if (wait(&status) < 0)
+        {
+            perror("wait");
+            return WORKER_FAILED;
+        }
+        running_count--;
+        const int worker_code = WIFEXITED(status) ? WEXITSTATUS(status) : WORKER_FAILED;
+        if (code == WORKER_SUCCESS)
+            code = worker_code;
+    }
+
+    return code;
+}
+
+static int ScanTile(const Shard& shard, uint32_t tile)
+{
+    std::vector<uint8_t> lines(melt_get_tile_line_count(&shard.tiling, tile));
+    if (!melt_scan_tile(shard.params, &shard.tiling, tile, lines.data()))
+        return WORKER_FAILED;
+    return WriteFile(TilePath(shard, tile, ".lines"), lines.data(), lines.size()) ? WORKER_SUCCESS : WORKER_FAILED;
+}
+
+static int GenerateTile(const Shard& shard, uint32_t tile)
+{
+    std::vector<uint8_t> lines;
+    if (!ReadFile(TilePath(shard, tile, ".lines"), lines) || lines.size() != melt_get_tile_line_count(&shard.tiling, tile))
+        return WORKER_FAILED;
+
+    melt_params_t params = shard.params;
+    params.instance_format = MELT_INSTANCE_FORMAT_FLOAT;
+
+    std::vector<uint8_t> states(lines.size());
+    melt_result_t result;
+    if (!melt_generate_tile(params, &shard.tiling, tile, lines.data(), states.data(), &result))
+        return result.status == MELT_STATUS_NOT_WATERTIGHT ? WORKER_NOT_WATERTIGHT : WORKER_FAILED;
+
+    const bool written = WriteFile(TilePath(shard, tile, ".states"), states.data(), states.size()) &&
+        WriteFile(TilePath(shard, tile, ".boxes"), result.instances.boxes, (size_t)result.instances.count * 6 * sizeof(float));
+    melt_free_result(result);
+    return written ? WORKER_SUCCESS : WORKER_FAILED;
+}
+
+static bool ReadTileFiles(const Shard& shard, const char* extension, std::vector<std::vector<uint8_t>>& tile_data)
+{
+    tile_data.resize(melt_get_tile_count(&shard.tiling));
+    for (uint32_t tile = 0; tile < tile_data.size(); ++tile)
+    {
+        if (!ReadFile(TilePath(shard, tile, extension), tile_data[tile]))
+        {
+            fprintf(stderr, "failed to read %s\n", TilePath(shard, tile, extension).c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+static void RemoveTileFiles(const Shard& shard)
+{
+    for (uint32_t tile = 0; tile < melt_get_tile_count(&shard.tiling); ++tile)
+        for (const char* extension : { ".lines", ".states", ".boxes" })
+            unlink(TilePath(shard, tile, extension).c_str());
+}
+
+// Generates the tiles in workers and adds their merged boxes to the set
+static bool GenerateShards(const Shard& shard, melt_box_set_t* set)
+{
+    const uint32_t tile_count = melt_get_tile_count(&shard.tiling);
+
+    if (RunWorkers(shard, ScanTile) != WORKER_SUCCESS)
+        return false;
+
+    std::vector<std::vector<uint8_t>> lines;
+    if (!ReadTileFiles(shard, ".lines", lines))
+        return false;
+    std::vector<uint8_t*> tile_lines(tile_count);
+    for (uint32_t tile = 0; tile < tile_count; ++tile)
+        tile_lines[tile] = lines[tile].data();
+    melt_resolve_tile_lines(&shard.tiling, tile_lines.data());
+    for (uint32_t tile = 0; tile < tile_count; ++tile)
+    {
+        if (!WriteFile(TilePath(shard, tile, ".lines"), lines[tile].data(), lines[tile].size()))
+            return false;
+    }
+
+    const int code = RunWorkers(shard, GenerateTile);
+    if (code == WORKER_NOT_WATERTIGHT)
+        fprintf(stderr, "the shell leaks within a tile\n");
+    if (code != WORKER_SUCCESS)
+        return false;
+
+    std::vector<std::vector<uint8_t>> states;
+    std::vector<std::vector<uint8_t>> boxes;
+    if (!ReadTileFiles(shard, ".states", states) || !ReadTileFiles(shard, ".boxes", boxes))
+        return false;
+    std::vector<const uint8_t*> tile_states(tile_count);
+    for (uint32_t tile = 0; tile < tile_count; ++tile)
+        tile_states[tile] = states[tile].data();
+    if (!melt_stitch_tile_lines(&shard.tiling, tile_states.data()))
+    {
+        fprintf(stderr, "the shell leaks across tiles\n");
+        return false;
+    }
+
+    // Boxes are added in tile order, the merged boxes don't depend on it
+    for (uint32_t tile = 0; tile < tile_count; ++tile)
+    {
+        const float* tile_boxes = (const float*)boxes[tile].data();
+        for (size_t box = 0; box < boxes[tile].size() / (6 * sizeof(float)); ++box)
+        {
+            const float* b = tile_boxes + box * 6;
+            melt_add_box(set, { b[0], b[1], b[2] }, { b[3], b[4], b[5] });
+        }
+    }
+    const uint32_t tile_box_count = melt_get_box_count(set);
+    printf("%u tile boxes merged into %u boxes\n", tile_box_count, melt_merge_boxes(set, shard.params.voxel_size));
+    return true;
+}
+
+static bool WriteBoxes(const char* path, const melt_box_set_t* set)
+{
+    std::vector<float> boxes;
+    boxes.reserve((size_t)melt_get_box_count(set) * 6);
+    for (uint32_t box = 0; box < melt_get_box_count(set); ++box)
+    {
+        melt_vec3_t center, half_extent;
+        melt_get_box(set, box, &center, &half_extent);
+        boxes.insert(boxes.end(), { center.x, center.y, center.z, half_extent.x, half_extent.y, half_extent.z });
+    }
+    return WriteFile(path, boxes.data(), boxes.size() * sizeof(float));
+}
+
+// Counts the voxels of a single process generation that the boxes don't cover
+// exactly once when inner, or cover when not inner. Only a fill of 1 covers
+// every inner voxel.
+static bool CountMismatches(const melt_params_t& base_params, const melt_box_set_t* set, uint64_t& mismatch_count)
+{
+    melt_params_t params = base_params;
+    params.occupancy = 1;
+    melt_result_t result;
+    if (!melt_generate_occluder(params, &result))
+        return false;
+
+    const melt_occupancy_t& occupancy = result.occupancy;
+    const size_t voxel_count = (size_t)occupancy.dimension_x * occupancy.dimension_y * occupancy.dimension_z;
+    std::vector<uint8_t> covered(voxel_count, 0);
+    const float min[3] = { occupancy.min.x, occupancy.min.y, occupancy.min.z };
+    for (uint32_t box = 0; box < melt_get_box_count(set); ++box)
+    {
+        melt_vec3_t center, half_extent;
+        melt_get_box(set, box, &center, &half_extent);
+        const float box_center[3] = { center.x, center.y, center.z };
+        const float box_half_extent[3] = { half_extent.x, half_extent.y, half_extent.z };
+        uint32_t begin[3];
+        uint32_t end[3];
+        for (uint32_t axis = 0; axis < 3; ++axis)
+        {
+            begin[axis] = (uint32_t)roundf((box_center[axis] - box_half_extent[axis] - min[axis]) / occupancy.voxel_size);
+            end[axis] = (uint32_t)roundf((box_center[axis] + box_half_extent[axis] - min[axis]) / occupancy.voxel_size);
+        }
+        for (uint32_t z = begin[2]; z < end[2]; ++z)
+            for (uint32_t y = begin[1]; y < end[1]; ++y)
+                for (uint32_t x = begin[0]; x < end[0]; ++x)
+                    covered[x + occupancy.dimension_x * (y + (size_t)occupancy.dimension_y * z)]++;
+    }
+
+    mismatch_count = 0;
+    for (size_t index = 0; index < voxel_count; ++index)
+    {
+        const bool inner = (occupancy.inner[index >> 5] & (1u << (index & 31))) != 0;
+        mismatch_count += covered[index] != (inner ? 1 : 0);
+    }
+
+    melt_free_result(result);
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    Shard shard;
+    memset(&shard.params, 0, sizeof(melt_params_t));
+    shard.params.voxel_size = 0.1f;
+    shard.params.fill_pct = 1.0f;
+    shard.params.box_type_flags = MELT_OCCLUDER_BOX_TYPE_REGULAR;
+    shard.params.deterministic = 1;
+
+    const char* model_path = nullptr;
+    const char* output_path = "boxes.bin";
+    uint32_t tile_size = 64;
+    bool verify = false;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string option = argv[i];
+        const bool has_value = i + 1 < argc;
+        if (option == "--voxel-size" && has_value)
+            shard.params.voxel_size = (float)atof(argv[++i]);
+        else if (option == "--tile-size" && has_value)
+            tile_size = (uint32_t)atoi(argv[++i]);
+        else if (option == "--workers" && has_value)
+            shard.worker_count = (uint32_t)atoi(argv[++i]);
+        else if (option == "--fill" && has_value)
+            shard.params.fill_pct = (float)atof(argv[++i]);
+        else if (option == "--work-dir" && has_value)
+            shard.work_dir = argv[++i];
+        else if (option == "--output" && has_value)
+            output_path = argv[++i];
+        else if (option == "--verify")
+            verify = true;
+        else if (!model_path && option[0] != '-')
+            model_path = argv[i];
+        else
+        {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (!model_path || tile_size == 0 || shard.worker_count == 0)
+    {
+        fprintf(stderr, "usage: melt-shard <model.obj> [--voxel-size <size>] [--tile-size <voxels>] [--workers <count>]\n"
+            "                  [--fill <percentage>] [--work-dir <path>] [--output <path>] [--verify]\n");
+        return 1;
+    }
+
+    if (verify && shard.params.fill_pct < 1.0f)
+    {
+        fprintf(stderr, "--verify needs a fill of 1, partial fills don't cover every inner voxel\n");
+        return 1;
+    }
+
+    if (mkdir(shard.work_dir.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+        perror(shard.work_dir.c_str());
+        return 1;
+    }
+
+    // Workers are forked after loading, they share the mesh with the driver
+    if (!LoadModelMesh(model_path, shard.params.mesh))
+    {
+        fprintf(stderr, "failed to load %s\n", model_path);
+        return 1;
+    }
+
+    melt_plan_tiling(shard.params, tile_size, &shard.tiling);
+    printf("%s: %ux%ux%u voxels in %u tiles\n", model_path, shard.tiling.dimension[0], shard.tiling.dimension[1],
+        shard.tiling.dimension[2], melt_get_tile_count(&shard.tiling));
+
+    melt_box_set_t* set = melt_create_box_set();
+    bool generated = GenerateShards(shard, set);
+    if (!generated)
+        fprintf(stderr, "failed to generate %s\n", model_path);
+    else if (!WriteBoxes(output_path, set))
+    {
+        fprintf(stderr, "failed to write %s\n", output_path);
+        generated = false;
+    }
+
+    if (generated && verify)
+    {
+        uint64_t mismatch_count;
+        if (!CountMismatches(shard.params, set, mismatch_count))
+        {
+            fprintf(stderr, "failed to generate %s in a single process\n", model_path);
+            generated = false;
+        }
+        else
+        {
+            printf("%llu voxels differ from a single process generation\n", (unsigned long long)mismatch_count);
+            generated = mismatch_count == 0;
+        }
+    }
+
+    melt_destroy_box_set(set);
+    RemoveTileFiles(shard);
+    MELT_FREE(shard.params.mesh.vertices);
+    MELT_FREE(shard.params.mesh.indices);
+    return generated ? 0 : 1;
+}